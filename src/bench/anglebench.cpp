@@ -0,0 +1,98 @@
+#include "anglebench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "../optimizer/optimizer.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/videoreader.hpp"
+
+// Sweeps the view angle across 0-360 degrees and times Optimizer::optimizeImage
+// plus extractInto at each step. Angles whose crop window crosses the 0/360
+// seam are marked, so any extra cost of wrapping shows up as a step in the
+// table and in the wrapped/unwrapped averages at the end.
+
+static const int REPEATS = 3;
+
+static bool cropWraps(int angle) {
+  int left = ((angle - CROP_ANGLE / 2) % 360 + 360) % 360;
+  int right = ((angle + CROP_ANGLE / 2) % 360 + 360) % 360;
+  return left > right && right > 0;
+}
+
+int AngleBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " anglebench filename [frames] [step]"
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int frames = argc >= 4 ? atoi(argv[3]) : 10;
+  int step = argc >= 5 ? atoi(argv[4]) : 10;
+  if (step <= 0) {
+    std::cerr << "step must be positive" << std::endl;
+    return 1;
+  }
+
+  std::vector<cv::Mat> images;
+  {
+    VideoReader vr(filename);
+    for (int i = 0; i < frames; i++) {
+      cv::Mat frame = vr.getFrame();
+      if (frame.empty())
+        break;
+      images.push_back(frame.clone());
+    }
+  }
+  if (images.empty()) {
+    std::cerr << "No frames read from " << filename << std::endl;
+    return 1;
+  }
+
+  double wrappedMs = 0, unwrappedMs = 0;
+  int wrappedCount = 0, unwrappedCount = 0;
+  cv::Mat dst;
+
+  printf("angle  wraps  optimize ms  extract ms\n");
+  for (int angle = 0; angle < 360; angle += step) {
+    double optimizeSeconds = 0, extractSeconds = 0;
+    for (int r = 0; r < REPEATS; r++) {
+      for (const cv::Mat& image : images) {
+        double start = Timer::timeInSeconds();
+        OptimizedImage optimized = Optimizer::optimizeImage(image, angle, 90);
+        double middle = Timer::timeInSeconds();
+        Optimizer::extractInto(optimized, dst);
+        double end = Timer::timeInSeconds();
+        optimizeSeconds += middle - start;
+        extractSeconds += end - middle;
+      }
+    }
+
+    int n = REPEATS * images.size();
+    double optimizeMs = 1000 * optimizeSeconds / n;
+    double extractMs = 1000 * extractSeconds / n;
+    bool wraps = cropWraps(angle);
+    printf("%5d  %5s  %11.3f  %10.3f\n", angle, wraps ? "yes" : "no",
+        optimizeMs, extractMs);
+
+    if (wraps) {
+      wrappedMs += optimizeMs + extractMs;
+      wrappedCount++;
+    } else {
+      unwrappedMs += optimizeMs + extractMs;
+      unwrappedCount++;
+    }
+  }
+
+  if (wrappedCount > 0 && unwrappedCount > 0) {
+    printf("Average per frame: %.3f ms across the seam, %.3f ms elsewhere (%.2fx)\n",
+        wrappedMs / wrappedCount, unwrappedMs / unwrappedCount,
+        (wrappedMs / wrappedCount) / (unwrappedMs / unwrappedCount));
+  }
+  return 0;
+}
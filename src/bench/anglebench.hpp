@@ -0,0 +1,9 @@
+#ifndef BENCH_ANGLEBENCH_H_
+#define BENCH_ANGLEBENCH_H_
+
+class AngleBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
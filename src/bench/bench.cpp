@@ -0,0 +1,291 @@
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "queuebench.hpp"
+#include "../optimizer/optimizer.hpp"
+#include "../util/cylinderwarp.hpp"
+#include "../util/imageutil.hpp"
+#include "../util/timer.hpp"
+
+// Output is a single JSON object:
+//   {"schema": 1, "timestamp": ..., "iterations": ..., "results": [
+//     {"name": "optimizeImage", "resolution": "4k", "width": 3840,
+//      "height": 2160, "params": {"angle": 0, "vAngle": 90, "blur": 3},
+//      "samples": 20, "min_ms": ..., "median_ms": ..., "p99_ms": ...,
+//      "throughput": ..., "throughput_unit": "frames/s"}, ...]}
+// Throughput is computed from the median.
+
+struct Resolution {
+  const char* name;
+  int width;
+  int height;
+};
+
+// Full top/bottom stereo frames; each eye is width x height / 2.
+static const Resolution RESOLUTIONS[] = {
+  { "1080p", 1920, 1080 },
+  { "4k", 3840, 2160 },
+  { "8k", 7680, 4320 },
+};
+
+static const int ANGLES[] = { 0, 90, 180, 270 };
+static const int V_ANGLES[] = { 30, 90, 150 };
+static const int BLUR_FACTORS[] = { BLUR_NONE, BLUR_NORMAL, BLUR_HIGH };
+
+static const int WARMUP_ITERATIONS = 2;
+static const int QUEUE_ITEMS_PER_SAMPLE = 100000;
+
+struct BenchResult {
+  std::string name;
+  std::string resolution;
+  int width = 0;
+  int height = 0;
+  std::vector<std::pair<std::string, int> > params;
+  std::vector<double> samples;
+  // Units of work per sample, e.g. 1 frame or QUEUE_ITEMS_PER_SAMPLE items.
+  double unitsPerSample = 1;
+  const char* unit = "frames/s";
+};
+
+// Deterministic top/bottom stereo equirect frame with gradients, a
+// checkerboard and fine detail, so the resizes have real work to do. The
+// right eye is shifted a few pixels to mimic parallax.
+static cv::Mat syntheticFrame(int width, int height) {
+  cv::Mat frame(height, width, CV_8UC3);
+  const int eyeHeight = height / 2;
+  for (int y = 0; y < height; y++) {
+    int eye = y >= eyeHeight ? 1 : 0;
+    int eyeRow = y - eye * eyeHeight;
+    uchar* row = frame.ptr<uchar>(y);
+    for (int x = 0; x < width; x++) {
+      int sx = (x + eye * 8) % width;
+      row[3 * x + 0] = (uchar) ((sx * 255 / width) ^ (eyeRow & 0x3f));
+      row[3 * x + 1] = (uchar) (eyeRow * 255 / std::max(1, eyeHeight - 1));
+      row[3 * x + 2] = ((sx / 64 + eyeRow / 64) & 1) ? 200 : 40;
+    }
+  }
+  return frame;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+  size_t i = (size_t) std::ceil(p * sorted.size());
+  return sorted[std::min(sorted.size() - 1, i > 0 ? i - 1 : 0)];
+}
+
+static void timeIt(BenchResult& result, int iterations, const std::function<void()>& work) {
+  for (int i = 0; i < WARMUP_ITERATIONS; i++)
+    work();
+  for (int i = 0; i < iterations; i++) {
+    double start = Timer::timeInSeconds();
+    work();
+    result.samples.push_back(1000 * (Timer::timeInSeconds() - start));
+  }
+}
+
+static BenchResult makeResult(const char* name, const Resolution& res) {
+  BenchResult result;
+  result.name = name;
+  result.resolution = res.name;
+  result.width = res.width;
+  result.height = res.height;
+  return result;
+}
+
+static void benchResolution(const Resolution& res, int iterations,
+    std::vector<BenchResult>& results) {
+  std::cerr << "Benchmarking " << res.name << " (" << res.width << "x"
+    << res.height << ")" << std::endl;
+
+  cv::Mat frame = syntheticFrame(res.width, res.height);
+  const int savedBlur = BLUR_FACTOR;
+
+  for (int blur : BLUR_FACTORS) {
+    BLUR_FACTOR = blur;
+
+    for (int angle : ANGLES) {
+      for (int vAngle : V_ANGLES) {
+        BenchResult result = makeResult("optimizeImage", res);
+        result.params = { {"angle", angle}, {"vAngle", vAngle}, {"blur", blur} };
+        timeIt(result, iterations, [&]() {
+          Optimizer::optimizeImage(frame, angle, vAngle);
+        });
+        results.push_back(result);
+      }
+    }
+
+    // Angle 0 puts the crop window across the seam; 180 keeps it inside.
+    for (int angle : { 0, 180 }) {
+      OptimizedImage optimized = Optimizer::optimizeImage(frame, angle, 90);
+
+      BenchResult extract = makeResult("extractImage", res);
+      extract.params = { {"angle", angle}, {"vAngle", 90}, {"blur", blur} };
+      timeIt(extract, iterations, [&]() {
+        Optimizer::extractImage(optimized);
+      });
+      results.push_back(extract);
+
+      BenchResult extractInto = makeResult("extractInto", res);
+      extractInto.params = extract.params;
+      cv::Mat dst;
+      timeIt(extractInto, iterations, [&]() {
+        Optimizer::extractInto(optimized, dst);
+      });
+      results.push_back(extractInto);
+    }
+  }
+  BLUR_FACTOR = savedBlur;
+
+  const int thirdCols = res.width / 3;
+  cv::Mat half1(frame, cv::Range::all(), cv::Range(0, res.width / 2));
+  cv::Mat half2(frame, cv::Range::all(), cv::Range(res.width / 2, res.width));
+  cv::Mat third1(frame, cv::Range::all(), cv::Range(0, thirdCols));
+  cv::Mat third2(frame, cv::Range::all(), cv::Range(thirdCols, 2 * thirdCols));
+  cv::Mat third3(frame, cv::Range::all(), cv::Range(2 * thirdCols, res.width));
+
+  BenchResult hconcat2 = makeResult("hconcat2", res);
+  timeIt(hconcat2, iterations, [&]() {
+    cv::Mat joined;
+    ImageUtil::hconcat2(half2, half1, joined);
+  });
+  results.push_back(hconcat2);
+
+  BenchResult hconcat3 = makeResult("hconcat3", res);
+  timeIt(hconcat3, iterations, [&]() {
+    cv::Mat joined;
+    ImageUtil::hconcat3(third3, third1, third2, joined);
+  });
+  results.push_back(hconcat3);
+
+  // One eye, as the cylinderwarp runmode does.
+  cv::Mat left(frame, cv::Range(0, res.height / 2));
+  BenchResult warp = makeResult("cylinderWarp", res);
+  timeIt(warp, iterations, [&]() {
+    CylinderWarp::cylinderWarp(left);
+  });
+  results.push_back(warp);
+}
+
+// Samples are QueueBench's own timings, so that both benchmarks measure
+// queues the same way.
+static void timeQueue(BenchResult& result, int iterations, size_t capacity,
+    double (*bench)(int, size_t, const cv::Mat&)) {
+  cv::Mat payload(1, 1, CV_8UC3);
+  result.params = { {"capacity", (int) capacity} };
+  result.unitsPerSample = QUEUE_ITEMS_PER_SAMPLE;
+  result.unit = "items/s";
+  for (int i = 0; i < WARMUP_ITERATIONS; i++)
+    bench(QUEUE_ITEMS_PER_SAMPLE, capacity, payload);
+  for (int i = 0; i < iterations; i++)
+    result.samples.push_back(1000 * bench(QUEUE_ITEMS_PER_SAMPLE, capacity, payload));
+}
+
+static void benchQueues(int iterations, std::vector<BenchResult>& results) {
+  std::cerr << "Benchmarking queues" << std::endl;
+
+  const Resolution none = { "", 0, 0 };
+  for (int capacity : { OPTIMIZER_QUEUE_SIZE, VIDEOREADER_QUEUE_SIZE }) {
+    BenchResult ring = makeResult("RingBuffer", none);
+    timeQueue(ring, iterations, capacity, QueueBench::benchRingBuffer);
+    results.push_back(ring);
+
+    BenchResult channel = makeResult("Channel", none);
+    timeQueue(channel, iterations, capacity, QueueBench::benchChannel);
+    results.push_back(channel);
+  }
+}
+
+static void writeJson(FILE* out, int iterations, const std::vector<BenchResult>& results) {
+  fprintf(out, "{\n  \"schema\": 1,\n  \"timestamp\": %ld,\n  \"iterations\": %d,\n"
+      "  \"results\": [\n", (long) std::time(NULL), iterations);
+
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult& r = results[i];
+    std::vector<double> sorted = r.samples;
+    std::sort(sorted.begin(), sorted.end());
+    double median = percentile(sorted, 0.5);
+
+    fprintf(out, "    {\"name\": \"%s\", ", r.name.c_str());
+    if (!r.resolution.empty()) {
+      fprintf(out, "\"resolution\": \"%s\", \"width\": %d, \"height\": %d, ",
+          r.resolution.c_str(), r.width, r.height);
+    }
+    fprintf(out, "\"params\": {");
+    for (size_t p = 0; p < r.params.size(); p++) {
+      fprintf(out, "%s\"%s\": %d", p > 0 ? ", " : "",
+          r.params[p].first.c_str(), r.params[p].second);
+    }
+    fprintf(out, "}, \"samples\": %d, \"min_ms\": %.4f, \"median_ms\": %.4f, "
+        "\"p99_ms\": %.4f, \"throughput\": %.2f, \"throughput_unit\": \"%s\"}%s\n",
+        (int) sorted.size(), sorted.front(), median, percentile(sorted, 0.99),
+        median > 0 ? r.unitsPerSample * 1000 / median : 0, r.unit,
+        i + 1 < results.size() ? "," : "");
+  }
+
+  fprintf(out, "  ]\n}\n");
+}
+
+static void usage(const char* program, int firstArg) {
+  std::cerr << "Usage: "
+    << program
+    << (firstArg > 1 ? " bench" : "")
+    << " [--iterations N] [--sizes 1080p,4k,8k] [--output results.json]"
+    << std::endl;
+}
+
+int Bench::run(int argc, char* argv[], int firstArg) {
+  int iterations = 20;
+  std::string sizes = "1080p,4k,8k";
+  std::string output;
+
+  for (int i = firstArg; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (arg == "--sizes" && i + 1 < argc) {
+      sizes = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      output = argv[++i];
+    } else {
+      usage(argv[0], firstArg);
+      return 1;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0], firstArg);
+    return 1;
+  }
+
+  std::vector<BenchResult> results;
+  for (const Resolution& res : RESOLUTIONS) {
+    if (("," + sizes + ",").find(std::string(",") + res.name + ",") != std::string::npos)
+      benchResolution(res, iterations, results);
+  }
+  benchQueues(iterations, results);
+
+  FILE* out = stdout;
+  if (!output.empty()) {
+    out = fopen(output.c_str(), "w");
+    if (!out) {
+      std::cerr << "Could not open " << output << std::endl;
+      return 1;
+    }
+  }
+  writeJson(out, iterations, results);
+  if (out != stdout) {
+    fclose(out);
+    std::cerr << "Wrote " << results.size() << " results to " << output << std::endl;
+  }
+  return 0;
+}
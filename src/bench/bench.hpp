@@ -0,0 +1,15 @@
+#ifndef BENCH_BENCH_H_
+#define BENCH_BENCH_H_
+
+// Headless benchmark suite. Runs the optimizer, image utilities, cylinder
+// warp and frame queues on synthetic top/bottom stereo equirect frames and
+// writes min/median/p99 timings and throughput as JSON, for tracking
+// regressions between releases. Needs no video file, HMD or window.
+class Bench {
+  public:
+    // Options start at argv[firstArg]; 2 for the "bench" runmode of conduit,
+    // 1 for the standalone conduit_bench binary.
+    static int run(int argc, char* argv[], int firstArg = 2);
+};
+
+#endif
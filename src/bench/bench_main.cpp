@@ -0,0 +1,10 @@
+#include "bench.hpp"
+
+#include "../util/trace.hpp"
+
+// Entry point of conduit_bench, which links only OpenCV and OpenGL so it can
+// run on machines without the Oculus runtime, SDL or CUDA.
+int main(int argc, char* argv[]) {
+  Trace::initFromEnvironment();
+  return Bench::run(argc, argv, 1);
+}
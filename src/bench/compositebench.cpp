@@ -0,0 +1,157 @@
+#include "compositebench.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+#include <GL/glew.h>
+#include <opencv2/core/core.hpp>
+
+#include "../oculus2/hmdbackend.hpp"
+#include "../oculus2/oculus2.hpp"
+#include "../optimizer/optimizer.hpp"
+#include "../settings.hpp"
+#include "../util/timer.hpp"
+
+// Checks the GPU_FOVEA_COMPOSITING shader against Optimizer::extractInto.
+// Each eye of an optimized synthetic frame is drawn with FoveatedTextures
+// into an offscreen framebuffer of the eye's full size, read back, and
+// compared with the CPU-extracted frame, on whatever driver the headless GL
+// context lands on (see NullHmdBackend). Also times drawing each eye.
+
+static const int DRAWS = 20;
+
+struct FoveaPose {
+  int angle;
+  int vAngle;
+};
+
+// Straight ahead, with the crop window wrapping around the seam, near the
+// poles, and with the fovea straddling the seam.
+static const FoveaPose POSES[] = {
+  { 0, 90 }, { 180, 90 }, { 90, 30 }, { 270, 150 }, { 355, 60 },
+};
+
+// Deterministic top/bottom stereo frame with gradients, fine detail and a
+// different pattern per eye, so a seam between the eyes would show.
+static cv::Mat syntheticFrame(int width, int height) {
+  cv::Mat frame(height, width, CV_8UC3);
+  for (int y = 0; y < height; y++) {
+    int eye = y >= height / 2 ? 1 : 0;
+    uchar* row = frame.ptr<uchar>(y);
+    for (int x = 0; x < width; x++) {
+      row[3 * x + 0] = (uchar) (x * 255 / width);
+      row[3 * x + 1] = (uchar) ((x ^ y) & 0x7f);
+      row[3 * x + 2] = eye ? 230 : 20;
+    }
+  }
+  return frame;
+}
+
+static void drawEye(FoveatedTextures& textures, bool isLeft) {
+  textures.bind(isLeft, 0);
+  glBegin(GL_QUADS);
+  glTexCoord2f(0, 0);
+  glVertex2f(-1, -1);
+  glTexCoord2f(1, 0);
+  glVertex2f(1, -1);
+  glTexCoord2f(1, 1);
+  glVertex2f(1, 1);
+  glTexCoord2f(0, 1);
+  glVertex2f(-1, 1);
+  glEnd();
+  textures.unbind();
+}
+
+// Largest per-channel difference, and how many pixels differ by more than 1.
+static int compare(const cv::Mat& a, const cv::Mat& b, long* offPixels) {
+  int maxDiff = 0;
+  *offPixels = 0;
+  for (int y = 0; y < a.rows; y++) {
+    const uchar* pa = a.ptr<uchar>(y);
+    const uchar* pb = b.ptr<uchar>(y);
+    for (int x = 0; x < a.cols; x++) {
+      int pixelDiff = 0;
+      for (int c = 0; c < 4; c++)
+        pixelDiff = std::max(pixelDiff, std::abs(pa[4 * x + c] - pb[4 * x + c]));
+      if (pixelDiff > 1)
+        (*offPixels)++;
+      maxDiff = std::max(maxDiff, pixelDiff);
+    }
+  }
+  return maxDiff;
+}
+
+int CompositeBench::run(int argc, char* argv[]) {
+  // Usage: compositebench [width] [height]. A 1280x1280 top/bottom frame by default.
+  int width = argc >= 3 ? atoi(argv[2]) : 1280;
+  int height = argc >= 4 ? atoi(argv[3]) : 1280;
+  const int eyeHeight = height / 2;
+
+  NullHmdBackend backend(HEADLESS_REFRESH_RATE);
+  if (!backend.init())
+    return 1;
+  glewInit();
+  printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  FoveatedTextures textures;
+  textures.init();
+
+  GLuint texture, fbo;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, eyeHeight, 0,
+      GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+  glViewport(0, 0, width, eyeHeight);
+  glMatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glMatrixMode(GL_MODELVIEW);
+  glLoadIdentity();
+
+  cv::Mat frame = syntheticFrame(width, height);
+  printf("%dx%d, blur %d\n", width, height, BLUR_FACTOR);
+
+  int worst = 0;
+  for (const FoveaPose& pose : POSES) {
+    OptimizedImage optimized = Optimizer::optimizeImage(frame, pose.angle, pose.vAngle);
+    cv::Mat expected;
+    Optimizer::extractInto(optimized, expected, false, true);
+
+    textures.load(optimized, 0);
+    glFinish();
+
+    double start = Timer::timeInSeconds();
+    for (int i = 0; i < DRAWS; i++) {
+      drawEye(textures, i % 2 == 0);
+      glFinish();
+    }
+    double msPerDraw = 1000 * (Timer::timeInSeconds() - start) / DRAWS;
+
+    for (int eye = 0; eye < 2; eye++) {
+      drawEye(textures, eye == 0);
+      // Row 0 of the read-back image is texture row 0, like the frame's.
+      cv::Mat drawn(eyeHeight, width, CV_8UC4);
+      glPixelStorei(GL_PACK_ALIGNMENT, 4);
+      glReadPixels(0, 0, width, eyeHeight, GL_BGRA, GL_UNSIGNED_BYTE, drawn.ptr());
+
+      long offPixels;
+      int maxDiff = compare(drawn,
+          expected.rowRange(eye * eyeHeight, (eye + 1) * eyeHeight), &offPixels);
+      worst = std::max(worst, maxDiff);
+      printf("angle %3d, vAngle %3d, %s eye: max difference %3d, %ld pixels off by more than 1,"
+          " %.3f ms/draw\n", pose.angle, pose.vAngle, eye == 0 ? "left " : "right",
+          maxDiff, offPixels, msPerDraw);
+    }
+  }
+  printf("Largest difference from the CPU path: %d\n", worst);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteTextures(1, &texture);
+  backend.shutdown();
+  return 0;
+}
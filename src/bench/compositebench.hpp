@@ -0,0 +1,9 @@
+#ifndef BENCH_COMPOSITEBENCH_H_
+#define BENCH_COMPOSITEBENCH_H_
+
+class CompositeBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
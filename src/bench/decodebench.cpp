@@ -0,0 +1,130 @@
+#include "decodebench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/highgui/highgui.hpp>
+
+#include "../optimizer/optimizer.hpp"
+#include "../settings.hpp"
+#include "../util/imageutil.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/libavdecoder.hpp"
+
+// Compares the two VideoReader backends: cv::VideoCapture, which decodes and
+// converts every frame to BGR, against LibavDecoder, which copies out the
+// I420 planes. Both decode on the calling thread. The first frames of each
+// are then optimized and extracted, to show what the smaller frames save
+// downstream. LibavDecoder is then run again reading the file through each
+// VideoFile, to show how long the demuxer waited for storage.
+
+static const int OPTIMIZED_FRAMES = 30;
+
+struct DecodeResult {
+  int frames = 0;
+  double seconds = 0;
+  double bytes = 0;
+  double optimizeMs = 0;
+  bool hasFile = false;
+  VideoFileStats file;
+};
+
+static bool decode(VideoBackend backend, cv::VideoCapture& capture,
+    LibavDecoder& decoder, cv::Mat& frame) {
+  if (backend == VIDEO_BACKEND_LIBAV)
+    return decoder.read(frame);
+  capture >> frame;
+  return !frame.empty();
+}
+
+static bool bench(const std::string& filename, VideoBackend backend, VideoIo io,
+    int frames, DecodeResult& result) {
+  cv::VideoCapture capture;
+  LibavDecoder decoder;
+  bool opened;
+  if (backend == VIDEO_BACKEND_LIBAV) {
+    opened = decoder.open(filename, io);
+  } else {
+    capture.open(filename);
+    opened = capture.isOpened();
+  }
+  if (!opened)
+    return false;
+
+  std::vector<cv::Mat> kept;
+  double start = Timer::timeInSeconds();
+  for (int i = 0; i < frames; i++) {
+    // A new Mat each time, as VideoReader queues every frame.
+    cv::Mat frame;
+    if (!decode(backend, capture, decoder, frame))
+      break;
+    result.frames++;
+    result.bytes += ImageUtil::imageSize(frame);
+    if ((int) kept.size() < OPTIMIZED_FRAMES)
+      kept.push_back(frame);
+  }
+  result.seconds = Timer::timeInSeconds() - start;
+  if (decoder.getFile()) {
+    result.hasFile = true;
+    result.file = decoder.getFile()->getStats();
+  }
+
+  cv::Mat dst;
+  start = Timer::timeInSeconds();
+  for (const cv::Mat& frame : kept)
+    Optimizer::extractInto(Optimizer::optimizeImage(frame, 0, 90), dst);
+  if (!kept.empty())
+    result.optimizeMs = 1000 * (Timer::timeInSeconds() - start) / kept.size();
+  return true;
+}
+
+static void print(const char* name, const DecodeResult& r, double baselineFps) {
+  double fps = r.seconds > 0 ? r.frames / r.seconds : 0;
+  printf("%-8s %5d frames %8.1f frames/s  %5.2fx  %6.2f MB/frame  optimize+extract %7.2f ms/frame\n",
+      name, r.frames, fps, baselineFps > 0 ? fps / baselineFps : 1.0,
+      r.frames ? r.bytes / r.frames / (1024 * 1024) : 0, r.optimizeMs);
+  if (r.hasFile) {
+    printf("         read %.1f MB, waited for storage %ldx for %.3f s, %lld storage reads ",
+        r.file.bytes / (1024.0 * 1024.0), r.file.waits, r.file.waitSeconds,
+        r.file.readTimes.count());
+    std::cout << "of ";
+    r.file.readTimes.print(std::cout, 1000);
+    std::cout << " ms" << std::endl;
+  }
+}
+
+int DecodeBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " decodebench filename [frames]"
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int frames = argc >= 4 ? atoi(argv[3]) : 300;
+
+  DecodeResult opencv, libav;
+  if (!bench(filename, VIDEO_BACKEND_OPENCV, VIDEO_IO_LIBAV, frames, opencv)) {
+    std::cerr << "Failed to open " << filename << " with OpenCV" << std::endl;
+    return 1;
+  }
+  print("opencv", opencv, 0);
+  if (!bench(filename, VIDEO_BACKEND_LIBAV, VIDEO_IO_LIBAV, frames, libav)) {
+    std::cerr << "Failed to open " << filename << " with libavcodec" << std::endl;
+    return 1;
+  }
+  double opencvFps = opencv.seconds > 0 ? opencv.frames / opencv.seconds : 0;
+  print("libav", libav, opencvFps);
+
+  DecodeResult mapped, prefetched;
+  if (bench(filename, VIDEO_BACKEND_LIBAV, VIDEO_IO_MMAP, frames, mapped))
+    print("mmap", mapped, opencvFps);
+  if (bench(filename, VIDEO_BACKEND_LIBAV, VIDEO_IO_PREFETCH, frames, prefetched))
+    print("prefetch", prefetched, opencvFps);
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_DECODEBENCH_H_
+#define BENCH_DECODEBENCH_H_
+
+class DecodeBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "extractbench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "../optimizer/optimizer.hpp"
+#include "../util/imageutil.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/videoreader.hpp"
+
+// Compares Optimizer::extractImage (resize, paste the fovea, then hconcat
+// with black fill) against the fused Optimizer::extractInto, and BGRA output
+// against expanding BGR output afterwards. The frames are decoded and
+// optimized up front so only extraction is timed. Also prints how many bytes
+// a frame takes to upload whole, and as the separate periphery and fovea
+// textures of GPU_FOVEA_COMPOSITING.
+
+static const int REPEATS = 5;
+
+typedef void (*ExtractFunction)(const OptimizedImage& image, cv::Mat& dst);
+
+static void extractImage(const OptimizedImage& image, cv::Mat& dst) {
+  dst = Optimizer::extractImage(image);
+}
+
+static void extractIntoNew(const OptimizedImage& image, cv::Mat& dst) {
+  dst = cv::Mat();
+  Optimizer::extractInto(image, dst);
+}
+
+static void extractIntoReused(const OptimizedImage& image, cv::Mat& dst) {
+  Optimizer::extractInto(image, dst);
+}
+
+// Every image is optimized at the same angle, so the black area stays black
+// between calls.
+static void extractIntoCleared(const OptimizedImage& image, cv::Mat& dst) {
+  Optimizer::extractInto(image, dst, true);
+}
+
+static void extractIntoBgra(const OptimizedImage& image, cv::Mat& dst) {
+  Optimizer::extractInto(image, dst, false, true);
+}
+
+// The unfused alternative: extract BGR, then widen it to BGRA for upload.
+static void extractThenExpand(const OptimizedImage& image, cv::Mat& dst) {
+  static thread_local cv::Mat bgr;
+  Optimizer::extractInto(image, bgr);
+  ImageUtil::expandBgrToBgra(bgr, dst);
+}
+
+// Bytes oculus2 uploads for image, counting BGR pixels as BGRA if
+// UPLOAD_BGRA is set.
+static size_t uploadedBytes(const cv::Mat& image) {
+  size_t pixelBytes = image.channels() == 3 && UPLOAD_BGRA ? 4 : image.elemSize();
+  return image.total() * pixelBytes;
+}
+
+// The textures GPU_FOVEA_COMPOSITING uploads instead of the extracted frame.
+static size_t compositedBytes(const OptimizedImage& image) {
+  size_t bytes = uploadedBytes(image.getBlurred()) +
+    uploadedBytes(image.getFocusedTop()) + uploadedBytes(image.getFocusedBot());
+  if (image.isI420())
+    bytes += compositedBytes(image.getChroma(0)) + compositedBytes(image.getChroma(1));
+  return bytes;
+}
+
+static void bench(const char* name, ExtractFunction extract,
+    const std::vector<OptimizedImage>& images, double baseline, double* msPerFrame) {
+  cv::Mat dst;
+  extract(images[0], dst);
+
+  double start = Timer::timeInSeconds();
+  for (int r = 0; r < REPEATS; r++) {
+    for (const OptimizedImage& image : images)
+      extract(image, dst);
+  }
+  double elapsed = Timer::timeInSeconds() - start;
+
+  *msPerFrame = 1000 * elapsed / (REPEATS * images.size());
+  printf("%-32s %8.3f ms/frame  %5.2fx\n", name, *msPerFrame,
+      baseline > 0 ? baseline / *msPerFrame : 1.0);
+}
+
+int ExtractBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " extractbench filename [frames] [angle] [vAngle]"
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int frames = argc >= 4 ? atoi(argv[3]) : 30;
+  int angle = argc >= 5 ? atoi(argv[4]) : 0;
+  int vAngle = argc >= 6 ? atoi(argv[5]) : 90;
+
+  std::vector<OptimizedImage> images;
+  {
+    VideoReader vr(filename);
+    for (int i = 0; i < frames; i++) {
+      cv::Mat frame = vr.getFrame();
+      if (frame.empty())
+        break;
+      images.push_back(Optimizer::optimizeImage(frame.clone(), angle, vAngle));
+    }
+  }
+  if (images.empty()) {
+    std::cerr << "No frames read from " << filename << std::endl;
+    return 1;
+  }
+
+  // The fused path uses the same fixed-point weights as cv::resize, so the
+  // outputs should agree to within rounding.
+  double maxDiff = 0, bgraDiff = 0;
+  for (const OptimizedImage& image : images) {
+    cv::Mat reference = Optimizer::extractImage(image);
+    cv::Mat fused;
+    Optimizer::extractInto(image, fused);
+    maxDiff = std::max(maxDiff, cv::norm(reference, fused, cv::NORM_INF));
+
+    // BGRA extraction must match BGR extraction pixel for pixel.
+    cv::Mat bgra, expanded;
+    Optimizer::extractInto(image, bgra, false, true);
+    ImageUtil::expandBgrToBgra(fused, expanded);
+    bgraDiff = std::max(bgraDiff, cv::norm(expanded, bgra, cv::NORM_INF));
+  }
+
+  printf("%d frames at angle %d, vAngle %d; max difference %.0f, BGRA %.0f\n",
+      (int) images.size(), angle, vAngle, maxDiff, bgraDiff);
+
+  double fullBytes = 0, partBytes = 0;
+  for (const OptimizedImage& image : images) {
+    cv::Mat frame;
+    Optimizer::extractInto(image, frame, false, UPLOAD_BGRA);
+    fullBytes += uploadedBytes(frame);
+    partBytes += compositedBytes(image);
+  }
+  printf("Upload per frame: %.2f MB extracted, %.2f MB as periphery and fovea\n",
+      fullBytes / images.size() / (1 << 20), partBytes / images.size() / (1 << 20));
+
+  double baseline = 0, ms = 0;
+  bench("extractImage", extractImage, images, 0, &baseline);
+  bench("extractInto (new dst)", extractIntoNew, images, baseline, &ms);
+  bench("extractInto (reused dst)", extractIntoReused, images, baseline, &ms);
+  bench("extractInto (reused, cleared)", extractIntoCleared, images, baseline, &ms);
+  bench("extractInto (BGRA)", extractIntoBgra, images, baseline, &ms);
+  bench("extractInto, then expand to BGRA", extractThenExpand, images, baseline, &ms);
+  return 0;
+}
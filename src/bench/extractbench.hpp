@@ -0,0 +1,9 @@
+#ifndef BENCH_EXTRACTBENCH_H_
+#define BENCH_EXTRACTBENCH_H_
+
+class ExtractBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
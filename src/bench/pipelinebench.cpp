@@ -0,0 +1,150 @@
+#include "pipelinebench.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+#include "../optimizer/optimizer.hpp"
+#include "../util/matpool.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/videoreader.hpp"
+
+// Measures OptimizerPipeline throughput as the number of optimizer workers
+// grows from 1 to maxWorkers (doubling each time). Decoding is measured on
+// its own first, since a single VideoReader caps what the pipeline can reach.
+// Finally each PipelineMode is driven by a simulated 75Hz display loop to
+// compare motion-to-update latency, dropped frames and queue depth.
+
+static const double DISPLAY_HZ = 75;
+
+static void waitForReadAhead(VideoReader& vr) {
+  double start = Timer::timeInSeconds();
+  while (vr.getNumFramesAvailable() < VIDEOREADER_QUEUE_SIZE &&
+      Timer::timeInSeconds() - start < 5) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+static double benchDecode(const std::string& filename, int frames, MatPool* pool) {
+  VideoReader vr(filename, pool);
+  vr.getFrame();
+
+  double start = Timer::timeInSeconds();
+  int got = 0;
+  while (got < frames && !vr.getFrame().empty())
+    got++;
+  return got / (Timer::timeInSeconds() - start);
+}
+
+static double benchPipeline(const std::string& filename, int frames,
+    int numWorkers, MatPool* pool, double* utilization) {
+  VideoReader vr(filename, pool);
+  waitForReadAhead(vr);
+
+  OptimizerPipeline pipeline(&vr, pool, numWorkers);
+  FrameData fd = pipeline.getFrame();
+  long lastSequence = fd.sequence;
+
+  double start = Timer::timeInSeconds();
+  int got = 0;
+  while (got < frames) {
+    fd = pipeline.getFrame();
+    if (fd.empty())
+      break;
+    if (fd.sequence != lastSequence + 1) {
+      std::cerr << "Frame " << fd.sequence << " out of order after "
+        << lastSequence << std::endl;
+      std::exit(1);
+    }
+    lastSequence = fd.sequence;
+    got++;
+  }
+  double elapsed = Timer::timeInSeconds() - start;
+
+  double busy = 0;
+  std::vector<OptimizerWorkerStats> stats = pipeline.getWorkerStats();
+  for (const OptimizerWorkerStats& w : stats)
+    busy += w.busySeconds;
+  *utilization = busy / (pipeline.getRunningSeconds() * numWorkers);
+
+  return got / elapsed;
+}
+
+static void benchLatency(const std::string& filename, int frames,
+    PipelineMode mode, MatPool* pool) {
+  VideoReader vr(filename, pool);
+  waitForReadAhead(vr);
+
+  OptimizerPipeline pipeline(&vr, pool, OPTIMIZER_WORKERS, mode);
+  Histogram m2u;
+  Histogram queueDepth(1);
+
+  int shown = 0;
+  double nextTick = Timer::timeInSeconds();
+  while (shown < frames) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(
+          std::max(0.0, nextTick - Timer::timeInSeconds())));
+    nextTick += 1.0 / DISPLAY_HZ;
+
+    // Same role as updatePipelineOrientation in oculus2: stamp the pose.
+    double now = Timer::timeInSeconds();
+    pipeline.hmdDataMutex.lock();
+    pipeline.lastUpdated = now;
+    pipeline.hmdDataMutex.unlock();
+
+    queueDepth.record(pipeline.getNumFramesAvailable());
+    if (shown > 0 && !pipeline.isFrameAvailable()) {
+      if (pipeline.isFinished())
+        break;
+      continue;
+    }
+
+    FrameData fd = pipeline.getFrame();
+    if (fd.empty())
+      break;
+    if (fd.timestamp > 0)
+      m2u.record(Timer::timeInSeconds() - fd.timestamp);
+    shown++;
+  }
+
+  printf("%-12s M2U p50=%7.2f p99=%7.2f max=%7.2f ms  dropped=%ld  "
+      "OQ p50=%3.0f max=%3.0f  (%d frames shown)\n",
+      mode == PIPELINE_LATEST_POSE ? "latest-pose" : "queued",
+      1000 * m2u.percentile(50), 1000 * m2u.percentile(99), 1000 * m2u.max(),
+      pipeline.getDroppedFrames(), queueDepth.percentile(50), queueDepth.max(), shown);
+}
+
+int PipelineBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " pipelinebench filename [frames] [maxWorkers]"
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int frames = argc >= 4 ? atoi(argv[3]) : 120;
+  int maxWorkers = argc >= 5 ? atoi(argv[4]) : 16;
+
+  MatPool pool(MAT_POOL_HUGE_PAGES);
+
+  printf("Decode only: %7.2f fps\n", benchDecode(filename, frames, &pool));
+
+  double baseline = 0;
+  for (int numWorkers = 1; numWorkers <= maxWorkers; numWorkers *= 2) {
+    double utilization = 0;
+    double fps = benchPipeline(filename, frames, numWorkers, &pool, &utilization);
+    if (numWorkers == 1)
+      baseline = fps;
+    printf("%2d workers: %7.2f fps  %5.2fx  %5.1f%% worker utilization\n",
+        numWorkers, fps, fps / baseline, 100 * utilization);
+  }
+
+  benchLatency(filename, frames, PIPELINE_QUEUED, &pool);
+  benchLatency(filename, frames, PIPELINE_LATEST_POSE, &pool);
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_PIPELINEBENCH_H_
+#define BENCH_PIPELINEBENCH_H_
+
+class PipelineBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "queuebench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include <opencv2/core/core.hpp>
+
+#include "../util/channel.h"
+#include "../util/ringbuffer.h"
+#include "../util/timer.hpp"
+#include "../util/workqueue.h"
+
+// Contention microbenchmark: one producer and one consumer thread hand
+// cv::Mat headers (the frame path payload) across a bounded queue as fast as
+// they can. WorkQueue is bounded the way the pipelines used to bound it, by
+// polling size() on the producer side.
+
+double QueueBench::benchWorkQueue(int items, size_t capacity, const cv::Mat& payload) {
+  WorkQueue<cv::Mat> queue;
+
+  double start = Timer::timeInSeconds();
+  std::thread producer([&]() {
+    for (int i = 0; i < items; i++) {
+      while (queue.size() >= capacity)
+        std::this_thread::yield();
+      queue.enqueue(payload);
+    }
+  });
+  for (int i = 0; i < items; i++) {
+    cv::Mat m = queue.dequeue();
+  }
+  producer.join();
+  return Timer::timeInSeconds() - start;
+}
+
+double QueueBench::benchRingBuffer(int items, size_t capacity, const cv::Mat& payload) {
+  RingBuffer<cv::Mat> queue(capacity);
+
+  double start = Timer::timeInSeconds();
+  std::thread producer([&]() {
+    for (int i = 0; i < items; i++) {
+      queue.push(payload);
+    }
+  });
+  for (int i = 0; i < items; i++) {
+    cv::Mat m = queue.pop();
+  }
+  producer.join();
+  return Timer::timeInSeconds() - start;
+}
+
+double QueueBench::benchChannel(int items, size_t capacity, const cv::Mat& payload) {
+  Channel<cv::Mat> queue(capacity);
+
+  double start = Timer::timeInSeconds();
+  std::thread producer([&]() {
+    for (int i = 0; i < items; i++) {
+      queue.push(payload);
+    }
+    queue.close();
+  });
+  cv::Mat m;
+  while (queue.pop(m)) {
+  }
+  producer.join();
+  return Timer::timeInSeconds() - start;
+}
+
+static void report(const char* name, size_t capacity, int items, double seconds) {
+  printf("%-12s cap=%-5zu %10.1f ns/item %12.0f items/s\n",
+      name, capacity, seconds * 1e9 / items, items / seconds);
+}
+
+int QueueBench::run(int argc, char* argv[]) {
+  int items = 1000000;
+  if (argc >= 3)
+    items = atoi(argv[2]);
+
+  cv::Mat payload(1, 1, CV_8UC3);
+  const size_t capacities[] = { 1, 7, 30, 256 };
+
+  printf("Queue contention benchmark, %d items per run\n", items);
+  for (size_t capacity : capacities) {
+    report("WorkQueue", capacity, items, benchWorkQueue(items, capacity, payload));
+    report("RingBuffer", capacity, items, benchRingBuffer(items, capacity, payload));
+    report("Channel", capacity, items, benchChannel(items, capacity, payload));
+  }
+  return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef BENCH_QUEUEBENCH_H_
+#define BENCH_QUEUEBENCH_H_
+
+#include <cstddef>
+
+#include <opencv2/core/core.hpp>
+
+class QueueBench {
+  public:
+    static int run(int argc, char* argv[]);
+
+    // Seconds for one producer and one consumer thread to pass items copies
+    // of payload through a queue of capacity. Also used by Bench.
+    static double benchWorkQueue(int items, size_t capacity, const cv::Mat& payload);
+    static double benchRingBuffer(int items, size_t capacity, const cv::Mat& payload);
+    static double benchChannel(int items, size_t capacity, const cv::Mat& payload);
+};
+
+#endif
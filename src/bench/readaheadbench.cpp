@@ -0,0 +1,96 @@
+#include "readaheadbench.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+
+#include "../settings.hpp"
+#include "../util/histogram.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/videoreader.hpp"
+
+// Compares VideoReader's two kinds of read-ahead with the libav backend:
+// VIDEOREADER_QUEUE_SIZE decoded frames, against a queue of compressed
+// packets with only VIDEOREADER_DECODED_FRAMES decoded. Each reader gets a
+// moment to fill its buffers and is then drained at a fixed frame rate by a
+// consumer timing every getFrame(). Memory is the growth of the process's
+// resident set over what it was before the reader was created. malloc may
+// hold on to freed frames and inflate the second reader's numbers; run with
+// MALLOC_MMAP_THRESHOLD_=1048576 so that frames go straight back to the OS.
+// conduit_synthetic runs this on a synthetic video, without libav.
+
+static const double FILL_SECONDS = 2;
+
+static double residentMB() {
+  long pages = 0, resident = 0;
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (!f)
+    return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (double) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static void bench(const char* name, const std::string& filename, bool packetReadAhead,
+    int frames, double fps) {
+  double baseline = residentMB();
+  Histogram waits;
+  double filledMB, peakMB;
+  int got = 0;
+
+  VideoReader vr(filename, NULL, VIDEO_BACKEND_LIBAV, packetReadAhead);
+  std::this_thread::sleep_for(std::chrono::milliseconds((int) (1000 * FILL_SECONDS)));
+  filledMB = peakMB = residentMB() - baseline;
+
+  double next = Timer::timeInSeconds();
+  for (; got < frames; got++) {
+    if (fps > 0) {
+      double delay = next - Timer::timeInSeconds();
+      if (delay > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds((long) (1e6 * delay)));
+      next += 1 / fps;
+    }
+    double start = Timer::timeInSeconds();
+    cv::Mat frame = vr.getFrame();
+    if (frame.empty())
+      break;
+    waits.record(Timer::timeInSeconds() - start);
+    peakMB = std::max(peakMB, residentMB() - baseline);
+  }
+
+  printf("%s: %d frames, resident +%.1f MB after filling, +%.1f MB peak",
+      name, got, filledMB, peakMB);
+  if (vr.hasPacketReadAhead()) {
+    printf(", packet queue peak %.2f MB",
+        vr.getPacketQueue().getPeakBytes() / (1024.0 * 1024.0));
+  }
+  std::cout << "\n  getFrame wait ";
+  waits.print(std::cout, 1000);
+  std::cout << " ms\n  decode        ";
+  vr.getDecodeTimes().print(std::cout, 1000);
+  std::cout << " ms" << std::endl;
+}
+
+int ReadAheadBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " readaheadbench filename [frames] [fps]\n"
+      << "fps defaults to 30; 0 reads frames as fast as they are decoded."
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int frames = argc >= 4 ? atoi(argv[3]) : 300;
+  double fps = argc >= 5 ? atof(argv[4]) : 30;
+
+  bench("decoded frames", filename, false, frames, fps);
+  bench("packets", filename, true, frames, fps);
+  return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef BENCH_READAHEADBENCH_H_
+#define BENCH_READAHEADBENCH_H_
+
+class ReadAheadBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
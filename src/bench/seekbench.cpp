@@ -0,0 +1,131 @@
+#include "seekbench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "../settings.hpp"
+#include "../util/histogram.hpp"
+#include "../util/timer.hpp"
+#include "../videoreader/videoreader.hpp"
+
+// Times how quickly VideoReader gets to a frame with each backend: from
+// construction to the first frame, starting at the beginning of the video
+// and halfway through it; from seekToFrame() to the frame after random
+// seeks; and across the end of the video when looping, against an ordinary
+// frame. Frames that come back with the wrong number are counted. The libav
+// backend's index is built first if there isn't one, and timed separately.
+
+static const int LOOP_FRAMES = 10;
+
+struct SeekResult {
+  double firstFrameMs = 0;
+  double midFrameMs = 0;
+  Histogram seeks;
+  long wrongFrames = 0;
+  double loopMs = 0;
+  double frameMs = 0;
+};
+
+static double timeFirstFrame(const std::string& filename, VideoBackend backend,
+    long startFrame, long& wrongFrames) {
+  double start = Timer::timeInSeconds();
+  VideoReader vr(filename, NULL, backend, VIDEOREADER_PACKET_READAHEAD, VIDEO_IO, startFrame);
+  VideoFrame frame;
+  bool got = vr.getFrame(frame);
+  double ms = 1000 * (Timer::timeInSeconds() - start);
+  if (!got || frame.frameNumber != startFrame)
+    wrongFrames++;
+  return ms;
+}
+
+static bool bench(const std::string& filename, VideoBackend backend, int seeks,
+    SeekResult& result) {
+  long frames;
+  {
+    VideoReader vr(filename, NULL, backend);
+    frames = vr.getFrameCount();
+  }
+  if (frames <= LOOP_FRAMES) {
+    std::cerr << "Need a video of more than " << LOOP_FRAMES << " frames" << std::endl;
+    return false;
+  }
+
+  result.firstFrameMs = timeFirstFrame(filename, backend, 0, result.wrongFrames);
+  result.midFrameMs = timeFirstFrame(filename, backend, frames / 2, result.wrongFrames);
+
+  VideoReader vr(filename, NULL, backend);
+  VideoFrame frame;
+  std::mt19937 random(1);
+  std::uniform_int_distribution<long> pick(0, frames - 1);
+  for (int i = 0; i < seeks; i++) {
+    long target = pick(random);
+    double start = Timer::timeInSeconds();
+    bool got = vr.seekToFrame(target) && vr.getFrame(frame);
+    result.seeks.record(Timer::timeInSeconds() - start);
+    if (!got || frame.frameNumber != target)
+      result.wrongFrames++;
+  }
+
+  // Play through the end of the video; the first frame after it should
+  // arrive about as quickly as any other.
+  vr.setLooping(true);
+  vr.seekToFrame(frames - LOOP_FRAMES / 2);
+  vr.getFrame(frame);
+  double frameSeconds = 0;
+  for (int i = 1; i < LOOP_FRAMES; i++) {
+    double start = Timer::timeInSeconds();
+    if (!vr.getFrame(frame)) {
+      result.wrongFrames++;
+      break;
+    }
+    double seconds = Timer::timeInSeconds() - start;
+    if (frame.frameNumber == 0)
+      result.loopMs = 1000 * seconds;
+    else
+      frameSeconds += seconds;
+  }
+  result.frameMs = 1000 * frameSeconds / (LOOP_FRAMES - 2);
+  return true;
+}
+
+static void print(const char* name, const SeekResult& r) {
+  printf("%-7s first frame %7.1f ms, halfway %7.1f ms, wrong frames %ld\n",
+      name, r.firstFrameMs, r.midFrameMs, r.wrongFrames);
+  std::cout << "        seek to frame ";
+  r.seeks.print(std::cout, 1000);
+  std::cout << " ms" << std::endl;
+  printf("        loop %.2f ms to frame 0, %.2f ms per other frame\n", r.loopMs, r.frameMs);
+}
+
+int SeekBench::run(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " seekbench filename [seeks]"
+      << std::endl;
+    return 1;
+  }
+
+  std::string filename = argv[2];
+  int seeks = argc >= 4 ? atoi(argv[3]) : 50;
+
+  // Built here rather than by the first reader, so it isn't counted as
+  // startup.
+  VideoIndex index;
+  if (!index.load(filename)) {
+    double start = Timer::timeInSeconds();
+    if (LibavDecoder::buildIndex(filename, index) && index.save(filename)) {
+      printf("indexed %ld frames, %ld keyframes in %.2f s\n", index.getFrameCount(),
+          index.getKeyframeCount(), Timer::timeInSeconds() - start);
+    }
+  }
+
+  SeekResult opencv, libav;
+  if (bench(filename, VIDEO_BACKEND_OPENCV, seeks, opencv))
+    print("opencv", opencv);
+  if (!index.isEmpty() && bench(filename, VIDEO_BACKEND_LIBAV, seeks, libav))
+    print("libav", libav);
+  return 0;
+}
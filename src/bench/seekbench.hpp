@@ -0,0 +1,9 @@
+#ifndef BENCH_SEEKBENCH_H_
+#define BENCH_SEEKBENCH_H_
+
+class SeekBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
@@ -0,0 +1,19 @@
+#include <iostream>
+#include <string>
+
+#include "readaheadbench.hpp"
+#include "../util/trace.hpp"
+
+// Entry point of conduit_synthetic, which runs readaheadbench on
+// bench/syntheticdecoder.cpp instead of libav. Takes the same arguments as
+// the readaheadbench runmode of conduit, with a synthetic video such as
+// 2560x2560 in place of the filename.
+int main(int argc, char* argv[]) {
+  Trace::initFromEnvironment();
+  if (argc < 2 || std::string(argv[1]) != "readaheadbench") {
+    std::cerr << "Usage: " << argv[0] << " readaheadbench WIDTHxHEIGHT[xFRAMES] [frames] [fps]"
+      << std::endl;
+    return 1;
+  }
+  return ReadAheadBench::run(argc, argv);
+}
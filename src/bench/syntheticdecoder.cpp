@@ -0,0 +1,125 @@
+#include "../videoreader/libavdecoder.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "../util/imageutil.hpp"
+
+// A stand-in for libavdecoder.cpp, linked into conduit_synthetic instead of
+// it, so the libav read-ahead path of VideoReader can be measured without
+// libav or a video file. The "filename" is WIDTHxHEIGHT or
+// WIDTHxHEIGHTxFRAMES (300 frames by default) of a 30 fps I420 video.
+// Packets are sized like a typical H.264 stream: a keyframe of a sixteenth
+// of a byte per pixel every 30 frames, and a tenth of that in between.
+// Decoding writes a moving pattern into every byte of the frame.
+
+static const double FRAME_SECONDS = 1.0 / 30;
+static const int KEYFRAME_INTERVAL = 30;
+
+// Only one synthetic video is open at a time in a bench process.
+static cv::Size videoSize;
+static long videoFrames = 0;
+
+LibavDecoder::LibavDecoder()
+  : io(NULL), format(NULL), codec(NULL), frame(NULL), stream(-1), frameSeconds(0),
+    draining(false), restarting(false), skipBefore(0), startPts(0), frameNumber(-1) {
+}
+
+LibavDecoder::~LibavDecoder() {
+}
+
+bool LibavDecoder::open(const std::string& filename, VideoIo videoIo) {
+  int width = 0, height = 0;
+  long frames = 300;
+  if (sscanf(filename.c_str(), "%dx%dx%ld", &width, &height, &frames) < 2 ||
+      width <= 0 || height <= 0 || width % 2 != 0 || height % 4 != 0 || frames <= 0) {
+    std::cerr << "synthetic video must be WIDTHxHEIGHT[xFRAMES], with an even"
+      " width and a height divisible by 4, not " << filename << std::endl;
+    return false;
+  }
+  videoSize = cv::Size(width, height);
+  videoFrames = frames;
+  frameSeconds = FRAME_SECONDS;
+  // The next frame to demux.
+  stream = 0;
+  return true;
+}
+
+bool LibavDecoder::isOpened() const {
+  return stream >= 0;
+}
+
+bool LibavDecoder::read(cv::Mat& image) {
+  return decode([this](VideoPacket& packet) { return readPacket(packet); }, image);
+}
+
+bool LibavDecoder::readPacket(VideoPacket& packet) {
+  if (stream < 0 || stream >= videoFrames)
+    return false;
+  size_t keyframeBytes = videoSize.area() / 16;
+  packet.packet = (AVPacket*) new long(stream);
+  packet.bytes = stream % KEYFRAME_INTERVAL == 0 ? keyframeBytes : keyframeBytes / 10;
+  packet.seconds = frameSeconds;
+  stream++;
+  return true;
+}
+
+void LibavDecoder::freePacket(VideoPacket& packet) {
+  delete (long*) packet.packet;
+  packet.packet = NULL;
+}
+
+bool LibavDecoder::decode(const std::function<bool(VideoPacket&)>& nextPacket,
+    cv::Mat& image) {
+  VideoPacket packet;
+  // Nothing is buffered in the decoder, so a rewind marker needs no draining.
+  do {
+    if (!nextPacket(packet))
+      return false;
+  } while (!packet.packet);
+  frameNumber = *(long*) packet.packet;
+  freePacket(packet);
+
+  ImageUtil::createI420(image, videoSize);
+  for (int row = 0; row < image.rows; row++)
+    memset(image.ptr(row), 16 + (row + frameNumber) % 220, image.cols);
+  return true;
+}
+
+bool LibavDecoder::openIndex(const std::string& filename, bool build) {
+  return false;
+}
+
+bool LibavDecoder::buildIndex(const std::string& filename, VideoIndex& index) {
+  std::cerr << "A synthetic video has no index" << std::endl;
+  return false;
+}
+
+bool LibavDecoder::rewind() {
+  stream = 0;
+  return true;
+}
+
+bool LibavDecoder::seekToFrame(long frame) {
+  if (frame < 0 || frame >= videoFrames)
+    return false;
+  stream = (int) frame;
+  return true;
+}
+
+long LibavDecoder::getFrameCount() const {
+  return videoFrames;
+}
+
+long LibavDecoder::getFrameAt(double seconds) const {
+  return (long) (seconds / frameSeconds + 0.5);
+}
+
+int64_t LibavDecoder::getPts(long frame) const {
+  return frame;
+}
+
+long LibavDecoder::getFrame(int64_t pts) const {
+  return (long) pts;
+}
@@ -0,0 +1,150 @@
+#include "uploadbench.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <GL/glew.h>
+#include <opencv2/core/core.hpp>
+
+#include "../oculus2/hmdbackend.hpp"
+#include "../settings.hpp"
+#include "../util/imageutil.hpp"
+#include "../util/timer.hpp"
+
+// Times texture uploads of one eye's frame in the formats oculus2 can use,
+// on whatever driver the headless GL context lands on (see NullHmdBackend),
+// both from client memory and through a pixel buffer the way
+// TextureData::upload does it. Each upload is followed by glFinish, so a
+// driver converting pixels on the CPU or the GPU pays for it inside the
+// measurement either way.
+
+static const int WARMUP_UPLOADS = 3;
+
+enum UploadCase {
+  // What oculus2 did before: RGB8 storage, BGR pixels.
+  UPLOAD_BGR_TO_RGB8,
+  UPLOAD_BGR_TO_RGBA8,
+  // Pixels already BGRA, as Optimizer::extractInto writes them.
+  UPLOAD_BGRA_TO_RGBA8,
+  // TextureData::upload: BGR pixels copied into a pixel buffer as they are,
+  // or, with UPLOAD_BGRA, widened to BGRA on the way in.
+  UPLOAD_BGR_PBO_TO_RGBA8,
+  UPLOAD_EXPAND_PBO_TO_RGBA8,
+};
+
+static GLuint createTexture(GLenum internalFormat, int width, int height) {
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  if (internalFormat == GL_RGBA8 && GLEW_ARB_texture_storage) {
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+  } else {
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0,
+        GL_BGR, GL_UNSIGNED_BYTE, NULL);
+  }
+  return texture;
+}
+
+// Copies bgr into a pixel buffer of size bytes, widening it to BGRA if
+// expand is set, and uploads it from there, as TextureData::upload does.
+static void uploadThroughBuffer(GLuint pbo, size_t size, const cv::Mat& bgr, bool expand) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+  GLubyte* ptr = (GLubyte*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (expand) {
+    for (int row = 0; row < bgr.rows; row++)
+      ImageUtil::expandBgrToBgra(bgr.ptr(row), ptr + row * bgr.cols * 4, bgr.cols);
+  } else {
+    std::memcpy(ptr, bgr.ptr(), ImageUtil::imageSize(bgr));
+  }
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bgr.cols, bgr.rows,
+      expand ? GL_BGRA : GL_BGR, GL_UNSIGNED_BYTE, 0);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+static void bench(const char* name, UploadCase uploadCase, const cv::Mat& bgr,
+    int uploads, double baseline, double* msPerUpload) {
+  cv::Mat bgra;
+  ImageUtil::expandBgrToBgra(bgr, bgra);
+
+  GLenum internalFormat = uploadCase == UPLOAD_BGR_TO_RGB8 ? GL_RGB8 : GL_RGBA8;
+  GLuint texture = createTexture(internalFormat, bgr.cols, bgr.rows);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, uploadCase == UPLOAD_BGRA_TO_RGBA8 ? 4 : 1);
+
+  // Room for BGRA, like TextureData's buffers.
+  size_t pboSize = bgr.total() * 4;
+  GLuint pbo;
+  glGenBuffers(1, &pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, pboSize, NULL, GL_STREAM_DRAW);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  double start = 0;
+  for (int i = -WARMUP_UPLOADS; i < uploads; i++) {
+    if (i == 0)
+      start = Timer::timeInSeconds();
+    switch (uploadCase) {
+      case UPLOAD_BGR_TO_RGB8:
+      case UPLOAD_BGR_TO_RGBA8:
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bgr.cols, bgr.rows,
+            GL_BGR, GL_UNSIGNED_BYTE, bgr.ptr());
+        break;
+      case UPLOAD_BGRA_TO_RGBA8:
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bgra.cols, bgra.rows,
+            GL_BGRA, GL_UNSIGNED_BYTE, bgra.ptr());
+        break;
+      case UPLOAD_BGR_PBO_TO_RGBA8:
+      case UPLOAD_EXPAND_PBO_TO_RGBA8:
+        uploadThroughBuffer(pbo, pboSize, bgr, uploadCase == UPLOAD_EXPAND_PBO_TO_RGBA8);
+        break;
+    }
+    glFinish();
+  }
+  double elapsed = Timer::timeInSeconds() - start;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glDeleteTextures(1, &texture);
+  glDeleteBuffers(1, &pbo);
+
+  *msPerUpload = 1000 * elapsed / uploads;
+  double pixelsPerSecond = (double) bgr.total() * uploads / elapsed;
+  printf("%-34s %8.3f ms/upload  %7.1f Mpixel/s  %5.2fx\n", name, *msPerUpload,
+      pixelsPerSecond / 1e6, baseline > 0 ? baseline / *msPerUpload : 1.0);
+}
+
+int UploadBench::run(int argc, char* argv[]) {
+  // Usage: uploadbench [width] [height] [uploads]. One eye of a 4k top/bottom frame by default.
+  int width = argc >= 3 ? atoi(argv[2]) : 3840;
+  int height = argc >= 4 ? atoi(argv[3]) : 1080;
+  int uploads = argc >= 5 ? atoi(argv[4]) : 50;
+
+  NullHmdBackend backend(HEADLESS_REFRESH_RATE);
+  if (!backend.init())
+    return 1;
+  glewInit();
+  printf("%s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+  cv::Mat bgr(height, width, CV_8UC3);
+  for (int row = 0; row < height; row++) {
+    uchar* p = bgr.ptr(row);
+    for (int i = 0; i < width * 3; i++)
+      p[i] = (uchar) (row * 7 + i * 13);
+  }
+  printf("%dx%d, %d uploads each\n", width, height, uploads);
+
+  double baseline = 0, ms = 0;
+  bench("BGR into RGB8", UPLOAD_BGR_TO_RGB8, bgr, uploads, 0, &baseline);
+  bench("BGR into RGBA8", UPLOAD_BGR_TO_RGBA8, bgr, uploads, baseline, &ms);
+  bench("BGRA into RGBA8", UPLOAD_BGRA_TO_RGBA8, bgr, uploads, baseline, &ms);
+  bench("BGR via PBO into RGBA8", UPLOAD_BGR_PBO_TO_RGBA8, bgr, uploads, baseline, &ms);
+  bench("BGR widened into PBO, into RGBA8", UPLOAD_EXPAND_PBO_TO_RGBA8, bgr, uploads,
+      baseline, &ms);
+
+  backend.shutdown();
+  return 0;
+}
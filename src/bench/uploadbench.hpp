@@ -0,0 +1,9 @@
+#ifndef BENCH_UPLOADBENCH_H_
+#define BENCH_UPLOADBENCH_H_
+
+class UploadBench {
+  public:
+    static int run(int argc, char* argv[]);
+};
+
+#endif
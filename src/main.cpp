@@ -1,6 +1,17 @@
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 
+#include "bench/anglebench.hpp"
+#include "bench/bench.hpp"
+#include "bench/compositebench.hpp"
+#include "bench/decodebench.hpp"
+#include "bench/extractbench.hpp"
+#include "bench/pipelinebench.hpp"
+#include "bench/queuebench.hpp"
+#include "bench/readaheadbench.hpp"
+#include "bench/seekbench.hpp"
+#include "bench/uploadbench.hpp"
 #include "buildtest/buildtest.hpp"
 #include "oculus2/oculus2.hpp"
 #include "optimizer/optimizer.hpp"
@@ -9,6 +20,7 @@
 #include "util/cylinderwarp.hpp"
 #include "util/imageutil.hpp"
 #include "util/timer.hpp"
+#include "util/trace.hpp"
 #include "videoreader/videoreader.hpp"
 
 static void usage() {
@@ -16,11 +28,23 @@ static void usage() {
     "Available runmodes:\n" <<
     "  buildtest\n" <<
     "  playvideo\n" <<
+    "  buildindex\n" <<
     "  cylinderwarp\n" <<
     "  render\n" <<
     "  rendertest\n" <<
     "  oculus2\n" <<
+    "  headless\n" <<
     "  optimize\n" <<
+    "  anglebench\n" <<
+    "  bench\n" <<
+    "  compositebench\n" <<
+    "  decodebench\n" <<
+    "  extractbench\n" <<
+    "  pipelinebench\n" <<
+    "  queuebench\n" <<
+    "  readaheadbench\n" <<
+    "  seekbench\n" <<
+    "  uploadbench\n" <<
     std::endl;
   std::exit(1);
 }
@@ -41,18 +65,71 @@ static int playVideo(int argc, char* argv[]) {
   return 0;
 }
 
+// Writes the keyframe index VideoReader seeks with next to the video, so
+// that playback doesn't have to build it on first open.
+static int buildIndex(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " buildindex filename"
+      << std::endl;
+    return 1;
+  }
+  std::string filename = argv[2];
+  VideoIndex index;
+  double start = Timer::timeInSeconds();
+  if (!LibavDecoder::buildIndex(filename, index) || !index.save(filename))
+    return 1;
+  printf("Indexed %ld frames, %ld keyframes in %.2f s into %s\n",
+      index.getFrameCount(), index.getKeyframeCount(), Timer::timeInSeconds() - start,
+      VideoIndex::getPath(filename).c_str());
+  return 0;
+}
+
+// Times the original per-pixel warp against the precomputed plan on the
+// same image, and reports the largest difference between them. Inside the
+// image the two agree to within a few levels; in the thin band that maps
+// just past the top and left edges the original extrapolates, while the plan
+// clamps to the edge pixel.
+static void benchCylinderWarp(const cv::Mat& image) {
+  const int repeats = 20;
+
+  CylinderWarp::cylinderWarp(image);
+  double start = Timer::timeInSeconds();
+  for (int i = 0; i < repeats; i++)
+    CylinderWarp::cylinderWarp(image);
+  double planMs = 1000 * (Timer::timeInSeconds() - start) / repeats;
+
+  start = Timer::timeInSeconds();
+  cv::Mat reference;
+  for (int i = 0; i < repeats; i++)
+    reference = CylinderWarp::cylinderWarpReference(image);
+  double referenceMs = 1000 * (Timer::timeInSeconds() - start) / repeats;
+
+  cv::Mat warped = CylinderWarp::cylinderWarp(image);
+  double maxDiff = cv::norm(reference, warped, cv::NORM_INF);
+
+  printf("%dx%d: reference %.3f ms/frame, plan %.3f ms/frame (%.1fx), max difference %.0f\n",
+      image.cols, image.rows, referenceMs, planMs, referenceMs / planMs, maxDiff);
+}
+
 static int cylinderWarp(int argc, char* argv[]) {
   if (argc < 3) {
     std::cerr << "Usage: "
       << argv[0]
-      << " cylinderwarp filename"
+      << " cylinderwarp filename [--bench]"
       << std::endl;
     return 1;
   }
   std::string filename = argv[2];
+  bool bench = argc >= 4 && std::string(argv[3]) == "--bench";
   VideoReader videoReader(filename);
   cv::Mat image = videoReader.getFrame();
   cv::Mat left = cv::Mat(image, cv::Range(0, image.rows / 2));
+  if (bench) {
+    benchCylinderWarp(left);
+    return 0;
+  }
   cv::Mat warpedImage = CylinderWarp::cylinderWarp(left);
   std::string windowName = "Warped image";
   cv::namedWindow(windowName, CV_WINDOW_NORMAL);
@@ -98,6 +175,10 @@ static int oculus2(int argc, char* argv[]) {
   return Oculus2::run(argc, argv);
 }
 
+static int headless(int argc, char* argv[]) {
+  return Oculus2::runHeadless(argc, argv);
+}
+
 static int optimize(int argc, char* argv[]) {
   if (argc < 3) {
     std::cerr << "Usage: "
@@ -159,11 +240,14 @@ int main(int argc, char* argv[]) {
   }
 
   std::string runMode(argv[1]);
+  Trace::initFromEnvironment();
 
   if (runMode == "buildtest") {
     return BuildTest::runBuildTest();
   } else if (runMode == "playvideo") {
     return playVideo(argc, argv);
+  } else if (runMode == "buildindex") {
+    return buildIndex(argc, argv);
   } else if (runMode == "cylinderwarp") {
     return cylinderWarp(argc, argv);
   } else if (runMode == "render") {
@@ -172,8 +256,30 @@ int main(int argc, char* argv[]) {
     return renderTest(argc, argv);
   } else if (runMode == "oculus2") {
     return oculus2(argc, argv);
+  } else if (runMode == "headless") {
+    return headless(argc, argv);
   } else if (runMode == "optimize") {
     return optimize(argc, argv);
+  } else if (runMode == "bench") {
+    return Bench::run(argc, argv);
+  } else if (runMode == "anglebench") {
+    return AngleBench::run(argc, argv);
+  } else if (runMode == "compositebench") {
+    return CompositeBench::run(argc, argv);
+  } else if (runMode == "decodebench") {
+    return DecodeBench::run(argc, argv);
+  } else if (runMode == "extractbench") {
+    return ExtractBench::run(argc, argv);
+  } else if (runMode == "pipelinebench") {
+    return PipelineBench::run(argc, argv);
+  } else if (runMode == "queuebench") {
+    return QueueBench::run(argc, argv);
+  } else if (runMode == "readaheadbench") {
+    return ReadAheadBench::run(argc, argv);
+  } else if (runMode == "seekbench") {
+    return SeekBench::run(argc, argv);
+  } else if (runMode == "uploadbench") {
+    return UploadBench::run(argc, argv);
   } else {
     usage();
   }
@@ -0,0 +1,18 @@
+#include <iostream>
+#include <string>
+
+#include "oculus2.hpp"
+#include "../util/trace.hpp"
+
+// Entry point of conduit_headless, which plays a video on the null HMD
+// backend and so links neither the Oculus SDK, SDL nor CUDA. Takes the same
+// arguments as the headless runmode of conduit.
+int main(int argc, char* argv[]) {
+  Trace::initFromEnvironment();
+  if (argc < 2 || std::string(argv[1]) != "headless") {
+    std::cerr << "Usage: " << argv[0]
+      << " headless filename [frames] [refreshRate] [queued|latest]" << std::endl;
+    return 1;
+  }
+  return Oculus2::runHeadless(argc, argv);
+}
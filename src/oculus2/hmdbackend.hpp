@@ -0,0 +1,119 @@
+#ifndef OCULUS2_HMDBACKEND_H_
+#define OCULUS2_HMDBACKEND_H_
+
+#include <vector>
+
+#include "../util/posetrace.hpp"
+
+// Eye indices, in the same order as ovrEyeType.
+enum HmdEye {
+  HMD_EYE_LEFT,
+  HMD_EYE_RIGHT
+};
+
+// Keys pollEvents() reports that have no ASCII code. Other keys are reported
+// as their ASCII code, letters in lower case.
+enum HmdKey {
+  HMD_KEY_LEFT = 0x100,
+  HMD_KEY_RIGHT,
+  HMD_KEY_UP,
+  HMD_KEY_DOWN,
+  HMD_KEY_KP_PLUS,
+  HMD_KEY_KP_MINUS
+};
+
+// The headset and display oculus2 renders to. Oculus2 draws both eyes side
+// by side into one render target texture and hands it to the backend each
+// frame; the backend owns the GL context and decides how the frame is shown
+// and paced.
+class HmdBackend {
+  public:
+    virtual ~HmdBackend() {}
+
+    // Creates the GL context and makes it current. Returns false if there is
+    // no usable display.
+    virtual bool init() = 0;
+    virtual void shutdown() = 0;
+
+    // Render target size recommended for one eye.
+    virtual void getEyeTextureSize(HmdEye eye, int& width, int& height) = 0;
+    // Called once after init() with the render target: framebuffer fbo, with
+    // texture (texWidth x texHeight) attached, of which the left width x
+    // height pixels are used, left eye first.
+    virtual void setRenderTarget(unsigned int fbo, unsigned int texture,
+        int texWidth, int texHeight, int width, int height) = 0;
+
+    // The eye to render i-th.
+    virtual HmdEye getEyeRenderOrder(int i) = 0;
+    // Projection for eye, row-major (load with glLoadTransposeMatrixf).
+    virtual void getProjection(HmdEye eye, float zNear, float zFar, float matrix[16]) = 0;
+    // Translation from the center of the head to eye, in meters.
+    virtual void getEyeViewOffset(HmdEye eye, float offset[3]) = 0;
+    virtual float getEyeHeight() = 0;
+
+    // Head pose predicted secondsAhead from now.
+    virtual Pose getHeadPose(double secondsAhead) = 0;
+    // Pose to render eye with in the current frame.
+    virtual Pose getEyePose(HmdEye eye) = 0;
+
+    virtual void beginFrame() = 0;
+    // Shows the render target, which was drawn with eyePoses. Returns once
+    // the frame has been handed to the display.
+    virtual void endFrame(const Pose eyePoses[2]) = 0;
+
+    // Appends the keys pressed since the last call to keys. Returns false if
+    // the user asked to quit.
+    virtual bool pollEvents(std::vector<int>& keys) = 0;
+    // Keys oculus2 itself doesn't use.
+    virtual void handleKey(int key) {}
+};
+
+// A DK2-shaped HMD with no hardware behind it, rendering into an offscreen
+// EGL pbuffer. Poses are always the identity (use CONDUIT_POSE_REPLAY for
+// head motion). endFrame() waits for the GPU and then, if refreshRate is
+// positive, for the next simulated vsync; with 0 frames are presented as
+// fast as they can be drawn.
+class NullHmdBackend : public HmdBackend {
+  public:
+    explicit NullHmdBackend(double refreshRate);
+
+    bool init();
+    void shutdown();
+
+    void getEyeTextureSize(HmdEye eye, int& width, int& height);
+    void setRenderTarget(unsigned int fbo, unsigned int texture,
+        int texWidth, int texHeight, int width, int height);
+
+    HmdEye getEyeRenderOrder(int i);
+    void getProjection(HmdEye eye, float zNear, float zFar, float matrix[16]);
+    void getEyeViewOffset(HmdEye eye, float offset[3]);
+    float getEyeHeight();
+
+    Pose getHeadPose(double secondsAhead);
+    Pose getEyePose(HmdEye eye);
+
+    void beginFrame();
+    void endFrame(const Pose eyePoses[2]);
+
+    bool pollEvents(std::vector<int>& keys);
+
+  private:
+    double refreshRate;
+    // Time of the first presented frame; vsyncs fall every 1 / refreshRate
+    // seconds after it.
+    double firstVsync;
+    // Index of the vsync the last frame was shown at.
+    long lastVsync;
+    long framesPresented;
+    long missedVsyncs;
+
+    unsigned int fbo;
+    int width;
+    int height;
+
+    void* display;
+    void* surface;
+    void* context;
+};
+
+#endif
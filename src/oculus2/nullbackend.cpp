@@ -0,0 +1,251 @@
+#include "hmdbackend.hpp"
+
+#include <GL/glew.h>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "../util/timer.hpp"
+
+// What the Oculus SDK reports for a DK2 with default settings.
+static const int DK2_RESOLUTION_WIDTH = 1920;
+static const int DK2_RESOLUTION_HEIGHT = 1080;
+static const int DK2_EYE_TEXTURE_WIDTH = 1182;
+static const int DK2_EYE_TEXTURE_HEIGHT = 1461;
+// Tangents of the left eye's half-angles; the right eye is mirrored.
+static const float DK2_FOV_UP = 1.3292f;
+static const float DK2_FOV_DOWN = 1.3292f;
+static const float DK2_FOV_OUTER = 1.0586f;
+static const float DK2_FOV_INNER = 1.0924f;
+static const float DK2_IPD = 0.064f;
+static const float DEFAULT_EYE_HEIGHT = 1.675f;
+
+NullHmdBackend::NullHmdBackend(double refreshRate)
+  : refreshRate(refreshRate), firstVsync(-1), lastVsync(0), framesPresented(0),
+    missedVsyncs(0), fbo(0), width(0), height(0), display(NULL), surface(NULL), context(NULL) {}
+
+#ifdef HAVE_EGL
+static bool hasExtension(const char* extensions, const char* name) {
+  if (!extensions)
+    return false;
+  size_t length = strlen(name);
+  for (const char* p = strstr(extensions, name); p; p = strstr(p + length, name)) {
+    if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+// Prefers a display that needs no window system: the first GPU through
+// EGL_EXT_platform_device, or Mesa's surfaceless platform.
+static EGLDisplay getHeadlessDisplay() {
+  const char* extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+  if (getPlatformDisplay && hasExtension(extensions, "EGL_EXT_platform_device")) {
+    PFNEGLQUERYDEVICESEXTPROC queryDevices =
+      (PFNEGLQUERYDEVICESEXTPROC) eglGetProcAddress("eglQueryDevicesEXT");
+    EGLDeviceEXT device;
+    EGLint numDevices = 0;
+    if (queryDevices && queryDevices(1, &device, &numDevices) && numDevices > 0) {
+      EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+      if (display != EGL_NO_DISPLAY)
+        return display;
+    }
+  }
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+  if (getPlatformDisplay && hasExtension(extensions, "EGL_MESA_platform_surfaceless")) {
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY)
+      return display;
+  }
+#endif
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+#endif
+
+bool NullHmdBackend::init() {
+#ifdef HAVE_EGL
+  EGLDisplay eglDisplay = getHeadlessDisplay();
+  EGLint major, minor;
+  if (eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, &major, &minor)) {
+    std::cerr << "failed to initialize EGL" << std::endl;
+    return false;
+  }
+  display = eglDisplay;
+
+  const EGLint configAttributes[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint numConfigs = 0;
+  if (!eglChooseConfig(eglDisplay, configAttributes, &config, 1, &numConfigs) || numConfigs < 1) {
+    std::cerr << "no EGL config for an OpenGL pbuffer" << std::endl;
+    return false;
+  }
+
+  // The pbuffer stands in for the HMD's screen.
+  const EGLint pbufferAttributes[] = {
+    EGL_WIDTH, DK2_RESOLUTION_WIDTH,
+    EGL_HEIGHT, DK2_RESOLUTION_HEIGHT,
+    EGL_NONE
+  };
+  surface = eglCreatePbufferSurface(eglDisplay, config, pbufferAttributes);
+  if (surface == EGL_NO_SURFACE) {
+    std::cerr << "failed to create EGL pbuffer" << std::endl;
+    return false;
+  }
+
+  // oculus2 draws with the fixed-function pipeline, so this must be a
+  // compatibility context, which is what EGL gives by default.
+  eglBindAPI(EGL_OPENGL_API);
+  context = eglCreateContext(eglDisplay, config, EGL_NO_CONTEXT, NULL);
+  if (context == EGL_NO_CONTEXT) {
+    std::cerr << "failed to create OpenGL context" << std::endl;
+    return false;
+  }
+  if (!eglMakeCurrent(eglDisplay, surface, surface, context)) {
+    std::cerr << "failed to make OpenGL context current" << std::endl;
+    return false;
+  }
+
+  printf("initialized null HMD (EGL %d.%d, %s), %.0f Hz\n",
+      major, minor, eglQueryString(eglDisplay, EGL_VENDOR), refreshRate);
+  return true;
+#else
+  std::cerr << "the null HMD needs EGL, which this build doesn't have" << std::endl;
+  return false;
+#endif
+}
+
+void NullHmdBackend::shutdown() {
+  if (refreshRate > 0) {
+    printf("null HMD: %ld frames presented, %ld vsyncs missed\n",
+        framesPresented, missedVsyncs);
+  } else {
+    printf("null HMD: %ld frames presented\n", framesPresented);
+  }
+
+#ifdef HAVE_EGL
+  if (display) {
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (context)
+      eglDestroyContext(display, context);
+    if (surface)
+      eglDestroySurface(display, surface);
+    eglTerminate(display);
+  }
+#endif
+  display = surface = context = NULL;
+}
+
+void NullHmdBackend::getEyeTextureSize(HmdEye eye, int& width, int& height) {
+  width = DK2_EYE_TEXTURE_WIDTH;
+  height = DK2_EYE_TEXTURE_HEIGHT;
+}
+
+void NullHmdBackend::setRenderTarget(unsigned int fbo, unsigned int texture,
+    int texWidth, int texHeight, int width, int height) {
+  this->fbo = fbo;
+  this->width = width;
+  this->height = height;
+}
+
+HmdEye NullHmdBackend::getEyeRenderOrder(int i) {
+  return i == 0 ? HMD_EYE_LEFT : HMD_EYE_RIGHT;
+}
+
+// Same matrix as ovrMatrix4f_Projection(fov, zNear, zFar, true).
+void NullHmdBackend::getProjection(HmdEye eye, float zNear, float zFar, float matrix[16]) {
+  float left = eye == HMD_EYE_LEFT ? DK2_FOV_OUTER : DK2_FOV_INNER;
+  float right = eye == HMD_EYE_LEFT ? DK2_FOV_INNER : DK2_FOV_OUTER;
+  float xScale = 2.0f / (left + right);
+  float xOffset = (left - right) * xScale * 0.5f;
+  float yScale = 2.0f / (DK2_FOV_UP + DK2_FOV_DOWN);
+  float yOffset = (DK2_FOV_UP - DK2_FOV_DOWN) * yScale * 0.5f;
+
+  memset(matrix, 0, 16 * sizeof(float));
+  matrix[0] = xScale;
+  matrix[2] = -xOffset;
+  matrix[5] = yScale;
+  matrix[6] = yOffset;
+  matrix[10] = zFar / (zNear - zFar);
+  matrix[11] = zFar * zNear / (zNear - zFar);
+  matrix[14] = -1;
+}
+
+void NullHmdBackend::getEyeViewOffset(HmdEye eye, float offset[3]) {
+  offset[0] = eye == HMD_EYE_LEFT ? DK2_IPD / 2 : -DK2_IPD / 2;
+  offset[1] = 0;
+  offset[2] = 0;
+}
+
+float NullHmdBackend::getEyeHeight() {
+  return DEFAULT_EYE_HEIGHT;
+}
+
+Pose NullHmdBackend::getHeadPose(double secondsAhead) {
+  Pose pose;
+  memset(&pose, 0, sizeof(pose));
+  pose.orientation[3] = 1;
+  return pose;
+}
+
+Pose NullHmdBackend::getEyePose(HmdEye eye) {
+  return getHeadPose(0);
+}
+
+void NullHmdBackend::beginFrame() {
+}
+
+void NullHmdBackend::endFrame(const Pose eyePoses[2]) {
+  // Stand-in for the distortion pass: copy the eyes to the screen.
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, width, height, 0, 0, DK2_RESOLUTION_WIDTH, DK2_RESOLUTION_HEIGHT,
+      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  // A real swap blocks until the GPU catches up; without this the driver
+  // would queue frames and the frame times would only measure submission.
+  glFinish();
+  framesPresented++;
+
+  if (refreshRate <= 0)
+    return;
+
+  double now = Timer::timeInSeconds();
+  if (firstVsync < 0) {
+    firstVsync = now;
+    lastVsync = 0;
+    return;
+  }
+
+  // Wait for the next vsync. Any vsyncs that passed since the previous
+  // frame's would have shown that frame again.
+  long vsync = (long) std::ceil((now - firstVsync) * refreshRate);
+  if (vsync > lastVsync + 1)
+    missedVsyncs += vsync - lastVsync - 1;
+  lastVsync = vsync;
+
+  double nextVsync = firstVsync + vsync / refreshRate;
+  std::this_thread::sleep_for(std::chrono::duration<double>(nextVsync - now));
+}
+
+bool NullHmdBackend::pollEvents(std::vector<int>& keys) {
+  return true;
+}
@@ -1,52 +1,54 @@
 #include "oculus2.hpp"
+#include "uploadpool.hpp"
 
+#include <cmath>
 #include <cstring>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <thread>
 #include <iomanip>
+#include <memory>
 
 #include "../optimizer/optimizer.hpp"
 #include "../settings.hpp"
+#include "../util/matpool.hpp"
+#include "../util/posetrace.hpp"
+#include "../util/trace.hpp"
 
 using cv::Mat;
 
 static int init(void);
 static void cleanup(void);
-static void toggle_hmd_fullscreen(void);
 static void display();
 static void updatePipelineOrientation(OptimizerPipeline& pipeline, double offsetIntoFuture);
-static void draw_scene(ovrEyeType);
+static void draw_scene(HmdEye);
 static void update_rtarg(int width, int height);
-static int handle_event(SDL_Event *ev);
-static int key_event(int key, int state);
-static void reshape(int x, int y);
+static int key_event(int key);
 static unsigned int next_pow2(unsigned int x);
 static void quat_to_matrix(const float *quat, float *mat);
 
-static SDL_Window *win;
-static SDL_GLContext ctx;
-static int win_width, win_height;
+static HmdBackend* backend;
 
 static unsigned int fbo, fb_tex, fb_depth;
 static int fb_width, fb_height;
 static int fb_tex_width, fb_tex_height;
 
-static ovrHmd hmd;
-static ovrSizei eyeres[2];
-static ovrEyeRenderDesc eye_rdesc[2];
-static ovrGLTexture fb_ovr_tex[2];
-static union ovrGLConfig glcfg;
-static unsigned int distort_caps;
-static unsigned int hmd_caps;
-
 static GLUquadric* qobj;
 
 static float xPos = 0, yPos = 0, zPos = 0, ourAngle = 0;
 
+static UploadRing uploadRing;
+// Frames the pipeline extracted into mapped memory, or NULL.
+static MappedUploadPool* uploadPool = NULL;
 static TextureData textureLeft;
 static TextureData textureRight;
+// The U and V planes of I420 frames; textureLeft and textureRight hold Y.
+static TextureData chromaLeft[2];
+static TextureData chromaRight[2];
+static FoveatedTextures foveatedTextures;
+// Draws I420 frames from the textures above.
+static GLuint yuvProgram;
 
 static bool three_d_enabled = true;
 static bool FROZEN = false;
@@ -58,6 +60,12 @@ static float OculusPitchAngle = 0;
 static GLuint myDisplayList;
 static bool UsePrediction = true;
 
+// Set CONDUIT_POSE_RECORD=file to record every pose read from the HMD, and
+// CONDUIT_POSE_REPLAY=file to use a recording instead of the HMD. Replay goes
+// frame by frame, so every run sees the same pose on the same display frame.
+static PoseRecorder poseRecorder;
+static PoseReplay poseReplay;
+
 static inline float getHorizontalAngleForOptimize() {
   return -(OculusZAngle + ourAngle) + 180;
 }
@@ -72,32 +80,136 @@ static FramerateProfiler displayProfiler;
 static FramerateProfiler sdlProfiler;
 static FramerateProfiler optimizeProfiler;
 static FramerateProfiler glTextureProfiler;
-static RollingAverage optimizeAverage;
+static IntervalHistogram optimizeTimes;
+static IntervalHistogram m2uTimes;
+// Queue depths, in frames.
+static IntervalHistogram videoReaderDepth(1);
+static IntervalHistogram optimizerDepth(1);
+
+// The frame in each upload slot.
+struct UploadedFrame {
+  long id;
+  long sequence;
+  FrameTimes times;
+  // Keeps the frame's mapped upload buffer from being reused until the slot
+  // is, as the GPU may still be reading from it.
+  Mat image;
+  bool isI420 = false;
+};
+static UploadedFrame uploadedFrames[UPLOAD_RING_SIZE];
+
+// The frame that just became drawable, until display() presents it.
+static bool framePending = false;
+static long pendingFrameId;
+static long pendingFrameSequence;
+static FrameTimes pendingFrameTimes;
+static FrameLatencyLog frameLatencyLog;
+
+// UploadRing
+
+static_assert(UPLOAD_RING_SIZE >= 2, "one slot is always being drawn");
+
+UploadRing::UploadRing() : drawSlot(-1), lastSlot(-1), drawnFrames(0), reportedFrames(0) {
+  for (int i = 0; i < UPLOAD_RING_SIZE; i++)
+    fences[i] = 0;
+}
+
+int UploadRing::beginUpload() {
+  int slot = (lastSlot + 1) % UPLOAD_RING_SIZE;
+  advance();
+  if (fences[slot] || slot == drawSlot) {
+    // Every other slot is still transferring: wait for the oldest one, so
+    // that it becomes the draw slot and this one is free.
+    TRACE_SPAN("wait for upload slot");
+    double start = Timer::timeInSeconds();
+    while (fences[slot] || slot == drawSlot) {
+      int oldestSlot = (drawSlot + 1) % UPLOAD_RING_SIZE;
+      GLsync oldest = fences[oldestSlot];
+      ASSERT(oldest);
+      GLenum result = glClientWaitSync(oldest, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+      if (result == GL_WAIT_FAILED) {
+        // Wait for everything instead, and take the slot as finished, so
+        // that the fence doesn't outlive its upload.
+        fprintf(stderr, "glClientWaitSync failed\n");
+        glFinish();
+        retire(oldestSlot);
+      }
+      advance();
+    }
+    stats.slotWaits++;
+    stats.slotWaitSeconds += Timer::timeInSeconds() - start;
+  }
+  return slot;
+}
+
+void UploadRing::endUpload(int slot, size_t bytes) {
+  REQUIRES(!fences[slot]);
+  fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // Start the transfer now rather than at the end of the display frame.
+  glFlush();
+  lastSlot = slot;
+  stats.frames++;
+  stats.bytes += bytes;
+}
+
+// Fences signal in order, so the slots after drawSlot finish in turn.
+void UploadRing::advance() {
+  for (int i = 0; i < UPLOAD_RING_SIZE; i++) {
+    int slot = (drawSlot + 1) % UPLOAD_RING_SIZE;
+    if (!fences[slot])
+      break;
+    GLenum result = glClientWaitSync(fences[slot], 0, 0);
+    if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+      break;
+    retire(slot);
+  }
+}
+
+void UploadRing::retire(int slot) {
+  REQUIRES(fences[slot] && slot == (drawSlot + 1) % UPLOAD_RING_SIZE);
+  glDeleteSync(fences[slot]);
+  fences[slot] = 0;
+  drawSlot = slot;
+  drawnFrames++;
+}
+
+bool UploadRing::updateDrawSlot() {
+  advance();
+  if (lastSlot >= 0 && drawSlot != lastSlot)
+    stats.lateFrames++;
+  // beginUpload() may have moved the draw slot too.
+  bool changed = drawnFrames != reportedFrames;
+  reportedFrames = drawnFrames;
+  return changed;
+}
 
 // TextureData
 
 TextureData::TextureData() {
+  for (int i = 0; i < UPLOAD_RING_SIZE; i++)
+    names[i] = pbos[i] = 0;
 }
 
 void TextureData::init() {
   REQUIRES(!initialized);
 
-  glGenTextures(1, &this->name);
-  glGenBuffers(1, &this->pbo);
+  glGenTextures(UPLOAD_RING_SIZE, this->names);
+  glGenBuffers(UPLOAD_RING_SIZE, this->pbos);
 
-  glBindTexture(GL_TEXTURE_2D, this->name);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+  for (int i = 0; i < UPLOAD_RING_SIZE; i++) {
+    glBindTexture(GL_TEXTURE_2D, this->names[i]);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
   glBindTexture(GL_TEXTURE_2D, 0);
 
   initialized = true;
 }
 
-void TextureData::load(const Mat& input) {
-  glBindTexture(GL_TEXTURE_2D, this->name);
-
+void TextureData::load(const Mat& input, int slot) {
+  TRACE_SPAN("TextureData::load");
   Mat image;
 #ifdef USE_OPTIMIZER_PIPELINE
   image = input;
@@ -111,59 +223,361 @@ void TextureData::load(const Mat& input) {
   }
 #endif
 
-  if (loaded) {
-    // The texture size should stay the same
-    REQUIRES(image.cols == this->width);
-    REQUIRES(image.rows == this->height);
+  upload(image, slot);
+}
+
+// The first video frame we get, initialize the textures of every slot
+void TextureData::allocate(int width, int height, int channels) {
+  REQUIRES(!loaded);
+  this->height = height;
+  this->width = width;
+  // Room for BGRA, 4 bytes a pixel, so UPLOAD_BGRA can change at any time.
+  this->size = width * height * (channels == 1 ? 1 : 4);
+
+  // RGBA8 for color: BGR uploads are converted by the driver, BGRA ones can
+  // be copied as is.
+  GLenum internalFormat = channels == 1 ? GL_R8 : GL_RGBA8;
+  GLenum format = channels == 1 ? GL_RED : GL_BGRA;
+  for (int i = 0; i < UPLOAD_RING_SIZE; i++) {
+    glBindTexture(GL_TEXTURE_2D, this->names[i]);
+    if (GLEW_ARB_texture_storage) {
+      glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, this->width, this->height);
+    } else {
+      glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, this->width, this->height, 0,
+          format, GL_UNSIGNED_BYTE, NULL);
+    }
 
 #ifdef USE_PIXEL_BUFFER
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo);
+    // Initialize pixel buffer objects, need to delete them when program exits.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbos[i]);
+    // glBufferData with NULL pointer only reserves memory space.
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, this->size, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#endif
+  }
+
+  loaded = true;
+}
 
-    // map the buffer object into client's memory
-    // Note that glMapBuffer() causes sync issue.
-    // If GPU is working with this buffer, glMapBuffer() will wait(stall)
-    // for GPU to finish its job. To avoid waiting (stall), you can call
-    // first glBufferData() with NULL pointer before glMapBuffer().
-    // If you do that, the previous data in PBO will be discarded and
-    // glMapBuffer() returns a new allocated pointer immediately
-    // even if GPU is still working with the previous data.
+void TextureData::uploadFromBuffer(GLuint buffer, size_t offset,
+    int width, int height, size_t step, int channels, int slot) {
+  TRACE_SPAN("TextureData::uploadFromBuffer");
+  REQUIRES(channels == 1 || channels == 3 || channels == 4);
+  REQUIRES(slot >= 0 && slot < UPLOAD_RING_SIZE);
+
+  if (!loaded)
+    allocate(width, height, channels);
+
+  // The texture size should stay the same
+  REQUIRES(width == this->width);
+  REQUIRES(height == this->height);
+
+  glBindTexture(GL_TEXTURE_2D, this->names[slot]);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, step / channels);
+
+  // The pixels are already in GPU-visible memory; the driver reads them
+  // from there, and the fence UploadRing puts after this frame tells when
+  // it is done.
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  GLenum format = channels == 1 ? GL_RED : channels == 4 ? GL_BGRA : GL_BGR;
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+      format, GL_UNSIGNED_BYTE, (const GLvoid*) offset);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-     glBufferData(GL_PIXEL_UNPACK_BUFFER, this->size, NULL, GL_STREAM_DRAW);
-     GLubyte* ptr = (GLubyte*)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-     std::memcpy(ptr, image.ptr(), this->size);
-     glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER); // release pointer to mapping buffer
+void TextureData::upload(const Mat& image, int slot) {
+  REQUIRES(image.type() == CV_8UC1 || image.type() == CV_8UC3 || image.type() == CV_8UC4);
+  REQUIRES(slot >= 0 && slot < UPLOAD_RING_SIZE);
 
-    // copy via pixel buffer
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, GL_BGR, GL_UNSIGNED_BYTE, 0);
+  if (!loaded)
+    allocate(image.cols, image.rows, image.channels());
 
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  // The texture size should stay the same
+  REQUIRES(image.cols == this->width);
+  REQUIRES(image.rows == this->height);
+
+  glBindTexture(GL_TEXTURE_2D, this->names[slot]);
+
+  // Rows of a BGR image needn't be 4-byte aligned, and views into a larger
+  // Mat (such as the focused regions of an OptimizedImage) aren't
+  // continuous.
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, image.step / image.elemSize());
+
+#ifdef USE_PIXEL_BUFFER
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbos[slot]);
+
+  // UploadRing only hands out a slot once the GPU has finished with its last
+  // upload, so the buffer can be mapped without the driver waiting for it or
+  // orphaning it.
+  GLubyte* ptr = (GLubyte*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, this->size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  // BGR images are widened to BGRA on the way into the buffer when
+  // UPLOAD_BGRA is set, at about the cost of the plain copy.
+  bool expand = image.channels() == 3 && UPLOAD_BGRA;
+  GLenum format = image.channels() == 1 ? GL_RED :
+    expand || image.channels() == 4 ? GL_BGRA : GL_BGR;
+  if (expand) {
+    size_t rowBytes = this->width * 4;
+    for (int row = 0; row < this->height; row++)
+      ImageUtil::expandBgrToBgra(image.ptr(row), ptr + row * rowBytes, this->width);
+  } else if (image.isContinuous()) {
+    std::memcpy(ptr, image.ptr(), ImageUtil::imageSize(image));
+  } else {
+    size_t rowBytes = this->width * image.elemSize();
+    for (int row = 0; row < this->height; row++)
+      std::memcpy(ptr + row * rowBytes, image.ptr(row), rowBytes);
+  }
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER); // release pointer to mapping buffer
+
+  // copy via pixel buffer; the buffer is always tightly packed. The copy
+  // runs on the GPU after this returns.
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, format, GL_UNSIGNED_BYTE, 0);
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 #else
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
+  GLenum format = image.channels() == 1 ? GL_RED : image.channels() == 4 ? GL_BGRA : GL_BGR;
+  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, this->width, this->height, format, GL_UNSIGNED_BYTE, image.ptr());
 #endif
 
-  } else {
-    // The first video frame we get, intiialize the texture
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// FoveatedTextures
+
+// Limited-range BT.709, the usual matrix for HD video. Y below 16 (such as
+// the 0 outside the crop window) clamps to black.
+static const char* YUV_TO_RGB =
+  "vec3 yuvToRgb(float y, float u, float v) {\n"
+  "  y = 1.164 * (y - 0.0625);\n"
+  "  u -= 0.5;\n"
+  "  v -= 0.5;\n"
+  "  return clamp(vec3(y + 1.793 * v, y - 0.213 * u - 0.533 * v, y + 2.112 * u),\n"
+  "      0.0, 1.0);\n"
+  "}\n";
+
+// Draws the Y, U and V planes of one eye of an I420 frame.
+static const char* YUV_FRAGMENT_SHADER =
+  "uniform sampler2D planeY;\n"
+  "uniform sampler2D planeU;\n"
+  "uniform sampler2D planeV;\n"
+  "void main() {\n"
+  "  vec2 st = gl_TexCoord[0].st;\n"
+  "  gl_FragColor = vec4(yuvToRgb(texture2D(planeY, st).r,\n"
+  "      texture2D(planeU, st).r, texture2D(planeV, st).r), 1.0);\n"
+  "}\n";
+
+// gluCylinder's texture coordinates span one eye of the full equirect frame.
+// Map them to the crop window (black outside it), then take the fovea inside
+// its rectangle and the upscaled periphery elsewhere. The periphery texture
+// holds both eyes stacked, like the frame itself; rows are clamped to half a
+// texel inside the eye's half so the other eye doesn't bleed in at the seam,
+// as in Optimizer::extractInto. With YUV defined, each plane is composited on
+// its own (the chroma planes with their own layout) and the result converted
+// to RGB.
+static const char* FOVEATED_FRAGMENT_SHADER =
+  "uniform sampler2D periphery;\n"
+  "uniform sampler2D fovea;\n"
+  "uniform float eye;\n"
+  // fullWidth, eyeHeight, leftBuffer, croppedWidth, in pixels
+  "uniform vec4 crop;\n"
+  // focusCol, focusRow, focusWidth, focusHeight, in crop window pixels
+  "uniform vec4 focus;\n"
+  // Rows of the periphery texture, both eyes
+  "uniform float peripheryRows;\n"
+  "uniform bool showFovea;\n"
+  "#ifdef YUV\n"
+  "uniform sampler2D peripheryU;\n"
+  "uniform sampler2D peripheryV;\n"
+  "uniform sampler2D foveaU;\n"
+  "uniform sampler2D foveaV;\n"
+  "uniform vec4 chromaCrop;\n"
+  "uniform vec4 chromaFocus;\n"
+  "uniform float chromaPeripheryRows;\n"
+  "#endif\n"
+  "vec4 composite(sampler2D periphery, sampler2D fovea, vec4 crop, vec4 focus,\n"
+  "    float rows, vec4 black) {\n"
+  "  vec2 st = gl_TexCoord[0].st;\n"
+  "  float x = st.s * crop.x - crop.z;\n"
+  "  if (x < 0.0)\n"
+  "    x += crop.x;\n"
+  "  if (x >= crop.w)\n"
+  "    return black;\n"
+  "  vec2 f = (vec2(x, st.t * crop.y) - focus.xy) / focus.zw;\n"
+  "  if (showFovea && all(greaterThanEqual(f, vec2(0.0))) &&\n"
+  "      all(lessThan(f, vec2(1.0)))) {\n"
+  "    return texture2D(fovea, f);\n"
+  "  }\n"
+  "  float t = clamp((eye + st.t) * 0.5, eye * 0.5 + 0.5 / rows,\n"
+  "      (eye + 1.0) * 0.5 - 0.5 / rows);\n"
+  "  return texture2D(periphery, vec2(x / crop.w, t));\n"
+  "}\n"
+  "void main() {\n"
+  "#ifdef YUV\n"
+  "  vec4 gray = vec4(0.5);\n"
+  "  gl_FragColor = vec4(yuvToRgb(\n"
+  "      composite(periphery, fovea, crop, focus, peripheryRows, vec4(0.0)).r,\n"
+  "      composite(peripheryU, foveaU, chromaCrop, chromaFocus,\n"
+  "          chromaPeripheryRows, gray).r,\n"
+  "      composite(peripheryV, foveaV, chromaCrop, chromaFocus,\n"
+  "          chromaPeripheryRows, gray).r), 1.0);\n"
+  "#else\n"
+  "  gl_FragColor = composite(periphery, fovea, crop, focus, peripheryRows,\n"
+  "      vec4(0.0, 0.0, 0.0, 1.0));\n"
+  "#endif\n"
+  "}\n";
+
+// header goes before source, for #defines and shared functions.
+static GLuint compileProgram(const std::string& header, const char* source) {
+  const char* sources[] = { header.c_str(), source };
+  GLuint shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(shader, 2, sources, NULL);
+  glCompileShader(shader);
+
+  GLint ok = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[4096];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "failed to compile fragment shader:\n%s\n", log);
+    ASSERT(false);
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, shader);
+  glLinkProgram(program);
+  glDeleteShader(shader);
+
+  glGetProgramiv(program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    char log[4096];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    fprintf(stderr, "failed to link shader program:\n%s\n", log);
+    ASSERT(false);
+  }
+  return program;
+}
 
-    this->height = image.rows;
-    this->width = image.cols;
-    this->size = width * height * 3; // RGB = 3 channels, 1 byte each
+void FoveatedTextures::initProgram(Program& program, bool yuv) {
+  GLuint name = compileProgram(yuv ? std::string("#define YUV\n") + YUV_TO_RGB : "",
+      FOVEATED_FRAGMENT_SHADER);
+  program.name = name;
+  program.periphery = glGetUniformLocation(name, "periphery");
+  program.fovea = glGetUniformLocation(name, "fovea");
+  program.eye = glGetUniformLocation(name, "eye");
+  program.crop = glGetUniformLocation(name, "crop");
+  program.focus = glGetUniformLocation(name, "focus");
+  program.peripheryRows = glGetUniformLocation(name, "peripheryRows");
+  program.showFovea = glGetUniformLocation(name, "showFovea");
+  if (yuv) {
+    program.peripheryChroma[0] = glGetUniformLocation(name, "peripheryU");
+    program.peripheryChroma[1] = glGetUniformLocation(name, "peripheryV");
+    program.foveaChroma[0] = glGetUniformLocation(name, "foveaU");
+    program.foveaChroma[1] = glGetUniformLocation(name, "foveaV");
+    program.chromaCrop = glGetUniformLocation(name, "chromaCrop");
+    program.chromaFocus = glGetUniformLocation(name, "chromaFocus");
+    program.chromaPeripheryRows = glGetUniformLocation(name, "chromaPeripheryRows");
+  }
+}
 
-    // Initialize Texture
-    glTexImage2D(GL_TEXTURE_2D, 0, 3, this->width, this->height, 0,
-        GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
+void FoveatedTextures::init() {
+  periphery.init();
+  foveaTop.init();
+  foveaBot.init();
+  for (int i = 0; i < 2; i++) {
+    peripheryChroma[i].init();
+    foveaTopChroma[i].init();
+    foveaBotChroma[i].init();
+  }
 
-#ifdef USE_PIXEL_BUFFER
-    // Initialize pixel buffer objects, need to delete them when program exits.
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->pbo);
-    // glBufferData with NULL pointer only reserves memory space.
-    glBufferData(GL_PIXEL_UNPACK_BUFFER, this->size, NULL, GL_STREAM_DRAW);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-#endif
+  initProgram(bgrProgram, false);
+  initProgram(yuvProgram, true);
+}
+
+void FoveatedTextures::setLayout(Layout& layout, const OptimizedImage& image) {
+  layout.croppedSize = image.getCroppedSize();
+  layout.fullSize = image.getFullSize();
+  layout.leftBuffer = image.getLeftBuffer();
+  layout.focusRow = image.getFocusRow();
+  layout.focusCol = image.getFocusCol();
+  layout.focusSize = image.getFocusedTop().size();
+  layout.peripheryRows = image.getBlurred().rows;
+}
 
-    loaded = true;
+void FoveatedTextures::load(const OptimizedImage& image, int slot) {
+  REQUIRES(!image.empty());
+
+  periphery.upload(image.getBlurred(), slot);
+  foveaTop.upload(image.getFocusedTop(), slot);
+  foveaBot.upload(image.getFocusedBot(), slot);
+  setLayout(layouts[slot], image);
+
+  isI420[slot] = image.isI420();
+  if (!image.isI420())
+    return;
+  for (int i = 0; i < 2; i++) {
+    const OptimizedImage& chroma = image.getChroma(i);
+    peripheryChroma[i].upload(chroma.getBlurred(), slot);
+    foveaTopChroma[i].upload(chroma.getFocusedTop(), slot);
+    foveaBotChroma[i].upload(chroma.getFocusedBot(), slot);
   }
+  setLayout(chromaLayouts[slot], image.getChroma(0));
+}
 
-  glBindTexture(GL_TEXTURE_2D, 0);
+void FoveatedTextures::setLayoutUniforms(GLint crop, GLint focus, GLint peripheryRows,
+    const Layout& layout) {
+  glUniform4f(crop, layout.fullSize.width, layout.fullSize.height / 2,
+      layout.leftBuffer, layout.croppedSize.width);
+  glUniform4f(focus, layout.focusCol, layout.focusRow,
+      layout.focusSize.width, layout.focusSize.height);
+  glUniform1f(peripheryRows, layout.peripheryRows);
+}
+
+void FoveatedTextures::bind(bool isLeft, int slot) {
+  REQUIRES(slot >= 0 && slot < UPLOAD_RING_SIZE);
+  const Program& program = isI420[slot] ? yuvProgram : bgrProgram;
+
+  glUseProgram(program.name);
+  glUniform1i(program.periphery, 0);
+  glUniform1i(program.fovea, 1);
+  glUniform1f(program.eye, isLeft ? 0 : 1);
+  setLayoutUniforms(program.crop, program.focus, program.peripheryRows, layouts[slot]);
+  glUniform1i(program.showFovea, FOVEA_DISPLAY);
+
+  if (isI420[slot]) {
+    setLayoutUniforms(program.chromaCrop, program.chromaFocus,
+        program.chromaPeripheryRows, chromaLayouts[slot]);
+    // Units 2 and 3 hold the U planes, 4 and 5 the V planes.
+    for (int i = 0; i < 2; i++) {
+      glUniform1i(program.peripheryChroma[i], 2 + 2 * i);
+      glUniform1i(program.foveaChroma[i], 3 + 2 * i);
+      glActiveTexture(GL_TEXTURE2 + 2 * i);
+      glBindTexture(GL_TEXTURE_2D, peripheryChroma[i].names[slot]);
+      glActiveTexture(GL_TEXTURE3 + 2 * i);
+      glBindTexture(GL_TEXTURE_2D,
+          isLeft ? foveaTopChroma[i].names[slot] : foveaBotChroma[i].names[slot]);
+    }
+  }
+
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, isLeft ? foveaTop.names[slot] : foveaBot.names[slot]);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, periphery.names[slot]);
+}
+
+void FoveatedTextures::unbind() {
+  for (int unit = 5; unit >= 0; unit--) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
+  glUseProgram(0);
 }
 
 #define CHECK_GL_ERROR() checkGLError(__FILE__, __LINE__)
@@ -180,7 +594,193 @@ static void checkGLError(const char *file, int line) {
   }
 }
 
+static const char* pipelineModeName(PipelineMode mode) {
+  return mode == PIPELINE_LATEST_POSE ? "latest-pose" : "queued";
+}
+
+static void printQueueStats(const char* name, const ChannelStats& stats) {
+  std::cout
+  << name << ": producer blocked " << stats.pushBlocks << "x for "
+  << std::setw(7) << stats.pushBlockedSeconds << "s, consumer blocked "
+  << stats.popBlocks << "x for "
+  << std::setw(7) << stats.popBlockedSeconds << "s"
+  << std::endl;
+}
+
+static void printUploadStats(const UploadRingStats& stats, double seconds) {
+  const double MB = 1024 * 1024;
+  std::cout
+  << "Texture uploads: " << stats.frames << " frames, waited for a free slot "
+  << stats.slotWaits << "x for " << std::setw(7) << stats.slotWaitSeconds << "s, "
+  << stats.lateFrames << " display frames drew an older frame while the newest was uploading"
+  << std::endl
+  << "Uploaded " << (stats.bytes / MB) << " MB, "
+  << (stats.frames ? stats.bytes / stats.frames / MB : 0) << " MB/frame, "
+  << (seconds > 0 ? stats.bytes / seconds / MB : 0) << " MB/s"
+  << std::endl;
+}
+
+static void printVideoFileStats(const VideoFile& file) {
+  VideoFileStats stats = file.getStats();
+  std::cout
+  << "Video file (" << VideoFile::getIoName(file.getIo()) << "): read "
+  << stats.bytes / (1024.0 * 1024.0) << " MB, demuxer waited for storage "
+  << stats.waits << "x for " << std::setw(7) << stats.waitSeconds << "s"
+  << std::endl
+  << "Storage reads: " << stats.readTimes.count() << ", ";
+  stats.readTimes.print(std::cout, 1000);
+  std::cout << " ms" << std::endl;
+}
+
+static void printHistogram(const char* name, const IntervalHistogram& h,
+    bool lifetime, double scale, const char* unit) {
+  std::cout << "  " << std::left << std::setw(12) << name << std::right;
+  if (lifetime)
+    h.getLifetime().print(std::cout, scale);
+  else
+    h.getInterval().print(std::cout, scale);
+  std::cout << " " << unit << std::endl;
+}
+
+// Tail latencies of each stage, over the last reporting interval or over
+// the whole run.
+static void printLatencies(const FramerateProfiler& frameProfiler, bool lifetime) {
+  printHistogram("frame", frameProfiler.getFrameTimes(), lifetime, 1000, "ms");
+  printHistogram("display", displayProfiler.getFrameTimes(), lifetime, 1000, "ms");
+  printHistogram("loadTexture", glTextureProfiler.getFrameTimes(), lifetime, 1000, "ms");
+  printHistogram("readVideo", videoReadProfiler.getFrameTimes(), lifetime, 1000, "ms");
+  printHistogram("M2U", m2uTimes, lifetime, 1000, "ms");
+  printHistogram("optimize", optimizeTimes, lifetime, 1000, "ms");
+  printHistogram("VRQ", videoReaderDepth, lifetime, 1, "frames");
+  printHistogram("OQ", optimizerDepth, lifetime, 1, "frames");
+}
+
+static void nextReportInterval(FramerateProfiler& frameProfiler) {
+  frameProfiler.nextInterval();
+  displayProfiler.nextInterval();
+  glTextureProfiler.nextInterval();
+  videoReadProfiler.nextInterval();
+  m2uTimes.nextInterval();
+  optimizeTimes.nextInterval();
+  videoReaderDepth.nextInterval();
+  optimizerDepth.nextInterval();
+}
+
 #ifdef USE_OPTIMIZER_PIPELINE
+static void printWorkerStats(OptimizerPipeline& pipeline) {
+  double elapsed = pipeline.getRunningSeconds();
+  std::vector<OptimizerWorkerStats> workers = pipeline.getWorkerStats();
+  Histogram optimizeSeconds;
+  for (size_t i = 0; i < workers.size(); i++) {
+    const OptimizerWorkerStats& w = workers[i];
+    std::cout
+    << "Optimizer worker " << i << ": " << w.frames << " frames, "
+    << std::setw(6) << 100 * w.busySeconds / elapsed << "% busy, "
+    << std::setw(6) << 100 * w.inputWaitSeconds / elapsed << "% waiting for input, "
+    << std::setw(6) << 100 * w.outputWaitSeconds / elapsed << "% waiting for output"
+    << std::endl;
+    optimizeSeconds.merge(w.optimizeSeconds);
+  }
+  std::cout << "Optimizer, all workers: ";
+  optimizeSeconds.print(std::cout, 1000);
+  std::cout << " ms" << std::endl;
+}
+#endif
+
+// Bytes TextureData::upload sends for image, which it widens to BGRA if
+// UPLOAD_BGRA is set.
+static size_t uploadedSize(const Mat& image) {
+  size_t pixelBytes = image.channels() == 3 && UPLOAD_BGRA ? 4 : image.elemSize();
+  return image.total() * pixelBytes;
+}
+
+// The texture for one plane of one eye: the image, or the Y plane, then the
+// U and V planes.
+static TextureData& eyeTexture(bool isLeft, int plane) {
+  if (plane == 0)
+    return isLeft ? textureLeft : textureRight;
+  return isLeft ? chromaLeft[plane - 1] : chromaRight[plane - 1];
+}
+
+// Each eye's half of image, plane by plane. Returns the number of planes.
+static int eyePlanes(const Mat& image, Mat left[3], Mat right[3]) {
+  Mat planes[3];
+  int count = 1;
+  if (ImageUtil::isI420(image)) {
+    ImageUtil::i420Planes(image, planes);
+    count = 3;
+  } else {
+    planes[0] = image;
+  }
+  for (int i = 0; i < count; i++) {
+    left[i] = planes[i].rowRange(0, planes[i].rows / 2);
+    right[i] = planes[i].rowRange(planes[i].rows / 2, planes[i].rows);
+  }
+  return count;
+}
+
+#ifdef USE_OPTIMIZER_PIPELINE
+static size_t uploadedSize(const OptimizedImage& image) {
+  size_t bytes = uploadedSize(image.getBlurred()) +
+    uploadedSize(image.getFocusedTop()) + uploadedSize(image.getFocusedBot());
+  if (image.isI420())
+    bytes += uploadedSize(image.getChroma(0)) + uploadedSize(image.getChroma(1));
+  return bytes;
+}
+
+// Uploads view, a part of image, from where image is in uploadPool's buffer.
+static void uploadMapped(TextureData& texture, const Mat& image, size_t offset,
+    const Mat& view, int slot) {
+  texture.uploadFromBuffer(uploadPool->getBuffer(), offset + (view.data - image.data),
+      view.cols, view.rows, view.step, view.channels(), slot);
+}
+
+static void loadFrameTextures(const FrameData& fd) {
+  glTextureProfiler.startFrame();
+  int slot = uploadRing.beginUpload();
+  // The slot's last uploads have finished, so its frame can go back to the
+  // pool.
+  uploadedFrames[slot].image.release();
+  size_t bytes;
+  if (GPU_FOVEA_COMPOSITING) {
+    foveatedTextures.load(fd.optimized, slot);
+    bytes = uploadedSize(fd.optimized);
+    uploadedFrames[slot].isI420 = fd.optimized.isI420();
+  } else {
+    const Mat& image = fd.image;
+    size_t offset;
+    bool mapped = uploadPool && uploadPool->getOffset(image, offset);
+    // Frames extracted before the first one's size was known come from the
+    // heap; map buffers for the rest, big enough for BGRA.
+    if (uploadPool && !mapped && !uploadPool->isReserved() && !image.empty()) {
+      uploadPool->reserve(ImageUtil::isI420(image) ?
+          ImageUtil::imageSize(image) : image.total() * 4);
+    }
+
+    Mat left[3], right[3];
+    int planes = eyePlanes(image, left, right);
+    for (int i = 0; i < planes; i++) {
+      if (mapped) {
+        uploadMapped(eyeTexture(true, i), image, offset, left[i], slot);
+        uploadMapped(eyeTexture(false, i), image, offset, right[i], slot);
+      } else {
+        eyeTexture(true, i).load(left[i], slot);
+        eyeTexture(false, i).load(right[i], slot);
+      }
+    }
+    if (mapped)
+      uploadedFrames[slot].image = image;
+    bytes = mapped ? ImageUtil::imageSize(image) : uploadedSize(image);
+    uploadedFrames[slot].isI420 = planes == 3;
+  }
+  uploadRing.endUpload(slot, bytes);
+  glTextureProfiler.endFrame();
+
+  uploadedFrames[slot].id = fd.id;
+  uploadedFrames[slot].sequence = fd.sequence;
+  uploadedFrames[slot].times = fd.times;
+}
+
 static double updateVideoFrame(OptimizerPipeline& pipeline, bool firstFrame) {
 
   // on the first frame, we want to wait till the video starts
@@ -196,19 +796,28 @@ static double updateVideoFrame(OptimizerPipeline& pipeline, bool firstFrame) {
     videoReadProfiler.startFrame();
 
   FrameData fd = pipeline.getFrame();
-  Mat image = fd.image;
-  optimizeAverage.addSample(fd.optimizeTime);
 
   if (!firstFrame)
     videoReadProfiler.endFrame();
 
-  glTextureProfiler.startFrame();
-  cv::Mat left = cv::Mat(image, cv::Range(0, image.rows / 2));
-  cv::Mat right = cv::Mat(image, cv::Range(image.rows / 2, image.rows));
-  textureLeft.load(left);
-  textureRight.load(right);
-  glTextureProfiler.endFrame();
+  // The video has ended; keep showing the last frame.
+  if (fd.empty())
+    return -1;
+
+  optimizeTimes.record(fd.optimizeTime);
 
+  loadFrameTextures(fd);
+  return fd.timestamp;
+}
+
+// Shows the current frame with its fovea moved to the latest head pose, if
+// the pipeline has re-foveated it since the last call.
+static double updateRefoveatedFrame(OptimizerPipeline& pipeline) {
+  FrameData fd;
+  if (!pipeline.getRefoveatedFrame(fd))
+    return -1;
+
+  loadFrameTextures(fd);
   return fd.timestamp;
 }
 #else
@@ -223,62 +832,192 @@ static double updateVideoFrame(VideoReader& videoReader, bool firstFrame) {
   if (!firstFrame)
     videoReadProfiler.endFrame();
 
+  // The video has ended; keep showing the last frame.
+  if (image.empty())
+    return -1;
+
   loadTextureProfiler.startFrame();
-  cv::Mat left = cv::Mat(image, cv::Range(0, image.rows / 2));
-  cv::Mat right = cv::Mat(image, cv::Range(image.rows / 2, image.rows));
-  textureLeft.load(left);
-  textureRight.load(right);
+  int slot = uploadRing.beginUpload();
+  Mat left[3], right[3];
+  if (eyePlanes(image, left, right) == 1) {
+    textureLeft.load(left[0], slot);
+    textureRight.load(right[0], slot);
+  } else {
+    // The optimizer takes I420 frames whole, not an eye's planes at a time.
+    if (USE_OPTIMIZER) {
+      image = Optimizer::processImage(image, getHorizontalAngleForOptimize(),
+          getVerticalAngleForOptimize());
+      eyePlanes(image, left, right);
+    }
+    for (int i = 0; i < 3; i++) {
+      eyeTexture(true, i).upload(left[i], slot);
+      eyeTexture(false, i).upload(right[i], slot);
+    }
+  }
+  uploadedFrames[slot].isI420 = ImageUtil::isI420(image);
+  uploadRing.endUpload(slot, uploadedSize(image));
   loadTextureProfiler.endFrame();
 
   return -1;
 }
 #endif
 
-int Oculus2::run(int argc, char **argv)
+static const char* videoBackendName(VideoBackend backend) {
+  return backend == VIDEO_BACKEND_LIBAV ? "libav" : "opencv";
+}
+
+static bool parseVideoBackend(const char* arg, VideoBackend& backend) {
+  std::string name = arg;
+  if (name == "opencv") {
+    backend = VIDEO_BACKEND_OPENCV;
+  } else if (name == "libav") {
+    backend = VIDEO_BACKEND_LIBAV;
+  } else {
+    std::cerr << "Unknown video backend " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static bool parseVideoIo(const char* arg, VideoIo& io) {
+  std::string name = arg;
+  if (name == "auto") {
+    io = VIDEO_IO_AUTO;
+  } else if (name == "libav") {
+    io = VIDEO_IO_LIBAV;
+  } else if (name == "mmap") {
+    io = VIDEO_IO_MMAP;
+  } else if (name == "prefetch") {
+    io = VIDEO_IO_PREFETCH;
+  } else {
+    std::cerr << "Unknown video I/O " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool Oculus2::parsePipelineMode(const char* arg, PipelineMode& mode) {
+  std::string name = arg;
+  if (name == "queued") {
+    mode = PIPELINE_QUEUED;
+  } else if (name == "latest") {
+    mode = PIPELINE_LATEST_POSE;
+  } else {
+    std::cerr << "Unknown pipeline mode " << name << std::endl;
+    return false;
+  }
+  return true;
+}
+
+int Oculus2::runHeadless(int argc, char **argv)
 {
   if (argc < 3) {
     std::cerr << "Usage: "
       << argv[0]
-      << " rendertest filename [secondsToRun]"
+      << " headless filename [frames] [refreshRate] [queued|latest]\n"
+      << "Renders to a null HMD with no window, for profiling without hardware.\n"
+      << "frames defaults to " << HEADLESS_FRAMES << "; 0 runs until the video ends.\n"
+      << "refreshRate defaults to " << HEADLESS_REFRESH_RATE << " Hz; 0 renders as fast as possible."
       << std::endl;
       return 1;
   }
 
-  int secondsToRun = -1;
-  if (argc >= 4) {
-    secondsToRun = atoi(argv[3]);
-    std::cout << "time limit " << secondsToRun << " seconds\n";
-  }
+  long frames = argc >= 4 ? atol(argv[3]) : HEADLESS_FRAMES;
+  double refreshRate = argc >= 5 ? atof(argv[4]) : HEADLESS_REFRESH_RATE;
 
-  std::cout
-    << "Q/E: manually rotate left/right\n"
-    << "R/Space: recenter\n"
-    << "B: high blur\n"
-    << "N: no blur\n"
-    << "G: 3D\n"
-    << "T: timewarp\n"
-    << "P: pause video updates\n"
-    << "+/- (keypad): increase/decrease blur\n"
-    << "U: use prediction\n"
-    << "V: fovea\n"
-    // << "o: toggle OLED overdrive (default: on)\n"
-    // << "l: toggle low persistence display (default: on)\n"
-    // << "v: toggle vignette (default: on)\n"
-  ;
+  PipelineMode pipelineMode = PIPELINE_MODE;
+  if (argc >= 6 && !parsePipelineMode(argv[5], pipelineMode))
+    return 1;
+
+  NullHmdBackend nullBackend(refreshRate);
+  return runWithBackend(nullBackend, argv[2], -1, frames > 0 ? frames : 0, pipelineMode);
+}
 
+int Oculus2::runWithBackend(HmdBackend& hmdBackend, const std::string& filename,
+    int secondsToRun, long framesToRun, PipelineMode pipelineMode)
+{
+  std::cout << "pipeline mode: " << pipelineModeName(pipelineMode) << "\n";
+  if (framesToRun > 0)
+    std::cout << "frame limit " << framesToRun << " frames\n";
+
+  backend = &hmdBackend;
   if (init() == -1) {
     return 1;
   }
 
-  std::string filename = argv[2];
-  VideoReader myVideoReader(filename);
+  Trace::setThreadName("Display");
+
+  const char* poseRecordFile = std::getenv("CONDUIT_POSE_RECORD");
+  if (poseRecordFile && *poseRecordFile && !poseRecorder.open(poseRecordFile))
+    return 1;
+  const char* poseReplayFile = std::getenv("CONDUIT_POSE_REPLAY");
+  if (poseReplayFile && *poseReplayFile && !poseReplay.load(poseReplayFile))
+    return 1;
+
+  // Per-frame stage times, in the binary format described in FrameLatencyLog.
+  const char* frameLogFile = std::getenv("CONDUIT_FRAME_LOG");
+  if (frameLogFile && *frameLogFile)
+    frameLatencyLog.openBinaryLog(frameLogFile);
+
+  // Declared before the reader and the pipeline, which hold pooled frames
+  // until they are destroyed.
+  std::unique_ptr<MatPool> framePoolOwner(USE_MAT_POOL ? new MatPool(MAT_POOL_HUGE_PAGES) : NULL);
+  MatPool* framePool = framePoolOwner.get();
+
+  VideoBackend videoBackend = VIDEO_BACKEND;
+  const char* backendName = std::getenv("CONDUIT_VIDEO_BACKEND");
+  if (backendName && *backendName && !parseVideoBackend(backendName, videoBackend))
+    return 1;
+  std::cout << "video backend: " << videoBackendName(videoBackend) << "\n";
+  VideoIo videoIo = VIDEO_IO;
+  const char* ioName = std::getenv("CONDUIT_VIDEO_IO");
+  if (ioName && *ioName && !parseVideoIo(ioName, videoIo))
+    return 1;
+
+  const char* startFrameName = std::getenv("CONDUIT_START_FRAME");
+  long startFrame = startFrameName ? atol(startFrameName) : 0;
+
+  const char* cacheDir = std::getenv("CONDUIT_FRAME_CACHE");
+  if (!cacheDir)
+    cacheDir = VIDEOREADER_CACHE_DIR;
 
+  VideoReader myVideoReader(filename, framePool, videoBackend,
+      VIDEOREADER_PACKET_READAHEAD, videoIo, startFrame, cacheDir);
+  const char* loopName = std::getenv("CONDUIT_LOOP");
+  if (loopName && *loopName)
+    myVideoReader.setLooping(std::string(loopName) != "0");
+
+  // Its buffers are mapped once the first frame arrives and its size is
+  // known, and unmapped before cleanup() destroys the GL context.
+  std::unique_ptr<MappedUploadPool> uploadPoolOwner;
 #ifdef USE_OPTIMIZER_PIPELINE
-  OptimizerPipeline pipeline(&myVideoReader);
+  if (USE_MAPPED_UPLOADS && !GPU_FOVEA_COMPOSITING && MappedUploadPool::isSupported())
+    uploadPoolOwner.reset(new MappedUploadPool(MAPPED_UPLOAD_BUFFERS));
+  uploadPool = uploadPoolOwner.get();
+
+  // Workers may be writing into uploadPool's mapped buffers, so the pipeline
+  // is stopped before cleanup() destroys the GL context.
+  std::unique_ptr<OptimizerPipeline> pipelineOwner(new OptimizerPipeline(&myVideoReader,
+      framePool, OPTIMIZER_WORKERS, pipelineMode, uploadPool));
+  OptimizerPipeline& pipeline = *pipelineOwner;
 #endif
 
   textureLeft.init();
   textureRight.init();
+  if (videoBackend == VIDEO_BACKEND_LIBAV) {
+    for (int i = 0; i < 2; i++) {
+      chromaLeft[i].init();
+      chromaRight[i].init();
+    }
+    yuvProgram = compileProgram(YUV_TO_RGB, YUV_FRAGMENT_SHADER);
+    glUseProgram(yuvProgram);
+    glUniform1i(glGetUniformLocation(yuvProgram, "planeY"), 0);
+    glUniform1i(glGetUniformLocation(yuvProgram, "planeU"), 1);
+    glUniform1i(glGetUniformLocation(yuvProgram, "planeV"), 2);
+    glUseProgram(0);
+  }
+  if (GPU_FOVEA_COMPOSITING)
+    foveatedTextures.init();
 
   myDisplayList = glGenLists(1);
   glNewList(myDisplayList, GL_COMPILE);
@@ -287,13 +1026,15 @@ int Oculus2::run(int argc, char **argv)
 
   FramerateProfiler profiler;
   double lastFPSAnnouncement = Timer::timeInSeconds();
+  double lastAnnouncedBytes = 0;
 
+  // Only feeds the pose prediction below; reporting uses m2uTimes.
   RollingAverage mtpProfiler;
-  RollingAverage vrfc;
-  RollingAverage ofc;
 
   bool isFirstFrame = true;
   double totalRunStart = Timer::timeInSeconds();
+  long framesShown = 0;
+  std::vector<int> keys;
 
   while (true) {
     profiler.startFrame();
@@ -309,49 +1050,67 @@ int Oculus2::run(int argc, char **argv)
       isFirstFrame = false;
     }
 
+#ifdef USE_OPTIMIZER_PIPELINE
+    // No new video frame (paused, or the video is slower than the display):
+    // follow the head with a re-foveated copy of the frame on screen.
+    if (timestamp < 0 && !isFirstFrame)
+      timestamp = updateRefoveatedFrame(pipeline);
+#endif
+
     if (timestamp > 0) {
       double mtpTime = Timer::timeInSeconds() - timestamp;
       ASSERT(mtpTime > 0);
       mtpProfiler.addSample(mtpTime);
+      m2uTimes.record(mtpTime);
     }
 
-    vrfc.addSample(myVideoReader.getNumFramesAvailable());
-    ofc.addSample(pipeline.getNumFramesAvailable());
+    videoReaderDepth.record(myVideoReader.getNumFramesAvailable());
+    optimizerDepth.record(pipeline.getNumFramesAvailable());
 
     displayProfiler.startFrame();
     display();
     displayProfiler.endFrame();
+    framesShown++;
     double mtuTime = mtpProfiler.getAverage();
     updatePipelineOrientation(pipeline, mtuTime); // TODO: optimal placement?
 
     double now = Timer::timeInSeconds();
     if (now - lastFPSAnnouncement > 2) {
+      double uploadedBytes = uploadRing.getStats().bytes;
+      double uploadRate = (uploadedBytes - lastAnnouncedBytes) / (now - lastFPSAnnouncement);
       lastFPSAnnouncement = now;
+      lastAnnouncedBytes = uploadedBytes;
 
       std::cout.precision(2);
       std::cout
       << std::setw(7) << std::fixed << profiler.getFramerate() << " FPS = "
-      << std::setw(7) << profiler.getAverageTimeMillis() << " ms/frame = "
-      << std::setw(7) << displayProfiler.getAverageTimeMillis() << " (display)"
-      // << " + " << std::setw(7) << loadTextureProfiler.getAverageTimeMillis() << " (loadTexture)"
-      << " + " << std::setw(7) << glTextureProfiler.getAverageTimeMillis() << " (loadTexture)"
-      << " + " << std::setw(7) << videoReadProfiler.getAverageTimeMillis() << " (readVideo)"
-      << ";    M2U=" << std::setw(7) << 1000 * mtuTime << "    "
-      << "optimize=" << std::setw(7) << 1000 * optimizeAverage.getAverage() << "    "
-      << "VRQ=" << std::setw(5) << vrfc.getAverage() << "    "
-      << "OQ=" << std::setw(5) << ofc.getAverage() << "    "
+      << std::setw(7) << profiler.getAverageTimeMillis() << " ms/frame;    "
+      << "dropped=" << pipeline.getDroppedFrames() << ", "
+      << "uploaded " << (uploadRate / (1024 * 1024)) << " MB/s"
       << std::endl;
+      printLatencies(profiler, false);
+      nextReportInterval(profiler);
     }
 
     if (secondsToRun > 0 && now - totalRunStart > secondsToRun)
       goto done;
+    if (framesToRun > 0 && framesShown >= framesToRun)
+      goto done;
+#ifdef USE_OPTIMIZER_PIPELINE
+    if (framesToRun == 0 && pipeline.isFinished())
+      goto done;
+#endif
+    // A replayed run covers exactly the recorded head motion.
+    if (poseReplay.isFinished())
+      goto done;
 
     sdlProfiler.startFrame();
-    SDL_Event ev;
-    while(SDL_PollEvent(&ev)) {
-      if(handle_event(&ev) == -1) {
+    keys.clear();
+    if (!backend->pollEvents(keys))
+      goto done;
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (key_event(keys[i]) == -1)
         goto done;
-      }
     }
     sdlProfiler.endFrame();
 
@@ -364,16 +1123,52 @@ done:
   << "\n========== Lifetime Stats ==========\n"
   << "Total time: " << (Timer::timeInSeconds() - totalRunStart) << "s\n"
   << std::setw(7) << std::fixed << profiler.getLifetimeFramerate() << " FPS = "
-  << std::setw(7) << profiler.getLifetimeAverageMillis() << " = "
-  << std::setw(7) << displayProfiler.getLifetimeAverageMillis() << " (display)"
-  // << " + " << std::setw(7) << loadTextureProfiler.getAverageTimeMillis() << " (loadTexture)"
-  << " + " << std::setw(7) << glTextureProfiler.getLifetimeAverageMillis() << " (loadTexture)"
-  << " + " << std::setw(7) << videoReadProfiler.getLifetimeAverageMillis() << " (readVideo)"
-  << ";    M2U=" << std::setw(7) << 1000 * mtpProfiler.getLifetimeAverage() << "    "
-  << "VRQ=" << std::setw(5) << vrfc.getLifetimeAverage() << "    "
-  << "OQ=" << std::setw(5) << ofc.getLifetimeAverage()
+  << std::setw(7) << profiler.getLifetimeAverageMillis() << " ms/frame"
+  << std::endl;
+  printLatencies(profiler, true);
+  frameLatencyLog.print(std::cout);
+
+#ifdef USE_OPTIMIZER_PIPELINE
+  std::cout
+  << "Pipeline mode " << pipelineModeName(pipeline.getMode()) << ": "
+  << pipeline.getDroppedFrames() << " frames dropped, "
+  << pipeline.getRefoveatedFrames() << " frames re-foveated ("
+  << pipeline.getRefoveateFallbacks() << " fully re-optimized)"
   << std::endl;
+#endif
 
+  printQueueStats("VideoReader queue", myVideoReader.getQueueStats());
+  if (myVideoReader.hasPacketReadAhead()) {
+    const PacketQueue& packets = myVideoReader.getPacketQueue();
+    printQueueStats("Packet queue", packets.getStats());
+    std::cout << "Packet queue peaked at "
+      << packets.getPeakBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+  }
+  if (myVideoReader.isPlayingCache())
+    std::cout << "VideoReader is playing from the frame cache" << std::endl;
+  std::cout << "VideoReader decode: ";
+  myVideoReader.getDecodeTimes().print(std::cout, 1000);
+  std::cout << " ms" << std::endl;
+  if (myVideoReader.getVideoFile())
+    printVideoFileStats(*myVideoReader.getVideoFile());
+#ifdef USE_OPTIMIZER_PIPELINE
+  printQueueStats("Optimizer queue", pipeline.getQueueStats());
+  printWorkerStats(pipeline);
+#endif
+  printUploadStats(uploadRing.getStats(), Timer::timeInSeconds() - totalRunStart);
+  if (framePool)
+    framePool->printStats("Frame pool");
+  if (uploadPool)
+    uploadPool->printStats("Upload pool");
+
+#ifdef USE_OPTIMIZER_PIPELINE
+  pipelineOwner.reset();
+#endif
+  // The upload slots hold on to the last frames uploaded from the pool.
+  for (UploadedFrame& frame : uploadedFrames)
+    frame.image.release();
+  uploadPool = NULL;
+  uploadPoolOwner.reset();
   cleanup();
   return 0;
 }
@@ -381,118 +1176,21 @@ done:
 
 int init(void)
 {
-  int i, x, y;
-  unsigned int flags;
-
-  /* libovr must be initialized before we create the OpenGL context */
-  if (!ovr_Initialize(0)) {
-    std::cerr << "Unable to initialize OVR" << std::endl;
-  }
-
-  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
-
-  x = y = SDL_WINDOWPOS_UNDEFINED;
-  flags = SDL_WINDOW_OPENGL;
-  if(!(win = SDL_CreateWindow("Conduit", x, y, 1024, 640, flags))) {
-    fprintf(stderr, "failed to create window\n");
-    return -1;
-  }
-  if(!(ctx = SDL_GL_CreateContext(win))) {
-    fprintf(stderr, "failed to create OpenGL context\n");
+  if (!backend->init()) {
     return -1;
   }
 
   glewInit();
 
-  bool is_debug = false;
-  if(!(hmd = ovrHmd_Create(0))) {
-    fprintf(stderr, "failed to open Oculus HMD, falling back to virtual debug HMD\n");
-    is_debug = true;
-    if(!(hmd = ovrHmd_CreateDebug(ovrHmd_DK2))) {
-      fprintf(stderr, "failed to create virtual debug HMD\n");
-      return -1;
-    }
-  }
-  printf("initialized HMD: %s - %s\n", hmd->Manufacturer, hmd->ProductName);
-
-  /* resize our window to match the HMD resolution */
-  win_width = hmd->Resolution.w;
-  win_height = hmd->Resolution.h;
-  if (is_debug) {
-    win_width /= 2;
-    win_height /= 2;
-  }
-
-  SDL_SetWindowSize(win, win_width, win_height);
-  SDL_SetWindowPosition(win, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
-
-  /* enable position and rotation tracking */
-  ovrHmd_ConfigureTracking(hmd, ovrTrackingCap_Orientation | ovrTrackingCap_MagYawCorrection | ovrTrackingCap_Position, 0);
-  /* retrieve the optimal render target resolution for each eye */
-  eyeres[0] = ovrHmd_GetFovTextureSize(hmd, ovrEye_Left, hmd->DefaultEyeFov[0], 1.0);
-  eyeres[1] = ovrHmd_GetFovTextureSize(hmd, ovrEye_Right, hmd->DefaultEyeFov[1], 1.0);
+  int eyeWidth[2], eyeHeight[2];
+  backend->getEyeTextureSize(HMD_EYE_LEFT, eyeWidth[0], eyeHeight[0]);
+  backend->getEyeTextureSize(HMD_EYE_RIGHT, eyeWidth[1], eyeHeight[1]);
 
   /* and create a single render target texture to encompass both eyes */
-  fb_width = eyeres[0].w + eyeres[1].w;
-  fb_height = eyeres[0].h > eyeres[1].h ? eyeres[0].h : eyeres[1].h;
+  fb_width = eyeWidth[0] + eyeWidth[1];
+  fb_height = eyeHeight[0] > eyeHeight[1] ? eyeHeight[0] : eyeHeight[1];
   update_rtarg(fb_width, fb_height);
-
-  /* fill in the ovrGLTexture structures that describe our render target texture */
-  for(i=0; i<2; i++) {
-    fb_ovr_tex[i].OGL.Header.API = ovrRenderAPI_OpenGL;
-    fb_ovr_tex[i].OGL.Header.TextureSize.w = fb_tex_width;
-    fb_ovr_tex[i].OGL.Header.TextureSize.h = fb_tex_height;
-    /* this next field is the only one that differs between the two eyes */
-    fb_ovr_tex[i].OGL.Header.RenderViewport.Pos.x = i == 0 ? 0 : fb_width / 2.0;
-    fb_ovr_tex[i].OGL.Header.RenderViewport.Pos.y = 0;
-    fb_ovr_tex[i].OGL.Header.RenderViewport.Size.w = fb_width / 2.0;
-    fb_ovr_tex[i].OGL.Header.RenderViewport.Size.h = fb_height;
-    fb_ovr_tex[i].OGL.TexId = fb_tex; /* both eyes will use the same texture id */
-  }
-
-  /* fill in the ovrGLConfig structure needed by the SDK to draw our stereo pair
-   * to the actual HMD display (SDK-distortion mode)
-   */
-  memset(&glcfg, 0, sizeof glcfg);
-  glcfg.OGL.Header.API = ovrRenderAPI_OpenGL;
-  glcfg.OGL.Header.BackBufferSize.w = win_width;
-  glcfg.OGL.Header.BackBufferSize.h = win_height;
-  glcfg.OGL.Header.Multisample = 1;
-
-#ifdef OVR_OS_WIN32
-  glcfg.OGL.Window = GetActiveWindow();
-  glcfg.OGL.DC = wglGetCurrentDC();
-#elif defined(OVR_OS_LINUX)
-  glcfg.OGL.Disp = glXGetCurrentDisplay();
-#endif
-
-  if(hmd->HmdCaps & ovrHmdCap_ExtendDesktop) {
-    printf("running in \"extended desktop\" mode\n");
-  } else {
-    /* to sucessfully draw to the HMD display in "direct-hmd" mode, we have to
-     * call ovrHmd_AttachToWindow
-     * XXX: this doesn't work properly yet due to bugs in the oculus 0.4.1 sdk/driver
-     */
-#ifdef WIN32
-    ovrHmd_AttachToWindow(hmd, glcfg.OGL.Window, 0, 0);
-#elif defined(OVR_OS_LINUX)
-    ovrHmd_AttachToWindow(hmd, (void*)glXGetCurrentDrawable(), 0, 0);
-#endif
-    printf("running in \"direct-hmd\" mode\n");
-  }
-
-  /* enable low-persistence display and dynamic prediction for lattency compensation */
-  hmd_caps = ovrHmdCap_LowPersistence | ovrHmdCap_DynamicPrediction;
-  ovrHmd_SetEnabledCaps(hmd, hmd_caps);
-
-  /* configure SDK-rendering and enable OLED overdrive and timewrap, which
-   * shifts the image before drawing to counter any lattency between the call
-   * to ovrHmd_GetEyePose and ovrHmd_EndFrame.
-   */
-  distort_caps = ovrDistortionCap_TimeWarp | ovrDistortionCap_Overdrive;
-  if(!ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc)) {
-    fprintf(stderr, "failed to configure distortion renderer\n");
-  }
+  backend->setRenderTarget(fbo, fb_tex, fb_tex_width, fb_tex_height, fb_width, fb_height);
 
   glEnable(GL_DEPTH_TEST);
   glEnable(GL_CULL_FACE);
@@ -508,9 +1206,6 @@ int init(void)
   gluQuadricTexture(qobj, true);
   glFrontFace(GL_CW);
 
-  if (!is_debug)
-    toggle_hmd_fullscreen();
-
   return 0;
 }
 
@@ -518,49 +1213,46 @@ void cleanup(void)
 {
   printf("Cleaning up...\n");
 
-  if(hmd) {
-    ovrHmd_Destroy(hmd);
-  }
-  ovr_Shutdown();
-
-  SDL_Quit();
+  backend->shutdown();
 }
 
-void toggle_hmd_fullscreen(void)
-{
-  static int fullscr, prev_x, prev_y;
-  fullscr = !fullscr;
-
-  if(fullscr) {
-    /* going fullscreen on the rift. save current window position, and move it
-     * to the rift's part of the desktop before going fullscreen
-     */
-    SDL_GetWindowPosition(win, &prev_x, &prev_y);
-    SDL_SetWindowPosition(win, hmd->WindowsPos.x, hmd->WindowsPos.y);
-    SDL_SetWindowFullscreen(win, SDL_WINDOW_FULLSCREEN_DESKTOP);
-
-#ifdef OVR_OS_LINUX
-    /* on linux for now we have to deal with screen rotation during rendering. The docs are promoting
-     * not rotating the DK2 screen globally
-     */
-    glcfg.OGL.Header.BackBufferSize.w = hmd->Resolution.h;
-    glcfg.OGL.Header.BackBufferSize.h = hmd->Resolution.w;
-
-    distort_caps |= ovrDistortionCap_LinuxDevFullscreen;
-    ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc);
-#endif
-  } else {
-    /* return to windowed mode and move the window back to its original position */
-    SDL_SetWindowFullscreen(win, 0);
-    SDL_SetWindowPosition(win, prev_x, prev_y);
+// Head pose offsetIntoFuture seconds from now, from the HMD. When replaying
+// a pose trace, the pose recorded for this frame instead, predicted as it
+// was when recorded.
+static Pose getHeadPose(double offsetIntoFuture) {
+  double when = Timer::timeInSeconds() + offsetIntoFuture;
+  Pose pose;
+  if (!poseReplay.isLoaded() || !poseReplay.getPose(POSE_HEAD, pose))
+    pose = backend->getHeadPose(offsetIntoFuture);
+  poseRecorder.record(POSE_HEAD, when, pose);
+  return pose;
+}
 
-#ifdef OVR_OS_LINUX
-    glcfg.OGL.Header.BackBufferSize = hmd->Resolution;
+static Pose getEyePose(HmdEye eye) {
+  PoseSource source = eye == HMD_EYE_LEFT ? POSE_LEFT_EYE : POSE_RIGHT_EYE;
+  double now = Timer::timeInSeconds();
+  Pose pose;
+  if (!poseReplay.isLoaded() || !poseReplay.getPose(source, pose))
+    pose = backend->getEyePose(eye);
+  poseRecorder.record(source, now, pose);
+  return pose;
+}
 
-    distort_caps &= ~ovrDistortionCap_LinuxDevFullscreen;
-    ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc);
-#endif
+// Yaw and pitch, in radians, of an orientation quaternion (x, y, z, w),
+// taken as rotations about Y, then X, then Z, the same as
+// OVR::Quatf::GetEulerAngles<Axis_Y, Axis_X, Axis_Z>.
+static void yawPitch(const float q[4], double& yaw, double& pitch) {
+  double x = q[0], y = q[1], z = q[2], w = q[3];
+  double s = 2 * (w * x - y * z);
+  // Looking straight up or down, yaw is undefined.
+  const double SINGULARITY = 1e-12;
+  if (s <= -1 + SINGULARITY || s >= 1 - SINGULARITY) {
+    yaw = 0;
+    pitch = s < 0 ? -M_PI / 2 : M_PI / 2;
+    return;
   }
+  yaw = atan2(2 * (w * y + x * z), w * w + z * z - x * x - y * y);
+  pitch = asin(s);
 }
 
 void updatePipelineOrientation(OptimizerPipeline& pipeline, double offsetIntoFuture) {
@@ -570,30 +1262,36 @@ void updatePipelineOrientation(OptimizerPipeline& pipeline, double offsetIntoFut
   if (!UsePrediction)
     offsetIntoFuture = 0;
 
-  // Query the HMD for the current tracking state.
-  ovrTrackingState ts  = ovrHmd_GetTrackingState(hmd, ovr_GetTimeInSeconds() + offsetIntoFuture);
-  OVR::Quatf q(ts.HeadPose.ThePose.Orientation);
-  float yaw = 0, pitch = 0, roll = 0;
-  q.GetEulerAngles<OVR::Axis_Y, OVR::Axis_X, OVR::Axis_Z>(&yaw, &pitch, &roll);
-  OculusZAngle = yaw * MATH_DOUBLE_RADTODEGREEFACTOR;
-  OculusPitchAngle = pitch * MATH_DOUBLE_RADTODEGREEFACTOR;
+  Pose headPose = getHeadPose(offsetIntoFuture);
+  double yaw, pitch;
+  yawPitch(headPose.orientation, yaw, pitch);
+  OculusZAngle = yaw * 180 / M_PI;
+  OculusPitchAngle = pitch * 180 / M_PI;
 
-  pipeline.hmdDataMutex.lock();
-  pipeline.lastUpdated = Timer::timeInSeconds();
-  pipeline.hAngle = getHorizontalAngleForOptimize();
-  pipeline.vAngle = getVerticalAngleForOptimize();
-  pipeline.hmdDataMutex.unlock();
+  pipeline.updateOrientation(getHorizontalAngleForOptimize(),
+      getVerticalAngleForOptimize(), Timer::timeInSeconds());
 }
 
 void display()
 {
+  TRACE_SPAN("display");
   int i;
-  ovrMatrix4f proj;
-  ovrPosef pose[2];
+  float proj[16];
+  float offset[3];
+  Pose pose[2];
   float rot_mat[16];
 
-  /* the drawing starts with a call to ovrHmd_BeginFrame */
-  ovrHmd_BeginFrame(hmd, 0);
+  // Switch to the newest frame whose upload has finished.
+  if (uploadRing.updateDrawSlot()) {
+    const UploadedFrame& frame = uploadedFrames[uploadRing.getDrawSlot()];
+    pendingFrameId = frame.id;
+    pendingFrameSequence = frame.sequence;
+    pendingFrameTimes = frame.times;
+    pendingFrameTimes.mark(FRAME_UPLOADED);
+    framePending = true;
+  }
+
+  backend->beginFrame();
 
   /* start drawing onto our texture render target */
   glBindFramebuffer(GL_FRAMEBUFFER, fbo);
@@ -601,43 +1299,42 @@ void display()
 
   /* for each eye ... */
   for(i=0; i<2; i++) {
-    ovrEyeType eye = hmd->EyeRenderOrder[i];
+    HmdEye eye = backend->getEyeRenderOrder(i);
 
     /* -- viewport transformation --
      * setup the viewport to draw in the left half of the framebuffer when we're
      * rendering the left eye's view (0, 0, width/2, height), and in the right half
      * of the framebuffer for the right eye's view (width/2, 0, width/2, height)
      */
-    glViewport(eye == ovrEye_Left ? 0 : fb_width / 2, 0, fb_width / 2, fb_height);
+    glViewport(eye == HMD_EYE_LEFT ? 0 : fb_width / 2, 0, fb_width / 2, fb_height);
 
     /* -- projection transformation --
-     * we'll just have to use the projection matrix supplied by the oculus SDK for this eye
-     * note that libovr matrices are the transpose of what OpenGL expects, so we have to
-     * use glLoadTransposeMatrixf instead of glLoadMatrixf to load it.
+     * we'll just have to use the projection matrix supplied by the HMD for this eye
+     * note that like libovr matrices it is the transpose of what OpenGL expects, so we
+     * have to use glLoadTransposeMatrixf instead of glLoadMatrixf to load it.
      */
-    proj = ovrMatrix4f_Projection(hmd->DefaultEyeFov[eye], 0.5, 500.0, 1);
+    backend->getProjection(eye, 0.5, 500.0, proj);
     glMatrixMode(GL_PROJECTION);
-    glLoadTransposeMatrixf(proj.M[0]);
+    glLoadTransposeMatrixf(proj);
 
     /* -- view/camera transformation --
-     * we need to construct a view matrix by combining all the information provided by the oculus
-     * SDK, about the position and orientation of the user's head in the world.
+     * we need to construct a view matrix by combining all the information provided by the HMD
+     * about the position and orientation of the user's head in the world.
      */
     /* TODO: use ovrHmd_GetEyePoses out of the loop instead */
-    pose[eye] = ovrHmd_GetHmdPosePerEye(hmd, eye);
+    pose[eye] = getEyePose(eye);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 
-    glTranslatef(eye_rdesc[eye].HmdToEyeViewOffset.x,
-        eye_rdesc[eye].HmdToEyeViewOffset.y,
-        eye_rdesc[eye].HmdToEyeViewOffset.z);
+    backend->getEyeViewOffset(eye, offset);
+    glTranslatef(offset[0], offset[1], offset[2]);
     /* retrieve the orientation quaternion and convert it to a rotation matrix */
-    quat_to_matrix(&pose[eye].Orientation.x, rot_mat);
+    quat_to_matrix(pose[eye].orientation, rot_mat);
     glMultMatrixf(rot_mat);
     /* translate the view matrix with the positional tracking */
-    glTranslatef(-pose[eye].Position.x, -pose[eye].Position.y, -pose[eye].Position.z);
+    glTranslatef(-pose[eye].position[0], -pose[eye].position[1], -pose[eye].position[2]);
     /* move the camera to the eye level of the user */
-    glTranslatef(0, -ovrHmd_GetFloat(hmd, OVR_KEY_EYE_HEIGHT, 1.65), 0);
+    glTranslatef(0, -backend->getEyeHeight(), 0);
     glRotatef(ourAngle, 0, -1, 0);
     glTranslatef(xPos, yPos, zPos);
 
@@ -646,31 +1343,39 @@ void display()
   }
 
   /* after drawing both eyes into the texture render target, revert to drawing directly to the
-   * display, and we call ovrHmd_EndFrame, to let the Oculus SDK draw both images properly
-   * compensated for lens distortion and chromatic abberation onto the HMD screen.
+   * display, and let the HMD show both images (with the Oculus SDK, properly compensated for
+   * lens distortion and chromatic abberation).
    */
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-  ovrHmd_EndFrame(hmd, pose, &fb_ovr_tex[0].Texture);
+  backend->endFrame(pose);
 
-  /* workaround for the oculus sdk distortion renderer bug, which uses a shader
-   * program, and doesn't restore the original binding when it's done.
-   */
-  glUseProgram(0);
+  if (framePending) {
+    pendingFrameTimes.mark(FRAME_PRESENTED);
+    frameLatencyLog.record(pendingFrameId, pendingFrameSequence, pendingFrameTimes);
+    framePending = false;
+  }
 
   CHECK_GL_ERROR();
 }
 
-void reshape(int x, int y)
+void draw_scene(HmdEye eye)
 {
-  win_width = x;
-  win_height = y;
-}
-
-void draw_scene(ovrEyeType eye)
-{
-  bool isLeft = eye == ovrEye_Left || !three_d_enabled;
-  glBindTexture(GL_TEXTURE_2D, isLeft ? textureLeft.name : textureRight.name);
+  bool isLeft = eye == HMD_EYE_LEFT || !three_d_enabled;
+  int slot = uploadRing.getDrawSlot();
+  bool foveated = GPU_FOVEA_COMPOSITING && slot >= 0;
+  bool yuv = !foveated && slot >= 0 && uploadedFrames[slot].isI420;
+  if (foveated) {
+    foveatedTextures.bind(isLeft, slot);
+  } else if (yuv) {
+    glUseProgram(yuvProgram);
+    for (int i = 2; i >= 0; i--) {
+      glActiveTexture(GL_TEXTURE0 + i);
+      glBindTexture(GL_TEXTURE_2D, eyeTexture(isLeft, i).names[slot]);
+    }
+  } else if (slot >= 0) {
+    glBindTexture(GL_TEXTURE_2D, isLeft ? textureLeft.names[slot] : textureRight.names[slot]);
+  }
 
 //  glMatrixMode(GL_MODELVIEW);
   glRotatef(90.0,1.0,0.0,0.0);
@@ -678,7 +1383,17 @@ void draw_scene(ovrEyeType eye)
 
   glCallList(myDisplayList);
 
-  glBindTexture(GL_TEXTURE_2D, 0);
+  if (foveated) {
+    foveatedTextures.unbind();
+  } else if (yuv) {
+    for (int i = 2; i >= 0; i--) {
+      glActiveTexture(GL_TEXTURE0 + i);
+      glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    glUseProgram(0);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, 0);
+  }
 }
 
 /* update_rtarg creates (and/or resizes) the render target used to draw the two stero views */
@@ -720,77 +1435,41 @@ void update_rtarg(int width, int height)
   printf("created render target: %dx%d (texture size: %dx%d)\n", width, height, fb_tex_width, fb_tex_height);
 }
 
-int handle_event(SDL_Event *ev)
-{
-  switch(ev->type) {
-    case SDL_QUIT:
-      return -1;
-
-    case SDL_KEYDOWN:
-    case SDL_KEYUP:
-      if(key_event(ev->key.keysym.sym, ev->key.state == SDL_PRESSED) == -1) {
-        return -1;
-      }
-      break;
-
-    case SDL_WINDOWEVENT:
-      if(ev->window.event == SDL_WINDOWEVENT_RESIZED) {
-        reshape(ev->window.data1, ev->window.data2);
-      }
-      break;
-
-    default:
-      break;
-  }
-
-  return 0;
-}
-
-int key_event(int key, int state)
+int key_event(int key)
 {
-  if (!state)
-    return 0;
-
-  ovrHSWDisplayState hsw;
-  ovrHmd_GetHSWDisplayState(hmd, &hsw);
-  if(hsw.Displayed) {
-    ovrHmd_DismissHSWDisplay(hmd);
-    return 0;
-  }
-
   switch( key ){
-    case SDLK_LEFT:
-    case SDLK_a:
+    case HMD_KEY_LEFT:
+    case 'a':
       xPos -= 1;
       break;
-    case SDLK_RIGHT:
-    case SDLK_d:
+    case HMD_KEY_RIGHT:
+    case 'd':
       xPos += 1;
       break;
-    case SDLK_UP:
-    case SDLK_w:
+    case HMD_KEY_UP:
+    case 'w':
       zPos += 1;
       break;
-    case SDLK_DOWN:
-    case SDLK_s:
+    case HMD_KEY_DOWN:
+    case 's':
       zPos -= 1;
       break;
-    case SDLK_q:
+    case 'q':
       ourAngle += ROTATION_GRANULARITY;
       break;
-    case SDLK_e:
+    case 'e':
       ourAngle -= ROTATION_GRANULARITY;
       break;
 
     case 27:
       return -1;
 
-    case SDLK_KP_PLUS:
+    case HMD_KEY_KP_PLUS:
       BLUR_FACTOR += 1;
       std::cout << "blur " << BLUR_FACTOR << "\n";
       break;
 
-    case SDLK_KP_MINUS:
+    case HMD_KEY_KP_MINUS:
       BLUR_FACTOR = BLUR_FACTOR > 1 ? BLUR_FACTOR - 1 : 1;
       std::cout << "blur " << BLUR_FACTOR << "\n";
       break;
@@ -805,6 +1484,19 @@ int key_event(int key, int state)
       printf("fovea=%d\n", FOVEA_DISPLAY);
       break;
 
+    case 'x':
+      UPLOAD_BGRA = !UPLOAD_BGRA;
+      printf("uploadBgra=%d\n", UPLOAD_BGRA);
+      break;
+
+    case 'c':
+      // Started from here rather than CONDUIT_TRACE: write to the default file.
+      if (!Trace::isEnabled() && !std::getenv("CONDUIT_TRACE"))
+        Trace::writeOnExit(TRACE_FILE);
+      Trace::setEnabled(!Trace::isEnabled());
+      printf("tracing=%d\n", Trace::isEnabled());
+      break;
+
     case 'b':
       if (BLUR_FACTOR == BLUR_HIGH)
         BLUR_FACTOR = BLUR_NORMAL;
@@ -823,12 +1515,6 @@ int key_event(int key, int state)
       std::cout << "blur " << BLUR_FACTOR << "\n";
       break;
 
-    case ' ':
-    case 'r':
-      /* allow the user to recenter by pressing space */
-      ovrHmd_RecenterPose(hmd);
-      break;
-
     case 'p':
       FROZEN = !FROZEN;
       printf("Toggling frozen to %d\n", FROZEN);
@@ -839,36 +1525,9 @@ int key_event(int key, int state)
       printf("Toggling 3D to %d\n", three_d_enabled);
       break;
 
-    case 'f':
-      /* press f to move the window to the HMD */
-      toggle_hmd_fullscreen();
-      break;
-
-    // case 'v':
-    //   distort_caps ^= ovrDistortionCap_Vignette;
-    //   printf("Vignette: %s\n", distort_caps & ovrDistortionCap_Vignette ? "on" : "off");
-    //   ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc);
-    //   break;
-
-    case 't':
-      distort_caps ^= ovrDistortionCap_TimeWarp;
-      printf("Time-warp: %s\n", distort_caps & ovrDistortionCap_TimeWarp ? "on" : "off");
-      ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc);
-      break;
-
-    case 'o':
-      distort_caps ^= ovrDistortionCap_Overdrive;
-      printf("OLED over-drive: %s\n", distort_caps & ovrDistortionCap_Overdrive ? "on" : "off");
-      ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distort_caps, hmd->DefaultEyeFov, eye_rdesc);
-      break;
-
-    case 'l':
-      hmd_caps ^= ovrHmdCap_LowPersistence;
-      printf("Low-persistence display: %s\n", hmd_caps & ovrHmdCap_LowPersistence ? "on" : "off");
-      ovrHmd_SetEnabledCaps(hmd, hmd_caps);
-      break;
-
     default:
+      /* recentering, fullscreen and display settings belong to the HMD */
+      backend->handleKey(key);
       break;
   }
 
@@ -7,48 +7,172 @@
 #include <assert.h>
 #include <thread>
 
-#ifdef WIN32
-#include <SDL.h>
-#else
-#include <SDL2/SDL.h>
-#endif
 #include <GL/glew.h>
 
-#ifdef WIN32
-#define OVR_OS_WIN32
-#elif defined(__APPLE__)
-#define OVR_OS_MAC
-#else
-#define OVR_OS_LINUX
-#include <X11/Xlib.h>
-#include <GL/glx.h>
-#endif
-
-#include <OVR_CAPI.h>
-#include <OVR_CAPI_GL.h>
-#include <Extras/OVR_Math.h>
-
 #include "../contracts.h"
+#include "../optimizer/optimizer.hpp"
+#include "../settings.hpp"
 #include "../videoreader/videoreader.hpp"
+#include "hmdbackend.hpp"
 
+struct UploadRingStats {
+	long frames = 0;
+	// Uploads that found every slot busy and had to wait for the GPU.
+	long slotWaits = 0;
+	double slotWaitSeconds = 0;
+	// Display frames that drew an older frame because the newest upload
+	// hadn't finished; without the ring, each would have stalled the GPU.
+	long lateFrames = 0;
+	// Pixel data copied to the GPU.
+	double bytes = 0;
+};
+
+// Video frames go to the GPU through a ring of UPLOAD_RING_SIZE slots, each
+// with its own textures and pixel buffers, so the next frame can be copied
+// in while the last one is still transferring. A fence after each frame's
+// uploads marks when it is safe to draw, and when its slot may be reused.
+class UploadRing {
+	public:
+		UploadRing();
+
+		// Slot to upload the next frame into. Waits if every slot is either
+		// being drawn or still transferring.
+		int beginUpload();
+		// bytes is how much pixel data the frame's uploads copied.
+		void endUpload(int slot, size_t bytes);
+
+		// Moves the draw slot to the newest frame whose uploads have finished.
+		// Call once per display frame; returns true if the draw slot changed.
+		bool updateDrawSlot();
+		// -1 until the first upload has finished.
+		int getDrawSlot() const {
+			return drawSlot;
+		}
+
+		const UploadRingStats& getStats() const {
+			return stats;
+		}
+
+	private:
+		void advance();
+		// Makes slot, the one after the draw slot, the draw slot.
+		void retire(int slot);
+
+		GLsync fences[UPLOAD_RING_SIZE];
+		int drawSlot;
+		int lastSlot;
+		// Frames that have become drawable, and how many of those
+		// updateDrawSlot() has reported.
+		long drawnFrames;
+		long reportedFrames;
+		UploadRingStats stats;
+};
+
+// A texture for each UploadRing slot. BGR and BGRA images go into RGBA8
+// textures, single planes of I420 frames into R8 ones.
 class TextureData {
 	public:
 		TextureData();
 		void init();
-		void load(const cv::Mat& image);
+		void load(const cv::Mat& image, int slot);
+		// Uploads image as is, without running the optimizer.
+		void upload(const cv::Mat& image, int slot);
+		// Uploads a BGR, BGRA or one-channel image that is already in a pixel
+		// unpack buffer, at offset with rows step bytes apart.
+		void uploadFromBuffer(GLuint buffer, size_t offset,
+				int width, int height, size_t step, int channels, int slot);
 
-		GLuint name = 0;
-		GLuint pbo = 0;
+		GLuint names[UPLOAD_RING_SIZE];
+		GLuint pbos[UPLOAD_RING_SIZE];
 		int width = 0;
 		int height = 0;
 		size_t size = 0;
 		bool initialized = false;
 		bool loaded = false;
+
+	private:
+		void allocate(int width, int height, int channels);
+};
+
+// Draws an OptimizedImage without expanding it on the CPU. The blurred
+// periphery and the two focused regions are uploaded as separate small
+// textures, and a fragment shader composites them on the cylinder using the
+// image's layout. I420 images are uploaded plane by plane and converted to
+// RGB by the same shader.
+class FoveatedTextures {
+	public:
+		void init();
+		void load(const OptimizedImage& image, int slot);
+		// Sets up the shader and textures to draw one eye; unbind() goes back to
+		// the fixed-function pipeline.
+		void bind(bool isLeft, int slot);
+		void unbind();
+
+	private:
+		// Where the regions of the image in each slot go.
+		struct Layout {
+			cv::Size croppedSize;
+			cv::Size fullSize;
+			int leftBuffer = 0;
+			int focusRow = 0;
+			int focusCol = 0;
+			cv::Size focusSize;
+			int peripheryRows = 0;
+		};
+
+		struct Program {
+			GLuint name = 0;
+			GLint periphery = -1;
+			GLint fovea = -1;
+			GLint eye = -1;
+			GLint crop = -1;
+			GLint focus = -1;
+			GLint showFovea = -1;
+			GLint peripheryRows = -1;
+			// YUV only.
+			GLint peripheryChroma[2] = {-1, -1};
+			GLint foveaChroma[2] = {-1, -1};
+			GLint chromaCrop = -1;
+			GLint chromaFocus = -1;
+			GLint chromaPeripheryRows = -1;
+		};
+
+		static void initProgram(Program& program, bool yuv);
+		static void setLayout(Layout& layout, const OptimizedImage& image);
+		static void setLayoutUniforms(GLint crop, GLint focus, GLint peripheryRows,
+				const Layout& layout);
+
+		// The image, or its Y plane, and the U and V planes.
+		TextureData periphery;
+		TextureData foveaTop;
+		TextureData foveaBot;
+		TextureData peripheryChroma[2];
+		TextureData foveaTopChroma[2];
+		TextureData foveaBotChroma[2];
+
+		Program bgrProgram;
+		Program yuvProgram;
+
+		Layout layouts[UPLOAD_RING_SIZE];
+		// The U and V planes share a layout.
+		Layout chromaLayouts[UPLOAD_RING_SIZE];
+		bool isI420[UPLOAD_RING_SIZE] = {};
 };
 
+// Only the Oculus SDK backend (ovrbackend.cpp) needs the SDK and SDL; the
+// rest builds without them, for conduit_headless.
 class Oculus2 {
   public:
+  	// On the Oculus SDK backend; defined in ovrbackend.cpp.
   	static int run(int argc, char **argv);
+  	// Plays the video on a NullHmdBackend, with no window or HMD.
+  	static int runHeadless(int argc, char **argv);
+  	// Stops after secondsToRun seconds or framesToRun displayed frames if
+  	// positive; framesToRun 0 stops once the video has been shown to the end.
+  	static int runWithBackend(HmdBackend& backend, const std::string& filename,
+  	    int secondsToRun, long framesToRun, PipelineMode pipelineMode);
+  	// Parses "queued" or "latest"; prints an error and returns false otherwise.
+  	static bool parsePipelineMode(const char* arg, PipelineMode& mode);
 };
 
 #endif
@@ -0,0 +1,373 @@
+#include "ovrbackend.hpp"
+
+#include "../util/trace.hpp"
+
+#include <iostream>
+
+static Pose toPose(const ovrPosef& p) {
+  Pose pose;
+  pose.orientation[0] = p.Orientation.x;
+  pose.orientation[1] = p.Orientation.y;
+  pose.orientation[2] = p.Orientation.z;
+  pose.orientation[3] = p.Orientation.w;
+  pose.position[0] = p.Position.x;
+  pose.position[1] = p.Position.y;
+  pose.position[2] = p.Position.z;
+  return pose;
+}
+
+static int toHmdKey(SDL_Keycode key) {
+  switch (key) {
+    case SDLK_LEFT: return HMD_KEY_LEFT;
+    case SDLK_RIGHT: return HMD_KEY_RIGHT;
+    case SDLK_UP: return HMD_KEY_UP;
+    case SDLK_DOWN: return HMD_KEY_DOWN;
+    case SDLK_KP_PLUS: return HMD_KEY_KP_PLUS;
+    case SDLK_KP_MINUS: return HMD_KEY_KP_MINUS;
+    default: return key;
+  }
+}
+
+static ovrPosef fromPose(const Pose& pose) {
+  ovrPosef p;
+  p.Orientation.x = pose.orientation[0];
+  p.Orientation.y = pose.orientation[1];
+  p.Orientation.z = pose.orientation[2];
+  p.Orientation.w = pose.orientation[3];
+  p.Position.x = pose.position[0];
+  p.Position.y = pose.position[1];
+  p.Position.z = pose.position[2];
+  return p;
+}
+
+OvrHmdBackend::OvrHmdBackend()
+  : win(NULL), ctx(NULL), winWidth(0), winHeight(0), hmd(NULL), isDebug(false),
+    distortCaps(0), hmdCaps(0), fullscreen(false), prevX(0), prevY(0) {}
+
+bool OvrHmdBackend::init() {
+  int x, y;
+  unsigned int flags;
+
+  /* libovr must be initialized before we create the OpenGL context */
+  if (!ovr_Initialize(0)) {
+    std::cerr << "Unable to initialize OVR" << std::endl;
+  }
+
+  SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER);
+
+  x = y = SDL_WINDOWPOS_UNDEFINED;
+  flags = SDL_WINDOW_OPENGL;
+  if(!(win = SDL_CreateWindow("Conduit", x, y, 1024, 640, flags))) {
+    fprintf(stderr, "failed to create window\n");
+    return false;
+  }
+  if(!(ctx = SDL_GL_CreateContext(win))) {
+    fprintf(stderr, "failed to create OpenGL context\n");
+    return false;
+  }
+
+  if(!(hmd = ovrHmd_Create(0))) {
+    fprintf(stderr, "failed to open Oculus HMD, falling back to virtual debug HMD\n");
+    isDebug = true;
+    if(!(hmd = ovrHmd_CreateDebug(ovrHmd_DK2))) {
+      fprintf(stderr, "failed to create virtual debug HMD\n");
+      return false;
+    }
+  }
+  printf("initialized HMD: %s - %s\n", hmd->Manufacturer, hmd->ProductName);
+
+  /* resize our window to match the HMD resolution */
+  winWidth = hmd->Resolution.w;
+  winHeight = hmd->Resolution.h;
+  if (isDebug) {
+    winWidth /= 2;
+    winHeight /= 2;
+  }
+
+  SDL_SetWindowSize(win, winWidth, winHeight);
+  SDL_SetWindowPosition(win, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
+
+  /* enable position and rotation tracking */
+  ovrHmd_ConfigureTracking(hmd, ovrTrackingCap_Orientation | ovrTrackingCap_MagYawCorrection | ovrTrackingCap_Position, 0);
+  return true;
+}
+
+void OvrHmdBackend::shutdown() {
+  if(hmd) {
+    ovrHmd_Destroy(hmd);
+    hmd = NULL;
+  }
+  ovr_Shutdown();
+
+  SDL_Quit();
+}
+
+void OvrHmdBackend::getEyeTextureSize(HmdEye eye, int& width, int& height) {
+  /* retrieve the optimal render target resolution for each eye */
+  ovrSizei size = ovrHmd_GetFovTextureSize(hmd, (ovrEyeType) eye, hmd->DefaultEyeFov[eye], 1.0);
+  width = size.w;
+  height = size.h;
+}
+
+void OvrHmdBackend::setRenderTarget(unsigned int fbo, unsigned int texture,
+    int texWidth, int texHeight, int width, int height) {
+  int i;
+
+  /* fill in the ovrGLTexture structures that describe our render target texture */
+  for(i=0; i<2; i++) {
+    eyeTextures[i].OGL.Header.API = ovrRenderAPI_OpenGL;
+    eyeTextures[i].OGL.Header.TextureSize.w = texWidth;
+    eyeTextures[i].OGL.Header.TextureSize.h = texHeight;
+    /* this next field is the only one that differs between the two eyes */
+    eyeTextures[i].OGL.Header.RenderViewport.Pos.x = i == 0 ? 0 : width / 2.0;
+    eyeTextures[i].OGL.Header.RenderViewport.Pos.y = 0;
+    eyeTextures[i].OGL.Header.RenderViewport.Size.w = width / 2.0;
+    eyeTextures[i].OGL.Header.RenderViewport.Size.h = height;
+    eyeTextures[i].OGL.TexId = texture; /* both eyes will use the same texture id */
+  }
+
+  /* fill in the ovrGLConfig structure needed by the SDK to draw our stereo pair
+   * to the actual HMD display (SDK-distortion mode)
+   */
+  memset(&glcfg, 0, sizeof glcfg);
+  glcfg.OGL.Header.API = ovrRenderAPI_OpenGL;
+  glcfg.OGL.Header.BackBufferSize.w = winWidth;
+  glcfg.OGL.Header.BackBufferSize.h = winHeight;
+  glcfg.OGL.Header.Multisample = 1;
+
+#ifdef OVR_OS_WIN32
+  glcfg.OGL.Window = GetActiveWindow();
+  glcfg.OGL.DC = wglGetCurrentDC();
+#elif defined(OVR_OS_LINUX)
+  glcfg.OGL.Disp = glXGetCurrentDisplay();
+#endif
+
+  if(hmd->HmdCaps & ovrHmdCap_ExtendDesktop) {
+    printf("running in \"extended desktop\" mode\n");
+  } else {
+    /* to sucessfully draw to the HMD display in "direct-hmd" mode, we have to
+     * call ovrHmd_AttachToWindow
+     * XXX: this doesn't work properly yet due to bugs in the oculus 0.4.1 sdk/driver
+     */
+#ifdef WIN32
+    ovrHmd_AttachToWindow(hmd, glcfg.OGL.Window, 0, 0);
+#elif defined(OVR_OS_LINUX)
+    ovrHmd_AttachToWindow(hmd, (void*)glXGetCurrentDrawable(), 0, 0);
+#endif
+    printf("running in \"direct-hmd\" mode\n");
+  }
+
+  /* enable low-persistence display and dynamic prediction for lattency compensation */
+  hmdCaps = ovrHmdCap_LowPersistence | ovrHmdCap_DynamicPrediction;
+  ovrHmd_SetEnabledCaps(hmd, hmdCaps);
+
+  /* configure SDK-rendering and enable OLED overdrive and timewrap, which
+   * shifts the image before drawing to counter any lattency between the call
+   * to ovrHmd_GetEyePose and ovrHmd_EndFrame.
+   */
+  distortCaps = ovrDistortionCap_TimeWarp | ovrDistortionCap_Overdrive;
+  if(!ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc)) {
+    fprintf(stderr, "failed to configure distortion renderer\n");
+  }
+
+  if (!isDebug)
+    toggleFullscreen();
+}
+
+HmdEye OvrHmdBackend::getEyeRenderOrder(int i) {
+  return (HmdEye) hmd->EyeRenderOrder[i];
+}
+
+void OvrHmdBackend::getProjection(HmdEye eye, float zNear, float zFar, float matrix[16]) {
+  ovrMatrix4f proj = ovrMatrix4f_Projection(hmd->DefaultEyeFov[eye], zNear, zFar, 1);
+  memcpy(matrix, proj.M, sizeof(proj.M));
+}
+
+void OvrHmdBackend::getEyeViewOffset(HmdEye eye, float offset[3]) {
+  offset[0] = eyeRenderDesc[eye].HmdToEyeViewOffset.x;
+  offset[1] = eyeRenderDesc[eye].HmdToEyeViewOffset.y;
+  offset[2] = eyeRenderDesc[eye].HmdToEyeViewOffset.z;
+}
+
+float OvrHmdBackend::getEyeHeight() {
+  return ovrHmd_GetFloat(hmd, OVR_KEY_EYE_HEIGHT, 1.65);
+}
+
+Pose OvrHmdBackend::getHeadPose(double secondsAhead) {
+  ovrTrackingState ts = ovrHmd_GetTrackingState(hmd, ovr_GetTimeInSeconds() + secondsAhead);
+  return toPose(ts.HeadPose.ThePose);
+}
+
+Pose OvrHmdBackend::getEyePose(HmdEye eye) {
+  return toPose(ovrHmd_GetHmdPosePerEye(hmd, (ovrEyeType) eye));
+}
+
+void OvrHmdBackend::beginFrame() {
+  /* the drawing starts with a call to ovrHmd_BeginFrame */
+  ovrHmd_BeginFrame(hmd, 0);
+}
+
+void OvrHmdBackend::endFrame(const Pose eyePoses[2]) {
+  ovrPosef pose[2] = { fromPose(eyePoses[0]), fromPose(eyePoses[1]) };
+  {
+    TRACE_SPAN("ovrHmd_EndFrame");
+    ovrHmd_EndFrame(hmd, pose, &eyeTextures[0].Texture);
+  }
+
+  /* workaround for the oculus sdk distortion renderer bug, which uses a shader
+   * program, and doesn't restore the original binding when it's done.
+   */
+  glUseProgram(0);
+}
+
+bool OvrHmdBackend::pollEvents(std::vector<int>& keys) {
+  SDL_Event ev;
+  while(SDL_PollEvent(&ev)) {
+    switch(ev.type) {
+      case SDL_QUIT:
+        return false;
+
+      case SDL_KEYDOWN: {
+        /* the first key press only dismisses the health and safety warning */
+        ovrHSWDisplayState hsw;
+        ovrHmd_GetHSWDisplayState(hmd, &hsw);
+        if(hsw.Displayed) {
+          ovrHmd_DismissHSWDisplay(hmd);
+          break;
+        }
+        keys.push_back(toHmdKey(ev.key.keysym.sym));
+        break;
+      }
+
+      case SDL_WINDOWEVENT:
+        if(ev.window.event == SDL_WINDOWEVENT_RESIZED) {
+          winWidth = ev.window.data1;
+          winHeight = ev.window.data2;
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+  return true;
+}
+
+void OvrHmdBackend::handleKey(int key) {
+  switch (key) {
+    case ' ':
+    case 'r':
+      /* allow the user to recenter by pressing space */
+      ovrHmd_RecenterPose(hmd);
+      break;
+
+    case 'f':
+      /* press f to move the window to the HMD */
+      toggleFullscreen();
+      break;
+
+    // case 'v':
+    //   distortCaps ^= ovrDistortionCap_Vignette;
+    //   printf("Vignette: %s\n", distortCaps & ovrDistortionCap_Vignette ? "on" : "off");
+    //   ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc);
+    //   break;
+
+    case 't':
+      distortCaps ^= ovrDistortionCap_TimeWarp;
+      printf("Time-warp: %s\n", distortCaps & ovrDistortionCap_TimeWarp ? "on" : "off");
+      ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc);
+      break;
+
+    case 'o':
+      distortCaps ^= ovrDistortionCap_Overdrive;
+      printf("OLED over-drive: %s\n", distortCaps & ovrDistortionCap_Overdrive ? "on" : "off");
+      ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc);
+      break;
+
+    case 'l':
+      hmdCaps ^= ovrHmdCap_LowPersistence;
+      printf("Low-persistence display: %s\n", hmdCaps & ovrHmdCap_LowPersistence ? "on" : "off");
+      ovrHmd_SetEnabledCaps(hmd, hmdCaps);
+      break;
+
+    default:
+      break;
+  }
+}
+
+void OvrHmdBackend::toggleFullscreen() {
+  fullscreen = !fullscreen;
+
+  if(fullscreen) {
+    /* going fullscreen on the rift. save current window position, and move it
+     * to the rift's part of the desktop before going fullscreen
+     */
+    SDL_GetWindowPosition(win, &prevX, &prevY);
+    SDL_SetWindowPosition(win, hmd->WindowsPos.x, hmd->WindowsPos.y);
+    SDL_SetWindowFullscreen(win, SDL_WINDOW_FULLSCREEN_DESKTOP);
+
+#ifdef OVR_OS_LINUX
+    /* on linux for now we have to deal with screen rotation during rendering. The docs are promoting
+     * not rotating the DK2 screen globally
+     */
+    glcfg.OGL.Header.BackBufferSize.w = hmd->Resolution.h;
+    glcfg.OGL.Header.BackBufferSize.h = hmd->Resolution.w;
+
+    distortCaps |= ovrDistortionCap_LinuxDevFullscreen;
+    ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc);
+#endif
+  } else {
+    /* return to windowed mode and move the window back to its original position */
+    SDL_SetWindowFullscreen(win, 0);
+    SDL_SetWindowPosition(win, prevX, prevY);
+
+#ifdef OVR_OS_LINUX
+    glcfg.OGL.Header.BackBufferSize = hmd->Resolution;
+
+    distortCaps &= ~ovrDistortionCap_LinuxDevFullscreen;
+    ovrHmd_ConfigureRendering(hmd, &glcfg.Config, distortCaps, hmd->DefaultEyeFov, eyeRenderDesc);
+#endif
+  }
+}
+
+int Oculus2::run(int argc, char **argv)
+{
+  if (argc < 3) {
+    std::cerr << "Usage: "
+      << argv[0]
+      << " oculus2 filename [secondsToRun] [queued|latest]"
+      << std::endl;
+      return 1;
+  }
+
+  int secondsToRun = -1;
+  if (argc >= 4) {
+    secondsToRun = atoi(argv[3]);
+    std::cout << "time limit " << secondsToRun << " seconds\n";
+  }
+
+  PipelineMode pipelineMode = PIPELINE_MODE;
+  if (argc >= 5 && !Oculus2::parsePipelineMode(argv[4], pipelineMode))
+    return 1;
+
+  std::cout
+    << "Q/E: manually rotate left/right\n"
+    << "R/Space: recenter\n"
+    << "B: high blur\n"
+    << "N: no blur\n"
+    << "G: 3D\n"
+    << "T: timewarp\n"
+    << "P: pause video updates\n"
+    << "+/- (keypad): increase/decrease blur\n"
+    << "U: use prediction\n"
+    << "V: fovea\n"
+    << "C: start/stop tracing\n"
+    << "X: BGR/BGRA upload\n"
+    // << "o: toggle OLED overdrive (default: on)\n"
+    // << "l: toggle low persistence display (default: on)\n"
+    // << "v: toggle vignette (default: on)\n"
+  ;
+
+  OvrHmdBackend ovrBackend;
+  return runWithBackend(ovrBackend, argv[2], secondsToRun, -1, pipelineMode);
+}
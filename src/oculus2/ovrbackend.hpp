@@ -0,0 +1,75 @@
+#ifndef OCULUS2_OVRBACKEND_H_
+#define OCULUS2_OVRBACKEND_H_
+
+#ifdef WIN32
+#include <SDL.h>
+#else
+#include <SDL2/SDL.h>
+#endif
+
+#include "oculus2.hpp"
+
+#ifdef WIN32
+#define OVR_OS_WIN32
+#elif defined(__APPLE__)
+#define OVR_OS_MAC
+#else
+#define OVR_OS_LINUX
+#include <X11/Xlib.h>
+#include <GL/glx.h>
+#endif
+
+#include <OVR_CAPI.h>
+#include <OVR_CAPI_GL.h>
+#include <Extras/OVR_Math.h>
+
+// An Oculus HMD through the Oculus SDK, with the SDK's distortion renderer
+// drawing to an SDL window. Falls back to a virtual DK2 if no HMD is
+// connected.
+class OvrHmdBackend : public HmdBackend {
+  public:
+    OvrHmdBackend();
+
+    bool init();
+    void shutdown();
+
+    void getEyeTextureSize(HmdEye eye, int& width, int& height);
+    void setRenderTarget(unsigned int fbo, unsigned int texture,
+        int texWidth, int texHeight, int width, int height);
+
+    HmdEye getEyeRenderOrder(int i);
+    void getProjection(HmdEye eye, float zNear, float zFar, float matrix[16]);
+    void getEyeViewOffset(HmdEye eye, float offset[3]);
+    float getEyeHeight();
+
+    Pose getHeadPose(double secondsAhead);
+    Pose getEyePose(HmdEye eye);
+
+    void beginFrame();
+    void endFrame(const Pose eyePoses[2]);
+
+    bool pollEvents(std::vector<int>& keys);
+    void handleKey(int key);
+
+  private:
+    void toggleFullscreen();
+
+    SDL_Window* win;
+    SDL_GLContext ctx;
+    int winWidth;
+    int winHeight;
+
+    ovrHmd hmd;
+    bool isDebug;
+    ovrEyeRenderDesc eyeRenderDesc[2];
+    ovrGLTexture eyeTextures[2];
+    union ovrGLConfig glcfg;
+    unsigned int distortCaps;
+    unsigned int hmdCaps;
+
+    bool fullscreen;
+    int prevX;
+    int prevY;
+};
+
+#endif
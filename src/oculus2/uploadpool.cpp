@@ -0,0 +1,124 @@
+#include "uploadpool.hpp"
+
+#include <cstdio>
+
+#include "../contracts.h"
+
+// Buffers start on page boundaries, which keeps every row the GPU reads
+// suitably aligned.
+static const size_t BUFFER_ALIGNMENT = 4096;
+
+// Heap fallbacks carry a header like MatPool's, padded to a cache line.
+static const size_t HEADER_BYTES = 64;
+
+static const GLbitfield MAP_FLAGS =
+  GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+MappedUploadPool::MappedUploadPool(int numBuffers)
+  : numBuffers(numBuffers), buffer(0), mapped(NULL), bufferBytes(0),
+    refcounts(numBuffers, 0) {
+  REQUIRES(numBuffers > 0);
+}
+
+MappedUploadPool::~MappedUploadPool() {
+  if (!buffer)
+    return;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(1, &buffer);
+}
+
+bool MappedUploadPool::isSupported() {
+  return GLEW_ARB_buffer_storage;
+}
+
+bool MappedUploadPool::reserve(size_t bytes) {
+  REQUIRES(!isReserved());
+  size_t alignedBytes = (bytes + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+  size_t totalBytes = alignedBytes * numBuffers;
+
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  glBufferStorage(GL_PIXEL_UNPACK_BUFFER, totalBytes, NULL, MAP_FLAGS);
+  uchar* data = (uchar*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, totalBytes, MAP_FLAGS);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (!data) {
+    fprintf(stderr, "failed to map %.1f MB of upload buffers\n", totalBytes / (1024.0 * 1024.0));
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  mapped = data;
+  bufferBytes = alignedBytes;
+  for (int i = numBuffers - 1; i >= 0; i--)
+    freeBuffers.push_back(i);
+  printf("mapped %d upload buffers of %.1f MB\n", numBuffers, alignedBytes / (1024.0 * 1024.0));
+  return true;
+}
+
+bool MappedUploadPool::isReserved() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return mapped != NULL;
+}
+
+bool MappedUploadPool::isMapped(const uchar* data) const {
+  return mapped && data >= mapped && data < mapped + bufferBytes * numBuffers;
+}
+
+bool MappedUploadPool::getOffset(const cv::Mat& image, size_t& offset) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (image.empty() || !isMapped(image.data))
+    return false;
+  offset = image.data - mapped;
+  return true;
+}
+
+uchar* MappedUploadPool::take(size_t bytes) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (mapped && bytes <= bufferBytes && !freeBuffers.empty()) {
+      int index = freeBuffers.back();
+      freeBuffers.pop_back();
+      refcounts[index] = 1;
+      stats.hits++;
+      return mapped + index * bufferBytes;
+    }
+    stats.misses++;
+  }
+
+  uchar* block = (uchar*) cv::fastMalloc(bytes + HEADER_BYTES);
+  *(int*) block = 1;
+  return block + HEADER_BYTES;
+}
+
+void MappedUploadPool::give(uchar* data) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (isMapped(data)) {
+      freeBuffers.push_back((int) ((data - mapped) / bufferBytes));
+      return;
+    }
+  }
+  cv::fastFree(data - HEADER_BYTES);
+}
+
+int* MappedUploadPool::getRefcount(uchar* data) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (isMapped(data))
+    return &refcounts[(data - mapped) / bufferBytes];
+  return (int*) (data - HEADER_BYTES);
+}
+
+UploadPoolStats MappedUploadPool::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+void MappedUploadPool::printStats(const char* name) const {
+  UploadPoolStats s = getStats();
+  printf("%s: %ld frames extracted into mapped memory, %ld into the heap\n",
+      name, s.hits, s.misses);
+}
@@ -0,0 +1,74 @@
+#ifndef OCULUS2_UPLOADPOOL_H_
+#define OCULUS2_UPLOADPOOL_H_
+
+#include <mutex>
+#include <vector>
+
+#include <GL/glew.h>
+#include <opencv2/core/core.hpp>
+
+#include "../util/poolallocator.hpp"
+
+struct UploadPoolStats {
+  // Allocations served from mapped memory / from the heap because the pool
+  // wasn't reserved yet, was full, or its buffers were too small.
+  long hits = 0;
+  long misses = 0;
+};
+
+// cv::MatAllocator whose buffers live in one persistently and coherently
+// mapped pixel unpack buffer (GL_ARB_buffer_storage). A Mat allocated from
+// it can be filled on any thread and then uploaded to a texture straight
+// from the buffer, with no copy on the display thread.
+//
+// The GL buffer only exists once reserve() has been called with the frame
+// size, on the thread owning the GL context; allocations before that, and
+// any the pool can't serve, come from the heap. A mapped buffer is reused
+// as soon as its last Mat is released, so whoever uploads from it must hold
+// on to the Mat until the upload has finished.
+//
+// Like MatPool, the pool must outlive every Mat allocated from it. It must
+// be destroyed on the GL thread, before the context.
+class MappedUploadPool : public PoolAllocator {
+  public:
+    explicit MappedUploadPool(int numBuffers);
+    ~MappedUploadPool();
+
+    // True if the current GL context supports persistent mappings.
+    static bool isSupported();
+
+    // Maps numBuffers buffers of at least bufferBytes each. GL thread only.
+    bool reserve(size_t bufferBytes);
+    bool isReserved() const;
+
+    // If image's pixels are in the mapped buffer, sets offset to their
+    // offset into getBuffer().
+    bool getOffset(const cv::Mat& image, size_t& offset) const;
+    GLuint getBuffer() const {
+      return buffer;
+    }
+
+    UploadPoolStats getStats() const;
+    void printStats(const char* name) const;
+
+  protected:
+    uchar* take(size_t bytes) const;
+    void give(uchar* data) const;
+    int* getRefcount(uchar* data) const;
+
+  private:
+    bool isMapped(const uchar* data) const;
+
+    const int numBuffers;
+    GLuint buffer;
+    uchar* mapped;
+    size_t bufferBytes;
+
+    mutable std::mutex mutex;
+    mutable std::vector<int> freeBuffers;
+    // OpenCV 2.x keeps the Mat refcount in allocator-owned memory.
+    mutable std::vector<int> refcounts;
+    mutable UploadPoolStats stats;
+};
+
+#endif
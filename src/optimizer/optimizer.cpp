@@ -1,6 +1,8 @@
 #include "optimizer.hpp"
 
+#include <cstring>
 #include <iostream>
+#include <string>
 
 using std::vector;
 
@@ -10,31 +12,135 @@ using cv::Size;
 
 int BLUR_FACTOR = BLUR_NORMAL;
 
-FrameData::FrameData(const cv::Mat& image, double timestamp, double optimizeTime) {
+FrameData::FrameData() {
+  this->sequence = -1;
+  this->id = -1;
+  this->timestamp = 0;
+  this->optimizeTime = 0;
+  this->hAngle = 0;
+  this->vAngle = 0;
+}
+
+FrameData::FrameData(const cv::Mat& image, long sequence, double timestamp, double optimizeTime) {
   this->image = image;
+  this->sequence = sequence;
   this->timestamp = timestamp;
   this->optimizeTime = optimizeTime;
+  this->id = -1;
+  this->hAngle = 0;
+  this->vAngle = 0;
+}
+
+bool FrameData::empty() const {
+  return image.empty() && optimized.empty();
+}
+
+OptimizedImage::OptimizedImage() {
+  this->focusRow = 0;
+  this->focusCol = 0;
+  this->leftBuffer = 0;
+}
+
+// CropWindow
+
+int CropWindow::rows() const {
+  return left.rows;
+}
+
+int CropWindow::cols() const {
+  return left.cols + right.cols;
+}
+
+Size CropWindow::size() const {
+  return Size(cols(), rows());
+}
+
+bool CropWindow::wraps() const {
+  return !right.empty();
+}
+
+bool CropWindow::empty() const {
+  return left.empty();
+}
+
+int CropWindow::type() const {
+  return left.type();
+}
+
+CropWindow CropWindow::rowRange(int begin, int end) const {
+  REQUIRES(0 <= begin && begin <= end && end <= rows());
+  CropWindow window;
+  window.left = Mat(left, Range(begin, end));
+  if (wraps())
+    window.right = Mat(right, Range(begin, end));
+  return window;
 }
 
-OptimizedImage::OptimizedImage(const cv::Mat& focusedTop,
+Mat CropWindow::colRange(int begin, int end) const {
+  REQUIRES(0 <= begin && begin <= end && end <= cols());
+  const int split = left.cols;
+  if (end <= split)
+    return Mat(left, Range::all(), Range(begin, end));
+  if (begin >= split)
+    return Mat(right, Range::all(), Range(begin - split, end - split));
+
+  Mat joined;
+  ImageUtil::hconcat2(Mat(left, Range::all(), Range(begin, split)),
+      Mat(right, Range::all(), Range(0, end - split)), joined);
+  return joined;
+}
+
+void CropWindow::resizeInto(Mat& dst, Size size, cv::MatAllocator* allocator) const {
+  REQUIRES(!empty());
+  dst.allocator = allocator;
+  if (!wraps()) {
+    cv::resize(left, dst, size);
+    return;
+  }
+
+  dst.create(size, type());
+  int leftCols = cvRound((double) size.width * left.cols / cols());
+  leftCols = std::max(0, std::min(leftCols, size.width));
+  if (leftCols > 0) {
+    Mat part(dst, Range::all(), Range(0, leftCols));
+    cv::resize(left, part, part.size());
+  }
+  if (leftCols < size.width) {
+    Mat part(dst, Range::all(), Range(leftCols, size.width));
+    cv::resize(right, part, part.size());
+  }
+}
+
+// OptimizedImage
+
+OptimizedImage::OptimizedImage(const CropWindow& cropped,
+    const cv::Mat& focusedTop,
     const cv::Mat& focusedBot,
     const cv::Mat& blurred,
     int focusRow, int focusCol,
-    Size croppedSize, Size fullSize, int leftBuffer) {
+    Size fullSize, int leftBuffer) {
+  this->cropped = cropped;
   this->focusedTop = Mat(focusedTop);
   this->focusedBot = Mat(focusedBot);
   this->blurred = Mat(blurred);
   this->focusRow = focusRow;
   this->focusCol = focusCol;
-  this->croppedSize = croppedSize;
+  this->croppedSize = cropped.size();
   this->fullSize = fullSize;
   this->leftBuffer = leftBuffer;
 }
 
 size_t OptimizedImage::size() const {
-  return ImageUtil::imageSize(focusedTop) +
+  size_t bytes = ImageUtil::imageSize(focusedTop) +
     ImageUtil::imageSize(focusedBot) +
     ImageUtil::imageSize(blurred);
+  if (isI420())
+    bytes += chroma[0]->size() + chroma[1]->size();
+  return bytes;
+}
+
+bool OptimizedImage::empty() const {
+  return blurred.empty();
 }
 
 static inline int constrainAngle(int x) {
@@ -49,37 +155,50 @@ static inline int clamp(int x, int lo, int hi) {
   return std::max(lo, std::min(x, hi));
 }
 
-static Mat cropHorizontallyWrapped(const Mat& image, const int leftCol, const int rightCol) {
+static CropWindow cropHorizontallyWrapped(const Mat& image, const int leftCol, const int rightCol) {
   REQUIRES(0 <= leftCol && leftCol < image.cols);
   REQUIRES(0 <= rightCol && rightCol < image.cols);
 
-  Mat cropped;
+  CropWindow cropped;
   if (leftCol < rightCol) {
     // Cropped window doesn't wrap around, simple case.
-    cropped = Mat(image, Range::all(), Range(leftCol, rightCol));
+    cropped.left = Mat(image, Range::all(), Range(leftCol, rightCol));
   } else {
     ASSERT(leftCol > rightCol);
-    // Cropped window *does* wrap around. We need to get the part
-    // before and after it wraps, which are in two separate places
-    // on the image.
-    Mat leftMat = Mat(image, Range::all(), Range(leftCol, image.cols));
-    Mat rightMat = Mat(image, Range::all(), Range(0, rightCol));
-    ImageUtil::hconcat2(leftMat, rightMat, cropped);
+    // Cropped window *does* wrap around. Keep the part before and after
+    // the seam as two views rather than joining them.
+    cropped.left = Mat(image, Range::all(), Range(leftCol, image.cols));
+    if (rightCol > 0)
+      cropped.right = Mat(image, Range::all(), Range(0, rightCol));
   }
   return cropped;
 }
 
 OptimizedImage Optimizer::optimizeImage(const Mat& image,
-    int angle, int vAngle) {
+    int angle, int vAngle, cv::MatAllocator* allocator) {
+  TRACE_SPAN("Optimizer::optimizeImage");
+  if (!ImageUtil::isI420(image))
+    return optimizePlane(image, angle, vAngle, allocator);
+
+  Mat planes[3];
+  ImageUtil::i420Planes(image, planes);
+  OptimizedImage luma = optimizePlane(planes[0], angle, vAngle, allocator);
+  for (int i = 0; i < 2; i++) {
+    luma.chroma[i] = std::make_shared<OptimizedImage>(
+        optimizePlane(planes[i + 1], angle, vAngle, allocator));
+  }
+  return luma;
+}
+
+OptimizedImage Optimizer::optimizePlane(const Mat& image,
+    int angle, int vAngle, cv::MatAllocator* allocator) {
   Timer timer;
 
   angle = constrainAngle(angle);
   REQUIRES(H_FOCUS_ANGLE < CROP_ANGLE);
 
   const int width = image.cols;
-  const int height = image.rows;
   const double angleToWidth = width / 360.0;
-  const double angleToHeight = height / 2.0 / 180.0;
 
   int leftAngle = constrainAngle(angle - CROP_ANGLE / 2);
   int rightAngle = constrainAngle(angle + CROP_ANGLE / 2);
@@ -92,52 +211,95 @@ OptimizedImage Optimizer::optimizeImage(const Mat& image,
   ASSERT(rightCol < width);
 
   timer.start();
-  Mat cropped = cropHorizontallyWrapped(image, leftCol, rightCol);
+  CropWindow cropped = cropHorizontallyWrapped(image, leftCol, rightCol);
   timer.stop("Cropping");
 
   int focusWidth = H_FOCUS_ANGLE * angleToWidth;
+  int focusLeftCol = cropped.cols() / 2 - focusWidth / 2;
 
-  int focusLeftCol = cropped.cols / 2 - focusWidth / 2;
-  int focusRightCol = cropped.cols / 2 + focusWidth / 2;
+  Size smallSize(cropped.cols() / BLUR_FACTOR, cropped.rows() / BLUR_FACTOR);
 
   timer.start();
+  Mat blurred;
+  cropped.resizeInto(blurred, smallSize, allocator);
+  timer.stop("Blurring");
+
+  return foveate(cropped, blurred, focusLeftCol, vAngle, image.size(), leftCol);
+}
+
+OptimizedImage Optimizer::foveate(const CropWindow& cropped, const Mat& blurred,
+    int focusLeftCol, int vAngle, Size fullSize, int leftCol) {
+  Timer timer;
+
+  const int height = fullSize.height;
+  const double angleToWidth = fullSize.width / 360.0;
+  const double angleToHeight = height / 2.0 / 180.0;
+
+  int focusWidth = H_FOCUS_ANGLE * angleToWidth;
+  int focusRightCol = focusLeftCol + 2 * (focusWidth / 2);
+
   ASSERT(0 <= focusLeftCol);
   ASSERT(focusLeftCol <= focusRightCol);
-  ASSERT(focusRightCol < cropped.cols);
-  Mat middle = Mat(cropped, Range::all(), Range(focusLeftCol, focusRightCol));
-  timer.stop("Splitting (H)");
+  ASSERT(focusRightCol < cropped.cols());
 
   int focusHeight = V_FOCUS_ANGLE * angleToHeight;
   int focusMiddleRow = clamp(vAngle * angleToHeight,
-      focusHeight / 2, (image.rows / 2) - focusHeight / 2);
+      focusHeight / 2, (height / 2) - focusHeight / 2);
   int focusTopRow = focusMiddleRow - focusHeight / 2;
   int focusBottomRow = focusMiddleRow + focusHeight / 2;
 
+  // Only a fovea that straddles the seam is copied.
   timer.start();
-  Mat focusedTop(middle,
-      Range(focusTopRow, focusBottomRow));
-  Mat focusedBot(middle,
-      Range(focusTopRow + height / 2, focusBottomRow + height / 2));
-  timer.stop("Splitting (V)");
+  Mat focusedTop = cropped.rowRange(focusTopRow, focusBottomRow)
+    .colRange(focusLeftCol, focusRightCol);
+  Mat focusedBot = cropped.rowRange(focusTopRow + height / 2, focusBottomRow + height / 2)
+    .colRange(focusLeftCol, focusRightCol);
+  timer.stop("Splitting");
 
-  Size smallSize(cropped.cols / BLUR_FACTOR, cropped.rows / BLUR_FACTOR);
+  OptimizedImage optImage(cropped, focusedTop, focusedBot, blurred,
+      focusTopRow, focusLeftCol, fullSize, leftCol);
+  return optImage;
+}
 
-  timer.start();
-  Mat blurred;
-  cv::resize(cropped, blurred, smallSize);
-  timer.stop("Blurring");
+bool Optimizer::refoveateImage(const OptimizedImage& image,
+    int angle, int vAngle, OptimizedImage& result) {
+  TRACE_SPAN("Optimizer::refoveateImage");
+  REQUIRES(!image.empty());
+  angle = constrainAngle(angle);
 
-  OptimizedImage optImage(focusedTop, focusedBot, blurred,
-      focusTopRow, focusLeftCol,
-      cropped.size(), image.size(), leftCol);
-  return optImage;
+  const int width = image.fullSize.width;
+  const double angleToWidth = width / 360.0;
+  int focusWidth = H_FOCUS_ANGLE * angleToWidth;
+
+  // Column of the new gaze direction inside the existing crop window.
+  int centerCol = (int) (angle * angleToWidth) - image.leftBuffer;
+  if (centerCol < 0)
+    centerCol += width;
+
+  int focusLeftCol = centerCol - focusWidth / 2;
+  int focusRightCol = centerCol + focusWidth / 2;
+  if (focusLeftCol < 0 || focusRightCol >= image.cropped.cols())
+    return false;
+
+  result = foveate(image.cropped, image.blurred, focusLeftCol, vAngle,
+      image.fullSize, image.leftBuffer);
+
+  for (int i = 0; i < 2 && image.isI420(); i++) {
+    std::shared_ptr<OptimizedImage> chroma = std::make_shared<OptimizedImage>();
+    if (!refoveateImage(*image.chroma[i], angle, vAngle, *chroma))
+      return false;
+    result.chroma[i] = chroma;
+  }
+  return true;
 }
 
-static Mat uncropWrapped(const Mat& croppedImage, const int fullWidth, const int leftBuffer) {
+static Mat uncropWrapped(const Mat& croppedImage, const int fullWidth, const int leftBuffer,
+    cv::MatAllocator* allocator) {
   int numRows = croppedImage.size().height;
   int origType = croppedImage.type(); // we use the same type everywhere
 
   Mat fullLeft, fullCenter, fullRight;
+  fullLeft.allocator = fullCenter.allocator = fullRight.allocator = allocator;
 
   // Split into 2 cases. In either case, there are 3 images to create
   if (croppedImage.size().width + leftBuffer >= fullWidth) {
@@ -156,20 +318,20 @@ static Mat uncropWrapped(const Mat& croppedImage, const int fullWidth, const int
     int centerCols = fullWidth - fullRight.size().width - fullLeft.size().width;
     ASSERT(centerCols >= 0);
 
-    fullCenter = Mat(numRows, centerCols, origType);
+    fullCenter.create(numRows, centerCols, origType);
     fullCenter.setTo(cv::Scalar(0,0,0));
 
   } else {
     // cropped image fully contained
     // Reconstruct as black_left + cropped + black_right
 
-    fullLeft = Mat(numRows, leftBuffer, origType);
+    fullLeft.create(numRows, leftBuffer, origType);
     fullCenter = croppedImage;
 
     int rightBufferCols = fullWidth - leftBuffer - croppedImage.size().width;
     ASSERT(rightBufferCols >= 0);
 
-    fullRight = Mat(numRows, rightBufferCols, origType);
+    fullRight.create(numRows, rightBufferCols, origType);
 
     fullLeft.setTo(cv::Scalar(0,0,0));
     fullRight.setTo(cv::Scalar(0,0,0));
@@ -177,19 +339,46 @@ static Mat uncropWrapped(const Mat& croppedImage, const int fullWidth, const int
 
 
   Mat fullImage;
+  fullImage.allocator = allocator;
   ImageUtil::hconcat3(fullLeft, fullCenter, fullRight, fullImage);
   return fullImage;
 }
 
 bool FOVEA_DISPLAY = true;
+bool UPLOAD_BGRA = false;
+
+Mat Optimizer::extractImage(const OptimizedImage& optImage,
+    cv::MatAllocator* allocator) {
+  if (optImage.isI420()) {
+    Mat fullImage;
+    fullImage.allocator = allocator;
+    extractInto(optImage, fullImage);
+    return fullImage;
+  }
 
-Mat Optimizer::extractImage(const OptimizedImage& optImage) {
+  TRACE_SPAN("Optimizer::extractImage");
   Timer timer;
 
   Mat croppedImage;
+  croppedImage.allocator = allocator;
 
+  // Each eye on its own, so they don't bleed into each other at the seam.
+  // If the blurred image has an odd number of rows, its middle row belongs
+  // to both eyes and extractInto differs from this in the rows next to it.
   timer.start();
-  cv::resize(optImage.blurred, croppedImage, optImage.croppedSize);
+  const Mat& blurred = optImage.blurred;
+  const Size croppedSize = optImage.croppedSize;
+  if (blurred.rows % 2 == 0 && croppedSize.height % 2 == 0) {
+    croppedImage.create(croppedSize, blurred.type());
+    for (int eye = 0; eye < 2; eye++) {
+      Mat dst = croppedImage.rowRange(eye * croppedSize.height / 2,
+          (eye + 1) * croppedSize.height / 2);
+      cv::resize(blurred.rowRange(eye * blurred.rows / 2, (eye + 1) * blurred.rows / 2),
+          dst, dst.size());
+    }
+  } else {
+    cv::resize(blurred, croppedImage, croppedSize);
+  }
   timer.stop("Expanding");
 
   if (FOVEA_DISPLAY) {
@@ -211,7 +400,8 @@ Mat Optimizer::extractImage(const OptimizedImage& optImage) {
   Mat fullLeft, fullCenter, fullRight;
 
   timer.start();
-  Mat fullImage = uncropWrapped(croppedImage, optImage.fullSize.width, optImage.leftBuffer);
+  Mat fullImage = uncropWrapped(croppedImage, optImage.fullSize.width, optImage.leftBuffer,
+      allocator);
   timer.stop("Full image");
 
   ENSURES(fullImage.size() == optImage.fullSize);
@@ -219,48 +409,412 @@ Mat Optimizer::extractImage(const OptimizedImage& optImage) {
   return fullImage;
 }
 
+// Fixed-point bilinear weights, as in the 8-bit INTER_LINEAR path of
+// cv::resize.
+static const int INTER_BITS = 11;
+static const int INTER_ONE = 1 << INTER_BITS;
+
+struct LinearTap {
+  int ofs0;
+  int ofs1;
+  int alpha;
+};
+
+// Source positions and weights for upscaling srcLen pixels to dstLen.
+// Offsets are in elements of a row with cn channels.
+static void linearTaps(int srcLen, int dstLen, int cn, std::vector<LinearTap>& taps) {
+  taps.resize(dstLen);
+  double scale = (double) srcLen / dstLen;
+  for (int i = 0; i < dstLen; i++) {
+    double f = (i + 0.5) * scale - 0.5;
+    int s0 = (int) std::floor(f);
+    f -= s0;
+    if (s0 < 0) {
+      s0 = 0;
+      f = 0;
+    }
+    int s1 = std::min(s0 + 1, srcLen - 1);
+    if (s0 >= srcLen - 1) {
+      s0 = srcLen - 1;
+      f = 0;
+    }
+    taps[i].ofs0 = s0 * cn;
+    taps[i].ofs1 = s1 * cn;
+    taps[i].alpha = cvRound(f * INTER_ONE);
+  }
+}
+
+// Like linearTaps, but for the rows of a top/bottom stereo image: each half
+// of dst only reads rows from the same half of src, so the eyes don't bleed
+// into each other at the seam. This matches the clamp in oculus2's
+// compositing shader.
+static void stereoLinearTaps(int srcLen, int dstLen, std::vector<LinearTap>& taps) {
+  taps.resize(dstLen);
+  double scale = (double) srcLen / dstLen;
+  double srcHalf = srcLen / 2.0;
+  for (int i = 0; i < dstLen; i++) {
+    bool top = i < dstLen / 2;
+    double f = (i + 0.5) * scale - 0.5;
+    f = std::max(f, top ? 0.0 : srcHalf);
+    f = std::min(f, top ? srcHalf - 1 : srcLen - 1.0);
+    int s0 = (int) std::floor(f);
+    f -= s0;
+    taps[i].ofs0 = s0;
+    taps[i].ofs1 = std::min(s0 + 1, srcLen - 1);
+    taps[i].alpha = cvRound(f * INTER_ONE);
+  }
+}
+
+// Horizontal pass of one blurred row, scaled by INTER_ONE.
+static void interpolateRow(const uchar* src, const std::vector<LinearTap>& taps,
+    int cn, int* out) {
+  const int n = taps.size();
+  for (int x = 0; x < n; x++) {
+    const uchar* s0 = src + taps[x].ofs0;
+    const uchar* s1 = src + taps[x].ofs1;
+    int a = taps[x].alpha;
+    for (int k = 0; k < cn; k++) {
+      *out++ = s0[k] * (INTER_ONE - a) + s1[k] * a;
+    }
+  }
+}
+
+// Vertical pass over elements [begin, end) of two interpolated rows.
+static void blendRows(const int* row0, const int* row1, int beta,
+    int begin, int end, uchar* out) {
+  const int shift = 2 * INTER_BITS;
+  const int round = 1 << (shift - 1);
+  if (beta == 0) {
+    for (int i = begin; i < end; i++)
+      *out++ = (uchar) ((row0[i] * INTER_ONE + round) >> shift);
+  } else {
+    for (int i = begin; i < end; i++)
+      *out++ = (uchar) ((row0[i] * (INTER_ONE - beta) + row1[i] * beta + round) >> shift);
+  }
+}
+
+// Same as blendRows, for 3-channel rows written out as opaque BGRA. begin
+// and end are in pixels.
+static void blendRowsBgra(const int* row0, const int* row1, int beta,
+    int begin, int end, uchar* out) {
+  const int shift = 2 * INTER_BITS;
+  const int round = 1 << (shift - 1);
+  for (int x = begin; x < end; x++) {
+    const int* r0 = row0 + 3 * x;
+    const int* r1 = row1 + 3 * x;
+    for (int k = 0; k < 3; k++)
+      *out++ = (uchar) ((r0[k] * (INTER_ONE - beta) + r1[k] * beta + round) >> shift);
+    *out++ = 255;
+  }
+}
+
+// Fills count pixels of cn channels with black; BGRA black is opaque.
+// Single-channel planes are filled with value, which is not 0 for chroma.
+static void fillBlack(uchar* out, int count, int cn, uchar value) {
+  if (cn == 4) {
+    const uchar black[4] = {0, 0, 0, 255};
+    for (int i = 0; i < count; i++)
+      memcpy(out + 4 * i, black, 4);
+  } else {
+    memset(out, value, count * cn);
+  }
+}
+
+// Chroma value of black (and any gray) in YUV.
+static const uchar NEUTRAL_CHROMA = 128;
+
+void Optimizer::extractInto(const OptimizedImage& optImage, Mat& dst,
+    bool dstCleared, bool bgra) {
+  TRACE_SPAN("Optimizer::extractInto");
+  REQUIRES(!optImage.empty());
+
+  if (!optImage.isI420()) {
+    extractPlane(optImage, dst, dstCleared, bgra, 0);
+    return;
+  }
+
+  bool reused = dst.size() == Size(optImage.fullSize.width, optImage.fullSize.height * 3 / 2) &&
+    dst.type() == CV_8UC1;
+  ImageUtil::createI420(dst, optImage.fullSize);
+  Mat planes[3];
+  ImageUtil::i420Planes(dst, planes);
+  extractPlane(optImage, planes[0], dstCleared && reused, false, 0);
+  for (int i = 0; i < 2; i++) {
+    extractPlane(*optImage.chroma[i], planes[i + 1], dstCleared && reused, false,
+        NEUTRAL_CHROMA);
+  }
+}
+
+void Optimizer::extractPlane(const OptimizedImage& optImage, Mat& dst,
+    bool dstCleared, bool bgra, uchar black) {
+  const Mat& blurred = optImage.blurred;
+  const Size fullSize = optImage.fullSize;
+
+  if (blurred.depth() != CV_8U) {
+    extractImage(optImage).copyTo(dst);
+    return;
+  }
+
+  const int cn = blurred.channels();
+  bgra = bgra && cn == 3;
+  const int outCn = bgra ? 4 : cn;
+  const int type = CV_MAKETYPE(CV_8U, outCn);
+
+  bool reused = dst.rows == fullSize.height && dst.cols == fullSize.width &&
+    dst.type() == type;
+  dst.create(fullSize, type);
+  const bool writeBlack = !(dstCleared && reused);
+
+  const int rows = optImage.croppedSize.height;
+  const int cols = optImage.croppedSize.width;
+  const int fullWidth = fullSize.width;
+  const int leftBuffer = optImage.leftBuffer;
+  ASSERT(rows == fullSize.height);
+  ASSERT(cols <= fullWidth);
+
+  // Crop columns [0, firstCols) land at leftBuffer; the rest wrap around to
+  // column 0. Everything else is black.
+  const int firstCols = std::min(cols, fullWidth - leftBuffer);
+  const int wrappedCols = cols - firstCols;
+  const int blackLeftBegin = wrappedCols;
+  const int blackLeftEnd = leftBuffer;
+  const int blackRightBegin = leftBuffer + firstCols;
+
+  const Mat& top = optImage.focusedTop;
+  const Mat& bot = optImage.focusedBot;
+  const int topRow = optImage.focusRow;
+  const int botRow = optImage.focusRow + rows / 2;
+  const int focusCol = optImage.focusCol;
+  const int focusCols = top.cols;
+
+  // Scratch space is kept per thread so steady-state calls don't allocate.
+  static thread_local std::vector<LinearTap> xTaps, yTaps;
+  static thread_local std::vector<int> rowBuffers;
+  linearTaps(blurred.cols, cols, cn, xTaps);
+  stereoLinearTaps(blurred.rows, rows, yTaps);
+  const int rowElems = cols * cn;
+  rowBuffers.resize(2 * rowElems);
+  int* row0 = &rowBuffers[0];
+  int* row1 = &rowBuffers[rowElems];
+  int cachedY0 = -1, cachedY1 = -1;
+
+  for (int y = 0; y < rows; y++) {
+    uchar* out = dst.ptr<uchar>(y);
+
+    if (writeBlack) {
+      if (blackLeftEnd > blackLeftBegin)
+        fillBlack(out + blackLeftBegin * outCn, blackLeftEnd - blackLeftBegin, outCn, black);
+      if (fullWidth > blackRightBegin)
+        fillBlack(out + blackRightBegin * outCn, fullWidth - blackRightBegin, outCn, black);
+    }
+
+    const uchar* fovea = NULL;
+    if (FOVEA_DISPLAY) {
+      if (topRow <= y && y < topRow + top.rows)
+        fovea = top.ptr<uchar>(y - topRow);
+      else if (botRow <= y && y < botRow + bot.rows)
+        fovea = bot.ptr<uchar>(y - botRow);
+    }
+
+    const int y0 = yTaps[y].ofs0;
+    const int y1 = yTaps[y].ofs1;
+    if (y0 != cachedY0 || y1 != cachedY1) {
+      if (y0 == cachedY1) {
+        std::swap(row0, row1);
+      } else {
+        interpolateRow(blurred.ptr<uchar>(y0), xTaps, cn, row0);
+      }
+      if (y1 != y0)
+        interpolateRow(blurred.ptr<uchar>(y1), xTaps, cn, row1);
+      cachedY0 = y0;
+      cachedY1 = y1;
+    }
+    const int beta = yTaps[y].alpha;
+
+    // Writes crop columns [begin, end), splitting at the wrap-around point.
+    auto place = [&](int begin, int end) {
+      while (begin < end) {
+        int stop = begin < firstCols ? std::min(end, firstCols) : end;
+        int outCol = begin < firstCols ? leftBuffer + begin : begin - firstCols;
+        uchar* o = out + outCol * outCn;
+        bool inFovea = fovea && begin >= focusCol && stop <= focusCol + focusCols;
+        if (inFovea && bgra)
+          ImageUtil::expandBgrToBgra(fovea + (begin - focusCol) * cn, o, stop - begin);
+        else if (inFovea)
+          memcpy(o, fovea + (begin - focusCol) * cn, (stop - begin) * cn);
+        else if (bgra)
+          blendRowsBgra(row0, row1, beta, begin, stop, o);
+        else
+          blendRows(row0, row1, beta, begin * cn, stop * cn, o);
+        begin = stop;
+      }
+    };
+
+    if (fovea) {
+      place(0, focusCol);
+      place(focusCol, focusCol + focusCols);
+      place(focusCol + focusCols, cols);
+    } else {
+      place(0, cols);
+    }
+  }
+}
+
 cv::Mat Optimizer::processImage(const cv::Mat& input,
-        int angle, int vAngle) {
-  OptimizedImage opt = optimizeImage(input, angle, vAngle);
-  return extractImage(opt);
+        int angle, int vAngle, cv::MatAllocator* allocator) {
+  OptimizedImage opt = optimizeImage(input, angle, vAngle, allocator);
+  Mat fullImage;
+  fullImage.allocator = allocator;
+  extractInto(opt, fullImage);
+  return fullImage;
 }
 
 // OptimizerPipeline
 
-OptimizerPipeline::OptimizerPipeline(VideoReader* vr) {
-  pthread_cond_init(&queueCond, NULL);
-  pthread_mutex_init(&queueLock, NULL);
+OptimizerPipeline::OptimizerPipeline(VideoReader* vr, cv::MatAllocator* allocator,
+    int numWorkers, PipelineMode mode, cv::MatAllocator* outputAllocator)
+  : mode(mode), frameQueue(OPTIMIZER_QUEUE_SIZE), allocator(allocator),
+    outputAllocator(outputAllocator ? outputAllocator : allocator), numWorkers(numWorkers),
+    activeWorkers(numWorkers), stopping(false), fullyBuffered(false),
+    refoveateThreshold(REFOVEATE_THRESHOLD_DEGREES), workerStats(numWorkers) {
+  REQUIRES(numWorkers > 0);
+  startTime = Timer::timeInSeconds();
 
-  bufferThread = std::thread(&OptimizerPipeline::bufferFrames, this, vr);
-  bufferThread.detach();
+  for (int i = 0; i < numWorkers; i++) {
+    workers.push_back(std::thread(&OptimizerPipeline::bufferFrames, this, vr, i));
+  }
+  refoveateThread = std::thread(&OptimizerPipeline::refoveateFrames, this);
+}
 
-//  bufferThread2 = std::thread(&OptimizerPipeline::bufferFrames, this, vr);
-//  bufferThread2.detach();
+OptimizerPipeline::~OptimizerPipeline() {
+  // Closing the output queue unblocks a worker stuck in push(); the flag
+  // releases any worker waiting in the reorder buffer.
+  frameQueue.close();
+  {
+    std::lock_guard<std::mutex> lock(reorderMutex);
+    stopping = true;
+    reorderCond.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(latestMutex);
+    latestCond.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(refoveateMutex);
+    refoveateCond.notify_all();
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  refoveateThread.join();
 }
 
 int OptimizerPipeline::getNumFramesAvailable() {
+  if (mode == PIPELINE_LATEST_POSE) {
+    std::lock_guard<std::mutex> lock(latestMutex);
+    return latestValid ? 1 : 0;
+  }
   return frameQueue.size();
 }
 
+// Returns a FrameData with an empty image once the video has ended.
 FrameData OptimizerPipeline::getFrame() {
-  FrameData frame = frameQueue.dequeue();
-  pthread_cond_signal(&queueCond);
+  FrameData frame;
+  if (mode == PIPELINE_LATEST_POSE) {
+    std::unique_lock<std::mutex> lock(latestMutex);
+    while (!latestValid && !latestClosed && !stopping) {
+      latestCond.wait(lock);
+    }
+    if (latestValid) {
+      frame = latestFrame;
+      latestFrame = FrameData();
+      latestValid = false;
+      latestInFlight--;
+      latestCond.notify_all();
+    }
+  } else {
+    frameQueue.pop(frame);
+  }
+
+  if (!frame.empty()) {
+    frame.times.mark(FRAME_DEQUEUED);
+    setShownFrame(frame);
+  }
   return frame;
 }
 
-void OptimizerPipeline::bufferFrames(VideoReader* vr) {
-  while (true) {
-    if (frameQueue.size() > OPTIMIZER_QUEUE_SIZE) {
-      pthread_mutex_lock(&queueLock);
-      pthread_cond_wait(&queueCond, &queueLock);
-      pthread_mutex_unlock(&queueLock);
+ChannelStats OptimizerPipeline::getQueueStats() {
+  return frameQueue.getStats();
+}
+
+std::vector<OptimizerWorkerStats> OptimizerPipeline::getWorkerStats() {
+  std::lock_guard<std::mutex> lock(statsMutex);
+  return workerStats;
+}
+
+double OptimizerPipeline::getRunningSeconds() {
+  return Timer::timeInSeconds() - startTime;
+}
+
+long OptimizerPipeline::getDroppedFrames() {
+  std::lock_guard<std::mutex> lock(latestMutex);
+  return droppedFrames;
+}
+
+PipelineMode OptimizerPipeline::getMode() const {
+  return mode;
+}
+
+long OptimizerPipeline::getRefoveatedFrames() {
+  std::lock_guard<std::mutex> lock(refoveateMutex);
+  return refoveatedFrames;
+}
+
+long OptimizerPipeline::getRefoveateFallbacks() {
+  std::lock_guard<std::mutex> lock(refoveateMutex);
+  return refoveateFallbacks;
+}
+
+void OptimizerPipeline::setRefoveateThreshold(int degrees) {
+  refoveateThreshold = degrees;
+  if (degrees < 0) {
+    std::lock_guard<std::mutex> lock(refoveateMutex);
+    lastSequence = -1;
+    lastSource.release();
+    lastOptimized = OptimizedImage();
+    shownSource.release();
+    shownOptimized = OptimizedImage();
+  }
+}
+
+bool OptimizerPipeline::isFinished() {
+  return fullyBuffered && getNumFramesAvailable() == 0;
+}
+
+void OptimizerPipeline::bufferFrames(VideoReader* vr, int worker) {
+  Trace::setThreadName("Optimizer worker " + std::to_string(worker));
+  while (!stopping) {
+    TRACE_SPAN("OptimizerPipeline::bufferFrames");
+    double waitStart = Timer::timeInSeconds();
+    if (mode == PIPELINE_LATEST_POSE && !reserveLatest())
+      break;
+    VideoFrame videoFrame;
+    bool gotFrame;
+    {
+      TRACE_SPAN("wait for decoded frame");
+      gotFrame = vr->getFrame(videoFrame);
     }
-    cv::Mat frame = vr->getFrame();
 
     // important to check isDone before changing frame, or it'll be different!
-    if (frame.empty()) {
-      fullyBuffered = true;
-      return;
+    if (!gotFrame || stopping) {
+      if (mode == PIPELINE_LATEST_POSE) {
+        std::lock_guard<std::mutex> lock(latestMutex);
+        if (!gotFrame)
+          latestInputDone = true;
+        latestInFlight--;
+        latestCond.notify_all();
+      }
+      break;
     }
 
     hmdDataMutex.lock();
@@ -270,21 +824,263 @@ void OptimizerPipeline::bufferFrames(VideoReader* vr) {
     hmdDataMutex.unlock();
 
     double optimizeStart = Timer::timeInSeconds();
-    frame = Optimizer::processImage(frame, hAngleCached, vAngleCached);
+    videoFrame.times.mark(FRAME_OPTIMIZE_START);
+    OptimizedImage optimized = Optimizer::optimizeImage(videoFrame.image,
+        hAngleCached, vAngleCached, allocator);
+    cv::Mat frame;
+    if (!GPU_FOVEA_COMPOSITING) {
+      frame.allocator = outputAllocator;
+      Optimizer::extractInto(optimized, frame, false, UPLOAD_BGRA);
+    }
+    double optimizeEnd = Timer::timeInSeconds();
+    videoFrame.times.mark(FRAME_OPTIMIZE_END);
 
-    FrameData fd(frame, lastUpdatedCached, Timer::timeInSeconds() - optimizeStart);
+    FrameData fd(frame, videoFrame.sequence, lastUpdatedCached,
+        optimizeEnd - optimizeStart);
+    fd.id = videoFrame.id;
+    fd.times = videoFrame.times;
+    fd.hAngle = hAngleCached;
+    fd.vAngle = vAngleCached;
+    if (GPU_FOVEA_COMPOSITING)
+      fd.optimized = optimized;
+    if (refoveateThreshold >= 0) {
+      std::lock_guard<std::mutex> lock(refoveateMutex);
+      if (videoFrame.sequence > lastSequence) {
+        lastSequence = videoFrame.sequence;
+        lastSource = videoFrame.image;
+        lastOptimized = optimized;
+      }
+    }
+    bool emitted;
+    {
+      TRACE_SPAN("emit frame");
+      emitted = mode == PIPELINE_LATEST_POSE ? publishLatest(fd) : emitInOrder(fd);
+    }
+
+    statsMutex.lock();
+    OptimizerWorkerStats& stats = workerStats[worker];
+    stats.frames++;
+    stats.busySeconds += optimizeEnd - optimizeStart;
+    stats.optimizeSeconds.record(optimizeEnd - optimizeStart);
+    stats.inputWaitSeconds += optimizeStart - waitStart;
+    stats.outputWaitSeconds += Timer::timeInSeconds() - optimizeEnd;
+    statsMutex.unlock();
 
-    frameQueue.enqueue(fd);
-    frameAvailable = true;
+    if (!emitted)
+      break;
   }
+
+  // Every frame a worker took has been emitted by the time it gets here, so
+  // once the last worker leaves the reorder buffer is empty.
+  if (--activeWorkers == 0)
+    finish();
 }
 
-bool OptimizerPipeline::isFrameAvailable() {
-  if (!frameAvailable) return false;
-  if (frameQueue.size() > 0)
+void OptimizerPipeline::finish() {
+  fullyBuffered = true;
+  frameQueue.close();
+
+  std::lock_guard<std::mutex> lock(latestMutex);
+  latestClosed = true;
+  latestCond.notify_all();
+}
+
+// Hands a finished frame to the reorder buffer and pushes every frame that is
+// now in sequence to the output queue. Pushes happen under reorderMutex, so
+// the output queue still only ever sees one producer at a time.
+bool OptimizerPipeline::emitInOrder(const FrameData& frame) {
+  std::unique_lock<std::mutex> lock(reorderMutex);
+
+  // Don't let workers run arbitrarily far ahead of a slow frame; the worker
+  // holding nextSequence is never blocked here, so this can't deadlock.
+  while (frame.sequence >= nextSequence + numWorkers && !stopping) {
+    reorderCond.wait(lock);
+  }
+  if (stopping)
+    return false;
+
+  ASSERT(frame.sequence >= nextSequence);
+  pending[frame.sequence] = frame;
+
+  bool pushed = true;
+  while (pushed && !pending.empty() && pending.begin()->first == nextSequence) {
+    // Blocks while the queue is full, which is our backpressure.
+    pushed = frameQueue.push(pending.begin()->second);
+    pending.erase(pending.begin());
+    nextSequence++;
+  }
+
+  reorderCond.notify_all();
+  return pushed;
+}
+
+// Latest-pose mode: waits until no frame is in flight beyond the one on
+// screen, then claims the slot. Returns false once stopping or at the end of
+// the video.
+bool OptimizerPipeline::reserveLatest() {
+  std::unique_lock<std::mutex> lock(latestMutex);
+  while (latestInFlight > 0 && !latestInputDone && !stopping) {
+    latestCond.wait(lock);
+  }
+  if (latestInputDone || stopping)
+    return false;
+  latestInFlight++;
+  return true;
+}
+
+// Latest-pose mode: hands a finished frame to getFrame(). Workers never block
+// here; the slot they hold is released when the frame is taken or dropped.
+bool OptimizerPipeline::publishLatest(const FrameData& frame) {
+  std::lock_guard<std::mutex> lock(latestMutex);
+  if (stopping)
+    return false;
+
+  if (frame.sequence < latestSequence) {
+    // Another worker already published a newer frame.
+    droppedFrames++;
+    latestInFlight--;
+    latestCond.notify_all();
     return true;
-  else {
-    frameAvailable = false;
+  }
+  if (latestValid) {
+    droppedFrames++;
+    latestInFlight--;
+    latestCond.notify_all();
+  }
+
+  latestFrame = frame;
+  latestValid = true;
+  latestSequence = frame.sequence;
+  // Workers waiting in reserveLatest() share latestCond with getFrame().
+  latestCond.notify_all();
+  return true;
+}
+
+static inline int angleDistance(int a, int b) {
+  int d = std::abs(a - b) % 360;
+  return std::min(d, 360 - d);
+}
+
+void OptimizerPipeline::updateOrientation(int hAngle, int vAngle, double timestamp) {
+  hmdDataMutex.lock();
+  this->lastUpdated = timestamp;
+  this->hAngle = hAngle;
+  this->vAngle = vAngle;
+  hmdDataMutex.unlock();
+
+  int threshold = refoveateThreshold;
+  if (threshold < 0)
+    return;
+
+  std::lock_guard<std::mutex> lock(refoveateMutex);
+  if (shownOptimized.empty())
+    return;
+  if (angleDistance(hAngle, targetHAngle) <= threshold &&
+      std::abs(vAngle - targetVAngle) <= threshold)
+    return;
+
+  targetHAngle = hAngle;
+  targetVAngle = vAngle;
+  refoveateRequested = true;
+  refoveateCond.notify_one();
+}
+
+bool OptimizerPipeline::getRefoveatedFrame(FrameData& frame) {
+  std::lock_guard<std::mutex> lock(refoveateMutex);
+  if (!refoveatedValid)
     return false;
+
+  frame = refoveatedFrame;
+  refoveatedFrame = FrameData();
+  refoveatedValid = false;
+  shownFrame = frame;
+  return true;
+}
+
+// A new video frame went on screen; anything re-foveated from the previous
+// one is obsolete. The frame can be re-foveated later only if no newer frame
+// has been optimized yet.
+void OptimizerPipeline::setShownFrame(const FrameData& frame) {
+  std::lock_guard<std::mutex> lock(refoveateMutex);
+  shownFrame = frame;
+  if (frame.sequence == lastSequence) {
+    shownSource = lastSource;
+    shownOptimized = lastOptimized;
+    lastSource.release();
+    lastOptimized = OptimizedImage();
+  } else {
+    shownSource.release();
+    shownOptimized = OptimizedImage();
   }
+  targetHAngle = frame.hAngle;
+  targetVAngle = frame.vAngle;
+  refoveatedFrame = FrameData();
+  refoveatedValid = false;
+  refoveateRequested = false;
+}
+
+// Moves the fovea of the frame on screen to the latest pose. Normally only
+// the focused crops are redone, reusing the blurred periphery; if the head
+// turned so far that the fovea left the crop window, the decoded frame is
+// optimized again from scratch.
+void OptimizerPipeline::refoveateFrames() {
+  Trace::setThreadName("Refoveate");
+  std::unique_lock<std::mutex> lock(refoveateMutex);
+  while (true) {
+    while (!refoveateRequested && !stopping) {
+      refoveateCond.wait(lock);
+    }
+    if (stopping)
+      return;
+
+    refoveateRequested = false;
+    FrameData base = shownFrame;
+    if (shownOptimized.empty())
+      continue;
+    cv::Mat source = shownSource;
+    OptimizedImage baseOptimized = shownOptimized;
+    lock.unlock();
+
+    hmdDataMutex.lock();
+    int hAngleCached = hAngle;
+    int vAngleCached = vAngle;
+    double lastUpdatedCached = lastUpdated;
+    hmdDataMutex.unlock();
+
+    double start = Timer::timeInSeconds();
+    OptimizedImage optimized;
+    bool fallback = !Optimizer::refoveateImage(baseOptimized,
+        hAngleCached, vAngleCached, optimized);
+    if (fallback) {
+      optimized = Optimizer::optimizeImage(source,
+          hAngleCached, vAngleCached, allocator);
+    }
+    cv::Mat image;
+    if (!GPU_FOVEA_COMPOSITING) {
+      image.allocator = outputAllocator;
+      Optimizer::extractInto(optimized, image, false, UPLOAD_BGRA);
+    }
+
+    FrameData fd(image, base.sequence, lastUpdatedCached,
+        Timer::timeInSeconds() - start);
+    fd.hAngle = hAngleCached;
+    fd.vAngle = vAngleCached;
+    if (GPU_FOVEA_COMPOSITING)
+      fd.optimized = optimized;
+    fd.id = base.id;
+    fd.times = base.times;
+
+    lock.lock();
+    if (shownFrame.sequence == base.sequence) {
+      refoveatedFrame = fd;
+      refoveatedValid = true;
+      refoveatedFrames++;
+      if (fallback)
+        refoveateFallbacks++;
+    }
+  }
+}
+
+bool OptimizerPipeline::isFrameAvailable() {
+  return getNumFramesAvailable() > 0;
 }
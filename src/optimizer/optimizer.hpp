@@ -1,6 +1,10 @@
 #ifndef OPTIMIZER_OPTIMIZER_H_
 #define OPTIMIZER_OPTIMIZER_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
@@ -10,34 +14,80 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include "../util/histogram.hpp"
 #include "../util/imageutil.hpp"
 #include "../util/timer.hpp"
 #include "../contracts.h"
 #include "../settings.hpp"
 #include "../videoreader/videoreader.hpp"
 
-class FrameData {
+// A horizontal window into an equirect frame that may wrap around the
+// 0/360 degree seam: the columns of left followed by those of right, which is
+// empty unless the window wraps. Both are views into the frame.
+class CropWindow {
   public:
-    FrameData(const cv::Mat& image, double timestamp, double optimizeTime);
+    int rows() const;
+    int cols() const;
+    cv::Size size() const;
+    bool wraps() const;
+    bool empty() const;
+    int type() const;
 
-    cv::Mat image;
-    double timestamp;
-    double optimizeTime;
+    // Rows [begin, end) of the window, as views.
+    CropWindow rowRange(int begin, int end) const;
+    // Columns [begin, end) of the window. A view unless the range crosses
+    // the seam, in which case the two pieces are copied side by side.
+    cv::Mat colRange(int begin, int end) const;
+    // Scales the whole window into dst, which is allocated with allocator.
+    // A wrapped window is resized part by part into matching column ranges
+    // of dst, so it is never joined first.
+    void resizeInto(cv::Mat& dst, cv::Size size,
+        cv::MatAllocator* allocator = NULL) const;
+
+    cv::Mat left;
+    cv::Mat right;
 };
 
 class OptimizedImage {
   friend class Optimizer;
 
   public:
+    OptimizedImage();
     size_t size() const;
+    bool empty() const;
+
+    // Layout, for consumers that composite the image themselves (e.g. on
+    // the GPU) instead of calling Optimizer::extractImage. focusRow and
+    // focusCol locate focusedTop in the top half of the crop window, and
+    // focusedBot at the same place in the bottom half. The crop window
+    // starts leftBuffer columns into the full image and may wrap around.
+    const cv::Mat& getFocusedTop() const { return focusedTop; }
+    const cv::Mat& getFocusedBot() const { return focusedBot; }
+    const cv::Mat& getBlurred() const { return blurred; }
+    int getFocusRow() const { return focusRow; }
+    int getFocusCol() const { return focusCol; }
+    cv::Size getCroppedSize() const { return croppedSize; }
+    cv::Size getFullSize() const { return fullSize; }
+    int getLeftBuffer() const { return leftBuffer; }
+
+    // An optimized I420 frame is its Y plane, with the U and V planes
+    // optimized the same way at half resolution. Their layouts match the Y
+    // plane's to within a pixel of rounding.
+    bool isI420() const { return chroma[0] != NULL; }
+    const OptimizedImage& getChroma(int plane) const { return *chroma[plane]; }
 
   private:
-    OptimizedImage(const cv::Mat& focusedTop,
+    OptimizedImage(const CropWindow& cropped,
+        const cv::Mat& focusedTop,
         const cv::Mat& focusedBot,
         const cv::Mat& blurred,
         int focusRow, int focusCol,
-        cv::Size croppedSize, cv::Size fullSize, int leftBuffer);
+        cv::Size fullSize, int leftBuffer);
 
+    // Full-resolution crop window; focusedTop and focusedBot are views into
+    // it unless they straddle the seam. Kept so the fovea can be moved
+    // without the source frame.
+    CropWindow cropped;
     cv::Mat focusedTop;
     cv::Mat focusedBot;
     cv::Mat blurred;
@@ -46,20 +96,103 @@ class OptimizedImage {
     cv::Size croppedSize;
     cv::Size fullSize;
     int leftBuffer;
+    std::shared_ptr<const OptimizedImage> chroma[2];
 };
 
+class FrameData {
+  public:
+    FrameData();
+    FrameData(const cv::Mat& image, long sequence, double timestamp, double optimizeTime);
+    // True for the end-of-video marker. With GPU_FOVEA_COMPOSITING frames
+    // carry only the OptimizedImage and image is empty.
+    bool empty() const;
+
+    cv::Mat image;
+    long sequence;
+    double timestamp;
+    double optimizeTime;
+    // Carried over from the VideoFrame; the pipeline and the display add
+    // the later stages.
+    long id;
+    FrameTimes times;
+
+    // Pose the frame was foveated for. optimized is only kept with
+    // GPU_FOVEA_COMPOSITING, where it replaces image.
+    int hAngle;
+    int vAngle;
+    OptimizedImage optimized;
+};
+
+// Every function takes an optional allocator (e.g. a MatPool) used for the
+// intermediate and output buffers it creates. Images may be BGR or I420 (see
+// ImageUtil::isI420); I420 images come out of extraction as I420.
 class Optimizer {
   public:
     static OptimizedImage optimizeImage(const cv::Mat& image,
-        int angle, int vAngle);
-    static cv::Mat extractImage(const OptimizedImage& image);
+        int angle, int vAngle, cv::MatAllocator* allocator = NULL);
+    // Moves the fovea of an already optimized image to a new pose, reusing
+    // its crop window and blurred periphery. Returns false if the new focus
+    // doesn't fit in the crop window; the caller must re-optimize then.
+    static bool refoveateImage(const OptimizedImage& image,
+        int angle, int vAngle, OptimizedImage& result);
+    static cv::Mat extractImage(const OptimizedImage& image,
+        cv::MatAllocator* allocator = NULL);
+    // Same image as extractImage, but upscaled, foveated and placed in a
+    // single row-by-row pass straight into dst, which is only (re)allocated
+    // if its size or type is wrong. If dstCleared is set and dst already had
+    // the right size, the black area outside the crop window is assumed to be
+    // left from a previous call and isn't written. If bgra is set and the
+    // image is 8-bit BGR, dst is widened to opaque BGRA in the same pass.
+    static void extractInto(const OptimizedImage& image, cv::Mat& dst,
+        bool dstCleared = false, bool bgra = false);
     static cv::Mat processImage(const cv::Mat& image,
-        int angle, int vAngle);
+        int angle, int vAngle, cv::MatAllocator* allocator = NULL);
+
+  private:
+    // optimizeImage for a single BGR image or plane.
+    static OptimizedImage optimizePlane(const cv::Mat& image,
+        int angle, int vAngle, cv::MatAllocator* allocator);
+    // extractInto for a single BGR image or plane; the area outside the crop
+    // window is filled with black, or with this value in a one-channel plane.
+    static void extractPlane(const OptimizedImage& image, cv::Mat& dst,
+        bool dstCleared, bool bgra, uchar black);
+    static OptimizedImage foveate(const CropWindow& cropped, const cv::Mat& blurred,
+        int focusLeftCol, int vAngle, cv::Size fullSize, int leftCol);
 };
 
+struct OptimizerWorkerStats {
+  long frames = 0;
+  // Time spent optimizing, waiting for the VideoReader, and waiting for
+  // earlier frames / space in the output queue.
+  double busySeconds = 0;
+  double inputWaitSeconds = 0;
+  double outputWaitSeconds = 0;
+  // Time to optimize each frame, in seconds.
+  Histogram optimizeSeconds;
+};
+
+// Runs Optimizer::processImage on frames from a VideoReader using numWorkers
+// threads. The pipeline must be the only consumer of the VideoReader.
+//
+// In PIPELINE_QUEUED mode frames may finish out of order; a reorder buffer
+// releases them to getFrame() strictly in VideoReader sequence order.
+//
+// In PIPELINE_LATEST_POSE mode there is no optimized queue: the only frames
+// waiting are the raw ones in the VideoReader, and a single frame is in
+// flight beyond the one on screen. A worker picks up the next raw frame only
+// once getFrame() has taken the previous one, and optimizes it against the
+// pose current at that point, so the workers run at display rate instead of
+// decode rate.
+//
+// allocator is used for intermediate images, and outputAllocator (allocator
+// if NULL) for the full-size frames handed out by getFrame(), e.g. to
+// extract them straight into mapped GPU upload buffers.
 class OptimizerPipeline {
   public:
-    OptimizerPipeline(VideoReader* vr);
+    OptimizerPipeline(VideoReader* vr, cv::MatAllocator* allocator = NULL,
+        int numWorkers = OPTIMIZER_WORKERS, PipelineMode mode = PIPELINE_MODE,
+        cv::MatAllocator* outputAllocator = NULL);
+    ~OptimizerPipeline();
     FrameData getFrame();
     bool isFrameAvailable();
     volatile int hAngle = 0;
@@ -67,16 +200,94 @@ class OptimizerPipeline {
     volatile double lastUpdated = 0;
     std::mutex hmdDataMutex;
     int getNumFramesAvailable();
+    ChannelStats getQueueStats();
+    std::vector<OptimizerWorkerStats> getWorkerStats();
+    double getRunningSeconds();
+    long getDroppedFrames();
+    PipelineMode getMode() const;
+
+    // Records a new head pose. If it is more than the re-foveation threshold
+    // away from the pose of the frame on screen, a copy of that frame with
+    // the fovea moved to the new pose is prepared in the background. Only
+    // the newest optimized video frame is kept for this, so the frame on
+    // screen can only be re-foveated if it was the newest when it was handed
+    // out: always in PIPELINE_LATEST_POSE mode, and in PIPELINE_QUEUED
+    // mode once the queue has drained, e.g. when the video is paused or
+    // decodes slower than the display.
+    void updateOrientation(int hAngle, int vAngle, double timestamp);
+    // Non-blocking. Returns the newest re-foveated frame, if any.
+    bool getRefoveatedFrame(FrameData& frame);
+    // Degrees of yaw or pitch change that trigger re-foveation; negative
+    // disables it. Only affects frames optimized after the call.
+    void setRefoveateThreshold(int degrees);
+    long getRefoveatedFrames();
+    long getRefoveateFallbacks();
+    // True once the video has ended and every frame has been taken.
+    bool isFinished();
 
   private:
-    void bufferFrames(VideoReader* vr);
-    WorkQueue<FrameData> frameQueue;
-    pthread_cond_t queueCond;
-    pthread_mutex_t queueLock;
-    std::thread bufferThread;
-    std::thread bufferThread2;
-    bool fullyBuffered;
-    bool frameAvailable;
+    void bufferFrames(VideoReader* vr, int worker);
+    bool emitInOrder(const FrameData& frame);
+    bool publishLatest(const FrameData& frame);
+    bool reserveLatest();
+    void finish();
+    void refoveateFrames();
+    void setShownFrame(const FrameData& frame);
+
+    const PipelineMode mode;
+
+    Channel<FrameData> frameQueue;
+    cv::MatAllocator* allocator;
+    cv::MatAllocator* outputAllocator;
+    const int numWorkers;
+    std::vector<std::thread> workers;
+    std::atomic<int> activeWorkers;
+    std::atomic<bool> stopping;
+    std::atomic<bool> fullyBuffered;
+    double startTime;
+
+    // Reorder buffer: finished frames waiting for their predecessors.
+    std::mutex reorderMutex;
+    std::condition_variable reorderCond;
+    std::map<long, FrameData> pending;
+    long nextSequence = 0;
+
+    // Latest-pose mode: the newest finished frame not yet taken, and the
+    // number of frames being optimized or waiting to be taken.
+    std::mutex latestMutex;
+    std::condition_variable latestCond;
+    FrameData latestFrame;
+    bool latestValid = false;
+    bool latestClosed = false;
+    bool latestInputDone = false;
+    int latestInFlight = 0;
+    long latestSequence = -1;
+    long droppedFrames = 0;
+
+    // Re-foveation of the frame on screen.
+    std::thread refoveateThread;
+    std::atomic<int> refoveateThreshold;
+    std::mutex refoveateMutex;
+    std::condition_variable refoveateCond;
+    FrameData shownFrame;
+    // While re-foveation is enabled: the newest optimized video frame and
+    // its decoded source, moved to shownSource/shownOptimized if it is the
+    // frame getFrame() hands out next.
+    long lastSequence = -1;
+    cv::Mat lastSource;
+    OptimizedImage lastOptimized;
+    cv::Mat shownSource;
+    OptimizedImage shownOptimized;
+    int targetHAngle = 0;
+    int targetVAngle = 0;
+    bool refoveateRequested = false;
+    FrameData refoveatedFrame;
+    bool refoveatedValid = false;
+    long refoveatedFrames = 0;
+    long refoveateFallbacks = 0;
+
+    std::mutex statsMutex;
+    std::vector<OptimizerWorkerStats> workerStats;
 };
 
 #endif
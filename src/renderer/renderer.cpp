@@ -1,5 +1,7 @@
 #include "renderer.hpp"
 
+#include "../settings.hpp"
+
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -181,8 +183,15 @@ GLuint Renderer::loadTexture(const cv::Mat& image) {
   // build our texture
   // glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
   //     GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
-  gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height,
-      GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
+  if (UPLOAD_BGRA) {
+    cv::Mat bgra;
+    ImageUtil::expandBgrToBgra(image, bgra);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA8, width, height,
+        GL_BGRA, GL_UNSIGNED_BYTE, bgra.ptr());
+  } else {
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB8, width, height,
+        GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
+  }
 
   glBindTexture(GL_TEXTURE_2D, 0);
   return texture;
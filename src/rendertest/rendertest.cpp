@@ -1,5 +1,7 @@
 #include "rendertest.hpp"
 
+#include "../settings.hpp"
+
 // angle of rotation for the camera direction
 static float angle = 0.0f;
 // actual vector representing the camera's direction
@@ -168,8 +170,15 @@ GLuint loadTexture(const cv::Mat& image) {
   // build our texture
   // glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
   //     GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
-  gluBuild2DMipmaps(GL_TEXTURE_2D, 3, width, height,
-	  0x1F02, GL_UNSIGNED_BYTE, image.ptr()); // TODO: fix 0x1F02 = GL_BGR
+  if (UPLOAD_BGRA) {
+    cv::Mat bgra;
+    ImageUtil::expandBgrToBgra(image, bgra);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA8, width, height,
+        GL_BGRA, GL_UNSIGNED_BYTE, bgra.ptr());
+  } else {
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB8, width, height,
+        GL_BGR, GL_UNSIGNED_BYTE, image.ptr());
+  }
 
   glBindTexture(GL_TEXTURE_2D, 0);
   return texture;
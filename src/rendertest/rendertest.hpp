@@ -9,6 +9,9 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <OVR_CAPI_0_5_0.h>
 
+// Includes GLEW, which must come before gl.h.
+#include "../util/imageutil.hpp"
+
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
@@ -5,6 +5,10 @@
 
 #define USE_PIXEL_BUFFER
 
+// Frames uploaded to the GPU can be in flight at once (see UploadRing in
+// oculus2). At least 2: one being drawn, one transferring.
+const int UPLOAD_RING_SIZE = 3;
+
 #define ASYNC_VIDEOCAPTURE
 
 #define USE_OPTIMIZER_PIPELINE
@@ -13,10 +17,125 @@ const float PITCH_MULTIPLIER = 90.0 / 50.0;
 
 const bool USE_OPTIMIZER = true;
 
+// Decoded frames VideoReader buffers ahead of its consumer with the OpenCV
+// backend, which can only read whole frames.
 const int VIDEOREADER_QUEUE_SIZE = 30;
 
+// With the libav backend, VideoReader instead demuxes ahead into a queue of
+// compressed packets, bounded by bytes and by seconds of video, whichever
+// fills first, and decodes only VIDEOREADER_DECODED_FRAMES ahead of the
+// consumer. Read-ahead then takes megabytes rather than the gigabyte or so
+// of 30 decoded 4K stereo frames.
+const bool VIDEOREADER_PACKET_READAHEAD = true;
+const long VIDEOREADER_READAHEAD_BYTES = 32 << 20;
+const double VIDEOREADER_READAHEAD_SECONDS = 2;
+const int VIDEOREADER_DECODED_FRAMES = 3;
+
+// Whether VideoReader starts over at the end of the video instead of
+// stopping. Set CONDUIT_LOOP=1 to loop in oculus2, and CONDUIT_START_FRAME
+// to start somewhere other than the first frame.
+const bool VIDEOREADER_LOOP = false;
+
+// Whether the libav backend builds the keyframe index for a video that
+// doesn't have one yet when it opens it. That demuxes the whole file before
+// the first frame, which takes a while for a large file on slow storage, so
+// it is off; run buildindex ahead of time instead. Without an index, seeks
+// are estimated from the frame rate.
+const bool VIDEOREADER_BUILD_INDEX = false;
+
+// How oculus2 decodes video. VIDEO_BACKEND_OPENCV goes through
+// cv::VideoCapture, which converts every frame to BGR. VIDEO_BACKEND_LIBAV
+// decodes with libavcodec directly (see LibavDecoder) and keeps frames as
+// I420, half the bytes, all the way to the GPU, where the fragment shader
+// converts them to RGB. Needs a build with libavcodec; set
+// CONDUIT_VIDEO_BACKEND=libav|opencv to override. Other runmodes always use
+// OpenCV, as they expect BGR frames.
+enum VideoBackend {
+  VIDEO_BACKEND_OPENCV,
+  VIDEO_BACKEND_LIBAV
+};
+const VideoBackend VIDEO_BACKEND = VIDEO_BACKEND_OPENCV;
+
+// How the libav backend reads the video file (see VideoFile). VIDEO_IO_LIBAV
+// leaves it to libavformat, whose small synchronous reads stall the demuxer
+// for a round trip each on network storage. VIDEO_IO_MMAP maps the file and
+// asks the kernel to read VIDEOREADER_MMAP_READAHEAD_BYTES ahead.
+// VIDEO_IO_PREFETCH keeps VIDEOREADER_PREFETCH_BUFFERS large reads in flight,
+// through io_uring if built with liburing and from a thread otherwise.
+// VIDEO_IO_AUTO prefetches on network filesystems and maps local files. Set
+// CONDUIT_VIDEO_IO=auto|libav|mmap|prefetch to override. cv::VideoCapture
+// always does its own reads.
+enum VideoIo {
+  VIDEO_IO_AUTO,
+  VIDEO_IO_LIBAV,
+  VIDEO_IO_MMAP,
+  VIDEO_IO_PREFETCH
+};
+const VideoIo VIDEO_IO = VIDEO_IO_AUTO;
+const long VIDEOREADER_MMAP_READAHEAD_BYTES = 32 << 20;
+const int VIDEOREADER_PREFETCH_BUFFERS = 8;
+const long VIDEOREADER_PREFETCH_BUFFER_BYTES = 4 << 20;
+
+// Directory where VideoReader keeps the decoded frames of videos it has
+// played through once (see FrameCache), so that playing them again decodes
+// nothing. Meant for a few short clips played over and over: a minute of
+// 1280x1280 video at 30 fps takes 4.4 GB as I420, twice that as BGR. Empty
+// disables the cache; set CONDUIT_FRAME_CACHE=dir to enable it in oculus2.
+// The least recently played videos are deleted to keep the directory under
+// VIDEOREADER_CACHE_MAX_BYTES.
+const char* const VIDEOREADER_CACHE_DIR = "";
+const long long VIDEOREADER_CACHE_MAX_BYTES = 16LL << 30;
+
 const int OPTIMIZER_QUEUE_SIZE = 7;
 
+// Number of threads running the optimizer in OptimizerPipeline.
+const int OPTIMIZER_WORKERS = 2;
+
+// PIPELINE_QUEUED optimizes frames ahead of time into a queue of
+// OPTIMIZER_QUEUE_SIZE frames. PIPELINE_LATEST_POSE keeps only raw decoded
+// frames queued and optimizes one frame at a time against the newest head
+// pose, starting the next as soon as the display takes the previous one.
+enum PipelineMode {
+  PIPELINE_QUEUED,
+  PIPELINE_LATEST_POSE
+};
+const PipelineMode PIPELINE_MODE = PIPELINE_QUEUED;
+
+// Re-foveate the frame on screen when the head turns or tilts by more than
+// this many degrees, without waiting for the next video frame. Negative
+// disables re-foveation.
+const int REFOVEATE_THRESHOLD_DEGREES = 5;
+
+// Skip rebuilding the full-resolution frame on the CPU. oculus2 uploads the
+// blurred periphery and the two focused regions as separate textures and
+// composites them in a fragment shader instead. Only the pixels that carry
+// information are uploaded, about a fifteenth of the full frame's bytes for
+// a 1280x1280 video (extractbench prints both). Off by default: frames then
+// don't go through the mapped upload pool, and the shader has only been
+// compared with the CPU path on llvmpipe (see compositebench).
+const bool GPU_FOVEA_COMPOSITING = false;
+
+// Recycle frame buffers through a MatPool instead of malloc/free per frame.
+const bool USE_MAT_POOL = true;
+const bool MAT_POOL_HUGE_PAGES = false;
+
+// Extract optimized frames straight into persistently mapped pixel buffers
+// (GL_ARB_buffer_storage), so oculus2 uploads them without copying. Enough
+// buffers for every frame that can be queued, in flight, or on screen.
+const bool USE_MAPPED_UPLOADS = true;
+const int MAPPED_UPLOAD_BUFFERS = OPTIMIZER_QUEUE_SIZE + OPTIMIZER_WORKERS + UPLOAD_RING_SIZE + 3;
+
+// Trace spans are recorded per thread into buffers of this many events
+// (24 bytes each). Set CONDUIT_TRACE=file.json, or press C in oculus2, to
+// record; the trace is written to that file, or TRACE_FILE, on exit.
+const int TRACE_EVENTS_PER_THREAD = 1 << 18;
+const char* const TRACE_FILE = "conduit_trace.json";
+
+// Defaults for the headless runmode: how many frames to render, and the
+// refresh rate of the simulated display (75 Hz, like a DK2).
+const long HEADLESS_FRAMES = 1000;
+const double HEADLESS_REFRESH_RATE = 75;
+
 // Optimizer settings
 const int CROP_ANGLE = 180;
 const int H_FOCUS_ANGLE = 30;
@@ -28,6 +147,14 @@ extern int BLUR_FACTOR;
 
 extern bool FOVEA_DISPLAY;
 
+// Upload textures from 4-byte BGRA pixels into GL_RGBA8 storage rather than
+// from 3-byte BGR, which some drivers convert slowly on the CPU. The
+// optimizer then extracts frames as BGRA; other images are widened while
+// they are copied for upload. Off by default, as it moves a third more
+// bytes and hasn't been shown to pay off (see uploadbench). Toggle with X in
+// oculus2.
+extern bool UPLOAD_BGRA;
+
 
 
 #endif
@@ -0,0 +1,154 @@
+#ifndef UTIL_CHANNEL_H_
+#define UTIL_CHANNEL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "ringbuffer.h"
+#include "timer.hpp"
+
+struct ChannelStats {
+  // Number of push() calls that found the channel full and had to sleep,
+  // and the total time they spent sleeping.
+  long pushBlocks = 0;
+  double pushBlockedSeconds = 0;
+
+  // Number of pop() calls that found the channel empty and had to sleep,
+  // and the total time they spent sleeping.
+  long popBlocks = 0;
+  double popBlockedSeconds = 0;
+};
+
+// Bounded blocking single-producer/single-consumer channel.
+//
+// push() blocks while the channel is full and pop() blocks while it is empty.
+// Items go through a lock-free RingBuffer; the mutex is only taken by a side
+// that has to sleep, or to wake a peer that announced it is sleeping, so the
+// uncontended path never locks.
+//
+// close() marks the end of the stream: pending and future push() calls fail,
+// and pop() keeps returning queued items until the channel is drained, then
+// returns false instead of blocking.
+template <class T>
+class Channel {
+  public:
+    explicit Channel(size_t capacity) : ring(capacity) {}
+
+    bool push(const T& item) {
+      if (closed.load())
+        return false;
+
+      if (!ring.tryPush(item)) {
+        double start = Timer::timeInSeconds();
+        std::unique_lock<std::mutex> lock(mutex);
+        producerWaiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ring.tryPush(item)) {
+          if (closed.load()) {
+            producerWaiting.store(false);
+            return false;
+          }
+          notFull.wait(lock);
+        }
+        producerWaiting.store(false);
+        stats.pushBlocks++;
+        stats.pushBlockedSeconds += Timer::timeInSeconds() - start;
+      }
+
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (consumerWaiting.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        notEmpty.notify_one();
+      }
+      return true;
+    }
+
+    // Returns false once the channel is closed and drained.
+    bool pop(T& item) {
+      if (!ring.tryPop(item)) {
+        double start = Timer::timeInSeconds();
+        std::unique_lock<std::mutex> lock(mutex);
+        consumerWaiting.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ring.tryPop(item)) {
+          if (closed.load()) {
+            // Anything pushed before close() is visible by now.
+            bool gotItem = ring.tryPop(item);
+            consumerWaiting.store(false);
+            return gotItem;
+          }
+          notEmpty.wait(lock);
+        }
+        consumerWaiting.store(false);
+        stats.popBlocks++;
+        stats.popBlockedSeconds += Timer::timeInSeconds() - start;
+      }
+
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (producerWaiting.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        notFull.notify_one();
+      }
+      return true;
+    }
+
+    bool tryPop(T& item) {
+      if (!ring.tryPop(item))
+        return false;
+
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (producerWaiting.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        notFull.notify_one();
+      }
+      return true;
+    }
+
+    void close() {
+      closed.store(true);
+      std::lock_guard<std::mutex> lock(mutex);
+      notFull.notify_all();
+      notEmpty.notify_all();
+    }
+
+    // Empties the channel and lets it take pushes again after close(). No
+    // thread may be using the channel.
+    void reopen() {
+      T item;
+      while (ring.tryPop(item)) {
+      }
+      closed.store(false);
+    }
+
+    bool isClosed() const {
+      return closed.load();
+    }
+
+    size_t size() const {
+      return ring.size();
+    }
+
+    size_t capacity() const {
+      return ring.capacity();
+    }
+
+    ChannelStats getStats() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stats;
+    }
+
+  private:
+    RingBuffer<T> ring;
+
+    std::atomic<bool> closed{false};
+    std::atomic<bool> producerWaiting{false};
+    std::atomic<bool> consumerWaiting{false};
+
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    ChannelStats stats;
+};
+
+#endif
@@ -1,15 +1,36 @@
 #include "cylinderwarp.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CYLINDERWARP_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CYLINDERWARP_NEON
+#include <arm_neon.h>
+#endif
+
+#include "../contracts.h"
+
 using cv::Mat;
 using cv::Point2f;
 using cv::Point2i;
 using cv::Vec3b;
 
 Mat CylinderWarp::cylinderWarp(const Mat& image) {
+  Mat result;
+  CylinderWarpPlan::get(image.cols, image.rows)->apply(image, result);
+  return result;
+}
+
+Mat CylinderWarp::cylinderWarpReference(const Mat& image) {
   int height = image.rows;
   int width = image.cols;
 
-  Mat result(image.size(), image.type());
+  Mat result = Mat::zeros(image.size(), image.type());
 
   for (int y = 0; y < height; y++) {
     for (int x = 0; x < width; x++) {
@@ -61,3 +82,308 @@ Point2f CylinderWarp::warpPoint(Point2f point, int width, int height) {
 
   return result;
 }
+
+// CylinderWarpPlan
+
+static const int WEIGHT_ONE = 1 << CylinderWarpPlan::WEIGHT_BITS;
+static const int RESULT_SHIFT = 2 * CylinderWarpPlan::WEIGHT_BITS;
+static const int RESULT_ROUND = 1 << (RESULT_SHIFT - 1);
+
+static inline int weightPair(float w) {
+  int w1 = cvRound(std::max(0.0f, std::min(w, 1.0f)) * WEIGHT_ONE);
+  return (WEIGHT_ONE - w1) | (w1 << 16);
+}
+
+CylinderWarpPlan::CylinderWarpPlan(int width, int height)
+  : width(width), height(height) {
+  REQUIRES(width >= 2 && height >= 2);
+
+  const int rowBytes = width * 3;
+  const int lastOffset = (height - 2) * rowBytes + (width - 2) * 3;
+  offsets.resize(width * height);
+  xWeights.resize(width * height);
+  yWeights.resize(width * height);
+  touchesEnd.resize(height);
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int i = y * width + x;
+      Point2f pos = CylinderWarp::warpPoint(Point2f(x, y), width, height);
+
+      Point2i topLeft((int) pos.x, (int) pos.y);
+      if (topLeft.x < 0 ||
+          topLeft.x > width - 2 ||
+          topLeft.y < 0 ||
+          topLeft.y > height - 2) {
+        offsets[i] = 0;
+        xWeights[i] = 0;
+        yWeights[i] = 0;
+        continue;
+      }
+
+      offsets[i] = topLeft.y * rowBytes + topLeft.x * 3;
+      xWeights[i] = weightPair(pos.x - topLeft.x);
+      yWeights[i] = weightPair(pos.y - topLeft.y);
+      if (offsets[i] == lastOffset)
+        touchesEnd[y] = true;
+    }
+  }
+}
+
+std::shared_ptr<const CylinderWarpPlan> CylinderWarpPlan::get(int width, int height) {
+  static std::mutex mutex;
+  static std::map<std::pair<int, int>, std::shared_ptr<const CylinderWarpPlan> > plans;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::shared_ptr<const CylinderWarpPlan>& plan = plans[std::make_pair(width, height)];
+  if (!plan)
+    plan = std::make_shared<CylinderWarpPlan>(width, height);
+  return plan;
+}
+
+// Kernels. Each warps count pixels of one row and returns how many it
+// handled; the caller finishes the rest with warpPixels. All of them compute
+// exactly the same fixed-point result.
+
+static inline int load32(const uchar* p) {
+  int v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static void warpPixels(const uchar* src, int rowBytes, const int* offsets,
+    const int* xWeights, const int* yWeights, uchar* out, int count) {
+  for (int i = 0; i < count; i++) {
+    const uchar* tl = src + offsets[i];
+    const uchar* bl = tl + rowBytes;
+    int wx0 = xWeights[i] & 0xffff, wx1 = xWeights[i] >> 16;
+    int wy0 = yWeights[i] & 0xffff, wy1 = yWeights[i] >> 16;
+    for (int c = 0; c < 3; c++) {
+      int top = tl[c] * wx0 + tl[c + 3] * wx1;
+      int bot = bl[c] * wx0 + bl[c + 3] * wx1;
+      out[3 * i + c] = (uchar) ((top * wy0 + bot * wy1 + RESULT_ROUND) >> RESULT_SHIFT);
+    }
+  }
+}
+
+// Stores n packed BGR0 pixels as 3-byte BGR. Each 4-byte write spills one
+// byte into the next pixel, which the next write overwrites.
+static inline void storePixels(const int* pixels, int n, uchar* out) {
+  for (int i = 0; i < n - 1; i++)
+    std::memcpy(out + 3 * i, &pixels[i], 4);
+  std::memcpy(out + 3 * (n - 1), &pixels[n - 1], 3);
+}
+
+typedef int (*WarpKernel)(const uchar* src, int rowBytes, const int* offsets,
+    const int* xWeights, const int* yWeights, uchar* out, int count);
+
+#if defined(CYLINDERWARP_X86)
+
+// One channel of four pixels: interleave each tap pair into 16-bit lanes
+// and blend with madd, horizontally and then vertically.
+static inline __m128i blendChannelSSE2(__m128i tl, __m128i tr, __m128i bl, __m128i br,
+    __m128i xw, __m128i yw, int channel) {
+  const __m128i mask = _mm_set1_epi32(0xff);
+  const __m128i shift = _mm_cvtsi32_si128(8 * channel);
+  __m128i tlc = _mm_and_si128(_mm_srl_epi32(tl, shift), mask);
+  __m128i trc = _mm_and_si128(_mm_srl_epi32(tr, shift), mask);
+  __m128i blc = _mm_and_si128(_mm_srl_epi32(bl, shift), mask);
+  __m128i brc = _mm_and_si128(_mm_srl_epi32(br, shift), mask);
+  __m128i top = _mm_madd_epi16(_mm_or_si128(tlc, _mm_slli_epi32(trc, 16)), xw);
+  __m128i bot = _mm_madd_epi16(_mm_or_si128(blc, _mm_slli_epi32(brc, 16)), xw);
+  __m128i v = _mm_madd_epi16(_mm_or_si128(top, _mm_slli_epi32(bot, 16)), yw);
+  v = _mm_srai_epi32(_mm_add_epi32(v, _mm_set1_epi32(RESULT_ROUND)), RESULT_SHIFT);
+  return _mm_sll_epi32(v, shift);
+}
+
+static int warpPixelsSSE2(const uchar* src, int rowBytes, const int* offsets,
+    const int* xWeights, const int* yWeights, uchar* out, int count) {
+  int i = 0;
+  // Keep the spilled byte of the last store inside the row.
+  for (; i + 5 <= count; i += 4) {
+    const int* o = offsets + i;
+    __m128i tl = _mm_setr_epi32(load32(src + o[0]), load32(src + o[1]),
+        load32(src + o[2]), load32(src + o[3]));
+    __m128i tr = _mm_setr_epi32(load32(src + o[0] + 3), load32(src + o[1] + 3),
+        load32(src + o[2] + 3), load32(src + o[3] + 3));
+    const uchar* below = src + rowBytes;
+    __m128i bl = _mm_setr_epi32(load32(below + o[0]), load32(below + o[1]),
+        load32(below + o[2]), load32(below + o[3]));
+    __m128i br = _mm_setr_epi32(load32(below + o[0] + 3), load32(below + o[1] + 3),
+        load32(below + o[2] + 3), load32(below + o[3] + 3));
+    __m128i xw = _mm_loadu_si128((const __m128i*) (xWeights + i));
+    __m128i yw = _mm_loadu_si128((const __m128i*) (yWeights + i));
+
+    __m128i result = _mm_or_si128(blendChannelSSE2(tl, tr, bl, br, xw, yw, 0),
+        _mm_or_si128(blendChannelSSE2(tl, tr, bl, br, xw, yw, 1),
+          blendChannelSSE2(tl, tr, bl, br, xw, yw, 2)));
+
+    int pixels[4];
+    _mm_storeu_si128((__m128i*) pixels, result);
+    storePixels(pixels, 4, out + 3 * i);
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i blendChannelAVX2(__m256i tl, __m256i tr, __m256i bl, __m256i br,
+    __m256i xw, __m256i yw, int channel) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  const __m128i shift = _mm_cvtsi32_si128(8 * channel);
+  __m256i tlc = _mm256_and_si256(_mm256_srl_epi32(tl, shift), mask);
+  __m256i trc = _mm256_and_si256(_mm256_srl_epi32(tr, shift), mask);
+  __m256i blc = _mm256_and_si256(_mm256_srl_epi32(bl, shift), mask);
+  __m256i brc = _mm256_and_si256(_mm256_srl_epi32(br, shift), mask);
+  __m256i top = _mm256_madd_epi16(_mm256_or_si256(tlc, _mm256_slli_epi32(trc, 16)), xw);
+  __m256i bot = _mm256_madd_epi16(_mm256_or_si256(blc, _mm256_slli_epi32(brc, 16)), xw);
+  __m256i v = _mm256_madd_epi16(_mm256_or_si256(top, _mm256_slli_epi32(bot, 16)), yw);
+  v = _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(RESULT_ROUND)), RESULT_SHIFT);
+  return _mm256_sll_epi32(v, shift);
+}
+
+__attribute__((target("avx2")))
+static int warpPixelsAVX2(const uchar* src, int rowBytes, const int* offsets,
+    const int* xWeights, const int* yWeights, uchar* out, int count) {
+  const int* base = (const int*) src;
+  const __m256i right = _mm256_set1_epi32(3);
+  const __m256i down = _mm256_set1_epi32(rowBytes);
+  int i = 0;
+  for (; i + 9 <= count; i += 8) {
+    __m256i o = _mm256_loadu_si256((const __m256i*) (offsets + i));
+    __m256i ob = _mm256_add_epi32(o, down);
+    __m256i tl = _mm256_i32gather_epi32(base, o, 1);
+    __m256i tr = _mm256_i32gather_epi32(base, _mm256_add_epi32(o, right), 1);
+    __m256i bl = _mm256_i32gather_epi32(base, ob, 1);
+    __m256i br = _mm256_i32gather_epi32(base, _mm256_add_epi32(ob, right), 1);
+    __m256i xw = _mm256_loadu_si256((const __m256i*) (xWeights + i));
+    __m256i yw = _mm256_loadu_si256((const __m256i*) (yWeights + i));
+
+    __m256i result = _mm256_or_si256(blendChannelAVX2(tl, tr, bl, br, xw, yw, 0),
+        _mm256_or_si256(blendChannelAVX2(tl, tr, bl, br, xw, yw, 1),
+          blendChannelAVX2(tl, tr, bl, br, xw, yw, 2)));
+
+    int pixels[8];
+    _mm256_storeu_si256((__m256i*) pixels, result);
+    storePixels(pixels, 8, out + 3 * i);
+  }
+  return i;
+}
+
+static WarpKernel selectKernel() {
+  if (__builtin_cpu_supports("avx2"))
+    return warpPixelsAVX2;
+  return warpPixelsSSE2;
+}
+
+#elif defined(CYLINDERWARP_NEON)
+
+static inline uint32x4_t blendChannelNEON(uint32x4_t tl, uint32x4_t tr,
+    uint32x4_t bl, uint32x4_t br, uint32x4_t xw, uint32x4_t yw, int channel) {
+  const uint32x4_t mask = vdupq_n_u32(0xff);
+  const uint32x4_t low = vdupq_n_u32(0xffff);
+  const int32x4_t shift = vdupq_n_s32(-8 * channel);
+  uint32x4_t tlc = vandq_u32(vshlq_u32(tl, shift), mask);
+  uint32x4_t trc = vandq_u32(vshlq_u32(tr, shift), mask);
+  uint32x4_t blc = vandq_u32(vshlq_u32(bl, shift), mask);
+  uint32x4_t brc = vandq_u32(vshlq_u32(br, shift), mask);
+  uint32x4_t wx0 = vandq_u32(xw, low), wx1 = vshrq_n_u32(xw, 16);
+  uint32x4_t wy0 = vandq_u32(yw, low), wy1 = vshrq_n_u32(yw, 16);
+  uint32x4_t top = vmlaq_u32(vmulq_u32(tlc, wx0), trc, wx1);
+  uint32x4_t bot = vmlaq_u32(vmulq_u32(blc, wx0), brc, wx1);
+  uint32x4_t v = vmlaq_u32(vmulq_u32(top, wy0), bot, wy1);
+  v = vshrq_n_u32(vaddq_u32(v, vdupq_n_u32(RESULT_ROUND)), RESULT_SHIFT);
+  return vshlq_u32(v, vnegq_s32(shift));
+}
+
+static int warpPixelsNEON(const uchar* src, int rowBytes, const int* offsets,
+    const int* xWeights, const int* yWeights, uchar* out, int count) {
+  int i = 0;
+  for (; i + 5 <= count; i += 4) {
+    const int* o = offsets + i;
+    const uchar* below = src + rowBytes;
+    uint32_t taps[4][4];
+    for (int k = 0; k < 4; k++) {
+      taps[0][k] = load32(src + o[k]);
+      taps[1][k] = load32(src + o[k] + 3);
+      taps[2][k] = load32(below + o[k]);
+      taps[3][k] = load32(below + o[k] + 3);
+    }
+    uint32x4_t tl = vld1q_u32(taps[0]), tr = vld1q_u32(taps[1]);
+    uint32x4_t bl = vld1q_u32(taps[2]), br = vld1q_u32(taps[3]);
+    uint32x4_t xw = vld1q_u32((const uint32_t*) (xWeights + i));
+    uint32x4_t yw = vld1q_u32((const uint32_t*) (yWeights + i));
+
+    uint32x4_t result = vorrq_u32(blendChannelNEON(tl, tr, bl, br, xw, yw, 0),
+        vorrq_u32(blendChannelNEON(tl, tr, bl, br, xw, yw, 1),
+          blendChannelNEON(tl, tr, bl, br, xw, yw, 2)));
+
+    int pixels[4];
+    vst1q_u32((uint32_t*) pixels, result);
+    storePixels(pixels, 4, out + 3 * i);
+  }
+  return i;
+}
+
+static WarpKernel selectKernel() {
+  return warpPixelsNEON;
+}
+
+#else
+
+static int warpPixelsNone(const uchar*, int, const int*, const int*, const int*,
+    uchar*, int) {
+  return 0;
+}
+
+static WarpKernel selectKernel() {
+  return warpPixelsNone;
+}
+
+#endif
+
+void CylinderWarpPlan::applyRows(const uchar* src, Mat& dst, int begin, int end) const {
+  static const WarpKernel kernel = selectKernel();
+  const int rowBytes = width * 3;
+
+  for (int y = begin; y < end; y++) {
+    const int* o = &offsets[y * width];
+    const int* xw = &xWeights[y * width];
+    const int* yw = &yWeights[y * width];
+    uchar* out = dst.ptr<uchar>(y);
+
+    int done = touchesEnd[y] ? 0 : kernel(src, rowBytes, o, xw, yw, out, width);
+    warpPixels(src, rowBytes, o + done, xw + done, yw + done, out + 3 * done,
+        width - done);
+  }
+}
+
+class CylinderWarpPlan::Body : public cv::ParallelLoopBody {
+  public:
+    Body(const CylinderWarpPlan& plan, const uchar* src, Mat& dst)
+      : plan(plan), src(src), dst(dst) {}
+
+    void operator()(const cv::Range& rows) const {
+      plan.applyRows(src, dst, rows.start, rows.end);
+    }
+
+  private:
+    const CylinderWarpPlan& plan;
+    const uchar* src;
+    Mat& dst;
+};
+
+void CylinderWarpPlan::apply(const Mat& src, Mat& dst) const {
+  REQUIRES(src.type() == CV_8UC3);
+  REQUIRES(src.cols == width && src.rows == height);
+
+  // The offsets assume tightly packed rows.
+  Mat input = src;
+  if (!input.isContinuous())
+    input = src.clone();
+
+  dst.create(height, width, CV_8UC3);
+  REQUIRES(dst.data != input.data);
+
+  Body body(*this, input.ptr<uchar>(), dst);
+  cv::parallel_for_(cv::Range(0, height), body, 4 * cv::getNumThreads());
+}
@@ -1,14 +1,59 @@
 #ifndef UTIL_CYLINDERWARP_H_
 #define UTIL_CYLINDERWARP_H_
 
+#include <memory>
+#include <vector>
+
 #include <opencv2/highgui/highgui.hpp>
 
 class CylinderWarp {
   public:
+    // Warps through the cached CylinderWarpPlan for the image's size.
     static cv::Mat cylinderWarp(const cv::Mat& image);
+    // The original per-pixel implementation, kept for comparison.
+    static cv::Mat cylinderWarpReference(const cv::Mat& image);
 
   private:
+    friend class CylinderWarpPlan;
     static cv::Point2f warpPoint(cv::Point2f point, int width, int height);
 };
 
+// Source positions and bilinear weights of CylinderWarp for one image size,
+// computed once. Applying a plan is a table lookup and four fixed-point
+// multiply-adds per channel, vectorized with AVX2, SSE2 or NEON where
+// available and split across threads in row bands.
+class CylinderWarpPlan {
+  public:
+    CylinderWarpPlan(int width, int height);
+
+    // Returns the shared plan for this size, building it on first use.
+    static std::shared_ptr<const CylinderWarpPlan> get(int width, int height);
+
+    // src must be CV_8UC3 and width x height; dst is (re)allocated to match.
+    void apply(const cv::Mat& src, cv::Mat& dst) const;
+
+    const int width;
+    const int height;
+
+    // Fixed-point precision of the bilinear weights.
+    static const int WEIGHT_BITS = 7;
+
+  private:
+    class Body;
+
+    void applyRows(const uchar* src, cv::Mat& dst, int begin, int end) const;
+
+    // Per destination pixel: byte offset of the top-left source pixel in a
+    // continuous src, and the horizontal and vertical weight pairs packed
+    // as (1 - w) | w << 16. Pixels that map outside the source have zero
+    // weights and offset 0, so they come out black without a branch.
+    std::vector<int> offsets;
+    std::vector<int> xWeights;
+    std::vector<int> yWeights;
+    // Rows containing a pixel whose bottom-right tap is the last pixel of
+    // the source. The vector kernels read 4 bytes per tap, one past that
+    // pixel, so these rows take the scalar path.
+    std::vector<bool> touchesEnd;
+};
+
 #endif
@@ -0,0 +1,96 @@
+#include "frametimes.hpp"
+
+#include <cstdint>
+#include <iomanip>
+
+#include "timer.hpp"
+
+static const char* const STAGE_NAMES[FRAME_STAGE_COUNT] = {
+  "decoded",
+  "enqueued",
+  "optimize start",
+  "optimize end",
+  "dequeued",
+  "uploaded",
+  "presented",
+};
+
+// What happens between each stage and the next.
+static const char* const INTERVAL_NAMES[FRAME_STAGE_COUNT - 1] = {
+  "hand to reader queue",
+  "reader queue",
+  "optimize",
+  "optimizer queue",
+  "upload",
+  "present",
+};
+
+FrameTimes::FrameTimes() {
+  for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+    times[i] = 0;
+}
+
+void FrameTimes::mark(FrameStage stage) {
+  times[stage] = Timer::timeInSeconds();
+}
+
+FrameLatencyLog::FrameLatencyLog() : lastId(-1), binaryLog(NULL) {}
+
+FrameLatencyLog::~FrameLatencyLog() {
+  if (binaryLog)
+    fclose(binaryLog);
+}
+
+bool FrameLatencyLog::openBinaryLog(const std::string& filename) {
+  if (binaryLog)
+    fclose(binaryLog);
+  binaryLog = fopen(filename.c_str(), "wb");
+  if (!binaryLog) {
+    std::cerr << "Could not open frame log " << filename << std::endl;
+    return false;
+  }
+  int32_t stages = FRAME_STAGE_COUNT;
+  fwrite("CNDFRM01", 1, 8, binaryLog);
+  fwrite(&stages, sizeof(stages), 1, binaryLog);
+  return true;
+}
+
+void FrameLatencyLog::record(long id, long sequence, const FrameTimes& times) {
+  if (id == lastId)
+    return;
+  lastId = id;
+
+  for (int i = 0; i + 1 < FRAME_STAGE_COUNT; i++) {
+    double begin = times.get((FrameStage) i);
+    double end = times.get((FrameStage) (i + 1));
+    if (begin > 0 && end > 0)
+      stageTimes[i].record(end - begin);
+  }
+  double decoded = times.get(FRAME_DECODED);
+  double presented = times.get(FRAME_PRESENTED);
+  if (decoded > 0 && presented > 0)
+    totalTimes.record(presented - decoded);
+
+  if (binaryLog) {
+    int64_t ids[2] = { id, sequence };
+    double stamps[FRAME_STAGE_COUNT];
+    for (int i = 0; i < FRAME_STAGE_COUNT; i++)
+      stamps[i] = times.get((FrameStage) i);
+    fwrite(ids, sizeof(ids), 1, binaryLog);
+    fwrite(stamps, sizeof(stamps), 1, binaryLog);
+  }
+}
+
+void FrameLatencyLog::print(std::ostream& out) const {
+  out << "Frame latency by stage (" << totalTimes.count() << " frames):" << std::endl;
+  for (int i = 0; i + 1 < FRAME_STAGE_COUNT; i++) {
+    if (stageTimes[i].count() == 0)
+      continue;
+    out << "  " << std::left << std::setw(22) << INTERVAL_NAMES[i] << std::right;
+    stageTimes[i].print(out, 1000);
+    out << " ms  (" << STAGE_NAMES[i] << " -> " << STAGE_NAMES[i + 1] << ")" << std::endl;
+  }
+  out << "  " << std::left << std::setw(22) << "decode to present" << std::right;
+  totalTimes.print(out, 1000);
+  out << " ms" << std::endl;
+}
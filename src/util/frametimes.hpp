@@ -0,0 +1,77 @@
+#ifndef UTIL_FRAMETIMES_H_
+#define UTIL_FRAMETIMES_H_
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "histogram.hpp"
+
+// Points a video frame passes on its way from the decoder to the HMD, in
+// order.
+enum FrameStage {
+  // VideoReader finished decoding the frame.
+  FRAME_DECODED,
+  // The frame was handed to the VideoReader queue. The time until
+  // FRAME_OPTIMIZE_START includes any time the reader spent blocked on a
+  // full queue.
+  FRAME_ENQUEUED,
+  FRAME_OPTIMIZE_START,
+  FRAME_OPTIMIZE_END,
+  // Taken off the optimizer queue by the display thread.
+  FRAME_DEQUEUED,
+  // Texture uploads finished on the GPU, so the frame can be drawn.
+  FRAME_UPLOADED,
+  // The HMD backend presented the first display frame showing it.
+  FRAME_PRESENTED,
+  FRAME_STAGE_COUNT
+};
+
+// Timer::timeInSeconds() at each stage a frame has reached; 0 for stages it
+// hasn't.
+class FrameTimes {
+  public:
+    FrameTimes();
+
+    void mark(FrameStage stage);
+    double get(FrameStage stage) const {
+      return times[stage];
+    }
+
+  private:
+    double times[FRAME_STAGE_COUNT];
+};
+
+// Collects the stage times of presented frames into per-stage histograms,
+// and optionally appends them to a binary log.
+//
+// The binary log starts with the 8 bytes "CNDFRM01" and an int32 stage
+// count, followed by one record per frame: int64 id, int64 sequence, then
+// one float64 per stage, all little-endian as written by the host.
+class FrameLatencyLog {
+  public:
+    FrameLatencyLog();
+    ~FrameLatencyLog();
+
+    bool openBinaryLog(const std::string& filename);
+
+    // Only the first record for each id is kept, so a frame shown again
+    // (e.g. re-foveated) isn't counted twice. Must be called from one
+    // thread.
+    void record(long id, long sequence, const FrameTimes& times);
+
+    // Prints the time spent between consecutive stages, and in total.
+    void print(std::ostream& out) const;
+
+  private:
+    FrameLatencyLog(const FrameLatencyLog&);
+    FrameLatencyLog& operator=(const FrameLatencyLog&);
+
+    // stageTimes[i] is the time from stage i to stage i + 1.
+    Histogram stageTimes[FRAME_STAGE_COUNT - 1];
+    Histogram totalTimes;
+    long lastId;
+    FILE* binaryLog;
+};
+
+#endif
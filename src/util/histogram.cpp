@@ -0,0 +1,154 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+#include "../contracts.h"
+
+// Values below SUB_BUCKETS units are counted exactly. Above that, each
+// power of two [2^k, 2^(k+1)) is split into HALF_BUCKETS equal buckets.
+static const int SUB_BUCKET_BITS = 7;
+static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+static const int HALF_BUCKETS = SUB_BUCKETS / 2;
+static const int MAX_BITS = 40;
+static const int NUM_BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BUCKET_BITS) * HALF_BUCKETS;
+static const unsigned long long MAX_UNITS = (1ULL << MAX_BITS) - 1;
+
+static int highestBit(unsigned long long v) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int bit = 0;
+  while (v >>= 1)
+    bit++;
+  return bit;
+#endif
+}
+
+static int bucketIndex(unsigned long long units) {
+  if (units < (unsigned long long) SUB_BUCKETS)
+    return (int) units;
+  if (units > MAX_UNITS)
+    units = MAX_UNITS;
+  int shift = highestBit(units) - (SUB_BUCKET_BITS - 1);
+  return SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + (int) (units >> shift) - HALF_BUCKETS;
+}
+
+// Largest value, in units, that falls into bucket index.
+static unsigned long long bucketUpperBound(int index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  int k = index - SUB_BUCKETS;
+  int shift = k / HALF_BUCKETS + 1;
+  unsigned long long sub = k % HALF_BUCKETS + HALF_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+Histogram::Histogram(double resolution)
+  : resolution(resolution), buckets(new std::atomic<long long>[NUM_BUCKETS]),
+    total(0), sum(0), maxValue(0) {
+  REQUIRES(resolution > 0);
+  for (int i = 0; i < NUM_BUCKETS; i++)
+    buckets[i].store(0, std::memory_order_relaxed);
+}
+
+Histogram::Histogram(const Histogram& other) : Histogram(other.resolution) {
+  add(other);
+}
+
+Histogram& Histogram::operator=(const Histogram& other) {
+  if (this != &other) {
+    resolution = other.resolution;
+    reset();
+    add(other);
+  }
+  return *this;
+}
+
+void Histogram::record(double value) {
+  unsigned long long units = value > 0 ?
+    (unsigned long long) (value / resolution + 0.5) : 0;
+  buckets[bucketIndex(units)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(units, std::memory_order_relaxed);
+
+  unsigned long long seen = maxValue.load(std::memory_order_relaxed);
+  while (units > seen &&
+      !maxValue.compare_exchange_weak(seen, units, std::memory_order_relaxed)) {}
+}
+
+void Histogram::merge(const Histogram& other) {
+  REQUIRES(other.resolution == resolution);
+  add(other);
+}
+
+void Histogram::add(const Histogram& other) {
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    long long n = other.buckets[i].load(std::memory_order_relaxed);
+    if (n)
+      buckets[i].fetch_add(n, std::memory_order_relaxed);
+  }
+  total.fetch_add(other.total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+  unsigned long long otherMax = other.maxValue.load(std::memory_order_relaxed);
+  unsigned long long seen = maxValue.load(std::memory_order_relaxed);
+  while (otherMax > seen &&
+      !maxValue.compare_exchange_weak(seen, otherMax, std::memory_order_relaxed)) {}
+}
+
+void Histogram::reset() {
+  for (int i = 0; i < NUM_BUCKETS; i++)
+    buckets[i].store(0, std::memory_order_relaxed);
+  total.store(0, std::memory_order_relaxed);
+  sum.store(0, std::memory_order_relaxed);
+  maxValue.store(0, std::memory_order_relaxed);
+}
+
+long long Histogram::count() const {
+  return total.load(std::memory_order_relaxed);
+}
+
+double Histogram::mean() const {
+  long long n = count();
+  if (n == 0)
+    return 0;
+  return sum.load(std::memory_order_relaxed) * resolution / n;
+}
+
+double Histogram::max() const {
+  return maxValue.load(std::memory_order_relaxed) * resolution;
+}
+
+double Histogram::percentile(double p) const {
+  long long n = count();
+  if (n == 0)
+    return 0;
+
+  long long target = (long long) std::ceil(p / 100.0 * n);
+  if (target < 1)
+    target = 1;
+
+  unsigned long long maxUnits = maxValue.load(std::memory_order_relaxed);
+  long long seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen >= target)
+      return std::min(bucketUpperBound(i), maxUnits) * resolution;
+  }
+  return maxUnits * resolution;
+}
+
+void Histogram::print(std::ostream& out, double scale) const {
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  out << std::fixed << std::setprecision(2)
+    << "p50=" << std::setw(7) << scale * percentile(50)
+    << " p90=" << std::setw(7) << scale * percentile(90)
+    << " p99=" << std::setw(7) << scale * percentile(99)
+    << " p99.9=" << std::setw(7) << scale * percentile(99.9)
+    << " max=" << std::setw(7) << scale * max();
+  out.flags(flags);
+  out.precision(precision);
+}
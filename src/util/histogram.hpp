@@ -0,0 +1,84 @@
+#ifndef UTIL_HISTOGRAM_H_
+#define UTIL_HISTOGRAM_H_
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+
+// Log-bucketed histogram in the style of HdrHistogram.
+//
+// Values are counted in units of `resolution` (e.g. 1e-6 for seconds at
+// microsecond resolution) and bucketed with 64 linear sub-buckets per power
+// of two, so any percentile is reported to within 1/64 of its true value.
+// Values up to 2^40 units are tracked; larger ones land in the top bucket.
+// Memory use is constant (about 18 KB).
+//
+// record() is lock-free and may be called from any number of threads.
+// Percentiles read while other threads record see a consistent-enough
+// snapshot for reporting, but not an exact one.
+class Histogram {
+  public:
+    explicit Histogram(double resolution = 1e-6);
+    Histogram(const Histogram& other);
+    Histogram& operator=(const Histogram& other);
+
+    void record(double value);
+
+    // Adds other's samples to this histogram. Both must have the same
+    // resolution.
+    void merge(const Histogram& other);
+    void reset();
+
+    long long count() const;
+    double mean() const;
+    double max() const;
+    // p is in [0, 100]. Returns 0 if nothing has been recorded.
+    double percentile(double p) const;
+
+    // Prints p50/p90/p99/p99.9/max, multiplied by scale.
+    void print(std::ostream& out, double scale = 1) const;
+
+  private:
+    void add(const Histogram& other);
+
+    double resolution;
+    std::unique_ptr<std::atomic<long long>[]> buckets;
+    std::atomic<long long> total;
+    std::atomic<unsigned long long> sum;
+    std::atomic<unsigned long long> maxValue;
+};
+
+// A histogram of the current reporting interval, plus everything recorded
+// before it.
+class IntervalHistogram {
+  public:
+    explicit IntervalHistogram(double resolution = 1e-6)
+      : interval(resolution), previous(resolution) {}
+
+    void record(double value) {
+      interval.record(value);
+    }
+
+    const Histogram& getInterval() const {
+      return interval;
+    }
+
+    Histogram getLifetime() const {
+      Histogram lifetime(previous);
+      lifetime.merge(interval);
+      return lifetime;
+    }
+
+    // Starts a new interval. Values recorded by other threads while this
+    // runs may be lost.
+    void nextInterval() {
+      previous.merge(interval);
+      interval.reset();
+    }
+
+  private:
+    Histogram interval;
+    Histogram previous;
+};
+
+#endif
@@ -1,4 +1,13 @@
 #include "imageutil.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGEUTIL_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMAGEUTIL_NEON
+#include <arm_neon.h>
+#endif
+
 #include "../contracts.h"
 
 using cv::Mat;
@@ -21,6 +30,125 @@ size_t ImageUtil::imageSize(const cv::Mat& image) {
   return image.total() * image.elemSize();
 }
 
+// Each expands a prefix of the pixels and returns how many it did.
+typedef int (*ExpandKernel)(const uchar* src, uchar* dst, int count);
+
+#if defined(IMAGEUTIL_X86)
+
+// 16 pixels per iteration: three 16-byte loads hold exactly 48 bytes of BGR,
+// realigned so each shuffle sees four whole pixels.
+__attribute__((target("ssse3")))
+static int expandPixelsSSSE3(const uchar* src, uchar* dst, int count) {
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+      6, 7, 8, -1, 9, 10, 11, -1);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    const uchar* s = src + 3 * i;
+    __m128i a = _mm_loadu_si128((const __m128i*) s);
+    __m128i b = _mm_loadu_si128((const __m128i*) (s + 16));
+    __m128i c = _mm_loadu_si128((const __m128i*) (s + 32));
+    __m128i* d = (__m128i*) (dst + 4 * i);
+    _mm_storeu_si128(d, _mm_or_si128(_mm_shuffle_epi8(a, shuffle), alpha));
+    _mm_storeu_si128(d + 1, _mm_or_si128(
+          _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), shuffle), alpha));
+    _mm_storeu_si128(d + 2, _mm_or_si128(
+          _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), shuffle), alpha));
+    _mm_storeu_si128(d + 3, _mm_or_si128(
+          _mm_shuffle_epi8(_mm_srli_si128(c, 4), shuffle), alpha));
+  }
+  return i;
+}
+
+static int expandPixelsNone(const uchar* src, uchar* dst, int count) {
+  return 0;
+}
+
+static ExpandKernel selectExpandKernel() {
+  if (__builtin_cpu_supports("ssse3"))
+    return expandPixelsSSSE3;
+  return expandPixelsNone;
+}
+
+#elif defined(IMAGEUTIL_NEON)
+
+static int expandPixelsNEON(const uchar* src, uchar* dst, int count) {
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    uint8x16x3_t bgr = vld3q_u8(src + 3 * i);
+    uint8x16x4_t bgra;
+    bgra.val[0] = bgr.val[0];
+    bgra.val[1] = bgr.val[1];
+    bgra.val[2] = bgr.val[2];
+    bgra.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst + 4 * i, bgra);
+  }
+  return i;
+}
+
+static ExpandKernel selectExpandKernel() {
+  return expandPixelsNEON;
+}
+
+#else
+
+static int expandPixelsNone(const uchar* src, uchar* dst, int count) {
+  return 0;
+}
+
+static ExpandKernel selectExpandKernel() {
+  return expandPixelsNone;
+}
+
+#endif
+
+void ImageUtil::expandBgrToBgra(const uchar* src, uchar* dst, int count) {
+  static const ExpandKernel kernel = selectExpandKernel();
+  for (int i = kernel(src, dst, count); i < count; i++) {
+    dst[4 * i] = src[3 * i];
+    dst[4 * i + 1] = src[3 * i + 1];
+    dst[4 * i + 2] = src[3 * i + 2];
+    dst[4 * i + 3] = 255;
+  }
+}
+
+void ImageUtil::expandBgrToBgra(const Mat& src, Mat& dst) {
+  REQUIRES(src.type() == CV_8UC3);
+  REQUIRES(src.data != dst.data);
+  dst.create(src.rows, src.cols, CV_8UC4);
+  for (int row = 0; row < src.rows; row++)
+    expandBgrToBgra(src.ptr(row), dst.ptr(row), src.cols);
+}
+
+bool ImageUtil::isI420(const Mat& image) {
+  // An even-sized frame takes 3/2 as many rows as its height, and its U and
+  // V planes half its width.
+  return image.type() == CV_8UC1 && image.isContinuous() &&
+    image.rows % 3 == 0 && image.cols % 2 == 0;
+}
+
+cv::Size ImageUtil::i420Size(const Mat& image) {
+  REQUIRES(isI420(image));
+  return cv::Size(image.cols, image.rows * 2 / 3);
+}
+
+void ImageUtil::createI420(Mat& image, cv::Size size) {
+  REQUIRES(size.width % 2 == 0 && size.height % 2 == 0);
+  image.create(size.height * 3 / 2, size.width, CV_8UC1);
+}
+
+void ImageUtil::i420Planes(const Mat& image, Mat planes[3]) {
+  REQUIRES(image.isContinuous());
+  cv::Size size = i420Size(image);
+  REQUIRES(size.height % 4 == 0);
+  // Each chroma plane is a quarter of the Y plane's rows, reshaped to half
+  // the width.
+  int chromaRows = size.height / 4;
+  planes[0] = image.rowRange(0, size.height);
+  planes[1] = image.rowRange(size.height, size.height + chromaRows).reshape(1, size.height / 2);
+  planes[2] = image.rowRange(size.height + chromaRows, image.rows).reshape(1, size.height / 2);
+}
+
 void ImageUtil::hconcat2(const Mat& m1, const Mat& m2, Mat& dst) {
   if (m1.empty())
     dst = m2;
@@ -21,6 +21,25 @@ class ImageUtil {
   public:
     static void glPixelsToMat(cv::Mat& image);
     static size_t imageSize(const cv::Mat& image);
+    // Widens count BGR pixels to BGRA with opaque alpha, so textures can be
+    // uploaded from 4-byte aligned pixels the driver needn't convert. Uses
+    // SSSE3 or NEON where available.
+    static void expandBgrToBgra(const uchar* src, uchar* dst, int count);
+    static void expandBgrToBgra(const cv::Mat& src, cv::Mat& dst);
+
+    // Frames decoded to YUV 4:2:0 are single-channel Mats in I420 layout:
+    // the full-size Y plane, then the U and V planes at half the width and
+    // height, all continuous. BGR frames have three channels. Any other
+    // image, e.g. a grayscale one whose size doesn't fit that layout, is
+    // not I420.
+    static bool isI420(const cv::Mat& image);
+    // Width and height of the picture in an I420 Mat.
+    static cv::Size i420Size(const cv::Mat& image);
+    // Allocates an I420 Mat for a width x height picture.
+    static void createI420(cv::Mat& image, cv::Size size);
+    // Views of the Y, U and V planes. The picture's height must be a
+    // multiple of 4, so each chroma plane is made of whole rows.
+    static void i420Planes(const cv::Mat& image, cv::Mat planes[3]);
     static void hconcat2(const cv::Mat& m1, const cv::Mat& m2, cv::Mat& dst);
     static void hconcat3(const cv::Mat& m1, const cv::Mat& m2,
         const cv::Mat& m3, cv::Mat& dst);
@@ -0,0 +1,162 @@
+#include "matpool.hpp"
+
+#include <cstdio>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include "../contracts.h"
+
+// Every buffer handed out is preceded by this header, padded to a cache line
+// so the pixel data stays 64-byte aligned.
+struct MatPool::BlockHeader {
+  // Total size of the block including the header, or 0 for small
+  // allocations that came from the heap.
+  size_t blockBytes;
+  // OpenCV 2.x keeps the Mat refcount in allocator-owned memory.
+  int refcount;
+};
+
+static const size_t HEADER_BYTES = 64;
+static const size_t POOL_GRANULARITY = 64 * 1024;
+static const size_t HUGE_PAGE_BYTES = 2 * 1024 * 1024;
+
+static inline size_t roundUp(size_t x, size_t multiple) {
+  return (x + multiple - 1) / multiple * multiple;
+}
+
+MatPool::MatPool(bool useHugePages, size_t maxIdleBytes) {
+  this->useHugePages = useHugePages;
+  this->maxIdleBytes = maxIdleBytes;
+}
+
+MatPool::~MatPool() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& entry : freeLists) {
+    for (void* block : entry.second) {
+      unmapBlock(block, entry.first);
+    }
+  }
+  freeLists.clear();
+}
+
+size_t MatPool::sizeClass(size_t bytes) const {
+  return roundUp(bytes + HEADER_BYTES,
+      useHugePages ? HUGE_PAGE_BYTES : POOL_GRANULARITY);
+}
+
+void* MatPool::mapBlock(size_t bytes) const {
+#ifdef __linux__
+  void* block = MAP_FAILED;
+  if (useHugePages) {
+    block = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (block == MAP_FAILED) {
+    // No reserved huge pages; fall back to transparent huge pages.
+    block = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if (useHugePages)
+      madvise(block, bytes, MADV_HUGEPAGE);
+#endif
+  }
+  return block;
+#else
+  return cv::fastMalloc(bytes);
+#endif
+}
+
+void MatPool::unmapBlock(void* block, size_t bytes) const {
+#ifdef __linux__
+  munmap(block, bytes);
+#else
+  cv::fastFree(block);
+#endif
+}
+
+uchar* MatPool::take(size_t bytes) const {
+  if (bytes < MIN_POOLED_BYTES) {
+    uchar* block = (uchar*) cv::fastMalloc(bytes + HEADER_BYTES);
+    BlockHeader* header = (BlockHeader*) block;
+    header->blockBytes = 0;
+    header->refcount = 1;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.smallAllocations++;
+    return block + HEADER_BYTES;
+  }
+
+  size_t blockBytes = sizeClass(bytes);
+  void* block = NULL;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<void*>& freeList = freeLists[blockBytes];
+    if (!freeList.empty()) {
+      block = freeList.back();
+      freeList.pop_back();
+      stats.hits++;
+      stats.idleBytes -= blockBytes;
+    } else {
+      stats.misses++;
+    }
+    stats.liveBytes += blockBytes;
+  }
+
+  if (!block) {
+    block = mapBlock(blockBytes);
+    if (!block) {
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.liveBytes -= blockBytes;
+      CV_Error(CV_StsNoMem, "MatPool: failed to allocate buffer");
+    }
+  }
+
+  BlockHeader* header = (BlockHeader*) block;
+  header->blockBytes = blockBytes;
+  header->refcount = 1;
+  return (uchar*) block + HEADER_BYTES;
+}
+
+void MatPool::give(uchar* data) const {
+  uchar* block = data - HEADER_BYTES;
+  BlockHeader* header = (BlockHeader*) block;
+  size_t blockBytes = header->blockBytes;
+
+  if (blockBytes == 0) {
+    cv::fastFree(block);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.liveBytes -= blockBytes;
+    if (stats.idleBytes + blockBytes <= maxIdleBytes) {
+      freeLists[blockBytes].push_back(block);
+      stats.idleBytes += blockBytes;
+      return;
+    }
+    stats.released++;
+  }
+  unmapBlock(block, blockBytes);
+}
+
+int* MatPool::getRefcount(uchar* data) const {
+  return &((BlockHeader*) (data - HEADER_BYTES))->refcount;
+}
+
+MatPoolStats MatPool::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+void MatPool::printStats(const char* name) const {
+  MatPoolStats s = getStats();
+  printf("%s: %ld hits, %ld misses, %ld small, %ld released, "
+      "%.1f MB live, %.1f MB idle\n",
+      name, s.hits, s.misses, s.smallAllocations, s.released,
+      s.liveBytes / (1024.0 * 1024.0), s.idleBytes / (1024.0 * 1024.0));
+}
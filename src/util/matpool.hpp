@@ -0,0 +1,71 @@
+#ifndef UTIL_MATPOOL_H_
+#define UTIL_MATPOOL_H_
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "poolallocator.hpp"
+
+struct MatPoolStats {
+  // Large allocations served from / not served from the pool.
+  long hits = 0;
+  long misses = 0;
+  // Allocations below the pooling threshold, passed straight to the heap.
+  long smallAllocations = 0;
+  // Large buffers given back to the OS because the pool was over its cap.
+  long released = 0;
+  // Bytes currently handed out to live Mats, and bytes sitting idle.
+  size_t liveBytes = 0;
+  size_t idleBytes = 0;
+};
+
+// cv::MatAllocator that recycles large image buffers.
+//
+// Frame-sized buffers are kept on free lists bucketed by size class, so once
+// playback reaches steady state every decoded, cropped, resized and extracted
+// frame reuses a buffer from an earlier frame instead of going through
+// malloc/free and faulting in fresh pages. Buffers are 64-byte aligned and can
+// optionally be backed by huge pages.
+//
+// To opt in, set a Mat's allocator before it is first allocated:
+//   cv::Mat frame;
+//   frame.allocator = pool;
+//   videoCapture >> frame;
+//
+// The pool must outlive every Mat allocated from it.
+class MatPool : public PoolAllocator {
+  public:
+    MatPool(bool useHugePages = false, size_t maxIdleBytes = DEFAULT_MAX_IDLE_BYTES);
+    virtual ~MatPool();
+
+    MatPoolStats getStats() const;
+    void printStats(const char* name) const;
+
+    // Allocations smaller than this are not pooled.
+    static const size_t MIN_POOLED_BYTES = 256 * 1024;
+    static const size_t DEFAULT_MAX_IDLE_BYTES = (size_t) 1 << 30;
+
+  protected:
+    uchar* take(size_t bytes) const;
+    void give(uchar* data) const;
+    int* getRefcount(uchar* data) const;
+
+  private:
+    struct BlockHeader;
+
+    void* mapBlock(size_t bytes) const;
+    void unmapBlock(void* block, size_t bytes) const;
+    size_t sizeClass(size_t bytes) const;
+
+    bool useHugePages;
+    size_t maxIdleBytes;
+
+    mutable std::mutex mutex;
+    mutable std::map<size_t, std::vector<void*> > freeLists;
+    mutable MatPoolStats stats;
+};
+
+#endif
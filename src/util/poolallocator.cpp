@@ -0,0 +1,67 @@
+#include "poolallocator.hpp"
+
+#if CV_MAJOR_VERSION >= 3
+
+// Modeled on OpenCV's StdMatAllocator.
+cv::UMatData* PoolAllocator::allocate(int dims, const int* sizes, int type,
+    void* data0, size_t* step, int flags,
+    cv::UMatUsageFlags usageFlags) const {
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; i--) {
+    if (step) {
+      if (data0 && step[i] != CV_AUTOSTEP) {
+        CV_Assert(total <= step[i]);
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= sizes[i];
+  }
+
+  uchar* data = data0 ? (uchar*) data0 : take(total);
+  cv::UMatData* u = new cv::UMatData(this);
+  u->data = u->origdata = data;
+  u->size = total;
+  if (data0)
+    u->flags |= cv::UMatData::USER_ALLOCATED;
+  return u;
+}
+
+bool PoolAllocator::allocate(cv::UMatData* u, int accessFlags,
+    cv::UMatUsageFlags usageFlags) const {
+  return u != NULL;
+}
+
+void PoolAllocator::deallocate(cv::UMatData* u) const {
+  if (!u)
+    return;
+
+  CV_Assert(u->urefcount == 0);
+  CV_Assert(u->refcount == 0);
+  if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+    give(u->origdata);
+    u->origdata = 0;
+  }
+  delete u;
+}
+
+#else
+
+void PoolAllocator::allocate(int dims, const int* sizes, int type, int*& refcount,
+    uchar*& datastart, uchar*& data, size_t* step) {
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; i--) {
+    step[i] = total;
+    total *= sizes[i];
+  }
+
+  data = datastart = take(total);
+  refcount = getRefcount(datastart);
+}
+
+void PoolAllocator::deallocate(int* refcount, uchar* datastart, uchar* data) {
+  give(datastart);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef UTIL_POOLALLOCATOR_H_
+#define UTIL_POOLALLOCATOR_H_
+
+#include <cstddef>
+
+#include <opencv2/core/core.hpp>
+
+// cv::MatAllocator glue shared by the buffer pools (MatPool,
+// MappedUploadPool). It works out the size and steps of each Mat and keeps
+// OpenCV's bookkeeping the way its StdMatAllocator does, for OpenCV 2.x and
+// 3.x alike, and leaves where the buffers come from to take() and give().
+class PoolAllocator : public cv::MatAllocator {
+  public:
+#if CV_MAJOR_VERSION >= 3
+    cv::UMatData* allocate(int dims, const int* sizes, int type,
+        void* data, size_t* step, int flags,
+        cv::UMatUsageFlags usageFlags) const;
+    bool allocate(cv::UMatData* data, int accessFlags,
+        cv::UMatUsageFlags usageFlags) const;
+    void deallocate(cv::UMatData* data) const;
+#else
+    void allocate(int dims, const int* sizes, int type, int*& refcount,
+        uchar*& datastart, uchar*& data, size_t* step);
+    void deallocate(int* refcount, uchar* datastart, uchar* data);
+#endif
+
+  protected:
+    // A buffer of at least bytes. Called from any thread.
+    virtual uchar* take(size_t bytes) const = 0;
+    // Gives back a buffer from take() once no Mat uses it.
+    virtual void give(uchar* data) const = 0;
+    // OpenCV 2.x keeps the Mat refcount in allocator-owned memory: the int
+    // that goes with data, a buffer from take(), which take() set to 1.
+    virtual int* getRefcount(uchar* data) const = 0;
+};
+
+#endif
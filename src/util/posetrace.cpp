@@ -0,0 +1,104 @@
+#include "posetrace.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+static const char MAGIC[8] = { 'C', 'N', 'D', 'P', 'O', 'S', 'E', '1' };
+
+static_assert(sizeof(PoseSample) == 40, "PoseSample is written to disk as is");
+
+PoseRecorder::PoseRecorder() : file(NULL), start(-1), samples(0) {}
+
+PoseRecorder::~PoseRecorder() {
+  if (file) {
+    fclose(file);
+    std::cout << "Recorded " << samples << " poses" << std::endl;
+  }
+}
+
+bool PoseRecorder::open(const std::string& filename) {
+  file = fopen(filename.c_str(), "wb");
+  if (!file) {
+    std::cerr << "Could not open pose trace " << filename << std::endl;
+    return false;
+  }
+  fwrite(MAGIC, 1, sizeof(MAGIC), file);
+  return true;
+}
+
+void PoseRecorder::record(PoseSource source, double now, const Pose& pose) {
+  if (!file)
+    return;
+  if (start < 0)
+    start = now;
+
+  PoseSample sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.time = now - start;
+  sample.source = source;
+  sample.pose = pose;
+  fwrite(&sample, sizeof(sample), 1, file);
+  samples++;
+}
+
+PoseReplay::PoseReplay() : loaded(false), finished(false) {
+  for (int i = 0; i < POSE_SOURCE_COUNT; i++)
+    next[i] = 0;
+}
+
+bool PoseReplay::load(const std::string& filename) {
+  FILE* file = fopen(filename.c_str(), "rb");
+  if (!file) {
+    std::cerr << "Could not open pose trace " << filename << std::endl;
+    return false;
+  }
+
+  char magic[sizeof(MAGIC)];
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+    std::cerr << filename << " is not a pose trace" << std::endl;
+    fclose(file);
+    return false;
+  }
+
+  long total = 0;
+  PoseSample sample;
+  while (fread(&sample, sizeof(sample), 1, file) == 1) {
+    if (sample.source < 0 || sample.source >= POSE_SOURCE_COUNT)
+      continue;
+    samples[sample.source].push_back(sample);
+    total++;
+  }
+  fclose(file);
+
+  // Samples are written in time order per source, but sort anyway so that
+  // hand-edited or concatenated traces still replay correctly.
+  for (int i = 0; i < POSE_SOURCE_COUNT; i++) {
+    std::stable_sort(samples[i].begin(), samples[i].end(),
+        [](const PoseSample& a, const PoseSample& b) { return a.time < b.time; });
+  }
+
+  std::cout << "Loaded " << total << " poses from " << filename << std::endl;
+  loaded = true;
+  return true;
+}
+
+bool PoseReplay::getPose(PoseSource source, Pose& pose) {
+  const std::vector<PoseSample>& s = samples[source];
+  if (s.empty())
+    return false;
+
+  if (next[source] < s.size())
+    pose = s[next[source]++].pose;
+  else
+    pose = s.back().pose;
+
+  bool allDone = true;
+  for (int i = 0; i < POSE_SOURCE_COUNT; i++) {
+    if (next[i] < samples[i].size())
+      allDone = false;
+  }
+  finished = allDone;
+  return true;
+}
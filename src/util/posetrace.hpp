@@ -0,0 +1,90 @@
+#ifndef UTIL_POSETRACE_H_
+#define UTIL_POSETRACE_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Head poses recorded from the HMD, so that a run can be repeated with
+// exactly the same head motion, or without an HMD at all.
+//
+// A trace file starts with the 8 bytes "CNDPOSE1", followed by fixed-size
+// PoseSample records in the host's byte order. Times are seconds since the
+// first sample of the recording; replay doesn't use them, but goes by the
+// order of the samples, so that it doesn't depend on how fast the replaying
+// run happens to be.
+
+// Which query a pose answers. Each source is replayed independently.
+enum PoseSource {
+  // Predicted head pose used to foveate frames.
+  POSE_HEAD,
+  // Per-eye poses used to render.
+  POSE_LEFT_EYE,
+  POSE_RIGHT_EYE,
+  POSE_SOURCE_COUNT
+};
+
+// Orientation is a unit quaternion (x, y, z, w); position is in meters.
+struct Pose {
+  float orientation[4];
+  float position[3];
+};
+
+struct PoseSample {
+  double time;
+  int32_t source;
+  Pose pose;
+};
+
+class PoseRecorder {
+  public:
+    PoseRecorder();
+    ~PoseRecorder();
+
+    bool open(const std::string& filename);
+    bool isOpen() const {
+      return file != NULL;
+    }
+
+    // now is Timer::timeInSeconds() at the time the pose is for.
+    void record(PoseSource source, double now, const Pose& pose);
+
+  private:
+    PoseRecorder(const PoseRecorder&);
+    PoseRecorder& operator=(const PoseRecorder&);
+
+    FILE* file;
+    double start;
+    long samples;
+};
+
+class PoseReplay {
+  public:
+    PoseReplay();
+
+    bool load(const std::string& filename);
+    bool isLoaded() const {
+      return loaded;
+    }
+
+    // The next recorded pose of source: the nth call for a source returns
+    // its nth sample, so a run that queries poses as often per frame as the
+    // recorded one sees the same pose on every frame. Past the end of the
+    // trace the last pose is held. Returns false if the trace has no samples
+    // for source.
+    bool getPose(PoseSource source, Pose& pose);
+
+    // True once every source has been replayed to its end.
+    bool isFinished() const {
+      return finished;
+    }
+
+  private:
+    std::vector<PoseSample> samples[POSE_SOURCE_COUNT];
+    size_t next[POSE_SOURCE_COUNT];
+    bool loaded;
+    bool finished;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef UTIL_RINGBUFFER_H_
+#define UTIL_RINGBUFFER_H_
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "../contracts.h"
+
+// Fixed-capacity single-producer/single-consumer ring buffer.
+//
+// tryPush and tryPop are wait-free: each side only writes its own index and
+// reads the other side's index, and the two indices live on separate cache
+// lines so the producer and consumer never false-share. Indices grow
+// monotonically, so tail - head is always the exact number of queued items.
+//
+// Exactly one thread may push and exactly one thread may pop at a time.
+template <class T>
+class RingBuffer {
+  public:
+    explicit RingBuffer(size_t capacity) : cap(capacity) {
+      REQUIRES(capacity > 0);
+      size_t slots = 1;
+      while (slots < capacity)
+        slots <<= 1;
+      mask = slots - 1;
+      storage.resize(slots);
+    }
+
+    bool tryPush(const T& item) {
+      const size_t t = tail.load(std::memory_order_relaxed);
+      if (t - cachedHead >= cap) {
+        cachedHead = head.load(std::memory_order_acquire);
+        if (t - cachedHead >= cap)
+          return false;
+      }
+      storage[t & mask] = item;
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool tryPop(T& item) {
+      const size_t h = head.load(std::memory_order_relaxed);
+      if (h == cachedTail) {
+        cachedTail = tail.load(std::memory_order_acquire);
+        if (h == cachedTail)
+          return false;
+      }
+      // Move the item out and reset the slot so that we don't keep large
+      // buffers (e.g. cv::Mat data) alive after they have been consumed.
+      item = std::move(storage[h & mask]);
+      storage[h & mask] = T();
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Blocking variants. These spin briefly, then yield, then back off to
+    // short sleeps, so a stalled peer doesn't burn a whole core.
+    void push(const T& item) {
+      for (int spins = 0; !tryPush(item); spins++)
+        backoff(spins);
+    }
+
+    T pop() {
+      T item;
+      for (int spins = 0; !tryPop(item); spins++)
+        backoff(spins);
+      return item;
+    }
+
+    // Number of items currently queued. Safe to call from any thread; the
+    // result is exact when called from the producer or consumer and never
+    // exceeds capacity() when called from a third thread.
+    size_t size() const {
+      const size_t h = head.load(std::memory_order_acquire);
+      const size_t t = tail.load(std::memory_order_acquire);
+      const size_t n = t - h;
+      return n > cap ? cap : n;
+    }
+
+    bool empty() const {
+      return size() == 0;
+    }
+
+    bool full() const {
+      return size() >= cap;
+    }
+
+    size_t capacity() const {
+      return cap;
+    }
+
+  private:
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    static void backoff(int spins) {
+      if (spins < 64) {
+        // busy wait
+      } else if (spins < 128) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+
+    RingBuffer(const RingBuffer&);
+    RingBuffer& operator=(const RingBuffer&);
+
+    char padStart[CACHE_LINE_SIZE];
+
+    // Consumer-owned line.
+    std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+    char padHead[CACHE_LINE_SIZE];
+
+    // Producer-owned line.
+    std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+    char padTail[CACHE_LINE_SIZE];
+
+    // Read-only after construction.
+    size_t cap;
+    size_t mask;
+    std::vector<T> storage;
+};
+
+#endif
@@ -6,6 +6,8 @@
 
 #include "../settings.hpp"
 #include "../CycleTimer.h"
+#include "histogram.hpp"
+#include "trace.hpp"
 
 class Timer {
   public:
@@ -19,19 +21,28 @@ class Timer {
       return CycleTimer::currentSeconds();
     }
 
-#ifdef DEBUG
-    double startTime;
+    // Each start/stop pair is also recorded as a trace span named
+    // timerName while tracing is enabled.
     void start() {
+      traceStart = Trace::isEnabled() ? Trace::now() : -1;
+#ifdef DEBUG
       startTime = time();
+#endif
     }
 
     void stop(const char* timerName) {
+      if (traceStart >= 0)
+        Trace::record(timerName, traceStart, Trace::now());
+#ifdef DEBUG
       double total = time() - startTime;
       printf("%s = %.6f ms\n", timerName, total);
+#endif
     }
-#else
-    void start() {}
-    void stop(const char* timerName) {}
+
+  private:
+    double traceStart = -1;
+#ifdef DEBUG
+    double startTime;
 #endif
 
 };
@@ -99,6 +110,9 @@ class RollingAverage {
 
 };
 
+// Frame times over the current reporting interval and over the whole run,
+// kept as histograms so that single slow frames show up in the tail
+// percentiles instead of vanishing into a mean.
 class FramerateProfiler {
 
   public:
@@ -111,27 +125,39 @@ class FramerateProfiler {
     }
 
     void endFrame() {
-      myRollingAverage.addSample(Timer::timeInSeconds() - frameStart);
+      frameTimes.record(Timer::timeInSeconds() - frameStart);
+    }
+
+    // Ends the reporting interval; the per-interval getters start over.
+    void nextInterval() {
+      frameTimes.nextInterval();
     }
 
     double getFramerate() {
-      return myRollingAverage.getAverageReciprocal();
+      double mean = frameTimes.getInterval().mean();
+      return mean > 0 ? 1 / mean : 0;
     }
 
     double getLifetimeFramerate() {
-      return myRollingAverage.getLifetimeAverageReciprocal();
+      double mean = frameTimes.getLifetime().mean();
+      return mean > 0 ? 1 / mean : 0;
     }
 
     double getAverageTimeMillis() {
-      return 1000 * myRollingAverage.getAverage();
+      return 1000 * frameTimes.getInterval().mean();
     }
 
     double getLifetimeAverageMillis() {
-      return 1000 * myRollingAverage.getLifetimeAverage();
+      return 1000 * frameTimes.getLifetime().mean();
+    }
+
+    // Frame times in seconds.
+    const IntervalHistogram& getFrameTimes() const {
+      return frameTimes;
     }
 
   private:
-    RollingAverage myRollingAverage;
+    IntervalHistogram frameTimes;
     double frameStart = 0;
 
 };
@@ -0,0 +1,178 @@
+#include "trace.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../settings.hpp"
+#include "../CycleTimer.h"
+
+struct TraceEvent {
+  const char* name;
+  double begin;
+  double end;
+};
+
+static const size_t TRACE_CHUNK_EVENTS = 4096;
+static const size_t TRACE_MAX_CHUNKS =
+  (TRACE_EVENTS_PER_THREAD + TRACE_CHUNK_EVENTS - 1) / TRACE_CHUNK_EVENTS;
+
+// Only the owning thread appends, allocating chunks as it goes so idle
+// threads cost almost nothing. The writer reads the first `count` events;
+// they and the chunks holding them are published by the release store in
+// Trace::record.
+struct TraceThreadBuffer {
+  explicit TraceThreadBuffer(int tid) : tid(tid), chunks(TRACE_MAX_CHUNKS) {}
+
+  TraceEvent& at(size_t i) {
+    return chunks[i / TRACE_CHUNK_EVENTS][i % TRACE_CHUNK_EVENTS];
+  }
+
+  const int tid;
+  std::string name;
+  std::vector<std::unique_ptr<TraceEvent[]> > chunks;
+  std::atomic<size_t> count{0};
+  std::atomic<long> dropped{0};
+};
+
+// Buffers outlive their threads so that short-lived threads still show up
+// in the trace.
+struct TraceRegistry {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<TraceThreadBuffer> > buffers;
+  std::string exitFilename;
+  bool exitHandlerInstalled = false;
+  double epoch = -1;
+};
+
+static TraceRegistry& registry() {
+  static TraceRegistry instance;
+  return instance;
+}
+
+static thread_local TraceThreadBuffer* threadBuffer = NULL;
+static thread_local std::string threadName;
+
+std::atomic<bool> Trace::enabled(false);
+
+static TraceThreadBuffer* createThreadBuffer() {
+  TraceRegistry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.buffers.emplace_back(new TraceThreadBuffer((int) r.buffers.size() + 1));
+  threadBuffer = r.buffers.back().get();
+  threadBuffer->name = threadName;
+  return threadBuffer;
+}
+
+double Trace::now() {
+  return CycleTimer::currentSeconds();
+}
+
+void Trace::record(const char* name, double begin, double end) {
+  TraceThreadBuffer* buffer = threadBuffer ? threadBuffer : createThreadBuffer();
+  size_t n = buffer->count.load(std::memory_order_relaxed);
+  if (n == (size_t) TRACE_EVENTS_PER_THREAD) {
+    buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  if (n % TRACE_CHUNK_EVENTS == 0)
+    buffer->chunks[n / TRACE_CHUNK_EVENTS].reset(new TraceEvent[TRACE_CHUNK_EVENTS]);
+  TraceEvent& event = buffer->at(n);
+  event.name = name;
+  event.begin = begin;
+  event.end = end;
+  buffer->count.store(n + 1, std::memory_order_release);
+}
+
+void Trace::setEnabled(bool enable) {
+  if (enable) {
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.epoch < 0)
+      r.epoch = now();
+  }
+  enabled.store(enable, std::memory_order_relaxed);
+}
+
+void Trace::setThreadName(const std::string& name) {
+  threadName = name;
+  if (threadBuffer) {
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    threadBuffer->name = name;
+  }
+}
+
+static void writeTraceAtExit() {
+  std::string filename;
+  {
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    filename = r.exitFilename;
+  }
+  if (!filename.empty())
+    Trace::write(filename);
+}
+
+void Trace::writeOnExit(const std::string& filename) {
+  TraceRegistry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+  r.exitFilename = filename;
+  // The registry is constructed above, before the handler is installed, so
+  // it is still alive when the handler runs.
+  if (!r.exitHandlerInstalled) {
+    std::atexit(writeTraceAtExit);
+    r.exitHandlerInstalled = true;
+  }
+}
+
+void Trace::initFromEnvironment() {
+  const char* filename = std::getenv("CONDUIT_TRACE");
+  if (!filename || !*filename)
+    return;
+  writeOnExit(filename);
+  setEnabled(true);
+}
+
+bool Trace::write(const std::string& filename) {
+  FILE* out = fopen(filename.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "Could not open trace file %s\n", filename.c_str());
+    return false;
+  }
+
+  TraceRegistry& r = registry();
+  std::lock_guard<std::mutex> lock(r.mutex);
+
+  long events = 0;
+  long dropped = 0;
+  fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+      "\"args\": {\"name\": \"conduit\"}}");
+  for (const std::unique_ptr<TraceThreadBuffer>& buffer : r.buffers) {
+    if (!buffer->name.empty()) {
+      fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+          "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+          buffer->tid, buffer->name.c_str());
+    }
+    size_t count = buffer->count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; i++) {
+      const TraceEvent& event = buffer->at(i);
+      fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"conduit\", \"ph\": \"X\", "
+          "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+          event.name, buffer->tid, 1e6 * (event.begin - r.epoch),
+          1e6 * (event.end - event.begin));
+    }
+    events += count;
+    dropped += buffer->dropped.load(std::memory_order_relaxed);
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+
+  fprintf(stderr, "Wrote %ld trace events to %s", events, filename.c_str());
+  if (dropped > 0)
+    fprintf(stderr, " (%ld dropped, buffers full)", dropped);
+  fprintf(stderr, "\n");
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef UTIL_TRACE_H_
+#define UTIL_TRACE_H_
+
+#include <atomic>
+#include <string>
+
+// Lightweight span tracing, written out in the Chrome trace event format so
+// it can be opened in chrome://tracing or Perfetto.
+//
+// Every thread records into its own fixed-size event buffer: appending an
+// event is a couple of plain stores and a release store of the count, with no
+// locks and no allocation after the first event on a thread. When tracing is
+// off a span costs one relaxed atomic load. Once a thread's buffer is full
+// further events on it are dropped and counted.
+//
+// Span names are stored by pointer and must outlive the trace; use string
+// literals.
+class Trace {
+  public:
+    static bool isEnabled() {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void setEnabled(bool enable);
+
+    // Enables tracing if the CONDUIT_TRACE environment variable is set, and
+    // writes the trace to the file it names on exit.
+    static void initFromEnvironment();
+
+    // Writes the trace to filename when the process exits.
+    static void writeOnExit(const std::string& filename);
+    static bool write(const std::string& filename);
+
+    // Names the calling thread in the trace viewer.
+    static void setThreadName(const std::string& name);
+
+    static double now();
+    // Records a complete event; begin and end come from now().
+    static void record(const char* name, double begin, double end);
+
+  private:
+    static std::atomic<bool> enabled;
+};
+
+// Records a span from construction to destruction.
+class TraceSpan {
+  public:
+    explicit TraceSpan(const char* name)
+      : name(name), begin(Trace::isEnabled() ? Trace::now() : -1) {}
+
+    ~TraceSpan() {
+      if (begin >= 0)
+        Trace::record(name, begin, Trace::now());
+    }
+
+  private:
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+
+    const char* name;
+    double begin;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+
+#endif
@@ -0,0 +1,417 @@
+#include "framecache.hpp"
+
+#include <iostream>
+
+#ifndef WIN32
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../contracts.h"
+#include "../util/trace.hpp"
+
+static const char MAGIC[8] = { 'C', 'N', 'D', 'F', 'C', 'A', 'C', '1' };
+
+// The header takes the first page; every frame starts on a page too.
+static const int64_t PAGE_BYTES = 4096;
+static const char* const SUFFIX = ".frames";
+
+// How much of each end of the source goes into its hash. Hashing all of a
+// multi-gigabyte video on every open would cost more than decoding a few
+// frames; size, mtime and both ends catch a replaced or re-encoded file.
+static const size_t HASHED_BYTES = 1 << 20;
+
+// A recording whose file hasn't been written to for this long was left
+// behind by a process that died, and may be taken over.
+static const int STALE_RECORDING_SECONDS = 60;
+
+// FNV-1a.
+static uint64_t hashBytes(const unsigned char* data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+static bool hashSource(const std::string& filename, int64_t size, uint64_t& hash) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  std::vector<unsigned char> buffer(HASHED_BYTES);
+  hash = hashBytes((const unsigned char*) &size, sizeof(size), HASH_SEED);
+  int64_t offsets[2] = { 0, std::max<int64_t>(0, size - (int64_t) HASHED_BYTES) };
+  bool ok = true;
+  for (int64_t offset : offsets) {
+    ssize_t bytes = pread(fd, buffer.data(), buffer.size(), offset);
+    if (bytes < 0) {
+      ok = false;
+      break;
+    }
+    hash = hashBytes(buffer.data(), bytes, hash);
+  }
+  close(fd);
+  return ok;
+}
+
+// Named after the video's absolute path, so that it is found however the
+// video is named on the command line.
+static std::string cachePath(const std::string& dir, const std::string& filename,
+    const std::string& format) {
+  char* resolved = realpath(filename.c_str(), NULL);
+  std::string source = resolved ? resolved : filename;
+  free(resolved);
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx",
+      (unsigned long long) hashBytes((const unsigned char*) source.data(), source.size(),
+        HASH_SEED));
+  return dir + "/" + name + "-" + format + SUFFIX;
+}
+
+static bool endsWith(const std::string& s, const std::string& suffix) {
+  return s.size() >= suffix.size()
+    && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Deletes the least recently played caches in dir, other than keep, until
+// those left take at most budget bytes.
+static void evict(const std::string& dir, long long budget, const std::string& keep) {
+  struct Entry {
+    std::string path;
+    long long bytes;
+    time_t mtime;
+  };
+  std::vector<Entry> entries;
+  long long total = 0;
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (struct dirent* entry = readdir(d)) {
+    std::string name = entry->d_name;
+    std::string entryPath = dir + "/" + name;
+    struct stat st;
+    if (!endsWith(name, SUFFIX) || entryPath == keep || stat(entryPath.c_str(), &st) != 0)
+      continue;
+    Entry e = { entryPath, (long long) st.st_size, st.st_mtime };
+    entries.push_back(e);
+    total += e.bytes;
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(),
+      [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+  for (const Entry& e : entries) {
+    if (total <= budget)
+      break;
+    if (unlink(e.path.c_str()) == 0) {
+      std::cout << "frame cache: evicted " << e.path << std::endl;
+      total -= e.bytes;
+    }
+  }
+}
+
+// Whether a frame of the header's type and size fills exactly frameBytes of
+// each page-aligned frameStride. Checked before mapping, so that a damaged
+// header can't point getFrame() past a frame's slot.
+bool FrameCache::isValidGeometry(const Header& header) {
+  const int64_t MAX_SIDE = 1 << 16;
+  if (header.rows <= 0 || header.cols <= 0 || header.rows > MAX_SIDE || header.cols > MAX_SIDE
+      || header.type != CV_MAT_TYPE(header.type) || header.frameCount <= 0)
+    return false;
+  int64_t bytes = (int64_t) header.rows * header.cols * CV_ELEM_SIZE(header.type);
+  return bytes == header.frameBytes && header.frameStride >= header.frameBytes
+    && header.frameStride % PAGE_BYTES == 0;
+}
+
+FrameCache::FrameCache()
+  : fd(-1), maxBytes(0), expectedFrames(-1), mapped(NULL), mappedBytes(0) {
+  static_assert(sizeof(Header) <= PAGE_BYTES, "the header fits in a page");
+  memset(&header, 0, sizeof(header));
+}
+
+FrameCache::~FrameCache() {
+  abandon();
+  unmap();
+}
+
+bool FrameCache::describeSource(const std::string& filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.sourceSize = st.st_size;
+  header.sourceMtime = st.st_mtime;
+  return hashSource(filename, header.sourceSize, header.sourceHash);
+}
+
+bool FrameCache::load(const std::string& cacheDir, const std::string& filename,
+    const std::string& format) {
+  REQUIRES(!isComplete() && !isRecording());
+  TRACE_SPAN("FrameCache::load");
+  dir = cacheDir;
+  path = cachePath(dir, filename, format);
+  if (!describeSource(filename))
+    return false;
+  Header expected = header;
+
+  int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    return false;
+  bool ok = pread(file, &header, sizeof(header), 0) == sizeof(header);
+  close(file);
+  if (!ok || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || !header.complete
+      || !isValidGeometry(header)) {
+    std::cerr << path << " is not a frame cache" << std::endl;
+    return false;
+  }
+  if (header.sourceSize != expected.sourceSize || header.sourceMtime != expected.sourceMtime
+      || header.sourceHash != expected.sourceHash) {
+    std::cout << "frame cache: " << filename << " changed since it was cached" << std::endl;
+    unlink(path.c_str());
+    return false;
+  }
+  if (!map())
+    return false;
+  // Marks the cache as recently played, for eviction.
+  utimes(path.c_str(), NULL);
+  return true;
+}
+
+bool FrameCache::beginRecording(const std::string& cacheDir, const std::string& filename,
+    const std::string& format, long long maxCacheBytes, long frames, double frameRate) {
+  REQUIRES(!isComplete() && !isRecording());
+  dir = cacheDir;
+  path = cachePath(dir, filename, format);
+  partialPath = path + ".partial";
+  if (!describeSource(filename))
+    return false;
+  header.frameRate = frameRate;
+  maxBytes = maxCacheBytes;
+  expectedFrames = frames;
+
+  mkdir(dir.c_str(), 0755);
+  fd = open(partialPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  struct stat st;
+  if (fd < 0 && errno == EEXIST && stat(partialPath.c_str(), &st) == 0
+      && time(NULL) - st.st_mtime > STALE_RECORDING_SECONDS) {
+    unlink(partialPath.c_str());
+    fd = open(partialPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  }
+  if (fd < 0) {
+    if (errno != EEXIST)
+      std::cerr << "Could not create " << partialPath << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool FrameCache::record(long frameNumber, const cv::Mat& frame) {
+  if (!isRecording())
+    return false;
+  if (frameNumber == 0 && header.frameCount > 0)
+    return finish();
+  TRACE_SPAN("FrameCache::record");
+
+  int64_t bytes = frame.total() * frame.elemSize();
+  if (header.frameCount == 0 && frameNumber == 0 && frame.isContinuous()) {
+    header.type = frame.type();
+    header.rows = frame.rows;
+    header.cols = frame.cols;
+    header.frameBytes = bytes;
+    header.frameStride = (bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+    long long needed = PAGE_BYTES + header.frameStride * std::max(expectedFrames, 1L);
+    if (needed > maxBytes) {
+      std::cout << "frame cache: " << needed / (1024 * 1024) << " MB of frames won't fit in "
+        << maxBytes / (1024 * 1024) << " MB" << std::endl;
+      abandon();
+      return false;
+    }
+    evict(dir, maxBytes - needed, path);
+  } else if (frameNumber != header.frameCount || !frame.isContinuous()
+      || frame.type() != header.type || frame.rows != header.rows || frame.cols != header.cols) {
+    abandon();
+    return false;
+  }
+
+  int64_t offset = PAGE_BYTES + header.frameCount * header.frameStride;
+  if (offset + header.frameStride > maxBytes) {
+    abandon();
+    return false;
+  }
+  const unsigned char* data = frame.data;
+  while (bytes > 0) {
+    ssize_t written = pwrite(fd, data, bytes, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0) {
+      std::cerr << "Could not write " << partialPath << ": " << strerror(errno) << std::endl;
+      abandon();
+      return false;
+    }
+    data += written;
+    offset += written;
+    bytes -= written;
+  }
+  header.frameCount++;
+  return false;
+}
+
+bool FrameCache::finish() {
+  if (!isRecording())
+    return false;
+  if (header.frameCount == 0) {
+    abandon();
+    return false;
+  }
+  if (expectedFrames > 0 && header.frameCount != expectedFrames) {
+    std::cout << "frame cache: recorded " << header.frameCount << " frames of "
+      << expectedFrames << "; not keeping them" << std::endl;
+    abandon();
+    return false;
+  }
+
+  header.complete = 1;
+  int64_t size = PAGE_BYTES + header.frameCount * header.frameStride;
+  bool ok = ftruncate(fd, size) == 0
+    && pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+  ok = close(fd) == 0 && ok;
+  fd = -1;
+  if (!ok || rename(partialPath.c_str(), path.c_str()) != 0) {
+    std::cerr << "Could not write " << path << std::endl;
+    unlink(partialPath.c_str());
+    return false;
+  }
+  std::cout << "frame cache: recorded " << header.frameCount << " frames, "
+    << size / (1024 * 1024) << " MB" << std::endl;
+  evict(dir, maxBytes - size, path);
+  return map();
+}
+
+void FrameCache::abandon() {
+  if (!isRecording())
+    return;
+  close(fd);
+  fd = -1;
+  unlink(partialPath.c_str());
+  header.frameCount = 0;
+}
+
+bool FrameCache::map() {
+  int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    return false;
+  struct stat st;
+  size_t size = PAGE_BYTES + header.frameCount * header.frameStride;
+  void* data = MAP_FAILED;
+  // Divides rather than multiplies, which a damaged frame count could
+  // overflow.
+  if (fstat(file, &st) == 0 && st.st_size >= PAGE_BYTES
+      && (st.st_size - PAGE_BYTES) / header.frameStride >= header.frameCount)
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    std::cerr << "Could not map " << path << std::endl;
+    return false;
+  }
+  mapped = (unsigned char*) data;
+  mappedBytes = size;
+  return true;
+}
+
+void FrameCache::unmap() {
+  if (mapped)
+    munmap(mapped, mappedBytes);
+  mapped = NULL;
+  mappedBytes = 0;
+}
+
+cv::Mat FrameCache::getFrame(long frame) const {
+  REQUIRES(isComplete() && frame >= 0 && frame < header.frameCount);
+  unsigned char* data = mapped + PAGE_BYTES + frame * header.frameStride;
+  // Gets the next frame off storage, should it have left the page cache,
+  // while this one is in use.
+  if (frame + 1 < header.frameCount)
+    madvise(data + header.frameStride, header.frameStride, MADV_WILLNEED);
+  return cv::Mat(header.rows, header.cols, header.type, data);
+}
+
+long FrameCache::getFrameCount() const {
+  return isComplete() ? (long) header.frameCount : -1;
+}
+
+double FrameCache::getFrameRate() const {
+  return header.frameRate;
+}
+
+#else
+
+// Whether a frame of the header's type and size fills exactly frameBytes of
+// each page-aligned frameStride. Checked before mapping, so that a damaged
+// header can't point getFrame() past a frame's slot.
+bool FrameCache::isValidGeometry(const Header& header) {
+  const int64_t MAX_SIDE = 1 << 16;
+  if (header.rows <= 0 || header.cols <= 0 || header.rows > MAX_SIDE || header.cols > MAX_SIDE
+      || header.type != CV_MAT_TYPE(header.type) || header.frameCount <= 0)
+    return false;
+  int64_t bytes = (int64_t) header.rows * header.cols * CV_ELEM_SIZE(header.type);
+  return bytes == header.frameBytes && header.frameStride >= header.frameBytes
+    && header.frameStride % PAGE_BYTES == 0;
+}
+
+FrameCache::FrameCache()
+  : fd(-1), maxBytes(0), expectedFrames(-1), mapped(NULL), mappedBytes(0) {
+}
+
+FrameCache::~FrameCache() {
+}
+
+bool FrameCache::load(const std::string& cacheDir, const std::string& filename,
+    const std::string& format) {
+  return false;
+}
+
+bool FrameCache::beginRecording(const std::string& cacheDir, const std::string& filename,
+    const std::string& format, long long maxCacheBytes, long frames, double frameRate) {
+  std::cerr << "The frame cache needs POSIX; decoding every time" << std::endl;
+  return false;
+}
+
+bool FrameCache::record(long frameNumber, const cv::Mat& frame) {
+  return false;
+}
+
+bool FrameCache::finish() {
+  return false;
+}
+
+void FrameCache::abandon() {
+}
+
+long FrameCache::getFrameCount() const {
+  return -1;
+}
+
+double FrameCache::getFrameRate() const {
+  return 0;
+}
+
+cv::Mat FrameCache::getFrame(long frame) const {
+  return cv::Mat();
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef VIDEOREADER_FRAMECACHE_H_
+#define VIDEOREADER_FRAMECACHE_H_
+
+#include <stdint.h>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+// Decoded frames of one video, kept in a raw file in a cache directory so
+// that later plays of the video need no decoding at all. The file is a
+// page-sized header followed by every frame in order, each starting on a
+// page boundary. It is recorded the first time the video is played through
+// from its first frame, and served from a read-only mapping from then on:
+// getFrame() returns Mats pointing straight into the page cache.
+//
+// The header records the source video's size, modification time and a hash
+// of its first and last megabyte, and a cache that doesn't match the video
+// any more is ignored and recorded again. The files in the directory are
+// kept under a size cap by deleting the least recently played first.
+//
+// Frames from getFrame() are read-only and only valid while the FrameCache
+// exists.
+class FrameCache {
+  public:
+    FrameCache();
+    ~FrameCache();
+
+    // Maps the complete cache of filename in dir, if there is one and it is
+    // up to date. format names the pixel format of the frames, as a video
+    // can be cached once per backend.
+    bool load(const std::string& dir, const std::string& filename, const std::string& format);
+    // Starts recording a cache of filename in dir, making room for
+    // expectedFrames frames (-1 if unknown) under maxBytes. Fails if another
+    // process is recording the same video.
+    bool beginRecording(const std::string& dir, const std::string& filename,
+        const std::string& format, long long maxBytes, long expectedFrames, double frameRate);
+
+    // Appends frame, which must be frame frameNumber of the video: the next
+    // one, or 0 again once the video starts over, which completes the cache
+    // and returns true. Anything else, or a frame that doesn't fit, stops
+    // the recording.
+    bool record(long frameNumber, const cv::Mat& frame);
+    // Completes the cache at the end of the video and maps it.
+    bool finish();
+    // Stops recording and deletes what was recorded.
+    void abandon();
+
+    bool isComplete() const {
+      return mapped != NULL;
+    }
+    bool isRecording() const {
+      return fd >= 0;
+    }
+    long getFrameCount() const;
+    double getFrameRate() const;
+    cv::Mat getFrame(long frame) const;
+
+  private:
+    // Written at the start of the file.
+    struct Header {
+      char magic[8];
+      int64_t sourceSize;
+      int64_t sourceMtime;
+      uint64_t sourceHash;
+      int32_t type;
+      int32_t rows;
+      int32_t cols;
+      int32_t complete;
+      int64_t frameBytes;
+      int64_t frameStride;
+      int64_t frameCount;
+      double frameRate;
+    };
+
+    static bool isValidGeometry(const Header& header);
+    bool describeSource(const std::string& filename);
+    bool map();
+    void unmap();
+
+    Header header;
+    std::string dir;
+    std::string path;
+
+    // Recording.
+    int fd;
+    std::string partialPath;
+    long long maxBytes;
+    long expectedFrames;
+
+    // Serving.
+    unsigned char* mapped;
+    size_t mappedBytes;
+};
+
+#endif
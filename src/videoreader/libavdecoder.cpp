@@ -0,0 +1,418 @@
+#include "libavdecoder.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#ifdef HAVE_LIBAV
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixdesc.h>
+}
+#endif
+
+#include "../contracts.h"
+#include "../util/imageutil.hpp"
+#include "../util/trace.hpp"
+
+LibavDecoder::LibavDecoder()
+  : io(NULL), format(NULL), codec(NULL), frame(NULL), stream(-1), frameSeconds(0),
+    draining(false), restarting(false), skipBefore(INT64_MIN), startPts(0), frameNumber(-1) {
+}
+
+#ifdef HAVE_LIBAV
+
+LibavDecoder::~LibavDecoder() {
+  av_frame_free(&frame);
+  avcodec_free_context(&codec);
+  avformat_close_input(&format);
+  if (io) {
+    av_freep(&io->buffer);
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 80, 100)
+    avio_context_free(&io);
+#else
+    av_freep(&io);
+#endif
+  }
+}
+
+static void printError(const char* what, int error) {
+  char message[AV_ERROR_MAX_STRING_SIZE];
+  av_strerror(error, message, sizeof(message));
+  std::cerr << what << ": " << message << std::endl;
+}
+
+// Large enough that the demuxer makes few calls into VideoFile per packet.
+static const int IO_BUFFER_BYTES = 256 << 10;
+
+static int readFile(void* opaque, uint8_t* buffer, int size) {
+  int bytes = ((VideoFile*) opaque)->read(buffer, size);
+  return bytes == 0 ? AVERROR_EOF : bytes;
+}
+
+static int64_t seekFile(void* opaque, int64_t offset, int whence) {
+  VideoFile* file = (VideoFile*) opaque;
+  whence &= ~AVSEEK_FORCE;
+  if (whence == AVSEEK_SIZE)
+    return file->size();
+  if (whence == SEEK_CUR)
+    offset += file->tell();
+  else if (whence == SEEK_END)
+    offset += file->size();
+  else if (whence != SEEK_SET)
+    return AVERROR(EINVAL);
+  return file->seek(offset) ? offset : AVERROR(EINVAL);
+}
+
+bool LibavDecoder::open(const std::string& filename, VideoIo videoIo) {
+  file.reset(VideoFile::open(filename, videoIo));
+  if (file) {
+    uint8_t* buffer = (uint8_t*) av_malloc(IO_BUFFER_BYTES);
+    io = avio_alloc_context(buffer, IO_BUFFER_BYTES, 0, file.get(), readFile, NULL, seekFile);
+    format = avformat_alloc_context();
+    format->pb = io;
+    format->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+  std::cout << "libavformat: reading with "
+    << VideoFile::getIoName(file ? file->getIo() : VIDEO_IO_LIBAV) << std::endl;
+
+  int error = avformat_open_input(&format, filename.c_str(), NULL, NULL);
+  if (error < 0) {
+    printError("avformat_open_input", error);
+    return false;
+  }
+  error = avformat_find_stream_info(format, NULL);
+  if (error < 0) {
+    printError("avformat_find_stream_info", error);
+    return false;
+  }
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+  const AVCodec* decoder = NULL;
+#else
+  AVCodec* decoder = NULL;
+#endif
+  stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+  if (stream < 0) {
+    printError("av_find_best_stream", stream);
+    return false;
+  }
+
+  codec = avcodec_alloc_context3(decoder);
+  avcodec_parameters_to_context(codec, format->streams[stream]->codecpar);
+  // Frame threading decodes several frames at once on all cores, at the
+  // cost of a few frames of latency, which the reader queue hides anyway.
+  codec->thread_count = 0;
+  codec->thread_type = FF_THREAD_FRAME;
+  error = avcodec_open2(codec, decoder, NULL);
+  if (error < 0) {
+    printError("avcodec_open2", error);
+    return false;
+  }
+
+  AVRational frameRate = format->streams[stream]->avg_frame_rate;
+  frameSeconds = frameRate.num > 0 ? av_q2d(av_inv_q(frameRate)) : 1.0 / 30;
+  int64_t startTime = format->streams[stream]->start_time;
+  startPts = startTime != AV_NOPTS_VALUE ? startTime : 0;
+  frame = av_frame_alloc();
+  std::cout << "libavcodec: decoding " << decoder->name << " with "
+    << codec->thread_count << " threads" << std::endl;
+  return true;
+}
+
+bool LibavDecoder::isOpened() const {
+  return codec != NULL && frame != NULL;
+}
+
+bool LibavDecoder::read(cv::Mat& image) {
+  return decode([this](VideoPacket& packet) { return readPacket(packet); }, image);
+}
+
+bool LibavDecoder::readPacket(VideoPacket& result) {
+  TRACE_SPAN("LibavDecoder::readPacket");
+  AVPacket* packet = av_packet_alloc();
+  while (true) {
+    int error = av_read_frame(format, packet);
+    if (error < 0) {
+      if (error != AVERROR_EOF)
+        printError("av_read_frame", error);
+      av_packet_free(&packet);
+      return false;
+    }
+    if (packet->stream_index == stream)
+      break;
+    av_packet_unref(packet);
+  }
+
+  result.packet = packet;
+  result.bytes = packet->size;
+  result.seconds = packet->duration > 0 ?
+    packet->duration * av_q2d(format->streams[stream]->time_base) : frameSeconds;
+  return true;
+}
+
+void LibavDecoder::freePacket(VideoPacket& packet) {
+  av_packet_free(&packet.packet);
+}
+
+bool LibavDecoder::openIndex(const std::string& filename, bool build) {
+  REQUIRES(isOpened());
+  AVRational timeBase = format->streams[stream]->time_base;
+  if (index.load(filename) && index.getTimeBaseNum() == timeBase.num
+      && index.getTimeBaseDen() == timeBase.den)
+    return true;
+  if (!build) {
+    index.reset(1, 1);
+    return false;
+  }
+  std::cerr << "building the video index for " << filename << std::endl;
+  if (!buildIndex(filename, index)) {
+    index.reset(1, 1);
+    return false;
+  }
+  index.save(filename);
+  return true;
+}
+
+bool LibavDecoder::buildIndex(const std::string& filename, VideoIndex& index) {
+  TRACE_SPAN("LibavDecoder::buildIndex");
+  // A context of its own, so the one being decoded from stays where it is.
+  AVFormatContext* indexFormat = NULL;
+  int error = avformat_open_input(&indexFormat, filename.c_str(), NULL, NULL);
+  if (error < 0) {
+    printError("avformat_open_input", error);
+    return false;
+  }
+  error = avformat_find_stream_info(indexFormat, NULL);
+  int indexStream = error < 0 ? error :
+    av_find_best_stream(indexFormat, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (indexStream < 0) {
+    printError("av_find_best_stream", indexStream);
+    avformat_close_input(&indexFormat);
+    return false;
+  }
+
+  AVStream* videoStream = indexFormat->streams[indexStream];
+  index.reset(videoStream->time_base.num, videoStream->time_base.den);
+  AVPacket* packet = av_packet_alloc();
+  int64_t lastPts = 0;
+  while ((error = av_read_frame(indexFormat, packet)) >= 0) {
+    if (packet->stream_index == indexStream) {
+      // Raw streams may carry no timestamps at all.
+      int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts :
+        packet->dts != AV_NOPTS_VALUE ? packet->dts : lastPts + std::max<int64_t>(packet->duration, 1);
+      index.addPacket(pts, packet->pos, packet->flags & AV_PKT_FLAG_KEY);
+      lastPts = pts;
+    }
+    av_packet_unref(packet);
+  }
+  av_packet_free(&packet);
+  avformat_close_input(&indexFormat);
+  if (error != AVERROR_EOF) {
+    printError("av_read_frame", error);
+    return false;
+  }
+  index.finish();
+  return !index.isEmpty();
+}
+
+bool LibavDecoder::rewind() {
+  int error = av_seek_frame(format, stream, getPts(0), AVSEEK_FLAG_BACKWARD);
+  if (error < 0) {
+    printError("av_seek_frame", error);
+    return false;
+  }
+  return true;
+}
+
+bool LibavDecoder::seekToFrame(long target) {
+  TRACE_SPAN("LibavDecoder::seekToFrame");
+  REQUIRES(target >= 0);
+  int error;
+  if (index.isEmpty()) {
+    error = av_seek_frame(format, stream, getPts(target), AVSEEK_FLAG_BACKWARD);
+  } else {
+    target = std::min(target, index.getFrameCount() - 1);
+    const VideoIndex::Keyframe& keyframe = index.getKeyframeBefore(target);
+    error = av_seek_frame(format, stream, keyframe.pts, AVSEEK_FLAG_BACKWARD);
+    // Some demuxers can only seek to a byte offset.
+    if (error < 0 && keyframe.position >= 0)
+      error = av_seek_frame(format, stream, keyframe.position, AVSEEK_FLAG_BYTE);
+  }
+  if (error < 0) {
+    printError("av_seek_frame", error);
+    return false;
+  }
+  avcodec_flush_buffers(codec);
+  draining = restarting = false;
+  skipBefore = getPts(target);
+  frameNumber = target - 1;
+  return true;
+}
+
+long LibavDecoder::getFrameCount() const {
+  if (!index.isEmpty())
+    return index.getFrameCount();
+  int64_t frames = format ? format->streams[stream]->nb_frames : 0;
+  return frames > 0 ? (long) frames : -1;
+}
+
+long LibavDecoder::getFrameAt(double seconds) const {
+  if (!index.isEmpty())
+    return index.getFrameAt(seconds);
+  return std::max(0L, (long) llround(seconds / frameSeconds));
+}
+
+int64_t LibavDecoder::getPts(long frame) const {
+  if (!index.isEmpty())
+    return index.getPts(std::min(frame, index.getFrameCount() - 1));
+  AVRational timeBase = format->streams[stream]->time_base;
+  return startPts + (int64_t) llround(frame * frameSeconds / av_q2d(timeBase));
+}
+
+long LibavDecoder::getFrame(int64_t pts) const {
+  if (!index.isEmpty())
+    return index.getFrame(pts);
+  AVRational timeBase = format->streams[stream]->time_base;
+  return std::max(0L, (long) llround((pts - startPts) * av_q2d(timeBase) / frameSeconds));
+}
+
+bool LibavDecoder::decode(const std::function<bool(VideoPacket&)>& nextPacket,
+    cv::Mat& image) {
+  TRACE_SPAN("LibavDecoder::decode");
+  while (true) {
+    int error = avcodec_receive_frame(codec, frame);
+    if (error == 0) {
+      int64_t pts = frame->best_effort_timestamp;
+      if (pts == AV_NOPTS_VALUE)
+        pts = frame->pts;
+      if (pts == AV_NOPTS_VALUE || pts >= skipBefore) {
+        frameNumber = pts == AV_NOPTS_VALUE ? frameNumber + 1 : getFrame(pts);
+        break;
+      }
+      // Between the keyframe a seek went to and the frame it asked for.
+      av_frame_unref(frame);
+      continue;
+    }
+    if (error == AVERROR_EOF) {
+      if (!restarting)
+        return false;
+      // The last frames before a rewind are out; start over.
+      avcodec_flush_buffers(codec);
+      draining = restarting = false;
+      continue;
+    }
+    if (error != AVERROR(EAGAIN) || draining) {
+      printError("avcodec_receive_frame", error);
+      return false;
+    }
+
+    // The decoder wants more input; once there is none, flush out the
+    // frames it still holds.
+    VideoPacket packet;
+    if (!nextPacket(packet)) {
+      draining = true;
+      avcodec_send_packet(codec, NULL);
+      continue;
+    }
+    if (!packet.packet) {
+      draining = restarting = true;
+      skipBefore = INT64_MIN;
+      avcodec_send_packet(codec, NULL);
+      continue;
+    }
+    error = avcodec_send_packet(codec, packet.packet);
+    if (error < 0)
+      printError("avcodec_send_packet", error);
+    freePacket(packet);
+  }
+
+  if (frame->format != AV_PIX_FMT_YUV420P && frame->format != AV_PIX_FMT_YUVJ420P) {
+    const char* name = av_get_pix_fmt_name((AVPixelFormat) frame->format);
+    std::cerr << "libavcodec: unsupported pixel format " << (name ? name : "unknown")
+      << "; use the OpenCV backend" << std::endl;
+    av_frame_unref(frame);
+    return false;
+  }
+
+  // I420 Mats need an even width and a height divisible by 4 (see
+  // ImageUtil::i420Planes); other sizes lose their last rows or column.
+  cv::Size size(frame->width & ~1, frame->height & ~3);
+  ImageUtil::createI420(image, size);
+  cv::Mat planes[3];
+  ImageUtil::i420Planes(image, planes);
+  for (int i = 0; i < 3; i++) {
+    cv::Mat& plane = planes[i];
+    for (int row = 0; row < plane.rows; row++)
+      memcpy(plane.ptr(row), frame->data[i] + row * frame->linesize[i], plane.cols);
+  }
+  av_frame_unref(frame);
+  return true;
+}
+
+#else
+
+LibavDecoder::~LibavDecoder() {
+}
+
+bool LibavDecoder::open(const std::string& filename, VideoIo videoIo) {
+  std::cerr << "Built without libavcodec; use the OpenCV video backend" << std::endl;
+  return false;
+}
+
+bool LibavDecoder::isOpened() const {
+  return false;
+}
+
+bool LibavDecoder::read(cv::Mat& image) {
+  return false;
+}
+
+bool LibavDecoder::readPacket(VideoPacket& packet) {
+  return false;
+}
+
+bool LibavDecoder::decode(const std::function<bool(VideoPacket&)>& nextPacket,
+    cv::Mat& image) {
+  return false;
+}
+
+void LibavDecoder::freePacket(VideoPacket& packet) {
+}
+
+bool LibavDecoder::openIndex(const std::string& filename, bool build) {
+  return false;
+}
+
+bool LibavDecoder::buildIndex(const std::string& filename, VideoIndex& index) {
+  std::cerr << "Built without libavcodec; can't index " << filename << std::endl;
+  return false;
+}
+
+bool LibavDecoder::rewind() {
+  return false;
+}
+
+bool LibavDecoder::seekToFrame(long frame) {
+  return false;
+}
+
+long LibavDecoder::getFrameCount() const {
+  return -1;
+}
+
+long LibavDecoder::getFrameAt(double seconds) const {
+  return 0;
+}
+
+int64_t LibavDecoder::getPts(long frame) const {
+  return 0;
+}
+
+long LibavDecoder::getFrame(int64_t pts) const {
+  return 0;
+}
+
+#endif
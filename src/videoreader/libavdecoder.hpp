@@ -0,0 +1,117 @@
+#ifndef VIDEOREADER_LIBAVDECODER_H_
+#define VIDEOREADER_LIBAVDECODER_H_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "videofile.hpp"
+#include "videoindex.hpp"
+#include "../settings.hpp"
+
+struct AVFormatContext;
+struct AVIOContext;
+struct AVCodecContext;
+struct AVPacket;
+struct AVFrame;
+
+// A demuxed, still compressed packet of the video stream. A VideoPacket
+// with no AVPacket marks where the demuxer went back to the start of the
+// video (see rewind()).
+struct VideoPacket {
+  AVPacket* packet = NULL;
+  size_t bytes = 0;
+  // How much video the packet holds, in seconds.
+  double seconds = 0;
+};
+
+// Decodes a video straight from libavformat/libavcodec, with frame
+// threading, into I420 Mats (see ImageUtil::isI420). Unlike
+// cv::VideoCapture there is no conversion to BGR: the planes are copied out
+// of the decoder's frame as they are. Only 8-bit 4:2:0 video is supported.
+//
+// The demuxer reads the file through a VideoFile unless io is
+// VIDEO_IO_LIBAV or the file can't be read that way.
+//
+// Needs a build with libavcodec (HAVE_LIBAV); otherwise open() fails.
+class LibavDecoder {
+  public:
+    LibavDecoder();
+    ~LibavDecoder();
+
+    bool open(const std::string& filename, VideoIo io = VIDEO_IO_LIBAV);
+    bool isOpened() const;
+    // Decodes the next frame into image, allocated with image's allocator.
+    // Returns false at the end of the video or on an error.
+    bool read(cv::Mat& image);
+
+    // read() split in two, so packets can be demuxed ahead of decoding on
+    // another thread. readPacket() returns false at the end of the video.
+    bool readPacket(VideoPacket& packet);
+    // Like read(), taking packets from nextPacket as the decoder needs them;
+    // nextPacket returns false once there are no more. Packets are freed.
+    // At a rewind marker the frames still in the decoder are returned first,
+    // then decoding carries on from the start without a gap.
+    bool decode(const std::function<bool(VideoPacket&)>& nextPacket, cv::Mat& image);
+    static void freePacket(VideoPacket& packet);
+
+    // Loads the index sidecar for filename, the file open() was given. If
+    // there is none, or it is out of date, builds it by demuxing the whole
+    // file, if build, and saves it. Seeks and frame numbers are exact with
+    // an index, and estimated from the frame rate without one.
+    bool openIndex(const std::string& filename, bool build);
+    const VideoIndex& getIndex() const {
+      return index;
+    }
+    // Demuxes filename without decoding it. Also the buildindex runmode.
+    static bool buildIndex(const std::string& filename, VideoIndex& index);
+
+    // Moves the demuxer back to the first packet, to loop the video.
+    bool rewind();
+    // Makes frame the next frame decode() returns, by demuxing from the
+    // keyframe before it and dropping the frames in between. Neither
+    // readPacket() nor decode() may be running.
+    bool seekToFrame(long frame);
+    // Number of the frame decode() or read() returned last, counting from 0.
+    long getFrameNumber() const {
+      return frameNumber;
+    }
+    // -1 if unknown.
+    long getFrameCount() const;
+    long getFrameAt(double seconds) const;
+    double getFrameRate() const {
+      return frameSeconds > 0 ? 1 / frameSeconds : 0;
+    }
+
+    // NULL if libavformat reads the file itself.
+    const VideoFile* getFile() const {
+      return file.get();
+    }
+
+  private:
+    int64_t getPts(long frame) const;
+    long getFrame(int64_t pts) const;
+
+    std::unique_ptr<VideoFile> file;
+    AVIOContext* io;
+    AVFormatContext* format;
+    AVCodecContext* codec;
+    AVFrame* frame;
+    int stream;
+    // Length of a frame, for packets that don't say.
+    double frameSeconds;
+    // Set once the packets have run out and the decoder is being drained.
+    bool draining;
+    // Set while draining at a rewind marker.
+    bool restarting;
+    // After a seek, frames before this pts are decoded but not returned.
+    int64_t skipBefore;
+    // pts of the first frame.
+    int64_t startPts;
+    long frameNumber;
+    VideoIndex index;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "packetqueue.hpp"
+
+#include <algorithm>
+
+#include "../util/timer.hpp"
+
+PacketQueue::PacketQueue(size_t maxBytes, double maxSeconds)
+  : maxBytes(maxBytes), maxSeconds(maxSeconds) {
+}
+
+PacketQueue::~PacketQueue() {
+  for (VideoPacket& packet : packets)
+    LibavDecoder::freePacket(packet);
+}
+
+// Called with the mutex held.
+bool PacketQueue::isFull() const {
+  return !packets.empty() && (bytes >= maxBytes || seconds >= maxSeconds);
+}
+
+bool PacketQueue::push(const VideoPacket& packet) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!closed && isFull()) {
+    double start = Timer::timeInSeconds();
+    while (!closed && isFull())
+      notFull.wait(lock);
+    stats.pushBlocks++;
+    stats.pushBlockedSeconds += Timer::timeInSeconds() - start;
+  }
+  if (closed)
+    return false;
+
+  packets.push_back(packet);
+  bytes += packet.bytes;
+  seconds += packet.seconds;
+  peakBytes = std::max(peakBytes, bytes);
+  notEmpty.notify_one();
+  return true;
+}
+
+bool PacketQueue::pop(VideoPacket& packet) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!closed && packets.empty()) {
+    double start = Timer::timeInSeconds();
+    while (!closed && packets.empty())
+      notEmpty.wait(lock);
+    stats.popBlocks++;
+    stats.popBlockedSeconds += Timer::timeInSeconds() - start;
+  }
+  if (packets.empty())
+    return false;
+
+  packet = packets.front();
+  packets.pop_front();
+  bytes -= packet.bytes;
+  seconds -= packet.seconds;
+  // Don't let rounding errors accumulate.
+  if (packets.empty())
+    seconds = 0;
+  notFull.notify_one();
+  return true;
+}
+
+void PacketQueue::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  closed = true;
+  notFull.notify_all();
+  notEmpty.notify_all();
+}
+
+void PacketQueue::reopen() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (VideoPacket& packet : packets)
+    LibavDecoder::freePacket(packet);
+  packets.clear();
+  bytes = 0;
+  seconds = 0;
+  closed = false;
+}
+
+size_t PacketQueue::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return packets.size();
+}
+
+size_t PacketQueue::getBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return bytes;
+}
+
+double PacketQueue::getSeconds() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return seconds;
+}
+
+size_t PacketQueue::getPeakBytes() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return peakBytes;
+}
+
+ChannelStats PacketQueue::getStats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
@@ -0,0 +1,55 @@
+#ifndef VIDEOREADER_PACKETQUEUE_H_
+#define VIDEOREADER_PACKETQUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "libavdecoder.hpp"
+#include "../util/channel.h"
+
+// Blocking queue of compressed packets between the demuxer and the decoder.
+// It is bounded by the bytes and by the seconds of video it holds, not by a
+// packet count, since a keyframe can be a hundred times the size of the
+// packets after it. An empty queue takes a packet of any size.
+//
+// close() works as in Channel: pending and future push() calls fail, and
+// pop() drains what is left before returning false. Packets still queued
+// when the queue is destroyed are freed.
+class PacketQueue {
+  public:
+    PacketQueue(size_t maxBytes, double maxSeconds);
+    ~PacketQueue();
+
+    bool push(const VideoPacket& packet);
+    bool pop(VideoPacket& packet);
+    void close();
+    // Frees the queued packets and lets the queue take pushes again after
+    // close(). No thread may be using the queue.
+    void reopen();
+
+    size_t size() const;
+    size_t getBytes() const;
+    double getSeconds() const;
+    // Most bytes ever queued at once.
+    size_t getPeakBytes() const;
+    ChannelStats getStats() const;
+
+  private:
+    bool isFull() const;
+
+    const size_t maxBytes;
+    const double maxSeconds;
+
+    mutable std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    std::deque<VideoPacket> packets;
+    size_t bytes = 0;
+    double seconds = 0;
+    size_t peakBytes = 0;
+    bool closed = false;
+    ChannelStats stats;
+};
+
+#endif
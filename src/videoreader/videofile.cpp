@@ -0,0 +1,487 @@
+#include "videofile.hpp"
+
+#include <iostream>
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "../contracts.h"
+#include "../util/timer.hpp"
+#include "../util/trace.hpp"
+
+static const long PAGE_BYTES = 4096;
+
+static long long alignDown(long long value, long long alignment) {
+  return value / alignment * alignment;
+}
+
+// Maps the whole file. The kernel reads ahead of sequential faults anyway;
+// madvise(WILLNEED) on the window ahead of the reader starts those reads
+// early and in large pieces, and pages far behind the reader are unmapped
+// again so they don't pile up in the process's resident set.
+class MappedVideoFile : public VideoFile {
+  public:
+    MappedVideoFile(unsigned char* data, long long fileSize)
+      : VideoFile(VIDEO_IO_MMAP, fileSize), data(data), advisedEnd(0), releasedEnd(0) {
+      madvise(data, fileSize, MADV_SEQUENTIAL);
+    }
+
+    ~MappedVideoFile() {
+      munmap(data, fileSize);
+    }
+
+    int read(unsigned char* buffer, int size) {
+      int bytes = (int) std::min<long long>(size, fileSize - position);
+      if (bytes <= 0)
+        return 0;
+      advise();
+
+      // Pages that aren't resident yet fault in from storage during the copy.
+      bool resident = isResident(position, bytes);
+      double start = Timer::timeInSeconds();
+      memcpy(buffer, data + position, bytes);
+      double seconds = Timer::timeInSeconds() - start;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      stats.bytes += bytes;
+      if (!resident) {
+        stats.readTimes.record(seconds);
+        stats.waits++;
+        stats.waitSeconds += seconds;
+      }
+      position += bytes;
+      return bytes;
+    }
+
+    bool seek(long long target) {
+      if (target < 0 || target > fileSize)
+        return false;
+      position = target;
+      advisedEnd = 0;
+      releasedEnd = std::min(releasedEnd, alignDown(target, PAGE_BYTES));
+      return true;
+    }
+
+    VideoFileStats getStats() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stats;
+    }
+
+  private:
+    void advise() {
+      long long window = VIDEOREADER_MMAP_READAHEAD_BYTES;
+      if (position + window / 2 > advisedEnd && advisedEnd < fileSize) {
+        long long begin = alignDown(position, PAGE_BYTES);
+        advisedEnd = std::min(begin + window, fileSize);
+        madvise(data + begin, advisedEnd - begin, MADV_WILLNEED);
+      }
+      long long behind = alignDown(position - window, PAGE_BYTES);
+      if (behind - releasedEnd >= window) {
+        madvise(data + releasedEnd, behind - releasedEnd, MADV_DONTNEED);
+        releasedEnd = behind;
+      }
+    }
+
+    bool isResident(long long offset, int bytes) {
+      long long begin = alignDown(offset, PAGE_BYTES);
+      size_t pages = (offset + bytes - begin + PAGE_BYTES - 1) / PAGE_BYTES;
+      residency.resize(pages);
+      if (mincore(data + begin, offset + bytes - begin, residency.data()) != 0)
+        return true;
+      for (unsigned char page : residency) {
+        if (!(page & 1))
+          return false;
+      }
+      return true;
+    }
+
+    unsigned char* data;
+    long long advisedEnd;
+    long long releasedEnd;
+    std::vector<unsigned char> residency;
+
+    mutable std::mutex mutex;
+    VideoFileStats stats;
+};
+
+// Reads the file ahead of the demuxer in VIDEOREADER_PREFETCH_BUFFER_BYTES
+// chunks, into a ring of VIDEOREADER_PREFETCH_BUFFERS buffers, all of them
+// in flight at once when the storage can take it. A chunk's buffer is
+// reused once the demuxer has read past it. A seek outside the chunks
+// already requested drops them and restarts the reads at the new position;
+// reads still in flight for the old position are discarded when they land.
+class PrefetchedVideoFile : public VideoFile {
+  public:
+    PrefetchedVideoFile(int fd, long long fileSize)
+      : VideoFile(VIDEO_IO_PREFETCH, fileSize), fd(fd),
+        buffers(new unsigned char[VIDEOREADER_PREFETCH_BUFFERS * VIDEOREADER_PREFETCH_BUFFER_BYTES]),
+        chunks(VIDEOREADER_PREFETCH_BUFFERS), generation(0), nextOffset(0), closed(false) {
+      for (int i = 0; i < VIDEOREADER_PREFETCH_BUFFERS; i++)
+        chunks[i].data = buffers.get() + i * VIDEOREADER_PREFETCH_BUFFER_BYTES;
+      thread = std::thread(&PrefetchedVideoFile::prefetch, this);
+    }
+
+    ~PrefetchedVideoFile() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+      }
+      changed.notify_all();
+      thread.join();
+      close(fd);
+    }
+
+    int read(unsigned char* buffer, int size) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (position >= fileSize)
+        return 0;
+
+      Chunk* chunk;
+      double waitStart = -1;
+      while (true) {
+        chunk = findChunk(position);
+        if (chunk && chunk->state == CHUNK_READY)
+          break;
+        // Unless the next read starts here, it is in the wrong place.
+        if (!chunk && nextOffset != position) {
+          restart(position);
+          continue;
+        }
+        if (waitStart < 0)
+          waitStart = Timer::timeInSeconds();
+        TRACE_SPAN("PrefetchedVideoFile::wait");
+        changed.wait(lock);
+      }
+      if (waitStart >= 0) {
+        stats.waits++;
+        stats.waitSeconds += Timer::timeInSeconds() - waitStart;
+      }
+
+      if (chunk->error)
+        return -chunk->error;
+      // A chunk can come up short if the file was truncated while open.
+      int bytes = (int) std::min<long long>(size, chunk->offset + chunk->filled - position);
+      if (bytes <= 0)
+        return 0;
+      memcpy(buffer, chunk->data + (position - chunk->offset), bytes);
+      position += bytes;
+      stats.bytes += bytes;
+      if (position >= chunk->offset + chunk->requested) {
+        chunk->state = CHUNK_FREE;
+        changed.notify_all();
+      }
+      return bytes;
+    }
+
+    bool seek(long long target) {
+      if (target < 0 || target > fileSize)
+        return false;
+      std::lock_guard<std::mutex> lock(mutex);
+      position = target;
+      if (!findChunk(target) && nextOffset != target) {
+        restart(target);
+        return true;
+      }
+      // Keep the chunks from target on, and free those it skipped.
+      for (Chunk& chunk : chunks) {
+        if (chunk.state == CHUNK_READY && chunk.generation == generation
+            && chunk.offset + chunk.requested <= target)
+          chunk.state = CHUNK_FREE;
+      }
+      changed.notify_all();
+      return true;
+    }
+
+    VideoFileStats getStats() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stats;
+    }
+
+  private:
+    enum ChunkState {
+      CHUNK_FREE,
+      CHUNK_READING,
+      CHUNK_READY
+    };
+
+    struct Chunk {
+      unsigned char* data = NULL;
+      ChunkState state = CHUNK_FREE;
+      long generation = 0;
+      long long offset = 0;
+      int requested = 0;
+      int filled = 0;
+      int error = 0;
+      double started = 0;
+    };
+
+    // The rest are called with the mutex held.
+
+    // The chunk of the current generation holding offset, read or not.
+    Chunk* findChunk(long long offset) {
+      for (Chunk& chunk : chunks) {
+        if (chunk.state != CHUNK_FREE && chunk.generation == generation
+            && offset >= chunk.offset && offset < chunk.offset + chunk.requested)
+          return &chunk;
+      }
+      return NULL;
+    }
+
+    void restart(long long offset) {
+      TRACE_SPAN("PrefetchedVideoFile::restart");
+      generation++;
+      nextOffset = offset;
+      for (Chunk& chunk : chunks) {
+        if (chunk.state == CHUNK_READY)
+          chunk.state = CHUNK_FREE;
+      }
+      changed.notify_all();
+    }
+
+    // Claims a free chunk for the next read, or returns NULL if there is
+    // nothing to read or nowhere to read it to.
+    Chunk* nextRead() {
+      if (closed || nextOffset >= fileSize)
+        return NULL;
+      for (Chunk& chunk : chunks) {
+        if (chunk.state != CHUNK_FREE)
+          continue;
+        chunk.state = CHUNK_READING;
+        chunk.generation = generation;
+        chunk.offset = nextOffset;
+        chunk.requested = (int) std::min<long long>(VIDEOREADER_PREFETCH_BUFFER_BYTES,
+            fileSize - nextOffset);
+        chunk.filled = 0;
+        chunk.error = 0;
+        chunk.started = Timer::timeInSeconds();
+        nextOffset += chunk.requested;
+        return &chunk;
+      }
+      return NULL;
+    }
+
+    // Records the end of a read of chunk. Returns false if the read came up
+    // short and the rest of the chunk still has to be read.
+    bool finishRead(Chunk& chunk, long result) {
+      if (result < 0) {
+        chunk.error = (int) -result;
+      } else {
+        chunk.filled += result;
+        if (result > 0 && chunk.filled < chunk.requested)
+          return false;
+      }
+      stats.readTimes.record(Timer::timeInSeconds() - chunk.started);
+      // Drop reads for an old position, or that a seek skipped over.
+      bool wanted = chunk.generation == generation && chunk.offset + chunk.requested > position;
+      chunk.state = wanted ? CHUNK_READY : CHUNK_FREE;
+      changed.notify_all();
+      return true;
+    }
+
+#ifdef HAVE_LIBURING
+
+    void prefetch() {
+      Trace::setThreadName("Prefetcher");
+      struct io_uring ring;
+      int error = io_uring_queue_init(VIDEOREADER_PREFETCH_BUFFERS, &ring, 0);
+      if (error < 0) {
+        std::cerr << "io_uring_queue_init: " << strerror(-error)
+          << "; prefetching with pread" << std::endl;
+        prefetchWithPread();
+        return;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      int inFlight = 0;
+      while (!closed || inFlight > 0) {
+        int submitted = 0;
+        Chunk* chunk;
+        while ((chunk = nextRead()) != NULL) {
+          submitRead(ring, *chunk);
+          submitted++;
+        }
+        inFlight += submitted;
+        if (submitted > 0)
+          io_uring_submit(&ring);
+        if (inFlight == 0) {
+          changed.wait(lock);
+          continue;
+        }
+
+        lock.unlock();
+        struct io_uring_cqe* cqe;
+        error = io_uring_wait_cqe(&ring, &cqe);
+        lock.lock();
+        if (error < 0) {
+          if (error == -EINTR)
+            continue;
+          std::cerr << "io_uring_wait_cqe: " << strerror(-error) << std::endl;
+          break;
+        }
+        chunk = (Chunk*) io_uring_cqe_get_data(cqe);
+        long result = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        bool retry = result == -EAGAIN || result == -EINTR;
+        if (!retry && finishRead(*chunk, result)) {
+          inFlight--;
+        } else {
+          submitRead(ring, *chunk);
+          io_uring_submit(&ring);
+        }
+      }
+      io_uring_queue_exit(&ring);
+    }
+
+    void submitRead(struct io_uring& ring, Chunk& chunk) {
+      struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+      ASSERT(sqe != NULL);
+      io_uring_prep_read(sqe, fd, chunk.data + chunk.filled,
+          chunk.requested - chunk.filled, chunk.offset + chunk.filled);
+      io_uring_sqe_set_data(sqe, &chunk);
+    }
+
+#else
+
+    void prefetch() {
+      Trace::setThreadName("Prefetcher");
+      prefetchWithPread();
+    }
+
+#endif
+
+    // One read at a time, so only the round trips between reads are saved,
+    // not those within them.
+    void prefetchWithPread() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!closed) {
+        Chunk* chunk = nextRead();
+        if (!chunk) {
+          changed.wait(lock);
+          continue;
+        }
+        // The chunk is ours while it is being read.
+        bool done = false;
+        while (!done) {
+          lock.unlock();
+          long result;
+          {
+            TRACE_SPAN("PrefetchedVideoFile::pread");
+            result = pread(fd, chunk->data + chunk->filled, chunk->requested - chunk->filled,
+                chunk->offset + chunk->filled);
+          }
+          if (result < 0)
+            result = -errno;
+          lock.lock();
+          done = result != -EINTR && finishRead(*chunk, result);
+        }
+      }
+    }
+
+    int fd;
+    std::unique_ptr<unsigned char[]> buffers;
+    std::vector<Chunk> chunks;
+    // Bumped by every restart, so reads for an old position are dropped.
+    long generation;
+    // Where the next chunk will be read from.
+    long long nextOffset;
+    bool closed;
+
+    std::thread thread;
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    VideoFileStats stats;
+};
+
+// Filesystems where every read is a round trip over the network.
+static bool isNetworkFilesystem(int fd) {
+  struct statfs fs;
+  if (fstatfs(fd, &fs) != 0)
+    return false;
+  switch ((unsigned long) fs.f_type) {
+    case 0x6969:      // NFS
+    case 0x517B:      // SMB
+    case 0xFF534D42:  // CIFS
+    case 0xFE534D42:  // SMB2
+    case 0x00C36400:  // Ceph
+    case 0x01021997:  // 9P
+    case 0x65735546:  // FUSE, e.g. sshfs or s3fs
+      return true;
+    default:
+      return false;
+  }
+}
+
+VideoFile* VideoFile::open(const std::string& filename, VideoIo io) {
+  if (io == VIDEO_IO_LIBAV)
+    return NULL;
+  int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    // Pipes and devices are left to libavformat.
+    close(fd);
+    return NULL;
+  }
+  if (io == VIDEO_IO_AUTO)
+    io = isNetworkFilesystem(fd) ? VIDEO_IO_PREFETCH : VIDEO_IO_MMAP;
+
+  if (io == VIDEO_IO_PREFETCH) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return new PrefetchedVideoFile(fd, st.st_size);
+  }
+
+  void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "mmap " << filename << ": " << strerror(errno) << std::endl;
+    return NULL;
+  }
+  return new MappedVideoFile((unsigned char*) data, st.st_size);
+}
+
+#else
+
+VideoFile* VideoFile::open(const std::string& filename, VideoIo io) {
+  if (io != VIDEO_IO_LIBAV)
+    std::cerr << "Custom video I/O needs Linux; leaving reads to libavformat" << std::endl;
+  return NULL;
+}
+
+#endif
+
+const char* VideoFile::getIoName(VideoIo io) {
+  switch (io) {
+    case VIDEO_IO_AUTO:
+      return "auto";
+    case VIDEO_IO_LIBAV:
+      return "libav";
+    case VIDEO_IO_MMAP:
+      return "mmap";
+    case VIDEO_IO_PREFETCH:
+#ifdef HAVE_LIBURING
+      return "prefetch (io_uring)";
+#else
+      return "prefetch (pread)";
+#endif
+  }
+  return "unknown";
+}
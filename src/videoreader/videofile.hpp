@@ -0,0 +1,59 @@
+#ifndef VIDEOREADER_VIDEOFILE_H_
+#define VIDEOREADER_VIDEOFILE_H_
+
+#include <string>
+
+#include "../settings.hpp"
+#include "../util/histogram.hpp"
+
+struct VideoFileStats {
+  // Bytes handed to the demuxer.
+  long long bytes = 0;
+  // Reads that went to storage, in seconds: the prefetcher's large reads, or
+  // with mmap the demuxer's reads that touched pages not yet in memory.
+  Histogram readTimes;
+  // Demuxer reads that had to wait for storage, and for how long in all.
+  long waits = 0;
+  double waitSeconds = 0;
+};
+
+// Reads the video file for LibavDecoder's demuxer in place of libavformat's
+// own small synchronous read()s, so that storage latency is hidden behind
+// read-ahead instead of stalling the demuxer (see VIDEO_IO).
+//
+// read() and seek() are called from one thread at a time.
+class VideoFile {
+  public:
+    virtual ~VideoFile() {}
+
+    // Opens filename for io, resolving VIDEO_IO_AUTO. Returns NULL for
+    // VIDEO_IO_LIBAV, or if the file can't be read that way.
+    static VideoFile* open(const std::string& filename, VideoIo io);
+    static const char* getIoName(VideoIo io);
+
+    // Copies up to size bytes at the current position into buffer. Returns
+    // the number of bytes copied, 0 at the end of the file, or -errno.
+    virtual int read(unsigned char* buffer, int size) = 0;
+    virtual bool seek(long long position) = 0;
+
+    long long tell() const {
+      return position;
+    }
+    long long size() const {
+      return fileSize;
+    }
+    VideoIo getIo() const {
+      return io;
+    }
+    virtual VideoFileStats getStats() const = 0;
+
+  protected:
+    VideoFile(VideoIo io, long long fileSize)
+      : io(io), fileSize(fileSize), position(0) {}
+
+    const VideoIo io;
+    const long long fileSize;
+    long long position;
+};
+
+#endif
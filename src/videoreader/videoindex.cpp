@@ -0,0 +1,185 @@
+#include "videoindex.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <sys/stat.h>
+
+#include "../contracts.h"
+
+static const char MAGIC[8] = { 'C', 'N', 'D', 'I', 'N', 'D', 'X', '1' };
+
+// Followed by frameCount int64 pts, then keyframeCount IndexKeyframes.
+struct IndexHeader {
+  int64_t videoSize;
+  int64_t videoMtime;
+  int32_t timeBaseNum;
+  int32_t timeBaseDen;
+  int64_t frameCount;
+  int64_t keyframeCount;
+};
+
+struct IndexKeyframe {
+  int64_t frame;
+  int64_t pts;
+  int64_t position;
+};
+
+static_assert(sizeof(IndexHeader) == 40, "IndexHeader is written to disk as is");
+static_assert(sizeof(IndexKeyframe) == 24, "IndexKeyframe is written to disk as is");
+
+static bool statVideo(const std::string& filename, int64_t& size, int64_t& mtime) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0)
+    return false;
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+VideoIndex::VideoIndex() : timeBaseNum(1), timeBaseDen(1) {}
+
+std::string VideoIndex::getPath(const std::string& videoFilename) {
+  return videoFilename + ".index";
+}
+
+bool VideoIndex::load(const std::string& videoFilename) {
+  std::string path = getPath(videoFilename);
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+
+  bool ok = false;
+  char magic[sizeof(MAGIC)];
+  IndexHeader header;
+  int64_t size, mtime;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      fread(&header, sizeof(header), 1, file) != 1 ||
+      header.frameCount <= 0 || header.keyframeCount <= 0 ||
+      header.timeBaseNum <= 0 || header.timeBaseDen <= 0) {
+    std::cerr << path << " is not a video index; ignoring it" << std::endl;
+  } else if (!statVideo(videoFilename, size, mtime) ||
+      size != header.videoSize || mtime != header.videoMtime) {
+    std::cerr << path << " is out of date; ignoring it" << std::endl;
+  } else {
+    reset(header.timeBaseNum, header.timeBaseDen);
+    pts.resize(header.frameCount);
+    std::vector<IndexKeyframe> records(header.keyframeCount);
+    ok = fread(pts.data(), sizeof(int64_t), pts.size(), file) == pts.size() &&
+      fread(records.data(), sizeof(IndexKeyframe), records.size(), file) == records.size();
+    for (const IndexKeyframe& record : records) {
+      Keyframe keyframe = { (long) record.frame, record.pts, record.position };
+      keyframes.push_back(keyframe);
+    }
+    if (!ok) {
+      std::cerr << path << " is truncated; ignoring it" << std::endl;
+      reset(1, 1);
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+bool VideoIndex::save(const std::string& videoFilename) const {
+  REQUIRES(!isEmpty());
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  if (!statVideo(videoFilename, header.videoSize, header.videoMtime))
+    return false;
+  header.timeBaseNum = timeBaseNum;
+  header.timeBaseDen = timeBaseDen;
+  header.frameCount = pts.size();
+  header.keyframeCount = keyframes.size();
+
+  // Written next to the index and renamed over it, so a reader never sees
+  // half an index.
+  std::string path = getPath(videoFilename);
+  std::string partial = path + ".partial";
+  FILE* file = fopen(partial.c_str(), "wb");
+  if (!file) {
+    std::cerr << "Could not write video index " << path << std::endl;
+    return false;
+  }
+  fwrite(MAGIC, 1, sizeof(MAGIC), file);
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(pts.data(), sizeof(int64_t), pts.size(), file);
+  for (const Keyframe& keyframe : keyframes) {
+    IndexKeyframe record = { keyframe.frame, keyframe.pts, keyframe.position };
+    fwrite(&record, sizeof(record), 1, file);
+  }
+  bool ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(partial.c_str(), path.c_str()) != 0) {
+    std::cerr << "Could not write video index " << path << std::endl;
+    remove(partial.c_str());
+    return false;
+  }
+  return true;
+}
+
+void VideoIndex::reset(int num, int den) {
+  REQUIRES(num > 0 && den > 0);
+  timeBaseNum = num;
+  timeBaseDen = den;
+  pts.clear();
+  keyframes.clear();
+}
+
+void VideoIndex::addPacket(int64_t packetPts, int64_t position, bool isKeyframe) {
+  pts.push_back(packetPts);
+  if (isKeyframe) {
+    // The frame number isn't known until all frames are sorted.
+    Keyframe keyframe = { -1, packetPts, position };
+    keyframes.push_back(keyframe);
+  }
+}
+
+void VideoIndex::finish() {
+  std::sort(pts.begin(), pts.end());
+  pts.erase(std::unique(pts.begin(), pts.end()), pts.end());
+  for (Keyframe& keyframe : keyframes)
+    keyframe.frame = getFrame(keyframe.pts);
+  std::sort(keyframes.begin(), keyframes.end(),
+      [](const Keyframe& a, const Keyframe& b) { return a.pts < b.pts; });
+  // A stream that doesn't start on a keyframe can still be decoded from its
+  // first packet, with some damage.
+  if (!pts.empty() && (keyframes.empty() || keyframes[0].frame > 0)) {
+    Keyframe first = { 0, pts[0], -1 };
+    keyframes.insert(keyframes.begin(), first);
+  }
+}
+
+int64_t VideoIndex::getPts(long frame) const {
+  REQUIRES(frame >= 0 && frame < getFrameCount());
+  return pts[frame];
+}
+
+long VideoIndex::getFrame(int64_t framePts) const {
+  REQUIRES(!isEmpty());
+  long frame = (long) (std::upper_bound(pts.begin(), pts.end(), framePts) - pts.begin()) - 1;
+  return std::max(frame, 0L);
+}
+
+long VideoIndex::getFrameAt(double seconds) const {
+  REQUIRES(!isEmpty());
+  return getFrame(fromSeconds(seconds) + pts[0]);
+}
+
+const VideoIndex::Keyframe& VideoIndex::getKeyframeBefore(long frame) const {
+  REQUIRES(!keyframes.empty());
+  auto after = std::upper_bound(keyframes.begin(), keyframes.end(), frame,
+      [](long f, const Keyframe& keyframe) { return f < keyframe.frame; });
+  return after == keyframes.begin() ? keyframes[0] : *(after - 1);
+}
+
+double VideoIndex::toSeconds(int64_t value) const {
+  return (double) value * timeBaseNum / timeBaseDen;
+}
+
+int64_t VideoIndex::fromSeconds(double seconds) const {
+  return (int64_t) llround(seconds * timeBaseDen / timeBaseNum);
+}
@@ -0,0 +1,71 @@
+#ifndef VIDEOREADER_VIDEOINDEX_H_
+#define VIDEOREADER_VIDEOINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Where every frame of a video stream is, kept next to the video in a
+// sidecar file (getPath()) so it only has to be built once. Frames are
+// numbered from 0 in presentation order and identified by their
+// presentation timestamp (pts), in units of the stream's time base.
+// Keyframes are where decoding can start after a seek.
+//
+// The sidecar records the size and modification time of the video it was
+// built from, and load() rejects it if either has changed.
+class VideoIndex {
+  public:
+    struct Keyframe {
+      long frame;
+      int64_t pts;
+      // Byte offset of the keyframe's packet in the file, or -1.
+      int64_t position;
+    };
+
+    VideoIndex();
+
+    static std::string getPath(const std::string& videoFilename);
+    bool load(const std::string& videoFilename);
+    bool save(const std::string& videoFilename) const;
+
+    // Building: add every packet of the stream in demuxing order, then
+    // finish().
+    void reset(int timeBaseNum, int timeBaseDen);
+    void addPacket(int64_t pts, int64_t position, bool isKeyframe);
+    void finish();
+
+    bool isEmpty() const {
+      return pts.empty();
+    }
+    long getFrameCount() const {
+      return (long) pts.size();
+    }
+    long getKeyframeCount() const {
+      return (long) keyframes.size();
+    }
+    int64_t getPts(long frame) const;
+    // The frame showing at pts: the last one starting at or before it.
+    long getFrame(int64_t pts) const;
+    // The frame showing seconds after the first one.
+    long getFrameAt(double seconds) const;
+    // The last keyframe from which frame can be decoded.
+    const Keyframe& getKeyframeBefore(long frame) const;
+
+    int getTimeBaseNum() const {
+      return timeBaseNum;
+    }
+    int getTimeBaseDen() const {
+      return timeBaseDen;
+    }
+    double toSeconds(int64_t pts) const;
+    int64_t fromSeconds(double seconds) const;
+
+  private:
+    int timeBaseNum;
+    int timeBaseDen;
+    // Presentation timestamps of the frames, in order.
+    std::vector<int64_t> pts;
+    std::vector<Keyframe> keyframes;
+};
+
+#endif
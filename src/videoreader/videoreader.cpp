@@ -1,57 +1,277 @@
 #include "videoreader.hpp"
 
+#include <algorithm>
+
 #include "../optimizer/optimizer.hpp"
 
 #define WINDOW_NAME "video"
 
-VideoReader::VideoReader(const std::string& filename) {
-  videoCapture.open(filename);
-  if (!videoCapture.isOpened()) {
-    std::cerr << "Failed to open file " << filename << std::endl;
-    std::exit(1);
+VideoFrame::VideoFrame() {
+  this->sequence = -1;
+  this->frameNumber = -1;
+  this->id = -1;
+}
+
+VideoReader::VideoReader(const std::string& filename, cv::MatAllocator* allocator,
+    VideoBackend backend, bool packetReadAhead, VideoIo io, long startFrame,
+    const std::string& cacheDir)
+  : backend(backend),
+    packetReadAhead(packetReadAhead && backend == VIDEO_BACKEND_LIBAV),
+    allocator(allocator),
+    looping(VIDEOREADER_LOOP),
+    playingCache(false),
+    stopping(false),
+    packetQueue(VIDEOREADER_READAHEAD_BYTES, VIDEOREADER_READAHEAD_SECONDS),
+    frameQueue(this->packetReadAhead ? VIDEOREADER_DECODED_FRAMES : VIDEOREADER_QUEUE_SIZE) {
+  // The backends decode to different pixel formats.
+  std::string format = backend == VIDEO_BACKEND_LIBAV ? "i420" : "bgr";
+  if (!cacheDir.empty() && frameCache.load(cacheDir, filename, format)) {
+    std::cout << "frame cache: playing " << frameCache.getFrameCount() << " cached frames of "
+      << filename << std::endl;
+    playingCache = true;
+    nextCacheFrame = std::max(startFrame, 0L);
+  } else {
+    open(filename, io, startFrame);
+    if (!cacheDir.empty() && startFrame <= 0) {
+      frameCache.beginRecording(cacheDir, filename, format, VIDEOREADER_CACHE_MAX_BYTES,
+          getFrameCount(), getFrameRate());
+    }
   }
 
   windowCreated = false;
   fullyBuffered = false;
+  startThreads();
+}
 
-#ifdef ASYNC_VIDEOCAPTURE
-  pthread_cond_init(&queueCond, NULL);
-  pthread_mutex_init(&queueLock, NULL);
+void VideoReader::open(const std::string& filename, VideoIo io, long startFrame) {
+  bool opened;
+  if (backend == VIDEO_BACKEND_LIBAV) {
+    opened = libavDecoder.open(filename, io);
+  } else {
+    videoCapture.open(filename);
+    opened = videoCapture.isOpened();
+  }
+  if (!opened) {
+    std::cerr << "Failed to open file " << filename << std::endl;
+    std::exit(1);
+  }
+
+  if (backend == VIDEO_BACKEND_LIBAV) {
+    double start = Timer::timeInSeconds();
+    if (libavDecoder.openIndex(filename, VIDEOREADER_BUILD_INDEX)) {
+      const VideoIndex& index = libavDecoder.getIndex();
+      std::cout << "video index: " << index.getFrameCount() << " frames, "
+        << index.getKeyframeCount() << " keyframes, opened in "
+        << 1000 * (Timer::timeInSeconds() - start) << " ms" << std::endl;
+    }
+  }
+  if (startFrame > 0) {
+    if (backend == VIDEO_BACKEND_LIBAV) {
+      libavDecoder.seekToFrame(startFrame);
+    } else {
+      videoCapture.set(CV_CAP_PROP_POS_FRAMES, startFrame);
+      nextFrameNumber = startFrame;
+    }
+  }
+}
+
+VideoReader::~VideoReader() {
+  stopThreads();
+}
 
-  bufferThread = std::thread(&VideoReader::bufferFrames, this, filename);
-  bufferThread.detach();
+void VideoReader::startThreads() {
+  fullyBuffered = false;
+  if (packetReadAhead && !playingCache)
+    demuxThread = std::thread(&VideoReader::demuxPackets, this);
+#ifdef ASYNC_VIDEOCAPTURE
+  bufferThread = std::thread(&VideoReader::bufferFrames, this);
 #endif
 }
 
-void VideoReader::bufferFrames(const std::string& filename) {
-  int framesBuffered = 0;
+void VideoReader::stopThreads() {
+  // Set first, as the buffer thread can't otherwise tell the closed queue
+  // from the end of the video.
+  stopping = true;
+  // Unblocks the threads if they are waiting for space in the queues, or
+  // the buffer thread if it is waiting for packets.
+  packetQueue.close();
+  frameQueue.close();
+  if (demuxThread.joinable())
+    demuxThread.join();
+  if (bufferThread.joinable())
+    bufferThread.join();
+  packetQueue.reopen();
+  frameQueue.reopen();
+  stopping = false;
+}
+
+bool VideoReader::seekToFrame(long frame) {
+  TRACE_SPAN("VideoReader::seek");
+  std::lock_guard<std::mutex> lock(consumerMutex);
+  stopThreads();
+  bool seeked;
+  if (playingCache) {
+    nextCacheFrame = std::max(frame, 0L);
+    seeked = nextCacheFrame < frameCache.getFrameCount();
+  } else if (backend == VIDEO_BACKEND_LIBAV) {
+    seeked = libavDecoder.seekToFrame(std::max(frame, 0L));
+  } else {
+    seeked = videoCapture.set(CV_CAP_PROP_POS_FRAMES, std::max(frame, 0L));
+    nextFrameNumber = std::max(frame, 0L);
+  }
+  // What was recorded no longer runs up to the frames that come next.
+  frameCache.abandon();
+  readSinceRewind = 0;
+  nextSequence = nextReturnedSequence;
+  startThreads();
+  return seeked;
+}
+
+bool VideoReader::seek(double seconds) {
+  if (backend == VIDEO_BACKEND_LIBAV && !playingCache)
+    return seekToFrame(libavDecoder.getFrameAt(seconds));
+  return seekToFrame((long) (seconds * getFrameRate() + 0.5));
+}
+
+long VideoReader::getFrameCount() {
+  if (playingCache)
+    return frameCache.getFrameCount();
+  if (backend == VIDEO_BACKEND_LIBAV)
+    return libavDecoder.getFrameCount();
+  long frames = (long) videoCapture.get(CV_CAP_PROP_FRAME_COUNT);
+  return frames > 0 ? frames : -1;
+}
+
+double VideoReader::getFrameRate() {
+  if (playingCache)
+    return frameCache.getFrameRate();
+  if (backend == VIDEO_BACKEND_LIBAV)
+    return libavDecoder.getFrameRate();
+  return videoCapture.get(CV_CAP_PROP_FPS);
+}
+
+bool VideoReader::readPacket(VideoPacket& packet) {
+  if (libavDecoder.readPacket(packet)) {
+    readSinceRewind++;
+    return true;
+  }
+  if (!looping || readSinceRewind == 0 || !libavDecoder.rewind())
+    return false;
+  packet = VideoPacket();
+  readSinceRewind = 0;
+  return true;
+}
+
+void VideoReader::demuxPackets() {
+  Trace::setThreadName("Demuxer");
+  VideoPacket packet;
+  while (readPacket(packet)) {
+    TRACE_SPAN("VideoReader::pushPacket");
+    if (!packetQueue.push(packet)) {
+      LibavDecoder::freePacket(packet);
+      return;
+    }
+  }
+  packetQueue.close();
+}
+
+void VideoReader::decodeFrame(cv::Mat& frame, long& frameNumber, bool isFirst) {
+  TRACE_SPAN("VideoReader::decode");
+  double start = Timer::timeInSeconds();
   int framesDropped = 0;
+  bool hadError = false;
   while (true) {
-    if (frameQueue.size() > VIDEOREADER_QUEUE_SIZE) {
-      pthread_mutex_lock(&queueLock);
-      pthread_cond_wait(&queueCond, &queueLock);
-      pthread_mutex_unlock(&queueLock);
-    }
-    cv::Mat frame;
-    videoCapture >> frame;
-    bool hadError = false;
-    while (framesBuffered == 0 && frame.empty() && framesDropped++ < MAX_FRAMES_TO_DROP) {
+    if (playingCache) {
+      if (nextCacheFrame >= frameCache.getFrameCount() && looping)
+        nextCacheFrame = 0;
+      if (nextCacheFrame < frameCache.getFrameCount()) {
+        frame = frameCache.getFrame(nextCacheFrame);
+        frameNumber = nextCacheFrame++;
+      } else {
+        frame.release();
+      }
+      break;
+    } else if (backend == VIDEO_BACKEND_LIBAV) {
+      auto nextPacket = [this](VideoPacket& packet) {
+        if (!packetReadAhead)
+          return readPacket(packet);
+        TRACE_SPAN("VideoReader::popPacket");
+        return packetQueue.pop(packet);
+      };
+      if (libavDecoder.decode(nextPacket, frame))
+        frameNumber = libavDecoder.getFrameNumber();
+      else
+        frame.release();
+    } else {
       videoCapture >> frame;
-      std::cout << "First frame empty. Trying again..." << std::endl;
-      hadError = true;
+      if (frame.empty() && looping && readSinceRewind > 0
+          && videoCapture.set(CV_CAP_PROP_POS_FRAMES, 0)) {
+        nextFrameNumber = 0;
+        readSinceRewind = 0;
+        videoCapture >> frame;
+      }
+      if (!frame.empty()) {
+        frameNumber = nextFrameNumber++;
+        readSinceRewind++;
+      }
     }
-    if (hadError && !frame.empty()) {
-      std::cout << "First frame retrieved successfully." << std::endl;
+    if (!isFirst || !frame.empty() || framesDropped++ >= MAX_FRAMES_TO_DROP)
+      break;
+    std::cout << "First frame empty. Trying again..." << std::endl;
+    hadError = true;
+  }
+  if (hadError && !frame.empty()) {
+    std::cout << "First frame retrieved successfully." << std::endl;
+  }
+
+  if (frameCache.isRecording()) {
+    if (frame.empty()) {
+      // Later plays of the video come from the cache. The decoder also
+      // comes up empty when stopThreads() closes the packet queue, and the
+      // recording then stops short of the end.
+      if (!stopping)
+        frameCache.finish();
+    } else if (frameCache.record(frameNumber, frame)) {
+      // Back at frame 0 after a loop, so every frame is cached, and the
+      // decoder and demuxer have nothing left to do.
+      playingCache = true;
+      nextCacheFrame = frameNumber + 1;
+      packetQueue.close();
     }
+  }
+  if (!frame.empty())
+    decodeTimes.record(Timer::timeInSeconds() - start);
+}
+
+void VideoReader::bufferFrames() {
+  Trace::setThreadName("VideoReader");
+  int framesBuffered = 0;
+  while (true) {
+    cv::Mat frame;
+    frame.allocator = allocator;
+    long frameNumber = -1;
+    decodeFrame(frame, frameNumber, framesBuffered == 0);
 
     // important to check isDone before changing frame, or it'll be different!
     if (frame.empty()) {
       fullyBuffered = true;
+      frameQueue.close();
       return;
     }
+    VideoFrame videoFrame;
+    videoFrame.times.mark(FRAME_DECODED);
+    videoFrame.image = frame;
+    videoFrame.sequence = nextSequence++;
+    videoFrame.frameNumber = frameNumber;
+    videoFrame.id = nextId++;
+    videoFrame.times.mark(FRAME_ENQUEUED);
     framesBuffered++;
 
-    frameQueue.enqueue(frame);
+    // Blocks while the queue is full, which is our backpressure. Fails once
+    // the reader is being destroyed or seeks.
+    TRACE_SPAN("VideoReader::push");
+    if (!frameQueue.push(videoFrame))
+      return;
   }
 }
 
@@ -63,31 +283,50 @@ bool VideoReader::isFrameAvailable() {
 #endif
 }
 
+// Returns an empty frame once the video has ended.
 cv::Mat VideoReader::getFrame() {
+  VideoFrame frame;
+  getFrame(frame);
+  return frame.image;
+}
+
+// Returns false once the video has ended.
+bool VideoReader::getFrame(VideoFrame& videoFrame) {
+  std::lock_guard<std::mutex> lock(consumerMutex);
 #ifdef ASYNC_VIDEOCAPTURE
-  cv::Mat frame = frameQueue.dequeue();
-  pthread_cond_signal(&queueCond);
+  if (!frameQueue.pop(videoFrame)) {
+    videoFrame = VideoFrame();
+    return false;
+  }
+  nextReturnedSequence = videoFrame.sequence + 1;
 #else
   cv::Mat frame;
-  videoCapture >> frame;
-  bool hadError = false;
-  int framesDropped = 0;
-  while (frame.empty() && framesDropped++ < MAX_FRAMES_TO_DROP) {
-    videoCapture >> frame;
-    std::cout << "First frame empty. Trying again..." << std::endl;
-    hadError = true;
-  }
-  if (hadError && !frame.empty()) {
-    std::cout << "First frame retrieved successfully." << std::endl;
-  }
+  frame.allocator = allocator;
+  long frameNumber = -1;
+  decodeFrame(frame, frameNumber, true);
+
+  videoFrame = VideoFrame();
+  if (frame.empty())
+    return false;
+  videoFrame.times.mark(FRAME_DECODED);
+  videoFrame.times.mark(FRAME_ENQUEUED);
+  videoFrame.image = frame;
+  videoFrame.sequence = nextSequence++;
+  videoFrame.frameNumber = frameNumber;
+  videoFrame.id = nextId++;
+  nextReturnedSequence = nextSequence;
 #endif
-  return frame;
+  return true;
 }
 
 int VideoReader::getNumFramesAvailable() {
   return frameQueue.size();
 }
 
+ChannelStats VideoReader::getQueueStats() {
+  return frameQueue.getStats();
+}
+
 
 
 static FramerateProfiler videoReaderProfiler;
@@ -1,6 +1,7 @@
 #ifndef VIDEOREADER_VIDEOREADER_H_
 #define VIDEOREADER_VIDEOREADER_H_
 
+#include <atomic>
 #include <iostream>
 #include <mutex>
 #include <queue>
@@ -9,33 +10,147 @@
 
 #include <opencv2/highgui/highgui.hpp>
 
+#include "framecache.hpp"
+#include "libavdecoder.hpp"
+#include "packetqueue.hpp"
+#include "../util/channel.h"
+#include "../util/frametimes.hpp"
+#include "../util/histogram.hpp"
 #include "../util/timer.hpp"
-#include "../util/workqueue.h"
 #include "../settings.hpp"
 
 const int MAX_FRAMES_TO_DROP = 10;
 
+class VideoFrame {
+  public:
+    VideoFrame();
+
+    cv::Mat image;
+    // Position of this frame among those getFrame() hands out, counting from
+    // 0. Keeps counting through seeks and loops.
+    long sequence;
+    // Position of this frame in the video, counting from 0.
+    long frameNumber;
+    // Unique for the lifetime of the VideoReader and increasing in decode
+    // order.
+    long id;
+    FrameTimes times;
+};
+
+// getFrame() may be called from several threads at once; callers are
+// serialized and each frame is handed to exactly one of them.
+//
+// Frames are BGR with VIDEO_BACKEND_OPENCV and I420 with VIDEO_BACKEND_LIBAV.
+// With the libav backend and packetReadAhead, a demuxer thread fills a
+// PacketQueue and only a few frames are decoded ahead (see
+// VIDEOREADER_PACKET_READAHEAD), and the file is read as io says (see
+// VIDEO_IO).
+//
+// Playback starts at startFrame and can be moved with seek(). The libav
+// backend seeks through a keyframe index kept next to the video (see
+// VideoIndex and VIDEOREADER_BUILD_INDEX). A looping reader goes back to
+// the start of the video at the end without reopening it, and its frames
+// keep coming with no gap.
+//
+// Given a cacheDir, the decoded frames of a video played from its first
+// frame to its end, or around a loop, are kept there (see FrameCache and
+// VIDEOREADER_CACHE_DIR). Once they are, and whenever the video is opened
+// again after that, frames come straight from the cache with no decoding.
+// Those frames are read-only and only valid while the VideoReader exists.
 class VideoReader {
   public:
-    VideoReader(const std::string& filename);
+    VideoReader(const std::string& filename, cv::MatAllocator* allocator = NULL,
+        VideoBackend backend = VIDEO_BACKEND_OPENCV,
+        bool packetReadAhead = VIDEOREADER_PACKET_READAHEAD, VideoIo io = VIDEO_IO,
+        long startFrame = 0, const std::string& cacheDir = VIDEOREADER_CACHE_DIR);
+    ~VideoReader();
     cv::Mat getFrame();
+    bool getFrame(VideoFrame& frame);
     bool showFrame();
     bool isFrameAvailable();
     int getNumFramesAvailable();
+    ChannelStats getQueueStats();
+
+    // Makes frame, or the frame showing seconds into the video, the next one
+    // getFrame() returns. Frames already decoded are dropped.
+    bool seekToFrame(long frame);
+    bool seek(double seconds);
+    void setLooping(bool loop) {
+      looping = loop;
+    }
+    bool isLooping() const {
+      return looping;
+    }
+    // -1 if unknown.
+    long getFrameCount();
+    double getFrameRate();
+
+    bool isPlayingCache() const {
+      return playingCache;
+    }
+    bool hasPacketReadAhead() const {
+      return packetReadAhead;
+    }
+    const PacketQueue& getPacketQueue() const {
+      return packetQueue;
+    }
+    // NULL unless the libav backend reads the file through a VideoFile.
+    const VideoFile* getVideoFile() const {
+      return libavDecoder.getFile();
+    }
+    // Time to decode each frame, in seconds, including any wait for packets.
+    const Histogram& getDecodeTimes() const {
+      return decodeTimes;
+    }
 
   private:
-    void bufferFrames(const std::string& filename);
+    void open(const std::string& filename, VideoIo io, long startFrame);
+    void startThreads();
+    // Stops the threads and empties the queues.
+    void stopThreads();
+    // The next packet from the libav demuxer, or a rewind marker at the end
+    // if looping.
+    bool readPacket(VideoPacket& packet);
+    void demuxPackets();
+    void bufferFrames();
+    // Decodes the next frame with the chosen backend, retrying a few times if
+    // the first frame comes out empty. frame is empty at the end.
+    void decodeFrame(cv::Mat& frame, long& frameNumber, bool isFirst);
 
+    VideoBackend backend;
+    bool packetReadAhead;
     cv::VideoCapture videoCapture;
+    LibavDecoder libavDecoder;
+    cv::MatAllocator* allocator;
     int framesCaptured;
     bool windowCreated;
     bool fullyBuffered;
     double avgFps;
+    long nextSequence = 0;
+    // Sequence after the last frame getFrame() returned, where decoding
+    // picks up after a seek drops the frames queued past it.
+    long nextReturnedSequence = 0;
+    long nextId = 0;
+    std::atomic<bool> looping;
+    // Packets or, with OpenCV, frames read since the video last started
+    // over; a video with none isn't looped.
+    long readSinceRewind = 0;
+    // With OpenCV, which doesn't say.
+    long nextFrameNumber = 0;
+
+    FrameCache frameCache;
+    // Whether frames come from frameCache rather than the decoder.
+    std::atomic<bool> playingCache;
+    long nextCacheFrame = 0;
+    // Set while stopThreads() stops the threads.
+    std::atomic<bool> stopping;
 
+    std::thread demuxThread;
+    PacketQueue packetQueue;
     std::thread bufferThread;
-    WorkQueue<cv::Mat> frameQueue;
-    pthread_cond_t queueCond;
-    pthread_mutex_t queueLock;
+    Channel<VideoFrame> frameQueue;
+    Histogram decodeTimes;
+    std::mutex consumerMutex;
 };
 
 #endif